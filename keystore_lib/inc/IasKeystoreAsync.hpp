@@ -0,0 +1,554 @@
+/*
+   Copyright 2018 Intel Corporation
+
+   This software is licensed to you in accordance
+   with the agreement between you and Intel Corporation.
+
+   Alternatively, you can use this file in compliance
+   with the Apache license, Version 2.
+
+
+   Apache License, Version 2.0
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+   http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef IAS_SECURITY_KEYSTORE_ASYNC_HPP
+#define IAS_SECURITY_KEYSTORE_ASYNC_HPP
+
+/*
+ * C++20 coroutine interface on top of ias_keystore_async.h.
+ *
+ * Header only, so that keystore_lib itself does not need to be built as
+ * C++20. Including this header in a translation unit without coroutine
+ * support is an error.
+ */
+
+#if !defined(__cpp_impl_coroutine)
+#error "IasKeystoreAsync.hpp requires C++20 coroutine support"
+#endif
+
+#include <coroutine>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <list>
+#include <utility>
+
+#include <errno.h>
+#include <poll.h>
+
+#include "ias_keystore_async.h"
+
+/**
+ * @brief Ias
+ */
+namespace Ias {
+
+  /**
+   * @brief keystore user space library
+   */
+  namespace IasKeystoreLib
+  {
+    template <typename T>
+    class Task;
+
+    namespace detail
+    {
+      /**
+       * Resumes the awaiting coroutine when a task finishes.
+       */
+      struct TaskFinalAwaiter
+      {
+        bool await_ready() const noexcept { return false; }
+
+        template <typename Promise>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept
+        {
+          std::coroutine_handle<> continuation = handle.promise().mContinuation;
+          return continuation ? continuation : std::noop_coroutine();
+        }
+
+        void await_resume() const noexcept {}
+      };
+
+      struct TaskPromiseBase
+      {
+        std::coroutine_handle<> mContinuation;
+
+        std::suspend_always initial_suspend() const noexcept { return {}; }
+        TaskFinalAwaiter final_suspend() const noexcept { return {}; }
+
+        /* keystore_lib reports errors through return codes */
+        void unhandled_exception() const noexcept { std::terminate(); }
+      };
+
+      template <typename T>
+      struct TaskPromise : TaskPromiseBase
+      {
+        T mValue{};
+
+        Task<T> get_return_object() noexcept;
+        void return_value(T value) { mValue = std::move(value); }
+        T result() { return std::move(mValue); }
+      };
+
+      template <>
+      struct TaskPromise<void> : TaskPromiseBase
+      {
+        Task<void> get_return_object() noexcept;
+        void return_void() const noexcept {}
+        void result() const noexcept {}
+      };
+    } // namespace detail
+
+    /**
+     * Lazily started coroutine. A task runs when it is awaited, or when
+     * it is handed to Executor::spawn().
+     */
+    template <typename T = void>
+    class Task
+    {
+      public:
+        using promise_type = detail::TaskPromise<T>;
+        using Handle = std::coroutine_handle<promise_type>;
+
+        Task() noexcept = default;
+        explicit Task(Handle handle) noexcept : mHandle(handle) {}
+        Task(Task &&other) noexcept : mHandle(std::exchange(other.mHandle, nullptr)) {}
+        Task &operator=(Task &&other) noexcept
+        {
+          if (this != &other)
+          {
+            destroy();
+            mHandle = std::exchange(other.mHandle, nullptr);
+          }
+          return *this;
+        }
+        Task(const Task &) = delete;
+        Task &operator=(const Task &) = delete;
+        ~Task() { destroy(); }
+
+        /**
+         * @return true once the coroutine has run to completion.
+         */
+        bool done() const noexcept { return !mHandle || mHandle.done(); }
+
+        /**
+         * Start the coroutine without awaiting it.
+         */
+        void start()
+        {
+          if (mHandle && !mHandle.done())
+            mHandle.resume();
+        }
+
+        bool await_ready() const noexcept { return done(); }
+
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept
+        {
+          mHandle.promise().mContinuation = awaiting;
+          return mHandle;
+        }
+
+        T await_resume() { return mHandle.promise().result(); }
+
+      private:
+        void destroy() noexcept
+        {
+          if (mHandle)
+            mHandle.destroy();
+          mHandle = nullptr;
+        }
+
+        Handle mHandle;
+    };
+
+    namespace detail
+    {
+      template <typename T>
+      inline Task<T> TaskPromise<T>::get_return_object() noexcept
+      {
+        return Task<T>(std::coroutine_handle<TaskPromise<T>>::from_promise(*this));
+      }
+
+      inline Task<void> TaskPromise<void>::get_return_object() noexcept
+      {
+        return Task<void>(std::coroutine_handle<TaskPromise<void>>::from_promise(*this));
+      }
+    } // namespace detail
+
+    class AsyncKeystore;
+
+    /**
+     * Awaitable for one keystore request. Created by the AsyncKeystore
+     * member functions and awaited immediately:
+     *
+     *     int res = co_await ks.encrypt(ticket, slot, ALGOSPEC_AES_GCM, iv, sizeof(iv),
+     *                                   in, in_size, out);
+     */
+    class Operation
+    {
+      public:
+        Operation(AsyncKeystore &keystore, const ias_keystore_async_req &req) noexcept
+          : mReq(req), mKeystore(keystore)
+        {
+        }
+        Operation(const Operation &) = delete;
+        Operation &operator=(const Operation &) = delete;
+
+        bool await_ready() const noexcept { return false; }
+        inline bool await_suspend(std::coroutine_handle<> handle) noexcept;
+
+        /**
+         * @return 0 or the slot ID for loadKey() if OK, or negative error code (see errno.h).
+         */
+        int await_resume() const noexcept
+        {
+          if (mReq.result == 0 && mReq.op == IAS_KEYSTORE_ASYNC_LOAD_KEY)
+            return (int)mReq.slot_id;
+          return mReq.result;
+        }
+
+        ias_keystore_async_req mReq;
+
+      private:
+        AsyncKeystore &mKeystore;
+    };
+
+    /**
+     * Coroutine front end for an ias_keystore_async worker pool.
+     *
+     * Requests are submitted without blocking. Completions are delivered
+     * through the pool eventfd and resumed by dispatch(), so all coroutines
+     * resume on the thread calling dispatch(). Requests which do not fit
+     * into the pool are parked and submitted as space becomes available.
+     *
+     * The member functions take the same arguments as the matching
+     * ias_keystore.h functions.
+     */
+    class AsyncKeystore
+    {
+      public:
+        AsyncKeystore() noexcept = default;
+        AsyncKeystore(const AsyncKeystore &) = delete;
+        AsyncKeystore &operator=(const AsyncKeystore &) = delete;
+        ~AsyncKeystore() { close(); }
+
+        /**
+         * Create the worker pool.
+         *
+         * @param config Pool configuration, or nullptr for the defaults.
+         *
+         * @return 0 if OK or negative error code (see errno.h).
+         */
+        int open(const ias_keystore_async_config *config = nullptr)
+        {
+          if (mPool)
+            return -EBUSY;
+          return ias_keystore_async_create(config, &mPool);
+        }
+
+        /**
+         * Destroy the worker pool. Coroutines still waiting for a request
+         * are not resumed.
+         */
+        void close()
+        {
+          ias_keystore_async_destroy(mPool);
+          mPool = nullptr;
+          mParked.clear();
+          mInFlight = 0;
+        }
+
+        /**
+         * @return The pool eventfd, readable when dispatch() has work to do.
+         */
+        int eventfd() const { return ias_keystore_async_eventfd(mPool); }
+
+        /**
+         * @return Number of requests submitted or parked and not yet resumed.
+         */
+        size_t pending() const noexcept { return mInFlight + mParked.size(); }
+
+        /**
+         * Resume the coroutines whose requests have completed.
+         *
+         * @return Number of coroutines resumed, or negative error code (see errno.h).
+         */
+        int dispatch()
+        {
+          ias_keystore_async_req *done[kDispatchBatch];
+          int resumed = 0;
+          int n;
+
+          do
+          {
+            n = ias_keystore_async_reap(mPool, done, kDispatchBatch);
+            if (n < 0)
+              return n;
+
+            mInFlight -= (size_t)n;
+            submitParked();
+
+            for (int i = 0; i < n; i++)
+              std::coroutine_handle<>::from_address(done[i]->user_data).resume();
+            resumed += n;
+          } while (n == (int)kDispatchBatch);
+
+          return resumed;
+        }
+
+        Operation encrypt(const uint8_t *client_ticket, uint32_t slot_id,
+                          keystore_algo_spec algo_spec, const uint8_t *iv, size_t iv_size,
+                          const uint8_t *input, size_t input_size, uint8_t *output)
+        {
+          return crypt(IAS_KEYSTORE_ASYNC_ENCRYPT, client_ticket, slot_id, algo_spec,
+                       iv, iv_size, input, input_size, output);
+        }
+
+        Operation decrypt(const uint8_t *client_ticket, uint32_t slot_id,
+                          keystore_algo_spec algo_spec, const uint8_t *iv, size_t iv_size,
+                          const uint8_t *input, size_t input_size, uint8_t *output)
+        {
+          return crypt(IAS_KEYSTORE_ASYNC_DECRYPT, client_ticket, slot_id, algo_spec,
+                       iv, iv_size, input, input_size, output);
+        }
+
+        Operation generateKey(const uint8_t *client_ticket, keystore_key_spec key_spec,
+                              uint8_t *wrapped_key)
+        {
+          ias_keystore_async_req req = newRequest();
+          req.op = IAS_KEYSTORE_ASYNC_GENERATE_KEY;
+          req.client_ticket = client_ticket;
+          req.key_spec = key_spec;
+          req.wrapped_key = wrapped_key;
+          return Operation(*this, req);
+        }
+
+        Operation wrapKey(const uint8_t *client_ticket, const uint8_t *app_key, size_t app_key_size,
+                          keystore_key_spec key_spec, uint8_t *wrapped_key)
+        {
+          ias_keystore_async_req req = newRequest();
+          req.op = IAS_KEYSTORE_ASYNC_WRAP_KEY;
+          req.client_ticket = client_ticket;
+          req.input = app_key;
+          req.input_size = app_key_size;
+          req.key_spec = key_spec;
+          req.wrapped_key = wrapped_key;
+          return Operation(*this, req);
+        }
+
+        /**
+         * Load a key. The awaited value is the slot ID if OK.
+         */
+        Operation loadKey(const uint8_t *client_ticket, uint8_t *wrapped_key, size_t wrapped_key_size)
+        {
+          ias_keystore_async_req req = newRequest();
+          req.op = IAS_KEYSTORE_ASYNC_LOAD_KEY;
+          req.client_ticket = client_ticket;
+          req.wrapped_key = wrapped_key;
+          req.wrapped_key_size = wrapped_key_size;
+          return Operation(*this, req);
+        }
+
+        Operation unloadKey(const uint8_t *client_ticket, uint32_t slot_id)
+        {
+          ias_keystore_async_req req = newRequest();
+          req.op = IAS_KEYSTORE_ASYNC_UNLOAD_KEY;
+          req.client_ticket = client_ticket;
+          req.slot_id = slot_id;
+          return Operation(*this, req);
+        }
+
+      private:
+        friend class Operation;
+
+        static constexpr size_t kDispatchBatch = 32;
+
+        static ias_keystore_async_req newRequest() noexcept
+        {
+          ias_keystore_async_req req;
+          std::memset(&req, 0, sizeof(req));
+          return req;
+        }
+
+        Operation crypt(ias_keystore_async_op type, const uint8_t *client_ticket, uint32_t slot_id,
+                        keystore_algo_spec algo_spec, const uint8_t *iv, size_t iv_size,
+                        const uint8_t *input, size_t input_size, uint8_t *output)
+        {
+          ias_keystore_async_req req = newRequest();
+          req.op = type;
+          req.client_ticket = client_ticket;
+          req.slot_id = slot_id;
+          req.algo_spec = algo_spec;
+          req.iv = iv;
+          req.iv_size = iv_size;
+          req.input = input;
+          req.input_size = input_size;
+          req.output = output;
+          return Operation(*this, req);
+        }
+
+        /**
+         * Submit a request, or park it if the pool is full.
+         *
+         * @return 0 if submitted or parked, or negative error code (see errno.h).
+         */
+        int submit(ias_keystore_async_req *req)
+        {
+          int res;
+
+          if (!mPool)
+            return -ENODEV;
+
+          /* Keep submission order: parked requests go first */
+          if (!mParked.empty())
+          {
+            mParked.push_back(req);
+            return 0;
+          }
+
+          res = ias_keystore_async_submit(mPool, req, IAS_KEYSTORE_ASYNC_NONBLOCK);
+          if (res == -EAGAIN)
+          {
+            mParked.push_back(req);
+            return 0;
+          }
+          if (res == 0)
+            mInFlight++;
+
+          return res;
+        }
+
+        void submitParked()
+        {
+          while (!mParked.empty())
+          {
+            ias_keystore_async_req *req = mParked.front();
+            int res = ias_keystore_async_submit(mPool, req, IAS_KEYSTORE_ASYNC_NONBLOCK);
+            if (res == -EAGAIN)
+              break;
+
+            mParked.pop_front();
+            if (res == 0)
+            {
+              mInFlight++;
+            }
+            else
+            {
+              req->result = res;
+              std::coroutine_handle<>::from_address(req->user_data).resume();
+            }
+          }
+        }
+
+        ias_keystore_async *mPool = nullptr;
+        std::deque<ias_keystore_async_req *> mParked;
+        size_t mInFlight = 0;
+    };
+
+    inline bool Operation::await_suspend(std::coroutine_handle<> handle) noexcept
+    {
+      int res;
+
+      mReq.user_data = handle.address();
+      res = mKeystore.submit(&mReq);
+      if (res)
+      {
+        /* Not submitted: resume immediately with the error */
+        mReq.result = res;
+        return false;
+      }
+
+      return true;
+    }
+
+    /**
+     * Single-threaded executor driving tasks on an AsyncKeystore.
+     *
+     *     AsyncKeystore ks;
+     *     Executor executor(ks);
+     *     ks.open();
+     *     executor.spawn(handleClient(ks, ...));
+     *     executor.run();
+     *
+     * Applications with their own event loop can instead poll
+     * AsyncKeystore::eventfd() and call AsyncKeystore::dispatch().
+     */
+    class Executor
+    {
+      public:
+        explicit Executor(AsyncKeystore &keystore) noexcept : mKeystore(keystore) {}
+        Executor(const Executor &) = delete;
+        Executor &operator=(const Executor &) = delete;
+
+        /**
+         * Start a task. It runs until its first suspension point before
+         * spawn() returns, and is kept alive until it completes.
+         */
+        void spawn(Task<void> task)
+        {
+          mTasks.push_back(std::move(task));
+          mTasks.back().start();
+          reapFinished();
+        }
+
+        /**
+         * Dispatch completions until every spawned task has finished.
+         *
+         * @return 0 if OK, -EDEADLK if tasks are left waiting with no keystore
+         * request in flight, or negative error code (see errno.h).
+         */
+        int run()
+        {
+          struct pollfd pfd;
+          int res;
+
+          pfd.fd = mKeystore.eventfd();
+          pfd.events = POLLIN;
+
+          while (!mTasks.empty())
+          {
+            if (!mKeystore.pending())
+              return -EDEADLK;
+
+            res = poll(&pfd, 1, -1);
+            if (res < 0 && errno != EINTR)
+              return -errno;
+
+            res = mKeystore.dispatch();
+            if (res < 0)
+              return res;
+
+            reapFinished();
+          }
+
+          return 0;
+        }
+
+      private:
+        void reapFinished()
+        {
+          mTasks.remove_if([](const Task<void> &task) { return task.done(); });
+        }
+
+        AsyncKeystore &mKeystore;
+        std::list<Task<void>> mTasks;
+    };
+
+  } // namespace IasKeystoreLib
+
+} // namespace Ias
+
+#endif  // IAS_SECURITY_KEYSTORE_ASYNC_HPP
@@ -0,0 +1,329 @@
+/*
+   Copyright 2018 Intel Corporation
+
+   This software is licensed to you in accordance
+   with the agreement between you and Intel Corporation.
+
+   Alternatively, you can use this file in compliance
+   with the Apache license, Version 2.
+
+
+   Apache License, Version 2.0
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+   http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#ifndef IAS_SECURITY_KEYSTORE_CIPHER_HPP
+#define IAS_SECURITY_KEYSTORE_CIPHER_HPP
+
+/*
+ * Compile-time specialized AES interface on top of ias_keystore.h.
+ *
+ * The algorithm and key spec are template parameters, so IV, tag and
+ * wrapped key sizes are constants and fixed-size messages map to
+ * std::array buffers on the stack. No size is queried on the encrypt
+ * and decrypt paths. Header only; C++11 or later.
+ */
+
+#include <array>
+#include <cstddef>
+
+#include <errno.h>
+#include <stdint.h>
+
+#include "ias_keystore.h"
+#include "IasKeystoreLib.hpp"
+
+/**
+ * @brief Ias
+ */
+namespace Ias {
+
+  /**
+   * @brief keystore user space library
+   */
+  namespace IasKeystoreLib
+  {
+    /**
+     * Sizes of a key spec. Only the AES key specs are defined.
+     */
+    template <keystore_key_spec_t KEYSPEC>
+    struct KeySpecTraits;
+
+    template <>
+    struct KeySpecTraits<KEYSPEC_LENGTH_128>
+    {
+      static constexpr size_t kKeySize = 16;
+    };
+
+    template <>
+    struct KeySpecTraits<KEYSPEC_LENGTH_256>
+    {
+      static constexpr size_t kKeySize = 32;
+    };
+
+    /**
+     * Sizes of an algorithm spec. Only the AES algorithms are defined.
+     */
+    template <keystore_algo_spec_t ALGOSPEC>
+    struct AlgoSpecTraits;
+
+    template <>
+    struct AlgoSpecTraits<ALGOSPEC_AES_GCM>
+    {
+      static constexpr size_t kIvSize = DAL_KEYSTORE_GCM_IV_SIZE;
+      static constexpr size_t kTagSize = 16;
+    };
+
+    /* The CCM IV is the RFC 3610 counter block: L - 1 and the nonce */
+    template <>
+    struct AlgoSpecTraits<ALGOSPEC_AES_CCM>
+    {
+      static constexpr size_t kIvSize = KEYSTORE_MAX_IV_SIZE;
+      static constexpr size_t kTagSize = 16;
+    };
+
+    /**
+     * AES cipher with a key loaded into a slot.
+     *
+     * Obtain one with loadKey() or attach(), which compare the constant
+     * sizes with the device once and fail with -EMSGSIZE if they differ,
+     * so a std::array buffer is never overrun. After that encrypt() and
+     * decrypt() are single ias_keystore.h calls.
+     *
+     *   typedef Cipher<ALGOSPEC_AES_GCM, KEYSPEC_LENGTH_256> Gcm256;
+     *
+     *   Gcm256::WrappedKey wrapped;
+     *   Gcm256 cipher;
+     *   std::array<uint8_t, 64> record;
+     *   Gcm256::Encrypted<64> sealed;
+     *
+     *   res = Gcm256::generateKey(ticket, wrapped);
+     *   res = Gcm256::loadKey(ticket, wrapped, cipher);
+     *   res = cipher.encrypt(iv, record, sealed);
+     */
+    template <keystore_algo_spec_t ALGOSPEC, keystore_key_spec_t KEYSPEC>
+    class Cipher
+    {
+      public:
+        static constexpr size_t kKeySize = KeySpecTraits<KEYSPEC>::kKeySize;
+        static constexpr size_t kWrappedKeySize = kKeySize + KEYSTORE_WRAPPED_KEY_EXTRA;
+        static constexpr size_t kIvSize = AlgoSpecTraits<ALGOSPEC>::kIvSize;
+        static constexpr size_t kTagSize = AlgoSpecTraits<ALGOSPEC>::kTagSize;
+
+        typedef std::array<uint8_t, kKeySize> Key;
+        typedef std::array<uint8_t, kWrappedKeySize> WrappedKey;
+        typedef std::array<uint8_t, kIvSize> Iv;
+
+        /* Output buffers for an N byte input */
+        template <size_t N>
+        using Encrypted = std::array<uint8_t, N + kTagSize>;
+        template <size_t N>
+        using Decrypted = std::array<uint8_t, N - kTagSize>;
+
+        Cipher() noexcept : mTicket(nullptr), mSlot(0) {}
+
+        /**
+         * Compare the constant sizes with the device.
+         *
+         * Answered by the library size table, so only the first call on
+         * a device reaches it.
+         *
+         * @return 0 if they match, -EMSGSIZE if not, or negative error code.
+         */
+        static int checkSizes()
+        {
+          size_t wrapped_size = 0;
+          size_t encrypted_size = 0;
+          int res;
+
+          res = ias_keystore_wrapped_key_size(KEYSPEC, &wrapped_size, NULL);
+          if (!res)
+            res = ias_keystore_encrypt_size(ALGOSPEC, kKeySize, &encrypted_size);
+          if (res)
+            return res;
+
+          if (wrapped_size != kWrappedKeySize || encrypted_size != kKeySize + kTagSize)
+            return -EMSGSIZE;
+
+          return 0;
+        }
+
+        /**
+         * Generate and wrap a random key.
+         *
+         * @return 0 if OK or negative error code (see errno.h).
+         */
+        static int generateKey(const uint8_t *client_ticket, WrappedKey &wrapped_key)
+        {
+          int res = checkSizes();
+
+          if (res)
+            return res;
+
+          return ias_keystore_generate_key(client_ticket, KEYSPEC, wrapped_key.data());
+        }
+
+        /**
+         * Wrap an application key.
+         *
+         * @return 0 if OK or negative error code (see errno.h).
+         */
+        static int wrapKey(const uint8_t *client_ticket, const Key &key, WrappedKey &wrapped_key)
+        {
+          int res = checkSizes();
+
+          if (res)
+            return res;
+
+          return ias_keystore_wrap_key(client_ticket, key.data(), key.size(), KEYSPEC,
+                                       wrapped_key.data());
+        }
+
+        /**
+         * Load a wrapped key and bind @cipher to its slot.
+         *
+         * As with ias_keystore_load_key(), -EAGAIN means the key was
+         * rewrapped in @wrapped_key and has to be stored and loaded again.
+         *
+         * @return 0 if OK or negative error code (see errno.h).
+         */
+        static int loadKey(const uint8_t *client_ticket, WrappedKey &wrapped_key, Cipher &cipher)
+        {
+          uint32_t slot = 0;
+          int res = checkSizes();
+
+          if (!res)
+            res = ias_keystore_load_key(client_ticket, wrapped_key.data(), wrapped_key.size(), &slot);
+          if (res)
+            return res;
+
+          cipher.mTicket = client_ticket;
+          cipher.mSlot = slot;
+          return 0;
+        }
+
+        /**
+         * Bind @cipher to a key which is already loaded.
+         *
+         * @return 0 if OK or negative error code (see errno.h).
+         */
+        static int attach(const uint8_t *client_ticket, uint32_t slot_id, Cipher &cipher)
+        {
+          int res = checkSizes();
+
+          if (res)
+            return res;
+
+          cipher.mTicket = client_ticket;
+          cipher.mSlot = slot_id;
+          return 0;
+        }
+
+        /**
+         * Unload the key. The cipher is unbound afterwards.
+         *
+         * @return 0 if OK or negative error code (see errno.h).
+         */
+        int unloadKey()
+        {
+          int res;
+
+          if (!mTicket)
+            return -EBADF;
+
+          res = ias_keystore_unload_key(mTicket, mSlot);
+          mTicket = nullptr;
+          return res;
+        }
+
+        uint32_t slot() const noexcept { return mSlot; }
+
+        /**
+         * Encrypt an N byte input into N + kTagSize bytes.
+         *
+         * @return 0 if OK or negative error code (see errno.h).
+         */
+        template <size_t N>
+        int encrypt(const Iv &iv, const std::array<uint8_t, N> &input, Encrypted<N> &output) const
+        {
+          static_assert(N > 0, "empty input");
+
+          if (!mTicket)
+            return -EBADF;
+
+          return ias_keystore_encrypt(mTicket, mSlot, ALGOSPEC, iv.data(), iv.size(),
+                                      input.data(), N, output.data());
+        }
+
+        /**
+         * Decrypt and verify an N byte input into N - kTagSize bytes.
+         *
+         * @return 0 if OK or negative error code (see errno.h).
+         */
+        template <size_t N>
+        int decrypt(const Iv &iv, const std::array<uint8_t, N> &input, Decrypted<N> &output) const
+        {
+          static_assert(N > kTagSize, "input shorter than the tag");
+
+          if (!mTicket)
+            return -EBADF;
+
+          return ias_keystore_decrypt(mTicket, mSlot, ALGOSPEC, iv.data(), iv.size(),
+                                      input.data(), N, output.data());
+        }
+
+        /**
+         * Encrypt the first N - kTagSize bytes of @buffer (an Encrypted
+         * array) in place; the tag is written into the kTagSize bytes
+         * behind them.
+         *
+         * @return 0 if OK or negative error code (see errno.h).
+         */
+        template <size_t N>
+        int encryptInPlace(const Iv &iv, std::array<uint8_t, N> &buffer) const
+        {
+          static_assert(N > kTagSize, "empty input");
+
+          if (!mTicket)
+            return -EBADF;
+
+          return ias_keystore_encrypt(mTicket, mSlot, ALGOSPEC, iv.data(), iv.size(),
+                                      buffer.data(), N - kTagSize, buffer.data());
+        }
+
+        /**
+         * Decrypt and verify @buffer in place; the plaintext is the first
+         * N - kTagSize bytes.
+         *
+         * @return 0 if OK or negative error code (see errno.h).
+         */
+        template <size_t N>
+        int decryptInPlace(const Iv &iv, std::array<uint8_t, N> &buffer) const
+        {
+          static_assert(N > kTagSize, "input shorter than the tag");
+
+          if (!mTicket)
+            return -EBADF;
+
+          return ias_keystore_decrypt(mTicket, mSlot, ALGOSPEC, iv.data(), iv.size(),
+                                      buffer.data(), N, buffer.data());
+        }
+
+      private:
+        const uint8_t *mTicket;
+        uint32_t mSlot;
+    };
+  }
+}
+
+#endif  // IAS_SECURITY_KEYSTORE_CIPHER_HPP
@@ -150,6 +150,9 @@ namespace Ias {
      * @param output Pointer to the block for encrypted data.
      * @param output_size Output block size in bytes (at least iv_size + input_size + 9 bytes).
      *
+     * For AES-GCM and AES-CCM, @p input may be output + iv_size + 1: a plaintext
+     * already placed behind the room for the algo spec and IV is encrypted in place.
+     *
      * @deprecated This function will be replaced by the C function ias_keystore_encrypt().
      *
      * @return Encrypted data size in bytes if OK or negative error code (see errno).
@@ -168,6 +171,9 @@ namespace Ias {
      * @param output Pointer to the block for decrypted data.
      * @param output_size Output block size in bytes.
      *
+     * For AES-GCM and AES-CCM, @p output may be input + KEYSTORE_MAX_IV_SIZE + 1
+     * to decrypt in place.
+     *
      * @deprecated This function will be replaced by the C function ias_keystore_decrypt().
      *
      * @return Decrypted data size in bytes if OK or negative error code (see errno).
@@ -32,6 +32,7 @@ extern "C"
 #endif
 
 #include <stdint.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 #include "keystore_api_common.h"
@@ -55,9 +56,31 @@ int keystore_memcpy(void* dst, const void* src, unsigned int size);
  * set to /dev/keystore and should only need to be changed for
  * testing or debugging.
  *
+ * The library keeps the device open between calls. Changing the
+ * path closes the cached handle, and the new device is opened on
+ * the next call. This function must not be called concurrently
+ * with other keystore calls.
+ *
+ * The handle is opened with O_CLOEXEC and is not shared with child
+ * processes: after fork() the child reopens the device on first use.
+ *
+ * Names starting with "sim:" select the in-process software keystore,
+ * e.g. "sim:" or "sim:latency=200,svn=2". See the interface
+ * documentation for the options.
+ *
+ * Names starting with "unix:" followed by a socket path send the calls
+ * to a keystore broker, see ias_keystore_broker.h.
+ *
  */
 void ias_keystore_set_device(const char* dev_name);
 
+/**
+ * @brief Get the keystore device path
+ *
+ * @return The path set by ias_keystore_set_device(), /dev/keystore by default.
+ */
+const char *ias_keystore_get_device(void);
+
 /**
  * @brief Register a keystore client
  * @param [in] seed_type Which SEED to use to generate client wrapping keys.
@@ -174,6 +197,9 @@ int ias_keystore_wrap_key(const uint8_t *client_ticket,
  * The number of slots available is limited to KEYSTORE_SLOTS_MAX (= 256)
  * slots per registered client.
  *
+ * With key sharing enabled (see ias_keystore_set_key_sharing()), a wrapped
+ * key the client already has loaded returns its slot and takes a reference.
+ *
  * This function will first try to unwrap the key using the latest client key
  * available. If this fails, it will try to unwrap using any legacy client
  * keys it can generate (which were created with outdated SVN numbered SEEDs).
@@ -197,11 +223,29 @@ int ias_keystore_load_key(const uint8_t *client_ticket,
  * @param [in] slot_id       The slot ID where the key is stored.
  *
  * If there is a key in the given slot, remove it and free the slot.
+ * A key loaded several times (see ias_keystore_set_key_sharing()) stays
+ * in its slot until it has been unloaded as often.
  *
  * @return 0 if OK or negative error code (see errno.h).
  */
 int ias_keystore_unload_key(const void *client_ticket, uint32_t slot_id);
 
+/**
+ * @brief Enable or disable sharing of loaded keys.
+ *
+ * @param [in] enable 0 to disable (the default), any other value to enable.
+ *
+ * With sharing, ias_keystore_load_key() of a wrapped key that the client
+ * has already loaded in this process returns the same slot without
+ * unwrapping it again, and concurrent loads of the same wrapped key are
+ * done once. Each load takes a reference on the slot, which
+ * ias_keystore_unload_key() drops; the key is unloaded with the last one.
+ *
+ * Without sharing, every load gets a slot of its own. Enabling or
+ * disabling only affects later loads.
+ */
+void ias_keystore_set_key_sharing(int enable);
+
 /**
  * @brief Get the required size of an encrypted buffer.
  * @param [in] algo_spec      The encryption algorithm specification.
@@ -212,6 +256,25 @@ int ias_keystore_unload_key(const void *client_ticket, uint32_t slot_id);
  */
 int ias_keystore_encrypt_size(enum keystore_algo_spec algo_spec,
                               size_t input_size, size_t *output_size);
+
+/**
+ * @brief Generate a random IV for an algorithm.
+ * @param [in] algo_spec      ALGOSPEC_AES_GCM or ALGOSPEC_AES_CCM.
+ * @param [out] iv            Buffer for the IV.
+ * @param [in,out] iv_size    Size of the buffer, set to the IV size
+ *                            (DAL_KEYSTORE_GCM_IV_SIZE).
+ *
+ * The random bytes come from a buffer per thread, refilled by one getrandom()
+ * call for several hundred IVs, and are not repeated in a fork() child. For
+ * AES-CCM the first byte is the flags byte of a 2 byte length field, which
+ * limits a message to 64 KB.
+ *
+ * For many messages under one key, ias_keystore_nonce.h avoids random IVs.
+ *
+ * @return 0 if OK, -EMSGSIZE if @iv_size is too small (it is set to the IV
+ * size), or negative error code (see errno.h).
+ */
+int ias_keystore_random_iv(enum keystore_algo_spec algo_spec, uint8_t *iv, size_t *iv_size);
 /**
  * @brief Encrypt plaintext using AppKey/IV according to AlgoSpec.
  *
@@ -252,7 +315,13 @@ int ias_keystore_encrypt_size(enum keystore_algo_spec algo_spec,
  * - ALGOSPEC_AES_GCM: The @p iv must be formatted according to RFC5288.
  * - ALGOSPEC_ECIES: The @p iv must be set to null with @iv_size zero.
  *
- * @return 0 if OK or negative error code (see errno.h).
+ * With ALGOSPEC_AES_CCM and ALGOSPEC_AES_GCM, @p output may be @p input
+ * to encrypt in place. The buffer then holds the plaintext followed by
+ * room for the tag, ias_keystore_encrypt_size() bytes in total. Any other
+ * overlap of @p input and @p output is rejected.
+ *
+ * @return 0 if OK, -EINVAL if @p output overlaps @p input other than in
+ * place, or negative error code (see errno.h).
  */
 int ias_keystore_encrypt(const uint8_t *client_ticket, uint32_t slot_id,
                          enum keystore_algo_spec algo_spec,
@@ -288,7 +357,13 @@ int ias_keystore_decrypt_size(enum keystore_algo_spec algo_spec,
  *
  * Use the key stored in the given slot to decrypt a block of data.
  *
- * @return 0 if OK or negative error code (see errno.h).
+ * With ALGOSPEC_AES_CCM and ALGOSPEC_AES_GCM, @p output may be @p input
+ * to decrypt in place: the plaintext replaces the start of the
+ * ciphertext. If the tag does not match, the buffer holds neither. Any
+ * other overlap of @p input and @p output is rejected.
+ *
+ * @return 0 if OK, -EINVAL if @p output overlaps @p input other than in
+ * place, or negative error code (see errno.h).
  */
 int ias_keystore_decrypt(const uint8_t *client_ticket, uint32_t slot_id,
                          enum keystore_algo_spec algo_spec,
@@ -296,6 +371,122 @@ int ias_keystore_decrypt(const uint8_t *client_ticket, uint32_t slot_id,
                          const uint8_t *input, size_t input_size,
                          uint8_t *output);
 
+/**
+ * IAS_KEYSTORE_IOV_MAX - Largest number of segments of a vector call
+ */
+#define IAS_KEYSTORE_IOV_MAX 1024
+
+/**
+ * @brief Encrypt scattered plaintext into scattered buffers.
+ *
+ * @param [in] client_ticket  The client ticket (KEYSTORE_CLIENT_TICKET_SIZE bytes).
+ * @param [in] slot_id        The slot ID.
+ * @param [in] algo_spec      The algorithm specification.
+ * @param [in] iv             Encryption initialization vector.
+ * @param [in] iv_size        Initialization vector size in bytes.
+ * @param [in] input          Input segments; the plaintext is their concatenation.
+ * @param [in] input_count    Number of input segments, at most IAS_KEYSTORE_IOV_MAX.
+ * @param [in] output         Output segments, filled in order.
+ * @param [in] output_count   Number of output segments, at most IAS_KEYSTORE_IOV_MAX.
+ *
+ * Same as ias_keystore_encrypt() on the concatenated input, without the
+ * caller building contiguous buffers. A single input and output segment
+ * go to the device as they are. Otherwise the segments are passed down
+ * as they are if the transport supports it (see ias_keystore_vector_supported()),
+ * or gathered once into one buffer and the output scattered from it.
+ *
+ * @return 0 if OK, -EMSGSIZE if the output segments hold less than
+ * ias_keystore_encrypt_size() bytes, or negative error code (see errno.h).
+ */
+int ias_keystore_encryptv(const uint8_t *client_ticket, uint32_t slot_id,
+                          enum keystore_algo_spec algo_spec,
+                          const uint8_t *iv, size_t iv_size,
+                          const struct iovec *input, int input_count,
+                          const struct iovec *output, int output_count);
+
+/**
+ * @brief Decrypt scattered ciphertext into scattered buffers.
+ *
+ * See ias_keystore_encryptv(). The output segments must hold at least
+ * ias_keystore_decrypt_size() bytes.
+ *
+ * @return 0 if OK, -EMSGSIZE if the output segments are too small, or
+ * negative error code (see errno.h).
+ */
+int ias_keystore_decryptv(const uint8_t *client_ticket, uint32_t slot_id,
+                          enum keystore_algo_spec algo_spec,
+                          const uint8_t *iv, size_t iv_size,
+                          const struct iovec *input, int input_count,
+                          const struct iovec *output, int output_count);
+
+/**
+ * @brief Check whether the transport takes vector calls without gathering.
+ *
+ * The result is probed once per device and cached.
+ *
+ * @return 1 if ias_keystore_encryptv() and ias_keystore_decryptv() pass
+ * segments down as they are, 0 if the library gathers them, or negative
+ * error code (see errno.h).
+ */
+int ias_keystore_vector_supported(void);
+
+/**
+ * @brief One encrypt or decrypt operation of a batch.
+ *
+ * The input fields have the same meaning as the corresponding arguments
+ * of ias_keystore_encrypt() and ias_keystore_decrypt(). @p status is set
+ * by the batch call to 0 or a negative error code (see errno.h).
+ */
+struct ias_keystore_crypto_op {
+  uint32_t slot_id;
+  enum keystore_algo_spec algo_spec;
+  const uint8_t *iv;
+  size_t iv_size;
+  const uint8_t *input;
+  size_t input_size;
+  uint8_t *output;
+  int status;
+};
+
+/**
+ * @brief Check whether the driver processes batches in a single ioctl.
+ *
+ * The result is probed once per device and cached.
+ *
+ * @return 1 if batches go down as one ioctl, 0 if the library processes
+ * them one operation at a time, or negative error code (see errno.h).
+ */
+int ias_keystore_batch_supported(void);
+
+/**
+ * @brief Encrypt several buffers with keys of one client.
+ *
+ * @param [in] client_ticket The client ticket (KEYSTORE_CLIENT_TICKET_SIZE bytes).
+ * @param [in,out] ops       Array of operations. Output buffers must be sized
+ *                           as for ias_keystore_encrypt().
+ * @param [in] count         Number of operations.
+ *
+ * If the driver supports it, the whole batch is passed down in one ioctl.
+ * Otherwise the operations are executed one after another. The results
+ * are the same in both cases.
+ *
+ * @return 0 if all operations succeeded, the status of the first failed
+ * operation, or negative error code (see errno.h) if the batch could not
+ * be processed at all. The status of each operation is stored in
+ * ops[i].status.
+ */
+int ias_keystore_encrypt_batch(const uint8_t *client_ticket,
+                               struct ias_keystore_crypto_op *ops, size_t count);
+
+/**
+ * @brief Decrypt several buffers with keys of one client.
+ *
+ * See ias_keystore_encrypt_batch(). Output buffers must be sized as for
+ * ias_keystore_decrypt().
+ */
+int ias_keystore_decrypt_batch(const uint8_t *client_ticket,
+                               struct ias_keystore_crypto_op *ops, size_t count);
+
 #ifdef __cplusplus
 }
 #endif
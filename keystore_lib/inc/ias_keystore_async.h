@@ -0,0 +1,206 @@
+/*
+   Copyright 2018 Intel Corporation
+
+   This software is licensed to you in accordance
+   with the agreement between you and Intel Corporation.
+
+   Alternatively, you can use this file in compliance
+   with the Apache license, Version 2.
+
+
+   Apache License, Version 2.0
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+   http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef IAS_KEYSTORE_ASYNC_H
+#define IAS_KEYSTORE_ASYNC_H
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#include <stdint.h>
+#include <unistd.h>
+
+#include "keystore_api_common.h"
+
+/**
+ * @brief Asynchronous keystore operations
+ *
+ * A pool of worker threads executes the blocking ias_keystore.h calls on
+ * behalf of the application. Requests are submitted with
+ * ias_keystore_async_submit() and complete either through a callback,
+ * invoked on a worker thread, or through a completion queue that is
+ * signalled with an eventfd and drained with ias_keystore_async_reap().
+ *
+ * The pool bounds the number of requests in flight. A request counts
+ * towards the limit from submission until its callback has returned or
+ * it has been reaped. When the limit is reached, submission blocks or
+ * fails with -EAGAIN.
+ *
+ * Worker threads are not inherited by child processes; a pool must not be
+ * used after fork() in the child.
+ */
+struct ias_keystore_async;
+
+/**
+ * @brief Operations which can be submitted.
+ */
+enum ias_keystore_async_op {
+  IAS_KEYSTORE_ASYNC_ENCRYPT = 1,
+  IAS_KEYSTORE_ASYNC_DECRYPT,
+  IAS_KEYSTORE_ASYNC_GENERATE_KEY,
+  IAS_KEYSTORE_ASYNC_WRAP_KEY,
+  IAS_KEYSTORE_ASYNC_LOAD_KEY,
+  IAS_KEYSTORE_ASYNC_UNLOAD_KEY,
+};
+
+struct ias_keystore_async_req;
+
+/**
+ * @brief Completion callback, invoked on a worker thread.
+ *
+ * The request belongs to the caller again once the callback is invoked.
+ */
+typedef void (*ias_keystore_async_cb)(struct ias_keystore_async_req *req);
+
+/**
+ * @brief An asynchronous request.
+ *
+ * The request, and all buffers it points to, are owned by the caller and
+ * must stay valid until the request has completed.
+ *
+ * Fields used by each operation (see the matching ias_keystore.h function):
+ *
+ * - IAS_KEYSTORE_ASYNC_ENCRYPT, IAS_KEYSTORE_ASYNC_DECRYPT: @p client_ticket,
+ *   @p slot_id, @p algo_spec, @p iv, @p iv_size, @p input, @p input_size, @p output.
+ * - IAS_KEYSTORE_ASYNC_GENERATE_KEY: @p client_ticket, @p key_spec, @p wrapped_key.
+ * - IAS_KEYSTORE_ASYNC_WRAP_KEY: @p client_ticket, @p key_spec, @p input (the
+ *   application key), @p input_size, @p wrapped_key.
+ * - IAS_KEYSTORE_ASYNC_LOAD_KEY: @p client_ticket, @p wrapped_key,
+ *   @p wrapped_key_size. The slot is returned in @p slot_id.
+ * - IAS_KEYSTORE_ASYNC_UNLOAD_KEY: @p client_ticket, @p slot_id.
+ */
+struct ias_keystore_async_req {
+  /* input */
+  enum ias_keystore_async_op op;
+  const uint8_t *client_ticket;
+  uint32_t slot_id;
+  enum keystore_algo_spec algo_spec;
+  enum keystore_key_spec key_spec;
+  const uint8_t *iv;
+  size_t iv_size;
+  const uint8_t *input;
+  size_t input_size;
+  uint8_t *output;
+  uint8_t *wrapped_key;
+  size_t wrapped_key_size;
+
+  /* completion: callback, or the completion queue if NULL */
+  ias_keystore_async_cb callback;
+  void *user_data;
+
+  /* output: 0 if OK or negative error code (see errno.h) */
+  int result;
+
+  /* private */
+  struct ias_keystore_async_req *next;
+};
+
+/**
+ * @brief Pool configuration.
+ * @param workers      Number of worker threads (0 for the default of 4).
+ * @param queue_depth  Maximum number of requests in flight (0 for the default of 64).
+ */
+struct ias_keystore_async_config {
+  unsigned int workers;
+  unsigned int queue_depth;
+};
+
+/**
+ * ias_keystore_async_submit() flag: fail with -EAGAIN instead of blocking
+ * when the pool is full.
+ */
+#define IAS_KEYSTORE_ASYNC_NONBLOCK 0x1
+
+/**
+ * @brief Create a worker pool.
+ *
+ * @param [in] config  Pool configuration, or NULL for the defaults.
+ * @param [out] pool   The new pool.
+ *
+ * @return 0 if OK or negative error code (see errno.h).
+ */
+int ias_keystore_async_create(const struct ias_keystore_async_config *config,
+                              struct ias_keystore_async **pool);
+
+/**
+ * @brief Destroy a worker pool.
+ *
+ * @param [in] pool The pool. May be NULL.
+ *
+ * Requests which were already submitted are executed and their callbacks
+ * invoked before this function returns. Completions which were not reaped
+ * are dropped. Must not be called concurrently with submission.
+ */
+void ias_keystore_async_destroy(struct ias_keystore_async *pool);
+
+/**
+ * @brief Submit a request.
+ *
+ * @param [in] pool    The pool.
+ * @param [in] req     The request. @p result is valid once it completes.
+ * @param [in] flags   0 or IAS_KEYSTORE_ASYNC_NONBLOCK.
+ *
+ * Without IAS_KEYSTORE_ASYNC_NONBLOCK the call blocks while the pool is
+ * full. A thread which reaps completions itself should therefore submit
+ * with IAS_KEYSTORE_ASYNC_NONBLOCK.
+ *
+ * @return 0 if queued, -EAGAIN if the pool is full and
+ * IAS_KEYSTORE_ASYNC_NONBLOCK is set, or negative error code (see errno.h).
+ */
+int ias_keystore_async_submit(struct ias_keystore_async *pool,
+                              struct ias_keystore_async_req *req, int flags);
+
+/**
+ * @brief Get the completion eventfd.
+ *
+ * The descriptor is readable while completed requests without a callback
+ * are waiting to be reaped. It is owned by the pool and must not be read
+ * or closed by the caller.
+ *
+ * @return File descriptor.
+ */
+int ias_keystore_async_eventfd(const struct ias_keystore_async *pool);
+
+/**
+ * @brief Take completed requests from the completion queue.
+ *
+ * @param [in] pool    The pool.
+ * @param [out] reqs   Array receiving up to @p max completed requests.
+ * @param [in] max     Size of @p reqs.
+ *
+ * Does not block. Requests are returned in completion order.
+ *
+ * @return Number of requests stored in @p reqs, or negative error code (see errno.h).
+ */
+int ias_keystore_async_reap(struct ias_keystore_async *pool,
+                            struct ias_keystore_async_req **reqs, size_t max);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* IAS_KEYSTORE_ASYNC_H */
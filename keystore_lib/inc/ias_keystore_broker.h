@@ -0,0 +1,126 @@
+/*
+   Copyright 2018 Intel Corporation
+
+   This software is licensed to you in accordance
+   with the agreement between you and Intel Corporation.
+
+   Alternatively, you can use this file in compliance
+   with the Apache license, Version 2.
+
+
+   Apache License, Version 2.0
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+   http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef IAS_KEYSTORE_BROKER_H
+#define IAS_KEYSTORE_BROKER_H
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#include <stdint.h>
+
+/**
+ * @brief Keystore broker
+ *
+ * A broker owns the keystore device sessions of a host and serves
+ * keystore calls from other processes over a Unix domain socket.
+ * Applications select it with ias_keystore_set_device("unix:<socket>")
+ * and use the ias_keystore.h interface unchanged.
+ *
+ * The broker hands out its own client tickets and slot IDs. All clients
+ * of a SEED type share a small pool of device registrations, which are
+ * added as slots run out, so the number of clients is not limited by
+ * KEYSTORE_CLIENTS_MAX. Encrypt and decrypt calls arriving from different
+ * connections at the same time are passed to the device as one batch.
+ *
+ * The device only sees the broker: keys are wrapped with the client key
+ * of the broker executable, and any client of the broker can load a key
+ * wrapped by another one. The broker keeps clients and slots apart and
+ * only accepts a ticket from the user which registered it.
+ *
+ * Registrations stay until they are unregistered, also after the
+ * connection and process which registered them are gone, so that a
+ * ticket can be kept in a file. Each user may hold up to max_user_clients
+ * of them, so a leaking user cannot take the registrations of others.
+ */
+struct ias_keystore_broker;
+
+/**
+ * @brief Broker configuration.
+ * @param socket_path  Path of the listening socket.
+ * @param device       Device to use, NULL for ias_keystore_get_device().
+ * @param max_clients  Maximum number of registered clients, 0 for 4096.
+ * @param socket_mode  Permissions of the socket, 0 for 0660.
+ * @param max_user_clients  Maximum number of clients registered by one
+ *                          user, 0 for 256. Beyond it registering fails
+ *                          with -EDQUOT.
+ */
+struct ias_keystore_broker_config {
+  const char *socket_path;
+  const char *device;
+  unsigned int max_clients;
+  unsigned int socket_mode;
+  unsigned int max_user_clients;
+};
+
+/**
+ * @brief Create a broker.
+ *
+ * Opens the device and the listening socket. A stale socket file is
+ * replaced; if another broker is listening on it, -EADDRINUSE is returned.
+ *
+ * @param [in] config   The configuration.
+ * @param [out] broker  The broker.
+ *
+ * @return 0 if OK or negative error code (see errno.h).
+ */
+int ias_keystore_broker_create(const struct ias_keystore_broker_config *config,
+                               struct ias_keystore_broker **broker);
+
+/**
+ * @brief Serve clients until ias_keystore_broker_stop() is called.
+ *
+ * @param [in] broker The broker.
+ *
+ * @return 0 if stopped or negative error code (see errno.h).
+ */
+int ias_keystore_broker_run(struct ias_keystore_broker *broker);
+
+/**
+ * @brief Stop ias_keystore_broker_run().
+ *
+ * Can be called from any thread and from signal handlers.
+ *
+ * @param [in] broker The broker.
+ */
+void ias_keystore_broker_stop(struct ias_keystore_broker *broker);
+
+/**
+ * @brief Destroy a broker.
+ *
+ * Unregisters its device sessions, which also unloads all keys loaded
+ * through the broker, and removes the socket.
+ *
+ * @param [in] broker The broker, may be NULL.
+ */
+void ias_keystore_broker_destroy(struct ias_keystore_broker *broker);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* IAS_KEYSTORE_BROKER_H */
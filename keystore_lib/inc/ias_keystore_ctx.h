@@ -0,0 +1,169 @@
+/*
+   Copyright 2018 Intel Corporation
+
+   This software is licensed to you in accordance
+   with the agreement between you and Intel Corporation.
+
+   Alternatively, you can use this file in compliance
+   with the Apache license, Version 2.
+
+
+   Apache License, Version 2.0
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+   http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef IAS_KEYSTORE_CTX_H
+#define IAS_KEYSTORE_CTX_H
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#include <stdint.h>
+#include <unistd.h>
+
+#include "keystore_api_common.h"
+
+/**
+ * @brief Keystore client context
+ *
+ * A context owns a device handle and one registered client session.
+ * The client ticket is kept inside the context, together with request
+ * templates that are pre-filled with it, so that calls on a context
+ * only set the per-call fields.
+ *
+ * Contexts do not share state with each other or with the ticket based
+ * ias_keystore.h functions. A process can open one context per seed
+ * type, or contexts on different devices, and use them independently.
+ *
+ * All functions taking a context are thread-safe. A context must not be
+ * used in a child process after fork(); the child should open its own.
+ */
+struct ias_keystore_ctx;
+
+/**
+ * @brief Open a device and register a keystore client on it.
+ *
+ * @param [in] dev_name   Path to the device, or NULL for the path set
+ *                        by ias_keystore_set_device().
+ * @param [in] seed_type  Which SEED to use (see ias_keystore_register_client()).
+ * @param [out] ctx       The new context.
+ *
+ * @return 0 if OK or negative error code (see errno.h).
+ */
+int ias_keystore_ctx_open(const char *dev_name, enum keystore_seed_type seed_type,
+                          struct ias_keystore_ctx **ctx);
+
+/**
+ * @brief Unregister the client and release the context.
+ *
+ * @param [in] ctx The context. May be NULL.
+ *
+ * Keys still loaded into slots of this client are removed by the
+ * unregister call.
+ *
+ * @return 0 if OK or negative error code (see errno.h). The context is
+ * released in either case.
+ */
+int ias_keystore_ctx_close(struct ias_keystore_ctx *ctx);
+
+/**
+ * @brief Get the client ticket of a context.
+ *
+ * @param [in] ctx The context.
+ *
+ * @return Pointer to KEYSTORE_CLIENT_TICKET_SIZE bytes, valid until
+ * ias_keystore_ctx_close().
+ */
+const uint8_t *ias_keystore_ctx_ticket(const struct ias_keystore_ctx *ctx);
+
+/**
+ * @brief Get the wrapped key size in bytes.
+ *
+ * Same as ias_keystore_wrapped_key_size(), but the sizes are cached in
+ * the context after the first query for each key spec.
+ */
+int ias_keystore_ctx_wrapped_key_size(struct ias_keystore_ctx *ctx,
+                                      enum keystore_key_spec key_spec,
+                                      size_t *wrapped_key_size,
+                                      size_t *unwrapped_key_size);
+
+/**
+ * @brief Generate a random key and wrap it (see ias_keystore_generate_key()).
+ */
+int ias_keystore_ctx_generate_key(struct ias_keystore_ctx *ctx,
+                                  enum keystore_key_spec key_spec,
+                                  uint8_t *wrapped_key);
+
+/**
+ * @brief Wrap the application key (see ias_keystore_wrap_key()).
+ */
+int ias_keystore_ctx_wrap_key(struct ias_keystore_ctx *ctx,
+                              const uint8_t *app_key, size_t app_key_size,
+                              enum keystore_key_spec key_spec,
+                              uint8_t *wrapped_key);
+
+/**
+ * @brief Unwrap the application key and store in a slot (see ias_keystore_load_key()).
+ *
+ * As with ias_keystore_load_key(), -EAGAIN means that @p wrapped_key
+ * was re-wrapped in place and must be stored again by the caller.
+ */
+int ias_keystore_ctx_load_key(struct ias_keystore_ctx *ctx,
+                              uint8_t *wrapped_key, size_t wrapped_key_size,
+                              uint32_t *slot_id);
+
+/**
+ * @brief Remove a key from a slot (see ias_keystore_unload_key()).
+ */
+int ias_keystore_ctx_unload_key(struct ias_keystore_ctx *ctx, uint32_t slot_id);
+
+/**
+ * @brief Get the required size of an encrypted buffer (see ias_keystore_encrypt_size()).
+ */
+int ias_keystore_ctx_encrypt_size(struct ias_keystore_ctx *ctx,
+                                  enum keystore_algo_spec algo_spec,
+                                  size_t input_size, size_t *output_size);
+
+/**
+ * @brief Get the required size of a decrypted buffer (see ias_keystore_decrypt_size()).
+ */
+int ias_keystore_ctx_decrypt_size(struct ias_keystore_ctx *ctx,
+                                  enum keystore_algo_spec algo_spec,
+                                  size_t input_size, size_t *output_size);
+
+/**
+ * @brief Encrypt using the key in a slot (see ias_keystore_encrypt()).
+ */
+int ias_keystore_ctx_encrypt(struct ias_keystore_ctx *ctx, uint32_t slot_id,
+                             enum keystore_algo_spec algo_spec,
+                             const uint8_t *iv, size_t iv_size,
+                             const uint8_t *input, size_t input_size,
+                             uint8_t *output);
+
+/**
+ * @brief Decrypt using the key in a slot (see ias_keystore_decrypt()).
+ */
+int ias_keystore_ctx_decrypt(struct ias_keystore_ctx *ctx, uint32_t slot_id,
+                             enum keystore_algo_spec algo_spec,
+                             const uint8_t *iv, size_t iv_size,
+                             const uint8_t *input, size_t input_size,
+                             uint8_t *output);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* IAS_KEYSTORE_CTX_H */
@@ -0,0 +1,158 @@
+/*
+   Copyright 2018 Intel Corporation
+
+   This software is licensed to you in accordance
+   with the agreement between you and Intel Corporation.
+
+   Alternatively, you can use this file in compliance
+   with the Apache license, Version 2.
+
+
+   Apache License, Version 2.0
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+   http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef IAS_KEYSTORE_KEYPOOL_H
+#define IAS_KEYSTORE_KEYPOOL_H
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#include <stdint.h>
+#include <unistd.h>
+
+#include "keystore_api_common.h"
+
+/**
+ * @brief Pre-generated key pool
+ *
+ * A key pool keeps wrapped keys of one client and key spec generated
+ * ahead of time, so that ias_keystore_keypool_take() returns without a
+ * device call. A background thread generates keys with
+ * ias_keystore_generate_key() whenever the pool drops below the low
+ * watermark, until it holds high watermark keys again.
+ *
+ * Keys are handed out once. They are wrapped, like any key returned by
+ * ias_keystore_generate_key(), and are cleared from memory when taken and
+ * when the pool is destroyed.
+ *
+ * All functions are thread-safe. The refill thread is not inherited by
+ * child processes; a pool must not be used after fork() in the child.
+ */
+struct ias_keystore_keypool;
+
+/**
+ * @brief Key pool configuration.
+ * @param key_spec        Key spec of the generated keys.
+ * @param low_watermark   Refill when fewer keys are left, less than
+ *                        @high_watermark. 0 for half of it.
+ * @param high_watermark  Number of keys kept ready, 0 for 16.
+ */
+struct ias_keystore_keypool_config {
+  enum keystore_key_spec key_spec;
+  uint32_t low_watermark;
+  uint32_t high_watermark;
+};
+
+/**
+ * @brief Key pool counters.
+ * @param taken      Keys handed out.
+ * @param empty      Takes which found the pool empty and generated the
+ *                   key on the calling thread.
+ * @param generated  Keys generated by the refill thread.
+ * @param errors     Failed generate calls of the refill thread.
+ * @param available  Keys in the pool.
+ */
+struct ias_keystore_keypool_stats {
+  uint64_t taken;
+  uint64_t empty;
+  uint64_t generated;
+  uint64_t errors;
+  uint32_t available;
+};
+
+/**
+ * @brief Create a key pool and start filling it.
+ *
+ * @param [in] client_ticket  Ticket of the client, must remain valid
+ *                            until ias_keystore_keypool_destroy().
+ * @param [in] config         Configuration.
+ * @param [out] pool          The new pool.
+ *
+ * @return 0 if OK or negative error code (see errno.h).
+ */
+int ias_keystore_keypool_create(const uint8_t *client_ticket,
+                                const struct ias_keystore_keypool_config *config,
+                                struct ias_keystore_keypool **pool);
+
+/**
+ * @brief Stop the refill thread and release the pool.
+ *
+ * @param [in] pool The pool. May be NULL.
+ *
+ * Waits for a generate call in progress.
+ */
+void ias_keystore_keypool_destroy(struct ias_keystore_keypool *pool);
+
+/**
+ * @brief Get the wrapped key size of the pool's keys.
+ *
+ * @param [in] pool The pool.
+ *
+ * @return Size in bytes (see ias_keystore_wrapped_key_size()).
+ */
+size_t ias_keystore_keypool_key_size(const struct ias_keystore_keypool *pool);
+
+/**
+ * @brief Take a wrapped key from the pool.
+ *
+ * @param [in] pool               The pool.
+ * @param [out] wrapped_key       Buffer for the wrapped key.
+ * @param [in] wrapped_key_size   Size of the buffer, at least
+ *                                ias_keystore_keypool_key_size().
+ *
+ * If the pool is empty, the key is generated on the calling thread.
+ *
+ * @return 0 if OK or negative error code (see errno.h).
+ */
+int ias_keystore_keypool_take(struct ias_keystore_keypool *pool,
+                              uint8_t *wrapped_key, size_t wrapped_key_size);
+
+/**
+ * @brief Wait until the pool is filled to the high watermark.
+ *
+ * @param [in] pool The pool.
+ *
+ * For filling the pool at start-up, before keys are requested.
+ *
+ * @return 0 if OK, or the error of the last failed generate call.
+ */
+int ias_keystore_keypool_fill(struct ias_keystore_keypool *pool);
+
+/**
+ * @brief Get the key pool counters.
+ *
+ * @param [in] pool    The pool.
+ * @param [out] stats  The counters.
+ */
+void ias_keystore_keypool_get_stats(struct ias_keystore_keypool *pool,
+                                    struct ias_keystore_keypool_stats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* IAS_KEYSTORE_KEYPOOL_H */
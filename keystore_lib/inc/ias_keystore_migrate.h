@@ -0,0 +1,138 @@
+/*
+   Copyright 2018 Intel Corporation
+
+   This software is licensed to you in accordance
+   with the agreement between you and Intel Corporation.
+
+   Alternatively, you can use this file in compliance
+   with the Apache license, Version 2.
+
+
+   Apache License, Version 2.0
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+   http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef IAS_KEYSTORE_MIGRATE_H
+#define IAS_KEYSTORE_MIGRATE_H
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#include <stdint.h>
+#include <unistd.h>
+
+#include "keystore_api_common.h"
+
+/**
+ * @brief Bulk key migration
+ *
+ * After a SEED SVN update, ias_keystore_load_key() returns -EAGAIN for
+ * every key wrapped with the old SVN and re-wraps it in place.
+ * ias_keystore_migrate() runs this load and re-wrap cycle over a corpus
+ * of wrapped keys on several worker threads. Keys are pulled from the
+ * application one at a time, so the corpus does not have to fit into
+ * memory, and handed back with the result so that re-wrapped keys can
+ * be stored.
+ *
+ * Every key is loaded and unloaded again; a re-wrapped key is loaded a
+ * second time to check the new blob before it is handed back. Each worker
+ * uses at most one slot at a time.
+ */
+
+/**
+ * IAS_KEYSTORE_MIGRATE_REWRAPPED - Result of a key which was re-wrapped
+ */
+#define IAS_KEYSTORE_MIGRATE_REWRAPPED 1
+
+/**
+ * @brief One key of the corpus.
+ * @param wrapped_key       The wrapped key, re-wrapped in place.
+ * @param wrapped_key_size  Size of the wrapped key.
+ * @param priv              For the application, e.g. where the key is stored.
+ * @param result            0 if the key is current,
+ *                          IAS_KEYSTORE_MIGRATE_REWRAPPED if it was
+ *                          re-wrapped, or negative error code (see errno.h).
+ */
+struct ias_keystore_migrate_key {
+  uint8_t *wrapped_key;
+  size_t wrapped_key_size;
+  void *priv;
+  int result;
+};
+
+/**
+ * @brief Migration counters.
+ * @param keys        Keys processed.
+ * @param current     Keys which were already wrapped with the current SVN.
+ * @param rewrapped   Keys which were re-wrapped and stored.
+ * @param failed      Keys which could not be loaded or stored.
+ * @param elapsed_ns  Time since the start of the migration.
+ */
+struct ias_keystore_migrate_stats {
+  uint64_t keys;
+  uint64_t current;
+  uint64_t rewrapped;
+  uint64_t failed;
+  uint64_t elapsed_ns;
+};
+
+/**
+ * @brief Migration configuration.
+ * @param workers      Number of worker threads, 0 for 4.
+ * @param next         Get the next key of the corpus. Returns 1 and fills
+ *                     in wrapped_key, wrapped_key_size and priv, 0 at the
+ *                     end of the corpus, or negative error code to abort.
+ *                     Calls are serialized.
+ * @param complete     Hand back a processed key, with its result. Should
+ *                     store re-wrapped keys, and release the key. Returns 0
+ *                     or negative error code, which counts the key as
+ *                     failed. Called concurrently from the workers.
+ * @param progress     Report progress, at most every @progress_ms and once
+ *                     at the end. Calls are serialized. May be NULL.
+ * @param progress_ms  Progress interval in milliseconds, 0 for 1000.
+ * @param priv         Passed to the callbacks.
+ */
+struct ias_keystore_migrate_config {
+  unsigned int workers;
+  int (*next)(void *priv, struct ias_keystore_migrate_key *key);
+  int (*complete)(void *priv, struct ias_keystore_migrate_key *key);
+  void (*progress)(void *priv, const struct ias_keystore_migrate_stats *stats);
+  unsigned int progress_ms;
+  void *priv;
+};
+
+/**
+ * @brief Migrate a corpus of wrapped keys to the current SEED SVN.
+ *
+ * @param [in] client_ticket  Ticket of the client the keys belong to.
+ * @param [in] config         Configuration.
+ * @param [out] stats         Final counters. May be NULL.
+ *
+ * Failed keys do not stop the migration; they are reported to
+ * complete() and counted.
+ *
+ * @return 0 if the whole corpus was processed, or the error returned by
+ * next(), or negative error code (see errno.h).
+ */
+int ias_keystore_migrate(const uint8_t *client_ticket,
+                         const struct ias_keystore_migrate_config *config,
+                         struct ias_keystore_migrate_stats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* IAS_KEYSTORE_MIGRATE_H */
@@ -0,0 +1,129 @@
+/*
+   Copyright 2018 Intel Corporation
+
+   This software is licensed to you in accordance
+   with the agreement between you and Intel Corporation.
+
+   Alternatively, you can use this file in compliance
+   with the Apache license, Version 2.
+
+
+   Apache License, Version 2.0
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+   http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#ifndef IAS_KEYSTORE_NONCE_H
+#define IAS_KEYSTORE_NONCE_H
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#include <stdint.h>
+#include <unistd.h>
+
+#include "keystore_api_common.h"
+
+/**
+ * @brief Deterministic AES-GCM nonces
+ *
+ * A nonce generator hands out the DAL_KEYSTORE_GCM_IV_SIZE byte IVs for
+ * one key, laid out as in RFC 5288:
+ *
+ *   fixed     IAS_KEYSTORE_NONCE_FIXED_SIZE random bytes, chosen once
+ *   counter   64 bit big endian invocation counter
+ *
+ * Each IV is taken with an atomic increment of the counter, with no system
+ * call and no lock. The state is kept in a file: before the counter passes
+ * the high-water mark stored there, the next @reserve counter values are
+ * reserved by writing a new mark, so after a crash the generator continues
+ * above every IV it may have handed out. ias_keystore_nonce_close() stores
+ * the exact counter.
+ *
+ * A state file belongs to exactly one key and must not be copied or
+ * restored from a backup: both would repeat IVs, which breaks AES-GCM. The
+ * file is locked while open, so two processes cannot share it.
+ *
+ * ias_keystore_nonce_next() is thread-safe.
+ */
+struct ias_keystore_nonce;
+
+/**
+ * IAS_KEYSTORE_NONCE_FIXED_SIZE - Size of the fixed field of an IV
+ */
+#define IAS_KEYSTORE_NONCE_FIXED_SIZE 4
+
+/**
+ * IAS_KEYSTORE_NONCE_RESERVE - Default number of IVs reserved per write
+ * of the state file
+ */
+#define IAS_KEYSTORE_NONCE_RESERVE 65536
+
+/**
+ * @brief Open a nonce generator.
+ *
+ * @param [in] path     State file, created with a new random fixed field if
+ *                      it does not exist. NULL for a generator kept in
+ *                      memory only, for a key that lives no longer than the
+ *                      process.
+ * @param [in] reserve  IVs reserved per write of the state file, 0 for
+ *                      IAS_KEYSTORE_NONCE_RESERVE.
+ * @param [out] nonce   The generator.
+ *
+ * @return 0 if OK, -EBUSY if the state file is open elsewhere, -EBADMSG if
+ * it is not a state file, or negative error code (see errno.h).
+ */
+int ias_keystore_nonce_open(const char *path, uint32_t reserve,
+                            struct ias_keystore_nonce **nonce);
+
+/**
+ * @brief Get the next IV.
+ *
+ * @param [in] nonce  The generator.
+ * @param [out] iv    DAL_KEYSTORE_GCM_IV_SIZE bytes.
+ *
+ * Every call returns a different IV, also across restarts.
+ *
+ * @return 0 if OK, -EOVERFLOW if the counter is exhausted (use a new key),
+ * or the error of writing the state file.
+ */
+int ias_keystore_nonce_next(struct ias_keystore_nonce *nonce, uint8_t *iv);
+
+/**
+ * @brief Get the counter of the next IV.
+ *
+ * @param [in] nonce  The generator.
+ *
+ * @return The number of IVs handed out by this key, including those
+ * reserved but not handed out before a restart.
+ */
+uint64_t ias_keystore_nonce_counter(const struct ias_keystore_nonce *nonce);
+
+/**
+ * @brief Store the counter and release the generator.
+ *
+ * @param [in] nonce The generator. May be NULL.
+ *
+ * Must not be called while another thread is in ias_keystore_nonce_next().
+ *
+ * @return 0 if OK or the error of writing the state file; the generator is
+ * released either way.
+ */
+int ias_keystore_nonce_close(struct ias_keystore_nonce *nonce);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* IAS_KEYSTORE_NONCE_H */
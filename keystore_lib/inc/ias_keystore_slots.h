@@ -0,0 +1,188 @@
+/*
+   Copyright 2018 Intel Corporation
+
+   This software is licensed to you in accordance
+   with the agreement between you and Intel Corporation.
+
+   Alternatively, you can use this file in compliance
+   with the Apache license, Version 2.
+
+
+   Apache License, Version 2.0
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+   http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef IAS_KEYSTORE_SLOTS_H
+#define IAS_KEYSTORE_SLOTS_H
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#include <stdint.h>
+#include <unistd.h>
+
+#include "keystore_api_common.h"
+
+/**
+ * @brief Keystore slot manager
+ *
+ * A client can have at most KEYSTORE_SLOTS_MAX (256) keys loaded at the
+ * same time. The slot manager holds any number of wrapped keys of one
+ * client, each under a handle chosen by the application, and loads them
+ * into slots on demand.
+ *
+ * ias_keystore_slots_acquire() returns the slot of a key, loading it if
+ * needed, and pins it until ias_keystore_slots_release(). When all slots
+ * of the manager are in use, the least recently released unpinned key is
+ * unloaded to make room.
+ *
+ * All functions are thread-safe. Keys are loaded and unloaded without
+ * holding the manager lock, so slot hits are not delayed by loads of
+ * other keys.
+ */
+struct ias_keystore_slots;
+
+/**
+ * @brief Slot manager configuration.
+ * @param max_slots  Slots the manager may use, 1..KEYSTORE_SLOTS_MAX.
+ *                   0 for KEYSTORE_SLOTS_MAX. Use less if the client loads
+ *                   other keys itself.
+ * @param rewrapped  Called when a key was wrapped with an old SEED SVN and
+ *                   has been re-wrapped while loading it (see
+ *                   ias_keystore_load_key()), so the application can store
+ *                   the new blob. May be NULL.
+ * @param priv       Passed to @rewrapped.
+ */
+struct ias_keystore_slots_config {
+  uint32_t max_slots;
+  void (*rewrapped)(void *priv, uint64_t handle,
+                    const uint8_t *wrapped_key, size_t wrapped_key_size);
+  void *priv;
+};
+
+/**
+ * @brief Slot manager counters.
+ * @param hits       Acquires of a key which was loaded.
+ * @param misses     Acquires which had to load the key.
+ * @param evictions  Keys unloaded to make room for another key.
+ * @param keys       Keys added to the manager.
+ * @param loaded     Slots in use, including loads in progress.
+ * @param pinned     Keys which are acquired.
+ */
+struct ias_keystore_slots_stats {
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evictions;
+  uint32_t keys;
+  uint32_t loaded;
+  uint32_t pinned;
+};
+
+/**
+ * @brief Create a slot manager for a registered client.
+ *
+ * @param [in] client_ticket  Ticket of the client, must remain valid
+ *                            until ias_keystore_slots_destroy().
+ * @param [in] config         Configuration, or NULL for the defaults.
+ * @param [out] slots         The new slot manager.
+ *
+ * @return 0 if OK or negative error code (see errno.h).
+ */
+int ias_keystore_slots_create(const uint8_t *client_ticket,
+                              const struct ias_keystore_slots_config *config,
+                              struct ias_keystore_slots **slots);
+
+/**
+ * @brief Unload all keys and release the slot manager.
+ *
+ * @param [in] slots The slot manager. May be NULL.
+ *
+ * No key may be acquired.
+ */
+void ias_keystore_slots_destroy(struct ias_keystore_slots *slots);
+
+/**
+ * @brief Add a wrapped key.
+ *
+ * @param [in] slots             The slot manager.
+ * @param [in] handle            Application handle of the key.
+ * @param [in] wrapped_key       The wrapped key, copied by the manager.
+ * @param [in] wrapped_key_size  Size of the wrapped key.
+ *
+ * The key is not loaded until it is acquired.
+ *
+ * @return 0 if OK, -EEXIST if the handle is in use, or negative error
+ * code (see errno.h).
+ */
+int ias_keystore_slots_add(struct ias_keystore_slots *slots, uint64_t handle,
+                           const uint8_t *wrapped_key, size_t wrapped_key_size);
+
+/**
+ * @brief Remove a key, unloading it if it is loaded.
+ *
+ * @param [in] slots   The slot manager.
+ * @param [in] handle  Application handle of the key.
+ *
+ * @return 0 if OK, -ENOENT if there is no such key, -EBUSY if it is
+ * acquired, or negative error code (see errno.h).
+ */
+int ias_keystore_slots_remove(struct ias_keystore_slots *slots, uint64_t handle);
+
+/**
+ * @brief Get the slot of a key and pin it.
+ *
+ * @param [in] slots     The slot manager.
+ * @param [in] handle    Application handle of the key.
+ * @param [out] slot_id  The slot, valid for the ias_keystore.h functions
+ *                       until the key is released.
+ *
+ * Loads the key if it is not loaded, unloading the least recently used
+ * unpinned key if the manager has no free slot. A key can be acquired
+ * several times and has to be released as often.
+ *
+ * @return 0 if OK, -ENOENT if there is no such key, -ENOSPC if all slots
+ * are pinned, or negative error code (see errno.h).
+ */
+int ias_keystore_slots_acquire(struct ias_keystore_slots *slots, uint64_t handle,
+                               uint32_t *slot_id);
+
+/**
+ * @brief Unpin a key acquired with ias_keystore_slots_acquire().
+ *
+ * @param [in] slots   The slot manager.
+ * @param [in] handle  Application handle of the key.
+ *
+ * The key stays loaded until its slot is needed for another key.
+ *
+ * @return 0 if OK, -ENOENT if there is no such key, -EINVAL if it is not
+ * acquired.
+ */
+int ias_keystore_slots_release(struct ias_keystore_slots *slots, uint64_t handle);
+
+/**
+ * @brief Get the slot manager counters.
+ *
+ * @param [in] slots   The slot manager.
+ * @param [out] stats  The counters.
+ */
+void ias_keystore_slots_get_stats(struct ias_keystore_slots *slots,
+                                  struct ias_keystore_slots_stats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* IAS_KEYSTORE_SLOTS_H */
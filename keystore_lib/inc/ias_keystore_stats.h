@@ -0,0 +1,134 @@
+/*
+   Copyright 2018 Intel Corporation
+
+   This software is licensed to you in accordance
+   with the agreement between you and Intel Corporation.
+
+   Alternatively, you can use this file in compliance
+   with the Apache license, Version 2.
+
+
+   Apache License, Version 2.0
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+   http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef IAS_KEYSTORE_STATS_H
+#define IAS_KEYSTORE_STATS_H
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#include <stdint.h>
+#include <stdio.h>
+
+/**
+ * @brief Keystore call statistics
+ *
+ * keystore_lib counts every ioctl it issues, per ioctl command: number of
+ * calls, failed calls, bytes processed and a latency histogram. The
+ * counters are updated with atomic increments and can be read at any time.
+ *
+ * Commands are identified by their ioctl number (_IOC_NR() of the
+ * KEYSTORE_IOC_* definitions in keystore_api_user.h), e.g. 9 for
+ * KEYSTORE_IOC_ENCRYPT. The library's own batch and vector commands, which
+ * are not driver ioctls, follow as 12 to 15.
+ */
+
+/**
+ * IAS_KEYSTORE_STATS_CMDS - Number of ioctl numbers with statistics
+ */
+#define IAS_KEYSTORE_STATS_CMDS 16
+
+/**
+ * IAS_KEYSTORE_STATS_BUCKETS - Number of latency histogram buckets
+ *
+ * Bucket i counts calls which took from 2^i up to 2^(i+1) nanoseconds.
+ * The first bucket also counts shorter calls, the last one longer calls.
+ */
+#define IAS_KEYSTORE_STATS_BUCKETS 32
+
+/**
+ * @brief Statistics of one ioctl command.
+ * @param calls      Number of calls.
+ * @param errors     Number of calls which returned an error.
+ * @param bytes      Input bytes of encrypt and decrypt calls.
+ * @param total_ns   Sum of all call latencies in nanoseconds.
+ * @param max_ns     Longest call latency in nanoseconds.
+ * @param histogram  Latency histogram (see IAS_KEYSTORE_STATS_BUCKETS).
+ */
+struct ias_keystore_cmd_stats {
+  uint64_t calls;
+  uint64_t errors;
+  uint64_t bytes;
+  uint64_t total_ns;
+  uint64_t max_ns;
+  uint64_t histogram[IAS_KEYSTORE_STATS_BUCKETS];
+};
+
+/**
+ * @brief Enable or disable statistics collection.
+ * @param enable 0 to disable, any other value to enable (the default).
+ */
+void ias_keystore_stats_enable(int enable);
+
+/**
+ * @brief Get the statistics of one ioctl command.
+ *
+ * @param [in] cmd_nr  The ioctl number.
+ * @param [out] stats  The statistics. Counters are read one by one and
+ *                     may be slightly inconsistent while calls are running.
+ *
+ * @return 0 if OK or negative error code (see errno.h).
+ */
+int ias_keystore_stats_get(unsigned int cmd_nr, struct ias_keystore_cmd_stats *stats);
+
+/**
+ * @brief Reset all statistics to zero.
+ */
+void ias_keystore_stats_reset(void);
+
+/**
+ * @brief Get the name of an ioctl command.
+ *
+ * @param [in] cmd_nr The ioctl number.
+ *
+ * @return Name without the KEYSTORE_IOC_ prefix, or NULL if unknown.
+ */
+const char *ias_keystore_stats_name(unsigned int cmd_nr);
+
+/**
+ * @brief Estimate a latency percentile from the histogram.
+ *
+ * @param [in] stats    The statistics.
+ * @param [in] percent  Percentile between 0 and 100.
+ *
+ * @return Upper bound of the histogram bucket containing the percentile
+ * in nanoseconds, at most max_ns. 0 if there were no calls.
+ */
+uint64_t ias_keystore_stats_percentile(const struct ias_keystore_cmd_stats *stats,
+                                       double percent);
+
+/**
+ * @brief Print a table of all commands which were called.
+ * @param [in] out Output stream.
+ */
+void ias_keystore_stats_dump(FILE *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* IAS_KEYSTORE_STATS_H */
@@ -0,0 +1,165 @@
+/*
+   Copyright 2018 Intel Corporation
+
+   This software is licensed to you in accordance
+   with the agreement between you and Intel Corporation.
+
+   Alternatively, you can use this file in compliance
+   with the Apache license, Version 2.
+
+
+   Apache License, Version 2.0
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+   http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef IAS_KEYSTORE_STORE_H
+#define IAS_KEYSTORE_STORE_H
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#include <stdint.h>
+#include <unistd.h>
+
+/**
+ * @brief Wrapped key store file
+ *
+ * A store file holds any number of wrapped keys under string IDs, so that
+ * a service does not need one file per key. The file has a fixed header,
+ * a hash index and the packed key records written by the last
+ * compaction, followed by an append log of records written since.
+ *
+ * The file is mapped read-only; lookups go through the hash index or an
+ * in-memory index of the log and read the key from the mapping, without
+ * system calls. ias_keystore_store_put() and ias_keystore_store_remove()
+ * append a record to the log. ias_keystore_store_compact() rewrites the
+ * file with an index over all keys and replaces it atomically.
+ *
+ * Log records carry a checksum. A record torn by a crash is dropped when
+ * the store is opened, together with anything after it.
+ *
+ * Only one process can open a store for writing. Stores opened read-only
+ * see the keys written up to the time they were opened. All functions are
+ * thread-safe.
+ */
+struct ias_keystore_store;
+
+/**
+ * IAS_KEYSTORE_STORE_ID_MAX - Longest key ID in bytes
+ */
+#define IAS_KEYSTORE_STORE_ID_MAX 255
+
+/* Open flags */
+#define IAS_KEYSTORE_STORE_CREATE  0x1  /* create the file if it does not exist */
+#define IAS_KEYSTORE_STORE_RDONLY  0x2  /* open for lookups only */
+#define IAS_KEYSTORE_STORE_SYNC    0x4  /* sync the log after every write */
+
+/**
+ * @brief Open a store file.
+ *
+ * @param [in] path   Path to the store file.
+ * @param [in] flags  IAS_KEYSTORE_STORE_* flags.
+ * @param [out] store The store.
+ *
+ * @return 0 if OK, -EBUSY if another process has the store open for
+ * writing, -EBADMSG if the file is not a store, or negative error code
+ * (see errno.h).
+ */
+int ias_keystore_store_open(const char *path, int flags, struct ias_keystore_store **store);
+
+/**
+ * @brief Close a store.
+ *
+ * @param [in] store The store. May be NULL.
+ */
+void ias_keystore_store_close(struct ias_keystore_store *store);
+
+/**
+ * @brief Look up a wrapped key.
+ *
+ * @param [in] store                 The store.
+ * @param [in] id                    Key ID.
+ * @param [out] wrapped_key          Buffer for the wrapped key.
+ * @param [in,out] wrapped_key_size  Size of the buffer, set to the size
+ *                                   of the wrapped key.
+ *
+ * @return 0 if OK, -ENOENT if there is no such key, -EMSGSIZE if the
+ * buffer is too small, or negative error code (see errno.h).
+ */
+int ias_keystore_store_get(struct ias_keystore_store *store, const char *id,
+                           uint8_t *wrapped_key, size_t *wrapped_key_size);
+
+/**
+ * @brief Add or replace a wrapped key.
+ *
+ * @param [in] store             The store.
+ * @param [in] id                Key ID, 1..IAS_KEYSTORE_STORE_ID_MAX bytes.
+ * @param [in] wrapped_key       The wrapped key.
+ * @param [in] wrapped_key_size  Size of the wrapped key.
+ *
+ * @return 0 if OK or negative error code (see errno.h).
+ */
+int ias_keystore_store_put(struct ias_keystore_store *store, const char *id,
+                           const uint8_t *wrapped_key, size_t wrapped_key_size);
+
+/**
+ * @brief Remove a wrapped key.
+ *
+ * @param [in] store The store.
+ * @param [in] id    Key ID.
+ *
+ * @return 0 if OK, -ENOENT if there is no such key, or negative error
+ * code (see errno.h).
+ */
+int ias_keystore_store_remove(struct ias_keystore_store *store, const char *id);
+
+/**
+ * @brief Call a function for every key in the store.
+ *
+ * @param [in] store The store.
+ * @param [in] fn    Called with each key, in no particular order. A non-zero
+ *                   return value stops the iteration. The store must not
+ *                   be modified from @fn.
+ * @param [in] priv  Passed to @fn.
+ *
+ * @return 0, or the value returned by @fn.
+ */
+int ias_keystore_store_foreach(struct ias_keystore_store *store,
+                               int (*fn)(void *priv, const char *id,
+                                         const uint8_t *wrapped_key, size_t wrapped_key_size),
+                               void *priv);
+
+/**
+ * @brief Get the number of keys in the store.
+ */
+size_t ias_keystore_store_count(struct ias_keystore_store *store);
+
+/**
+ * @brief Rewrite the store with all keys in the index.
+ *
+ * @param [in] store The store, opened for writing.
+ *
+ * The new file is written next to the old one and renamed over it.
+ *
+ * @return 0 if OK or negative error code (see errno.h).
+ */
+int ias_keystore_store_compact(struct ias_keystore_store *store);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* IAS_KEYSTORE_STORE_H */
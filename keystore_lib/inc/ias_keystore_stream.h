@@ -0,0 +1,298 @@
+/*
+   Copyright 2018 Intel Corporation
+
+   This software is licensed to you in accordance
+   with the agreement between you and Intel Corporation.
+
+   Alternatively, you can use this file in compliance
+   with the Apache license, Version 2.
+
+
+   Apache License, Version 2.0
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+   http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#ifndef IAS_KEYSTORE_STREAM_H
+#define IAS_KEYSTORE_STREAM_H
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#include <stdint.h>
+#include <unistd.h>
+
+#include "keystore_api_common.h"
+
+/**
+ * @brief Streaming encryption
+ *
+ * A stream encrypts input of any length with a key in a slot, a chunk at
+ * a time, so memory use does not depend on the input size and no single
+ * device call exceeds the chunk size. The output is a container:
+ *
+ *   header    IAS_KEYSTORE_STREAM_HEADER_SIZE bytes: magic, version,
+ *             algorithm, chunk size and a random 96 bit stream IV
+ *   chunks    (ciphertext || tag) of chunk size plaintext bytes each;
+ *             the last chunk is shorter or empty
+ *
+ * Every chunk has its own AES-GCM nonce: the stream IV of the header with
+ * the chunk number and a flag set only for the last chunk XORed into its
+ * last 5 bytes. Each stream draws a full 96 bit IV, so the streams under
+ * one slot key are as unlikely to share a nonce as random IVs. Chunks that
+ * are reordered, dropped, duplicated or appended after the last one fail
+ * authentication, as does a container cut off at a chunk boundary.
+ *
+ * Decrypted chunks are returned as soon as they are authenticated. The
+ * plaintext is complete and intact only once ias_keystore_stream_final()
+ * returns 0.
+ *
+ * In envelope mode (ias_keystore_stream_envelope_init()) the slot key only
+ * wraps a random 256 bit data key (DEK) stored after the header; the
+ * chunks are encrypted with the DEK on the host with AES-NI and PCLMULQDQ.
+ * Decryption unwraps the DEK once, so a container costs two device
+ * calls whatever its size. Decryption detects the mode from the header.
+ * On CPUs without those instructions envelope containers can be neither
+ * written nor read (-EOPNOTSUPP): the portable AES uses lookup tables,
+ * which leak the data key through the cache.
+ *
+ * A stream must not be used by several threads at once.
+ */
+struct ias_keystore_stream;
+
+/**
+ * IAS_KEYSTORE_STREAM_HEADER_SIZE - Size of the container header
+ */
+#define IAS_KEYSTORE_STREAM_HEADER_SIZE 32
+
+/**
+ * IAS_KEYSTORE_STREAM_ENVELOPE_SIZE - Size of the wrapped DEK after the
+ * header of an envelope container
+ */
+#define IAS_KEYSTORE_STREAM_ENVELOPE_SIZE 60
+
+/**
+ * IAS_KEYSTORE_STREAM_CHUNK_SIZE - Default plaintext bytes per chunk
+ */
+#define IAS_KEYSTORE_STREAM_CHUNK_SIZE (64 * 1024)
+
+/**
+ * IAS_KEYSTORE_STREAM_CHUNK_SIZE_MAX - Largest plaintext bytes per chunk
+ */
+#define IAS_KEYSTORE_STREAM_CHUNK_SIZE_MAX (16 * 1024 * 1024)
+
+/**
+ * @brief Start encrypting a stream.
+ *
+ * @param [in] client_ticket  The client ticket (KEYSTORE_CLIENT_TICKET_SIZE bytes).
+ * @param [in] slot_id        Slot of the key.
+ * @param [in] algo_spec      ALGOSPEC_AES_GCM.
+ * @param [in] chunk_size     Plaintext bytes per chunk, 0 for
+ *                            IAS_KEYSTORE_STREAM_CHUNK_SIZE.
+ * @param [out] stream        The stream.
+ *
+ * @return 0 if OK or negative error code (see errno.h).
+ */
+int ias_keystore_stream_encrypt_init(const uint8_t *client_ticket, uint32_t slot_id,
+                                     enum keystore_algo_spec algo_spec, size_t chunk_size,
+                                     struct ias_keystore_stream **stream);
+
+/**
+ * @brief Start encrypting a stream in envelope mode.
+ *
+ * @param [in] client_ticket  The client ticket (KEYSTORE_CLIENT_TICKET_SIZE bytes).
+ * @param [in] slot_id        Slot of the key that wraps the data key.
+ * @param [in] chunk_size     Plaintext bytes per chunk, 0 for
+ *                            IAS_KEYSTORE_STREAM_CHUNK_SIZE.
+ * @param [out] stream        The stream.
+ *
+ * The chunks are AES-GCM encrypted on the host with a new random data key.
+ *
+ * @return 0 if OK, -EOPNOTSUPP if the CPU has no AES-NI and PCLMULQDQ,
+ * or negative error code (see errno.h).
+ */
+int ias_keystore_stream_envelope_init(const uint8_t *client_ticket, uint32_t slot_id,
+                                      size_t chunk_size, struct ias_keystore_stream **stream);
+
+/**
+ * @brief Start decrypting a stream.
+ *
+ * @param [in] client_ticket  The client ticket (KEYSTORE_CLIENT_TICKET_SIZE bytes).
+ * @param [in] slot_id        Slot of the key.
+ * @param [out] stream        The stream.
+ *
+ * The algorithm and chunk size are read from the container header.
+ *
+ * @return 0 if OK or negative error code (see errno.h).
+ */
+int ias_keystore_stream_decrypt_init(const uint8_t *client_ticket, uint32_t slot_id,
+                                     struct ias_keystore_stream **stream);
+
+/**
+ * @brief Get the output buffer size for the next input.
+ *
+ * @param [in] stream      The stream.
+ * @param [in] input_size  Size of the next ias_keystore_stream_update() input,
+ *                         0 for ias_keystore_stream_final().
+ *
+ * @return Output buffer size large enough for ias_keystore_stream_update()
+ * with @input_size bytes followed by ias_keystore_stream_final().
+ */
+size_t ias_keystore_stream_output_size(const struct ias_keystore_stream *stream,
+                                       size_t input_size);
+
+/**
+ * @brief Process more input.
+ *
+ * @param [in] stream            The stream.
+ * @param [in] input             Plaintext when encrypting, container data
+ *                               when decrypting.
+ * @param [in] input_size        Size of the input; any size.
+ * @param [out] output           Output buffer.
+ * @param [in,out] output_size   Size of the output buffer, set to the number
+ *                               of bytes written.
+ *
+ * Input is buffered up to one chunk; complete chunks are processed and
+ * written to @output.
+ *
+ * @return 0 if OK, -EMSGSIZE if @output_size is smaller than
+ * ias_keystore_stream_output_size() (it is set to that size), -EBADMSG if
+ * the container is not valid, or negative error code (see errno.h). After
+ * an error other than -EMSGSIZE, all further calls fail.
+ */
+int ias_keystore_stream_update(struct ias_keystore_stream *stream,
+                               const uint8_t *input, size_t input_size,
+                               uint8_t *output, size_t *output_size);
+
+/**
+ * @brief Process the buffered input and the last chunk.
+ *
+ * @param [in] stream            The stream.
+ * @param [out] output           Output buffer.
+ * @param [in,out] output_size   Size of the output buffer, set to the number
+ *                               of bytes written.
+ *
+ * @return 0 if OK, -EMSGSIZE if @output_size is too small (see
+ * ias_keystore_stream_update()), -EBADMSG if the container is truncated or
+ * not valid, or negative error code (see errno.h).
+ */
+int ias_keystore_stream_final(struct ias_keystore_stream *stream,
+                              uint8_t *output, size_t *output_size);
+
+/**
+ * @brief Get the container size for an input.
+ *
+ * @param [in] algo_spec    ALGOSPEC_AES_GCM.
+ * @param [in] chunk_size   Plaintext bytes per chunk, 0 for the default.
+ * @param [in] input_size   Plaintext size.
+ * @param [out] output_size Container size.
+ *
+ * An envelope container is IAS_KEYSTORE_STREAM_ENVELOPE_SIZE bytes larger.
+ *
+ * @return 0 if OK or negative error code (see errno.h).
+ */
+int ias_keystore_stream_encrypted_size(enum keystore_algo_spec algo_spec, size_t chunk_size,
+                                       size_t input_size, size_t *output_size);
+
+/**
+ * @brief Encrypt a buffer into a container on several threads.
+ *
+ * @param [in] client_ticket     The client ticket (KEYSTORE_CLIENT_TICKET_SIZE bytes).
+ * @param [in] slot_id           Slot of the key.
+ * @param [in] algo_spec         ALGOSPEC_AES_GCM.
+ * @param [in] chunk_size        Plaintext bytes per chunk, 0 for the default.
+ * @param [in] threads           Number of threads including the calling one,
+ *                               0 for 4, at most 64.
+ * @param [in] input             Plaintext.
+ * @param [in] input_size        Plaintext size.
+ * @param [out] output           Container buffer.
+ * @param [in,out] output_size   Size of the buffer, set to the container size.
+ *
+ * The chunks are encrypted independently, each thread with its own device
+ * calls in flight, and written to their place in @output. The container
+ * is the same as the one of a stream and can be decrypted either way.
+ *
+ * @return 0 if OK, -EMSGSIZE if the buffer is smaller than
+ * ias_keystore_stream_encrypted_size() (@output_size is set to it), or
+ * negative error code (see errno.h).
+ */
+int ias_keystore_stream_encrypt_parallel(const uint8_t *client_ticket, uint32_t slot_id,
+                                         enum keystore_algo_spec algo_spec, size_t chunk_size,
+                                         unsigned int threads,
+                                         const uint8_t *input, size_t input_size,
+                                         uint8_t *output, size_t *output_size);
+
+/**
+ * @brief Decrypt a container on several threads.
+ *
+ * @param [in] client_ticket     The client ticket (KEYSTORE_CLIENT_TICKET_SIZE bytes).
+ * @param [in] slot_id           Slot of the key.
+ * @param [in] threads           Number of threads including the calling one,
+ *                               0 for 4, at most 64.
+ * @param [in] input             The container.
+ * @param [in] input_size        Container size.
+ * @param [out] output           Plaintext buffer.
+ * @param [in,out] output_size   Size of the buffer, set to the plaintext size.
+ *
+ * On failure the output buffer is cleared.
+ *
+ * @return 0 if OK, -EMSGSIZE if the buffer is too small (@output_size is
+ * set to the plaintext size), -EBADMSG if the container is not valid, or
+ * negative error code (see errno.h).
+ */
+int ias_keystore_stream_decrypt_parallel(const uint8_t *client_ticket, uint32_t slot_id,
+                                         unsigned int threads,
+                                         const uint8_t *input, size_t input_size,
+                                         uint8_t *output, size_t *output_size);
+
+/**
+ * @brief Decrypt a byte range of a container file.
+ *
+ * @param [in] client_ticket     The client ticket (KEYSTORE_CLIENT_TICKET_SIZE bytes).
+ * @param [in] slot_id           Slot of the key.
+ * @param [in] fd                The container file, read with pread().
+ * @param [in] offset            Plaintext offset of the range.
+ * @param [in] length            Plaintext bytes of the range.
+ * @param [out] output           Plaintext buffer.
+ * @param [in,out] output_size   Size of the buffer, set to the plaintext bytes
+ *                               of the range; fewer than @length at the end of
+ *                               the plaintext, 0 beyond it.
+ *
+ * Chunks sit at fixed offsets of the file, so only the header, the chunks
+ * covering the range and the last chunk are read and decrypted. The last
+ * chunk authenticates the length of the container. On failure the output
+ * buffer is cleared.
+ *
+ * @return 0 if OK, -EMSGSIZE if the buffer is too small (@output_size is
+ * set to the size needed), -EBADMSG if the container is not valid, or
+ * negative error code (see errno.h).
+ */
+int ias_keystore_stream_decrypt_range(const uint8_t *client_ticket, uint32_t slot_id,
+                                      int fd, uint64_t offset, size_t length,
+                                      uint8_t *output, size_t *output_size);
+
+/**
+ * @brief Release a stream.
+ *
+ * @param [in] stream The stream. May be NULL.
+ *
+ * Buffered plaintext is cleared.
+ */
+void ias_keystore_stream_free(struct ias_keystore_stream *stream);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* IAS_KEYSTORE_STREAM_H */
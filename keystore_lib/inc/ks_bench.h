@@ -0,0 +1,72 @@
+/*
+   Copyright 2018 Intel Corporation
+
+   This software is licensed to you in accordance
+   with the agreement between you and Intel Corporation.
+
+   Alternatively, you can use this file in compliance
+   with the Apache license, Version 2.
+
+
+   Apache License, Version 2.0
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+   http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef IAS_KS_BENCH_H
+#define IAS_KS_BENCH_H
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/*
+ * Compare the per-call cost of encrypt with the cached device handle
+ * against reopening the device for every call.
+ */
+int ks_bench_handle(unsigned int iterations);
+
+/*
+ * Compare encrypting records one call at a time against the batch API.
+ */
+int ks_bench_batch(unsigned int iterations);
+
+/*
+ * Compare generating keys on demand against taking them from a key pool.
+ */
+int ks_bench_keypool(unsigned int iterations);
+
+/*
+ * Encrypt a payload with ias_keystore_stream_encrypt_parallel() for
+ * several chunk sizes and thread counts.
+ */
+int ks_bench_parallel(unsigned int iterations);
+
+/*
+ * Compare stream encryption on the device against envelope mode, which
+ * encrypts the payload on the host with a wrapped data key.
+ */
+int ks_bench_envelope(unsigned int iterations);
+
+/*
+ * Compare the cost of an IV from /dev/urandom, getrandom(), the buffered
+ * ias_keystore_random_iv() and a nonce counter.
+ */
+int ks_bench_iv(unsigned int iterations);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* IAS_KS_BENCH_H */
@@ -31,10 +31,49 @@ extern "C"
 {
 #endif
 
+int ks_smoke_aes_vectors(enum keystore_key_spec key_spec,
+                         enum keystore_algo_spec algo_spec);
+
 int ks_smoke_encrypt(enum keystore_seed_type seed_type,
                      enum keystore_key_spec key_spec,
                      enum keystore_algo_spec algo_spec);
 
+int ks_smoke_ctx_encrypt(enum keystore_key_spec key_spec,
+                         enum keystore_algo_spec algo_spec);
+
+int ks_smoke_async_encrypt(enum keystore_key_spec key_spec,
+                           enum keystore_algo_spec algo_spec);
+
+int ks_smoke_broker_encrypt(enum keystore_key_spec key_spec,
+                            enum keystore_algo_spec algo_spec);
+
+int ks_smoke_slots_encrypt(enum keystore_key_spec key_spec,
+                           enum keystore_algo_spec algo_spec);
+
+int ks_smoke_shared_encrypt(enum keystore_key_spec key_spec,
+                            enum keystore_algo_spec algo_spec);
+
+int ks_smoke_keypool_encrypt(enum keystore_key_spec key_spec,
+                             enum keystore_algo_spec algo_spec);
+
+int ks_smoke_migrate_keys(enum keystore_key_spec key_spec);
+
+int ks_smoke_store_keys(enum keystore_key_spec key_spec);
+
+int ks_smoke_stream_encrypt(enum keystore_key_spec key_spec,
+                            enum keystore_algo_spec algo_spec);
+
+int ks_smoke_vector_encrypt(enum keystore_key_spec key_spec,
+                            enum keystore_algo_spec algo_spec);
+
+int ks_smoke_nonce_encrypt(enum keystore_key_spec key_spec,
+                           enum keystore_algo_spec algo_spec);
+
+int ks_smoke_cipher_encrypt(void);
+
+int ks_smoke_coro_encrypt(enum keystore_key_spec key_spec,
+                          enum keystore_algo_spec algo_spec);
+
 int ks_smoke_sign(enum keystore_seed_type seed_type,
                   enum keystore_key_spec key_spec,
                   enum keystore_algo_spec algo_spec);
@@ -182,6 +182,9 @@ namespace IasKeystoreLib
      * @param output Pointer to the block for encrypted data.
      * @param output_size Output block size in bytes (at least iv_size + input_size + 9 bytes).
      *
+     * For AES-GCM and AES-CCM, @p input may be output + iv_size + 1: a plaintext
+     * already placed behind the room for the algo spec and IV is encrypted in place.
+     *
      * @return Encrypted data size in bytes if OK or negative error code (see errno.h).
      */
     int encrypt(const void *client_ticket, int slot_id, keystore_algo_spec_t algo_spec,
@@ -238,6 +241,9 @@ namespace IasKeystoreLib
      * @param output Pointer to the block for decrypted data.
      * @param output_size Output block size in bytes.
      *
+     * For AES-GCM and AES-CCM, @p output may be input + KEYSTORE_MAX_IV_SIZE + 1
+     * to decrypt in place.
+     *
      * @return Decrypted data size in bytes if OK or negative error code (see errno.h).
      */
     int decrypt(const void *client_ticket, int slot_id, const void *input, unsigned int input_size,
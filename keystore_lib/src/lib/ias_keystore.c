@@ -25,7 +25,9 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
+#include <pthread.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
 #include <sys/stat.h>
@@ -34,52 +36,360 @@
 #include "keystore_api_user.h"
 
 #include "ias_keystore.h"
+#include "ias_keystore_aes.h"
+#include "ias_keystore_priv.h"
 
 static char keystore_dev[] = "/dev/keystore";
 const char *_dev_name = keystore_dev;
 
-void ias_keystore_set_device(const char* dev_name)
+/*
+ * Long-lived handle to _dev_name, opened on first use and shared by all
+ * threads. It is dropped in the child after fork() and whenever the
+ * device path changes, and reopened lazily by keystore_get_fd().
+ */
+static int _dev_fd = -1;
+/* Batch ioctl support of the current device: -1 unknown, 0 no, 1 yes */
+static int _batch_supported = -1;
+/* Vector ioctl support of the current device: -1 unknown, 0 no, 1 yes */
+static int _vector_supported = -1;
+/* Size table of the current device, valid once _sizes_checked is set */
+static const struct keystore_size_table *_sizes;
+static int _sizes_checked;
+/* Incremented by ias_keystore_set_device() */
+static unsigned int _dev_generation;
+static pthread_mutex_t _dev_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t _dev_atfork_once = PTHREAD_ONCE_INIT;
+
+static void keystore_atfork_prepare(void)
 {
-  _dev_name = dev_name;
+  keystore_keys_atfork_prepare();
+  pthread_mutex_lock(&_dev_lock);
+}
+
+static void keystore_atfork_parent(void)
+{
+  pthread_mutex_unlock(&_dev_lock);
+  keystore_keys_atfork_parent();
+}
+
+static void keystore_vdev_atfork_child(void);
+
+static void keystore_atfork_child(void)
+{
+  keystore_vdev_atfork_child();
+  if (_dev_fd != -1)
+  {
+    keystore_dev_close(_dev_fd);
+    _dev_fd = -1;
+  }
+  pthread_mutex_unlock(&_dev_lock);
+  keystore_keys_atfork_child();
+}
+
+static void keystore_register_atfork(void)
+{
+  pthread_atfork(keystore_atfork_prepare, keystore_atfork_parent, keystore_atfork_child);
 }
 
 /**
- * @brief Helper function, executes ioctl request.
+ * @brief Helper function, closes the cached device handle.
  *
- * @param[in] cmd IOCTL command to execute.
- * @param[in] request Pointer to the request data structure.
- * @param[in] size Size of request data structure in bytes.
+ * Must be called with _dev_lock held.
+ */
+static void keystore_close_fd_locked(void)
+{
+  if (_dev_fd != -1)
+  {
+    keystore_dev_close(_dev_fd);
+    __atomic_store_n(&_dev_fd, -1, __ATOMIC_RELEASE);
+  }
+}
+
+/**
+ * @brief Helper function, returns the cached device handle.
  *
- * @return >=0 if OK or negative error code (see errno.h).
- * Positive values returned depend on the request type.
+ * Opens _dev_name if no handle is cached yet.
+ *
+ * @return File descriptor if OK or negative error code (see errno.h).
  */
-static int keystore_ioctl(unsigned int cmd, void *request)
+static int keystore_get_fd(void)
 {
-  int res, fd;
+  int fd;
+
+  fd = __atomic_load_n(&_dev_fd, __ATOMIC_ACQUIRE);
+  if (fd != -1)
+    return fd;
 
-  fd = open(_dev_name, O_RDWR);
+  pthread_once(&_dev_atfork_once, keystore_register_atfork);
+
+  pthread_mutex_lock(&_dev_lock);
+  fd = _dev_fd;
   if (fd == -1)
   {
+    fd = keystore_dev_open(_dev_name);
+    if (fd >= 0)
+      __atomic_store_n(&_dev_fd, fd, __ATOMIC_RELEASE);
+  }
+  pthread_mutex_unlock(&_dev_lock);
+
+  return fd;
+}
+
+void ias_keystore_set_device(const char* dev_name)
+{
+  pthread_mutex_lock(&_dev_lock);
+  keystore_close_fd_locked();
+  _dev_name = dev_name;
+  _batch_supported = -1;
+  _vector_supported = -1;
+  __atomic_store_n(&_sizes_checked, 0, __ATOMIC_RELEASE);
+  _sizes = NULL;
+  _dev_generation++;
+  pthread_mutex_unlock(&_dev_lock);
+
+  /* Slots of the old device are meaningless on the new one */
+  keystore_keys_reset();
+}
+
+const char *ias_keystore_get_device(void)
+{
+  return _dev_name;
+}
+
+/*
+ * Handles of in-process backends. Entries are claimed and released with
+ * atomic operations only, so that they can be closed in a fork() child.
+ */
+#define KEYSTORE_VDEV_MAX 64
+
+struct keystore_vdev {
+  const struct keystore_backend *backend;
+  void *priv;
+};
+
+static const struct keystore_backend *const _backends[] = {
+  &keystore_sim_backend,
+  &keystore_unix_backend,
+};
+
+static struct keystore_vdev _vdevs[KEYSTORE_VDEV_MAX];
+/* Marks an entry which is being opened */
+static const struct keystore_backend _vdev_busy;
+
+/**
+ * @brief Helper function, opens a handle of an in-process backend.
+ *
+ * @return Handle if OK or negative error code (see errno.h).
+ */
+static int keystore_vdev_open(const struct keystore_backend *backend, const char *args)
+{
+  const struct keystore_backend *expected;
+  int i, res;
+
+  pthread_once(&_dev_atfork_once, keystore_register_atfork);
+
+  for (i = 0; i < KEYSTORE_VDEV_MAX; i++)
+  {
+    expected = NULL;
+    if (!__atomic_compare_exchange_n(&_vdevs[i].backend, &expected, &_vdev_busy, 0,
+                                     __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+      continue;
+
+    res = backend->open(args, &_vdevs[i].priv);
+    if (res)
+    {
+      __atomic_store_n(&_vdevs[i].backend, NULL, __ATOMIC_RELEASE);
+      return res;
+    }
+
+    __atomic_store_n(&_vdevs[i].backend, backend, __ATOMIC_RELEASE);
+    return KEYSTORE_VDEV_BASE + i;
+  }
+
+  return -EMFILE;
+}
+
+/**
+ * @brief Helper function, returns the handle entry of an in-process backend.
+ */
+static struct keystore_vdev *keystore_vdev(int fd, const struct keystore_backend **backend)
+{
+  struct keystore_vdev *vdev;
+
+  if (fd < KEYSTORE_VDEV_BASE || fd >= KEYSTORE_VDEV_BASE + KEYSTORE_VDEV_MAX)
+    return NULL;
+
+  vdev = &_vdevs[fd - KEYSTORE_VDEV_BASE];
+  *backend = __atomic_load_n(&vdev->backend, __ATOMIC_ACQUIRE);
+  if (!*backend || *backend == &_vdev_busy)
+    return NULL;
+
+  return vdev;
+}
+
+/**
+ * @brief Helper function, lets the backends of all open handles drop the
+ * state they share with the parent after fork().
+ */
+static void keystore_vdev_atfork_child(void)
+{
+  const struct keystore_backend *backend;
+  int i;
+
+  for (i = 0; i < KEYSTORE_VDEV_MAX; i++)
+  {
+    backend = __atomic_load_n(&_vdevs[i].backend, __ATOMIC_ACQUIRE);
+    if (backend && backend != &_vdev_busy && backend->atfork_child)
+      backend->atfork_child(_vdevs[i].priv);
+  }
+}
+
+int keystore_dev_open(const char *dev_name)
+{
+  size_t i, len;
+  int fd;
+
+  if (!dev_name)
+    return -EFAULT;
+
+  for (i = 0; i < sizeof(_backends) / sizeof(_backends[0]); i++)
+  {
+    len = strlen(_backends[i]->prefix);
+    if (!strncmp(dev_name, _backends[i]->prefix, len))
+      return keystore_vdev_open(_backends[i], dev_name + len);
+  }
+
+  fd = open(dev_name, O_RDWR | O_CLOEXEC);
+  if (fd == -1)
     return -errno;
+
+  return fd;
+}
+
+void keystore_dev_close(int fd)
+{
+  const struct keystore_backend *backend;
+  struct keystore_vdev *vdev;
+
+  if (fd >= KEYSTORE_VDEV_BASE)
+  {
+    vdev = keystore_vdev(fd, &backend);
+    if (vdev)
+    {
+      backend->close(vdev->priv);
+      __atomic_store_n(&vdev->backend, NULL, __ATOMIC_RELEASE);
+    }
   }
+  else if (fd >= 0)
+  {
+    close(fd);
+  }
+}
 
-  if (request == NULL)
+int keystore_dev_ioctl_quiet(int fd, unsigned int cmd, void *request)
+{
+  uint64_t start = keystore_stats_begin();
+  const struct keystore_backend *backend;
+  struct keystore_vdev *vdev;
+  int res;
+
+  if (fd >= KEYSTORE_VDEV_BASE)
   {
-    res = ioctl(fd, cmd);
+    vdev = keystore_vdev(fd, &backend);
+    res = vdev ? backend->ioctl(vdev->priv, cmd, request) : -EBADF;
   }
   else
   {
-    res = ioctl(fd, cmd, request);
+    if (request == NULL)
+    {
+      res = ioctl(fd, cmd);
+    }
+    else
+    {
+      res = ioctl(fd, cmd, request);
+    }
+
+    if (res < 0)
+      res = -errno;
+  }
+
+  keystore_stats_end(cmd, request, start, res);
+
+  return res;
+}
+
+int keystore_dev_ioctl(int fd, unsigned int cmd, void *request)
+{
+  int res = keystore_dev_ioctl_quiet(fd, cmd, request);
+
+  /*
+   * Optional ioctls are probed, so a missing one is not reported, and
+   * -EAGAIN of a load is the re-wrap result of ias_keystore_load_key()
+   */
+  if (res < 0 && res != -ENOTTY && !(cmd == KEYSTORE_IOC_LOAD_KEY && res == -EAGAIN))
+    printf("Error: %d (errno: %d) for command 0x%x\n", res, -res, cmd);
+
+  return res;
+}
+
+/**
+ * @brief Helper function, executes ioctl request on the cached device handle.
+ *
+ * @param[in] cmd IOCTL command to execute.
+ * @param[in] request Pointer to the request data structure.
+ *
+ * @return >=0 if OK or negative error code (see errno.h).
+ * Positive values returned depend on the request type.
+ */
+static int keystore_ioctl(unsigned int cmd, void *request)
+{
+  int fd;
+
+  fd = keystore_get_fd();
+  if (fd < 0)
+  {
+    return fd;
   }
 
-  if (res < 0)
+  return keystore_dev_ioctl(fd, cmd, request);
+}
+
+/**
+ * @brief Helper function, returns the size table of the current device.
+ *
+ * @return The table, NULL if sizes have to be queried from the device.
+ */
+static const struct keystore_size_table *keystore_sizes(void)
+{
+  const struct keystore_size_table *table;
+  const char *dev_name;
+  unsigned int generation;
+  int fd;
+
+  if (__atomic_load_n(&_sizes_checked, __ATOMIC_ACQUIRE))
+    return _sizes;
+
+  fd = keystore_get_fd();
+  if (fd < 0)
+    return NULL;
+
+  pthread_mutex_lock(&_dev_lock);
+  generation = _dev_generation;
+  dev_name = _dev_name;
+  pthread_mutex_unlock(&_dev_lock);
+
+  table = keystore_size_table(fd, dev_name);
+
+  /* Drop the result if the device was changed meanwhile */
+  pthread_mutex_lock(&_dev_lock);
+  if (generation == _dev_generation)
   {
-    res = -errno;
-    printf("Error: %d (errno: %d) for command 0x%x\n", res, errno, cmd);
+    _sizes = table;
+    __atomic_store_n(&_sizes_checked, 1, __ATOMIC_RELEASE);
   }
+  pthread_mutex_unlock(&_dev_lock);
 
-  close(fd);
-  return res;
+  return table;
 }
 
 /**
@@ -142,6 +452,8 @@ int ias_keystore_unregister_client(const uint8_t *client_ticket)
     return res;
 
   res = keystore_ioctl(KEYSTORE_IOC_UNREGISTER, &request);
+  if (!res)
+    keystore_keys_forget(client_ticket);
 
   return res;
 }
@@ -156,7 +468,10 @@ int ias_keystore_wrapped_key_size(enum keystore_key_spec key_spec,
     memset(&request, 0, sizeof(request));
 
     request.key_spec = (uint32_t) key_spec;
-    res = keystore_ioctl(KEYSTORE_IOC_WRAPPED_KEYSIZE, &request);
+    res = keystore_size_wrapped(keystore_sizes(), request.key_spec,
+                                &request.key_size, &request.unwrapped_key_size);
+    if (res == -ENOENT)
+      res = keystore_ioctl(KEYSTORE_IOC_WRAPPED_KEYSIZE, &request);
     if (res)
       return res;
 
@@ -229,21 +544,30 @@ int ias_keystore_load_key(const uint8_t *client_ticket,
                           uint32_t *slot_id)
 {
   struct ias_keystore_load_key request;
+  struct keystore_keys_entry *claim;
   int res;
 
   if (!client_ticket || !wrapped_key || !slot_id)
     return -EFAULT;
 
+  /* Already loaded by this client */
+  if (keystore_keys_claim(client_ticket, wrapped_key, wrapped_key_size, slot_id, &claim))
+    return 0;
+
   memset(&request, 0, sizeof(request));
 
   res = keystore_memcpy(request.client_ticket, client_ticket, sizeof(request.client_ticket));
   if (res)
+  {
+    keystore_keys_loaded(claim, res, 0);
     return res;
+  }
 
   request.wrapped_key = wrapped_key;
   request.wrapped_key_size = (uint32_t)wrapped_key_size;
 
   res = keystore_ioctl(KEYSTORE_IOC_LOAD_KEY, &request);
+  keystore_keys_loaded(claim, res, request.slot_id);
   if (res)
     return res;
 
@@ -260,6 +584,10 @@ int ias_keystore_unload_key(const void *client_ticket, uint32_t slot_id)
   if (!client_ticket)
     return -EFAULT;
 
+  /* The key is still used through other loads */
+  if (keystore_keys_release((const uint8_t *)client_ticket, slot_id))
+    return 0;
+
   memset(&request, 0, sizeof(request));
   res = keystore_memcpy(request.client_ticket, client_ticket, sizeof(request.client_ticket));
   if (res)
@@ -281,6 +609,11 @@ int ias_keystore_encrypt_size(enum keystore_algo_spec algo_spec,
   if (!output_size)
     return -EFAULT;
 
+  res = keystore_size_crypt(keystore_sizes(), KEYSTORE_IOC_ENCRYPT_SIZE, algo_spec,
+                            input_size, output_size);
+  if (res != -ENOENT)
+    return res;
+
   memset(&request, 0, sizeof(request));
 
   request.algospec = algo_spec;
@@ -295,6 +628,50 @@ int ias_keystore_encrypt_size(enum keystore_algo_spec algo_spec,
   return res;
 }
 
+/**
+ * @brief Helper function, output size on the device of ias_keystore.h.
+ */
+static int keystore_crypt_size(void *priv, unsigned int cmd, uint32_t algo_spec,
+                               size_t input_size, size_t *output_size)
+{
+  (void)priv;
+
+  if (cmd == KEYSTORE_IOC_ENCRYPT_SIZE)
+    return ias_keystore_encrypt_size((enum keystore_algo_spec)algo_spec, input_size, output_size);
+
+  return ias_keystore_decrypt_size((enum keystore_algo_spec)algo_spec, input_size, output_size);
+}
+
+int keystore_crypt_check_alias(int encrypt, uint32_t algo_spec,
+                               const uint8_t *input, size_t input_size,
+                               const uint8_t *output,
+                               keystore_crypt_size_fn crypt_size, void *priv)
+{
+  uintptr_t in = (uintptr_t)input;
+  uintptr_t out = (uintptr_t)output;
+  size_t output_size;
+
+  if (out == in)
+    return (algo_spec == ALGOSPEC_AES_GCM || algo_spec == ALGOSPEC_AES_CCM) ? 0 : -EINVAL;
+
+  if (out > in)
+    return (out - in < input_size) ? -EINVAL : 0;
+
+  /* Output below the input: it overlaps if it is longer than the gap. An
+   * AES output is at most KEYSTORE_MAX_TAG_SIZE longer than the input, so
+   * only a gap shorter than that needs the exact size. A size error is
+   * left to the operation itself to report. */
+  if ((algo_spec == ALGOSPEC_AES_GCM || algo_spec == ALGOSPEC_AES_CCM) &&
+      in - out >= input_size && in - out - input_size >= KEYSTORE_MAX_TAG_SIZE)
+    return 0;
+
+  if (crypt_size(priv, encrypt ? KEYSTORE_IOC_ENCRYPT_SIZE : KEYSTORE_IOC_DECRYPT_SIZE,
+                 algo_spec, input_size, &output_size))
+    return 0;
+
+  return (in - out < output_size) ? -EINVAL : 0;
+}
+
 int ias_keystore_encrypt(const uint8_t *client_ticket, uint32_t slot_id,
                          enum keystore_algo_spec algo_spec,
                          const uint8_t *iv, size_t iv_size,
@@ -308,6 +685,11 @@ int ias_keystore_encrypt(const uint8_t *client_ticket, uint32_t slot_id,
   if (!client_ticket || !input || !output)
     return -EFAULT;
 
+  res = keystore_crypt_check_alias(1, (uint32_t)algo_spec, input, input_size, output,
+                                   keystore_crypt_size, NULL);
+  if (res)
+    return res;
+
   memset(&request, 0, sizeof(request));
   res = keystore_memcpy(request.client_ticket, client_ticket, sizeof(request.client_ticket));
   if (res)
@@ -335,6 +717,11 @@ int ias_keystore_decrypt_size(enum keystore_algo_spec algo_spec,
   if (!output_size)
     return -EFAULT;
 
+  res = keystore_size_crypt(keystore_sizes(), KEYSTORE_IOC_DECRYPT_SIZE, algo_spec,
+                            input_size, output_size);
+  if (res != -ENOENT)
+    return res;
+
   memset(&request, 0, sizeof(request));
 
   request.algospec = algo_spec;
@@ -363,6 +750,11 @@ int ias_keystore_decrypt(const uint8_t *client_ticket, uint32_t slot_id,
   if (!client_ticket || !input || !output)
     return -EFAULT;
 
+  res = keystore_crypt_check_alias(0, (uint32_t)algo_spec, input, input_size, output,
+                                   keystore_crypt_size, NULL);
+  if (res)
+    return res;
+
   memset(&request, 0, sizeof(request));
   res = keystore_memcpy(request.client_ticket, client_ticket, sizeof(request.client_ticket));
   if (res)
@@ -380,4 +772,359 @@ int ias_keystore_decrypt(const uint8_t *client_ticket, uint32_t slot_id,
 
   return res;
 }
+
+int keystore_iov_size(const struct iovec *iov, size_t count, size_t *size)
+{
+  uint64_t total = 0;
+  size_t i;
+
+  if (count > IAS_KEYSTORE_IOV_MAX)
+    return -EINVAL;
+  if (!iov && count)
+    return -EFAULT;
+
+  for (i = 0; i < count; i++)
+  {
+    if (!iov[i].iov_base && iov[i].iov_len)
+      return -EFAULT;
+    total += iov[i].iov_len;
+    if (total > UINT32_MAX)
+      return -EINVAL;
+  }
+
+  *size = (size_t)total;
+  return 0;
+}
+
+void keystore_iov_gather(uint8_t *dst, const struct iovec *iov, size_t count, size_t size)
+{
+  size_t i, n;
+
+  for (i = 0; i < count && size; i++)
+  {
+    n = iov[i].iov_len < size ? iov[i].iov_len : size;
+    memcpy(dst, iov[i].iov_base, n);
+    dst += n;
+    size -= n;
+  }
+}
+
+void keystore_iov_scatter(const struct iovec *iov, size_t count, const uint8_t *src, size_t size)
+{
+  size_t i, n;
+
+  for (i = 0; i < count && size; i++)
+  {
+    n = iov[i].iov_len < size ? iov[i].iov_len : size;
+    memcpy(iov[i].iov_base, src, n);
+    src += n;
+    size -= n;
+  }
+}
+
+/**
+ * @brief Helper function, encrypts or decrypts scattered buffers.
+ */
+static int keystore_cryptv(int encrypt, const uint8_t *client_ticket, uint32_t slot_id,
+                           enum keystore_algo_spec algo_spec,
+                           const uint8_t *iv, size_t iv_size,
+                           const struct iovec *input, int input_count,
+                           const struct iovec *output, int output_count)
+{
+  struct ias_keystore_encrypt_decrypt_vec request;
+  size_t input_size, output_max, output_size, buf_size;
+  uint8_t *buf, *in, *out;
+  int scatter, res;
+
+  if (!client_ticket)
+    return -EFAULT;
+
+  if (input_count < 0 || output_count < 0 || iv_size > UINT32_MAX)
+    return -EINVAL;
+
+  res = keystore_iov_size(input, (size_t)input_count, &input_size);
+  if (!res)
+    res = keystore_iov_size(output, (size_t)output_count, &output_max);
+  if (res)
+    return res;
+
+  if (encrypt)
+    res = ias_keystore_encrypt_size(algo_spec, input_size, &output_size);
+  else
+    res = ias_keystore_decrypt_size(algo_spec, input_size, &output_size);
+  if (res)
+    return res;
+
+  if (output_max < output_size)
+    return -EMSGSIZE;
+
+  /* Segments usable as they are */
+  in = input_count == 1 ? (uint8_t *)input[0].iov_base : NULL;
+  out = output_count == 1 ? (uint8_t *)output[0].iov_base : NULL;
+
+  if (!(in && out) && __atomic_load_n(&_vector_supported, __ATOMIC_RELAXED) != 0)
+  {
+    memset(&request, 0, sizeof(request));
+    memcpy(request.client_ticket, client_ticket, sizeof(request.client_ticket));
+    request.slot_id = slot_id;
+    request.algospec = (uint32_t)algo_spec;
+    request.iv = iv;
+    request.iv_size = (uint32_t)iv_size;
+    request.input = input;
+    request.input_count = (uint32_t)input_count;
+    request.output = output;
+    request.output_count = (uint32_t)output_count;
+
+    res = keystore_ioctl(encrypt ? KEYSTORE_LIB_IOC_ENCRYPTV : KEYSTORE_LIB_IOC_DECRYPTV, &request);
+    if (res != -ENOTTY)
+    {
+      __atomic_store_n(&_vector_supported, 1, __ATOMIC_RELAXED);
+      return res;
+    }
+    __atomic_store_n(&_vector_supported, 0, __ATOMIC_RELAXED);
+  }
+
+  /* Gather into one buffer holding whichever side is scattered */
+  scatter = !out;
+  buf_size = (in ? 0 : input_size) + (out ? 0 : output_size);
+  buf = (uint8_t *)malloc(buf_size ? buf_size : 1);
+  if (!buf)
+    return -ENOMEM;
+
+  if (!in)
+  {
+    in = buf;
+    keystore_iov_gather(in, input, (size_t)input_count, input_size);
+  }
+  if (scatter)
+    out = buf + buf_size - output_size;
+
+  if (encrypt)
+    res = ias_keystore_encrypt(client_ticket, slot_id, algo_spec, iv, iv_size,
+                               in, input_size, out);
+  else
+    res = ias_keystore_decrypt(client_ticket, slot_id, algo_spec, iv, iv_size,
+                               in, input_size, out);
+
+  if (!res && scatter)
+    keystore_iov_scatter(output, (size_t)output_count, out, output_size);
+
+  keystore_memzero(buf, buf_size);
+  free(buf);
+  return res;
+}
+
+int ias_keystore_encryptv(const uint8_t *client_ticket, uint32_t slot_id,
+                          enum keystore_algo_spec algo_spec,
+                          const uint8_t *iv, size_t iv_size,
+                          const struct iovec *input, int input_count,
+                          const struct iovec *output, int output_count)
+{
+  return keystore_cryptv(1, client_ticket, slot_id, algo_spec, iv, iv_size,
+                         input, input_count, output, output_count);
+}
+
+int ias_keystore_decryptv(const uint8_t *client_ticket, uint32_t slot_id,
+                          enum keystore_algo_spec algo_spec,
+                          const uint8_t *iv, size_t iv_size,
+                          const struct iovec *input, int input_count,
+                          const struct iovec *output, int output_count)
+{
+  return keystore_cryptv(0, client_ticket, slot_id, algo_spec, iv, iv_size,
+                         input, input_count, output, output_count);
+}
+
+int ias_keystore_vector_supported(void)
+{
+  struct ias_keystore_encrypt_decrypt_vec request;
+  int res;
+
+  res = __atomic_load_n(&_vector_supported, __ATOMIC_RELAXED);
+  if (res >= 0)
+    return res;
+
+  memset(&request, 0, sizeof(request));
+
+  res = keystore_ioctl(KEYSTORE_LIB_IOC_ENCRYPTV, &request);
+  if (res == -ENOTTY)
+    res = 0;
+  else if (res == 0)
+    res = 1;
+  else
+    return res;
+
+  __atomic_store_n(&_vector_supported, res, __ATOMIC_RELAXED);
+  return res;
+}
+
+/* Batches up to this size are converted on the stack */
+#define KEYSTORE_BATCH_STACK_ENTRIES 16
+
+/**
+ * @brief Helper function, checks the arguments of one batch operation.
+ *
+ * @return 0 if OK or negative error code (see errno.h).
+ */
+static int keystore_batch_check_op(int encrypt, const struct ias_keystore_crypto_op *op)
+{
+  /* Do not check the IV as it allowed to be null */
+  if (!op->input || !op->output)
+    return -EFAULT;
+
+  if (op->input_size > UINT32_MAX || op->iv_size > UINT32_MAX)
+    return -EINVAL;
+
+  return keystore_crypt_check_alias(encrypt, (uint32_t)op->algo_spec, op->input,
+                                    op->input_size, op->output, keystore_crypt_size, NULL);
+}
+
+/**
+ * @brief Helper function, passes a batch down in a single ioctl.
+ *
+ * @return 0 if all operations succeeded, the status of the first failed
+ * operation, or negative error code (see errno.h) for the whole batch.
+ * -ENOTTY means the driver has no batch support.
+ */
+static int keystore_crypt_batch_ioctl(unsigned int cmd, const uint8_t *client_ticket,
+                                      struct ias_keystore_crypto_op *ops, size_t count)
+{
+  struct ias_keystore_crypto_batch request;
+  struct ias_keystore_crypto_batch_entry stack_entries[KEYSTORE_BATCH_STACK_ENTRIES];
+  struct ias_keystore_crypto_batch_entry *entries = stack_entries;
+  size_t i;
+  int res;
+
+  if (count > KEYSTORE_BATCH_STACK_ENTRIES)
+  {
+    entries = (struct ias_keystore_crypto_batch_entry *)malloc(count * sizeof(*entries));
+    if (!entries)
+      return -ENOMEM;
+  }
+
+  memset(&request, 0, sizeof(request));
+  res = keystore_memcpy(request.client_ticket, client_ticket, sizeof(request.client_ticket));
+  if (res)
+    goto out;
+
+  for (i = 0; i < count; i++)
+  {
+    entries[i].slot_id = ops[i].slot_id;
+    entries[i].algospec = (uint32_t)ops[i].algo_spec;
+    entries[i].iv = ops[i].iv;
+    entries[i].iv_size = (uint32_t)ops[i].iv_size;
+    entries[i].input = ops[i].input;
+    entries[i].input_size = (uint32_t)ops[i].input_size;
+    entries[i].output = ops[i].output;
+    entries[i].status = 0;
+  }
+
+  request.count = (uint32_t)count;
+  request.entries = entries;
+
+  res = keystore_ioctl(cmd, &request);
+  if (res)
+    goto out;
+
+  for (i = 0; i < count; i++)
+  {
+    ops[i].status = entries[i].status;
+    if (ops[i].status && !res)
+      res = ops[i].status;
+  }
+
+out:
+  if (entries != stack_entries)
+    free(entries);
+
+  return res;
+}
+
+/**
+ * @brief Helper function, executes a batch as one ioctl or one operation at a time.
+ */
+static int keystore_crypt_batch(int encrypt, const uint8_t *client_ticket,
+                                struct ias_keystore_crypto_op *ops, size_t count)
+{
+  int res = 0;
+  int direct = 1;
+  size_t i;
+
+  if (!client_ticket || (!ops && count))
+    return -EFAULT;
+
+  if (count > UINT32_MAX)
+    return -EINVAL;
+
+  /* Invalid operations are reported one by one in the loop below */
+  for (i = 0; i < count && direct; i++)
+    direct = !keystore_batch_check_op(encrypt, &ops[i]);
+
+  if (direct && count && __atomic_load_n(&_batch_supported, __ATOMIC_RELAXED) != 0)
+  {
+    res = keystore_crypt_batch_ioctl(encrypt ? KEYSTORE_LIB_IOC_ENCRYPT_BATCH : KEYSTORE_LIB_IOC_DECRYPT_BATCH,
+                                     client_ticket, ops, count);
+    if (res != -ENOTTY)
+    {
+      __atomic_store_n(&_batch_supported, 1, __ATOMIC_RELAXED);
+      return res;
+    }
+    __atomic_store_n(&_batch_supported, 0, __ATOMIC_RELAXED);
+    res = 0;
+  }
+
+  for (i = 0; i < count; i++)
+  {
+    struct ias_keystore_crypto_op *op = &ops[i];
+
+    op->status = keystore_batch_check_op(encrypt, op);
+    if (!op->status && encrypt)
+      op->status = ias_keystore_encrypt(client_ticket, op->slot_id, op->algo_spec,
+                                        op->iv, op->iv_size, op->input, op->input_size,
+                                        op->output);
+    else if (!op->status)
+      op->status = ias_keystore_decrypt(client_ticket, op->slot_id, op->algo_spec,
+                                        op->iv, op->iv_size, op->input, op->input_size,
+                                        op->output);
+
+    if (op->status && !res)
+      res = op->status;
+  }
+
+  return res;
+}
+
+int ias_keystore_batch_supported(void)
+{
+  struct ias_keystore_crypto_batch request;
+  int res;
+
+  res = __atomic_load_n(&_batch_supported, __ATOMIC_RELAXED);
+  if (res >= 0)
+    return res;
+
+  memset(&request, 0, sizeof(request));
+
+  res = keystore_ioctl(KEYSTORE_LIB_IOC_ENCRYPT_BATCH, &request);
+  if (res == -ENOTTY)
+    res = 0;
+  else if (res == 0)
+    res = 1;
+  else
+    return res;
+
+  __atomic_store_n(&_batch_supported, res, __ATOMIC_RELAXED);
+  return res;
+}
+
+int ias_keystore_encrypt_batch(const uint8_t *client_ticket,
+                               struct ias_keystore_crypto_op *ops, size_t count)
+{
+  return keystore_crypt_batch(1, client_ticket, ops, count);
+}
+
+int ias_keystore_decrypt_batch(const uint8_t *client_ticket,
+                               struct ias_keystore_crypto_op *ops, size_t count)
+{
+  return keystore_crypt_batch(0, client_ticket, ops, count);
+}
 /* end of file */
@@ -0,0 +1,1020 @@
+/*
+   Copyright 2018 Intel Corporation
+
+   This software is licensed to you in accordance
+   with the agreement between you and Intel Corporation.
+
+   Alternatively, you can use this file in compliance
+   with the Apache license, Version 2.
+
+
+   Apache License, Version 2.0
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+   http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+
+#include "ias_keystore_aes.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define KEYSTORE_AES_ACCEL 1
+#define KEYSTORE_AES_ACCEL_TARGET __attribute__((target("aes,pclmul,ssse3")))
+#endif
+
+#define GET_U32(p) (((uint32_t)(p)[0] << 24) | ((uint32_t)(p)[1] << 16) | \
+                    ((uint32_t)(p)[2] << 8) | (uint32_t)(p)[3])
+
+#define PUT_U32(p, v) do { \
+    (p)[0] = (uint8_t)((v) >> 24); (p)[1] = (uint8_t)((v) >> 16); \
+    (p)[2] = (uint8_t)((v) >> 8); (p)[3] = (uint8_t)(v); \
+  } while (0)
+
+#define GET_U64(p) (((uint64_t)GET_U32(p) << 32) | GET_U32((p) + 4))
+
+#define PUT_U64(p, v) do { \
+    PUT_U32((p), (uint32_t)((v) >> 32)); PUT_U32((p) + 4, (uint32_t)(v)); \
+  } while (0)
+
+static uint8_t _sbox[256];
+static uint32_t _te[4][256];
+static pthread_once_t _tables_once = PTHREAD_ONCE_INIT;
+
+static uint8_t keystore_aes_xtime(uint8_t x)
+{
+  return (uint8_t)((x << 1) ^ ((x & 0x80) ? 0x1b : 0));
+}
+
+static uint32_t keystore_ror32(uint32_t x, unsigned int n)
+{
+  return (x >> n) | (x << (32 - n));
+}
+
+/**
+ * @brief Helper function, computes the S-box and the round tables.
+ */
+static void keystore_aes_tables(void)
+{
+  uint8_t p = 1, q = 1, x;
+  unsigned int i;
+
+  /* p runs through all non-zero elements, q is its multiplicative inverse */
+  do
+  {
+    p = (uint8_t)(p ^ keystore_aes_xtime(p));
+    q ^= (uint8_t)(q << 1);
+    q ^= (uint8_t)(q << 2);
+    q ^= (uint8_t)(q << 4);
+    if (q & 0x80)
+      q ^= 0x09;
+
+    x = (uint8_t)(q ^ (uint8_t)((q << 1) | (q >> 7)) ^ (uint8_t)((q << 2) | (q >> 6)) ^
+                  (uint8_t)((q << 3) | (q >> 5)) ^ (uint8_t)((q << 4) | (q >> 4)));
+    _sbox[p] = x ^ 0x63;
+  } while (p != 1);
+  _sbox[0] = 0x63;
+
+  for (i = 0; i < 256; i++)
+  {
+    uint8_t s = _sbox[i];
+    uint8_t s2 = keystore_aes_xtime(s);
+    uint32_t t = ((uint32_t)s2 << 24) | ((uint32_t)s << 16) | ((uint32_t)s << 8) |
+                 (uint32_t)(s2 ^ s);
+
+    _te[0][i] = t;
+    _te[1][i] = keystore_ror32(t, 8);
+    _te[2][i] = keystore_ror32(t, 16);
+    _te[3][i] = keystore_ror32(t, 24);
+  }
+}
+
+#ifdef KEYSTORE_AES_ACCEL
+/**
+ * @brief Helper function, SubWord() with AESENCLAST instead of the S-box.
+ *
+ * With the word in all four columns ShiftRows changes nothing, and a zero
+ * round key leaves SubBytes: no lookup depends on the key.
+ */
+KEYSTORE_AES_ACCEL_TARGET
+static uint32_t keystore_aes_accel_subword(uint32_t w)
+{
+  return (uint32_t)_mm_cvtsi128_si32(_mm_aesenclast_si128(_mm_set1_epi32((int)w), _mm_setzero_si128()));
+}
+#endif
+
+static uint32_t keystore_aes_subword(uint32_t w)
+{
+#ifdef KEYSTORE_AES_ACCEL
+  if (keystore_gcm_accelerated())
+    return keystore_aes_accel_subword(w);
+#endif
+
+  return ((uint32_t)_sbox[w >> 24] << 24) | ((uint32_t)_sbox[(w >> 16) & 0xff] << 16) |
+         ((uint32_t)_sbox[(w >> 8) & 0xff] << 8) | (uint32_t)_sbox[w & 0xff];
+}
+
+int keystore_aes_setkey(struct keystore_aes_key *key, const uint8_t *raw, size_t size)
+{
+  unsigned int nk, i, words;
+  uint8_t rcon = 1;
+  uint32_t t;
+
+  if (!key || !raw)
+    return -EFAULT;
+
+  if (size != 16 && size != 24 && size != 32)
+    return -EINVAL;
+
+  pthread_once(&_tables_once, keystore_aes_tables);
+
+  nk = (unsigned int)size / 4;
+  key->rounds = (int)nk + 6;
+  words = 4 * ((unsigned int)key->rounds + 1);
+
+  for (i = 0; i < nk; i++)
+    key->rk[i] = GET_U32(raw + 4 * i);
+
+  for (i = nk; i < words; i++)
+  {
+    t = key->rk[i - 1];
+    if (i % nk == 0)
+    {
+      t = keystore_aes_subword((t << 8) | (t >> 24)) ^ ((uint32_t)rcon << 24);
+      rcon = keystore_aes_xtime(rcon);
+    }
+    else if (nk > 6 && i % nk == 4)
+    {
+      t = keystore_aes_subword(t);
+    }
+    key->rk[i] = key->rk[i - nk] ^ t;
+  }
+
+  return 0;
+}
+
+void keystore_aes_encrypt_block(const struct keystore_aes_key *key,
+                                const uint8_t in[KEYSTORE_AES_BLOCK_SIZE],
+                                uint8_t out[KEYSTORE_AES_BLOCK_SIZE])
+{
+  const uint32_t *rk = key->rk;
+  uint32_t s0, s1, s2, s3, t0, t1, t2, t3;
+  int r;
+
+  s0 = GET_U32(in) ^ rk[0];
+  s1 = GET_U32(in + 4) ^ rk[1];
+  s2 = GET_U32(in + 8) ^ rk[2];
+  s3 = GET_U32(in + 12) ^ rk[3];
+
+  for (r = 1; r < key->rounds; r++)
+  {
+    rk += 4;
+    t0 = _te[0][s0 >> 24] ^ _te[1][(s1 >> 16) & 0xff] ^ _te[2][(s2 >> 8) & 0xff] ^ _te[3][s3 & 0xff] ^ rk[0];
+    t1 = _te[0][s1 >> 24] ^ _te[1][(s2 >> 16) & 0xff] ^ _te[2][(s3 >> 8) & 0xff] ^ _te[3][s0 & 0xff] ^ rk[1];
+    t2 = _te[0][s2 >> 24] ^ _te[1][(s3 >> 16) & 0xff] ^ _te[2][(s0 >> 8) & 0xff] ^ _te[3][s1 & 0xff] ^ rk[2];
+    t3 = _te[0][s3 >> 24] ^ _te[1][(s0 >> 16) & 0xff] ^ _te[2][(s1 >> 8) & 0xff] ^ _te[3][s2 & 0xff] ^ rk[3];
+    s0 = t0;
+    s1 = t1;
+    s2 = t2;
+    s3 = t3;
+  }
+
+  rk += 4;
+  t0 = ((uint32_t)_sbox[s0 >> 24] << 24) | ((uint32_t)_sbox[(s1 >> 16) & 0xff] << 16) |
+       ((uint32_t)_sbox[(s2 >> 8) & 0xff] << 8) | (uint32_t)_sbox[s3 & 0xff];
+  t1 = ((uint32_t)_sbox[s1 >> 24] << 24) | ((uint32_t)_sbox[(s2 >> 16) & 0xff] << 16) |
+       ((uint32_t)_sbox[(s3 >> 8) & 0xff] << 8) | (uint32_t)_sbox[s0 & 0xff];
+  t2 = ((uint32_t)_sbox[s2 >> 24] << 24) | ((uint32_t)_sbox[(s3 >> 16) & 0xff] << 16) |
+       ((uint32_t)_sbox[(s0 >> 8) & 0xff] << 8) | (uint32_t)_sbox[s1 & 0xff];
+  t3 = ((uint32_t)_sbox[s3 >> 24] << 24) | ((uint32_t)_sbox[(s0 >> 16) & 0xff] << 16) |
+       ((uint32_t)_sbox[(s1 >> 8) & 0xff] << 8) | (uint32_t)_sbox[s2 & 0xff];
+
+  PUT_U32(out, t0 ^ rk[0]);
+  PUT_U32(out + 4, t1 ^ rk[1]);
+  PUT_U32(out + 8, t2 ^ rk[2]);
+  PUT_U32(out + 12, t3 ^ rk[3]);
+}
+
+/*
+ * GHASH uses 4-bit tables (Shoup's method): hl/hh hold the multiples
+ * of H for every nibble value.
+ */
+static const uint64_t _ghash_last4[16] = {
+  0x0000, 0x1c20, 0x3840, 0x2460, 0x7080, 0x6ca0, 0x48c0, 0x54e0,
+  0xe100, 0xfd20, 0xd940, 0xc560, 0x9180, 0x8da0, 0xa9c0, 0xb5e0
+};
+
+#ifdef KEYSTORE_AES_ACCEL
+/*
+ * AES-NI and PCLMULQDQ versions of CTR mode and GHASH. GHASH works on
+ * byte reflected blocks (Gueron and Kounavis, "Intel Carry-Less
+ * Multiplication Instruction and its Usage for Computing the GCM Mode"),
+ * four blocks at a time with a single reduction.
+ */
+#define KEYSTORE_AES_ACCEL_BLOCKS 4
+
+static int _accel = -1;
+
+static void keystore_gcm_accel_detect(void)
+{
+  __builtin_cpu_init();
+  _accel = __builtin_cpu_supports("aes") && __builtin_cpu_supports("pclmul") &&
+           __builtin_cpu_supports("ssse3");
+}
+
+KEYSTORE_AES_ACCEL_TARGET
+static __m128i keystore_bswap128(__m128i x)
+{
+  return _mm_shuffle_epi8(x, _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15));
+}
+
+/**
+ * @brief Helper function, carry-less product of @a and @b without reduction.
+ */
+KEYSTORE_AES_ACCEL_TARGET
+static void keystore_clmul(__m128i a, __m128i b, __m128i *lo, __m128i *hi)
+{
+  __m128i mid = _mm_xor_si128(_mm_clmulepi64_si128(a, b, 0x10), _mm_clmulepi64_si128(a, b, 0x01));
+
+  *lo = _mm_xor_si128(*lo, _mm_xor_si128(_mm_clmulepi64_si128(a, b, 0x00), _mm_slli_si128(mid, 8)));
+  *hi = _mm_xor_si128(*hi, _mm_xor_si128(_mm_clmulepi64_si128(a, b, 0x11), _mm_srli_si128(mid, 8)));
+}
+
+/**
+ * @brief Helper function, reduces the 256 bit product @lo:@hi modulo the GCM polynomial.
+ */
+KEYSTORE_AES_ACCEL_TARGET
+static __m128i keystore_clmul_reduce(__m128i lo, __m128i hi)
+{
+  __m128i t7, t8, t9, t2, t4, t5;
+
+  /* Shift the product left by one bit for the reflected representation */
+  t7 = _mm_srli_epi32(lo, 31);
+  t8 = _mm_srli_epi32(hi, 31);
+  lo = _mm_slli_epi32(lo, 1);
+  hi = _mm_slli_epi32(hi, 1);
+  t9 = _mm_srli_si128(t7, 12);
+  t8 = _mm_slli_si128(t8, 4);
+  t7 = _mm_slli_si128(t7, 4);
+  lo = _mm_or_si128(lo, t7);
+  hi = _mm_or_si128(_mm_or_si128(hi, t8), t9);
+
+  t7 = _mm_xor_si128(_mm_xor_si128(_mm_slli_epi32(lo, 31), _mm_slli_epi32(lo, 30)),
+                     _mm_slli_epi32(lo, 25));
+  t8 = _mm_srli_si128(t7, 4);
+  t7 = _mm_slli_si128(t7, 12);
+  lo = _mm_xor_si128(lo, t7);
+
+  t2 = _mm_srli_epi32(lo, 1);
+  t4 = _mm_srli_epi32(lo, 2);
+  t5 = _mm_srli_epi32(lo, 7);
+  t2 = _mm_xor_si128(_mm_xor_si128(t2, t4), _mm_xor_si128(t5, t8));
+  lo = _mm_xor_si128(lo, t2);
+
+  return _mm_xor_si128(hi, lo);
+}
+
+KEYSTORE_AES_ACCEL_TARGET
+static __m128i keystore_gfmul(__m128i a, __m128i b)
+{
+  __m128i lo = _mm_setzero_si128();
+  __m128i hi = _mm_setzero_si128();
+
+  keystore_clmul(a, b, &lo, &hi);
+  return keystore_clmul_reduce(lo, hi);
+}
+
+KEYSTORE_AES_ACCEL_TARGET
+static __m128i keystore_aes_accel_block(const struct keystore_gcm_key *key, __m128i x)
+{
+  int r;
+
+  x = _mm_xor_si128(x, _mm_loadu_si128((const __m128i *)key->rk_bytes[0]));
+  for (r = 1; r < key->aes.rounds; r++)
+    x = _mm_aesenc_si128(x, _mm_loadu_si128((const __m128i *)key->rk_bytes[r]));
+  return _mm_aesenclast_si128(x, _mm_loadu_si128((const __m128i *)key->rk_bytes[r]));
+}
+
+/**
+ * @brief Helper function, sets up the AES-NI round keys and powers of H.
+ *
+ * @param[out] h  H = E(K, 0), computed with AES-NI.
+ */
+KEYSTORE_AES_ACCEL_TARGET
+static void keystore_gcm_accel_setkey(struct keystore_gcm_key *key, uint8_t h[KEYSTORE_AES_BLOCK_SIZE])
+{
+  __m128i hr, hp;
+  int i;
+
+  for (i = 0; i < 4 * (key->aes.rounds + 1); i++)
+    PUT_U32(key->rk_bytes[i / 4] + 4 * (i % 4), key->aes.rk[i]);
+
+  _mm_storeu_si128((__m128i *)h, keystore_aes_accel_block(key, _mm_setzero_si128()));
+  hr = keystore_bswap128(_mm_loadu_si128((const __m128i *)h));
+
+  hp = hr;
+  for (i = 0; i < 4; i++)
+  {
+    _mm_storeu_si128((__m128i *)key->h_pow[i], hp);
+    hp = keystore_gfmul(hp, hr);
+  }
+
+  key->accel = 1;
+}
+
+/**
+ * @brief Helper function, keystore_gcm_crypt() with AES-NI and PCLMULQDQ.
+ */
+KEYSTORE_AES_ACCEL_TARGET
+static void keystore_gcm_accel_crypt(const struct keystore_gcm_key *key, int encrypt,
+                                     uint8_t ctr[KEYSTORE_AES_BLOCK_SIZE],
+                                     uint8_t y[KEYSTORE_AES_BLOCK_SIZE],
+                                     const uint8_t *input, size_t size, uint8_t *output)
+{
+  const __m128i one = _mm_set_epi32(0, 0, 0, 1);
+  __m128i rk[15];
+  __m128i h_pow[4];
+  __m128i c = keystore_bswap128(_mm_loadu_si128((const __m128i *)ctr));
+  __m128i yr = keystore_bswap128(_mm_loadu_si128((const __m128i *)y));
+  __m128i b[KEYSTORE_AES_ACCEL_BLOCKS], x[KEYSTORE_AES_ACCEL_BLOCKS];
+  __m128i lo, hi;
+  uint8_t block[KEYSTORE_AES_BLOCK_SIZE];
+  size_t n;
+  int i, r;
+
+  for (r = 0; r <= key->aes.rounds; r++)
+    rk[r] = _mm_loadu_si128((const __m128i *)key->rk_bytes[r]);
+  for (i = 0; i < 4; i++)
+    h_pow[i] = _mm_loadu_si128((const __m128i *)key->h_pow[i]);
+
+  /* The counter is incremented in its low 32 bits, which wrap like inc32 */
+  while (size >= KEYSTORE_AES_ACCEL_BLOCKS * KEYSTORE_AES_BLOCK_SIZE)
+  {
+    for (i = 0; i < KEYSTORE_AES_ACCEL_BLOCKS; i++)
+    {
+      c = _mm_add_epi32(c, one);
+      b[i] = _mm_xor_si128(keystore_bswap128(c), rk[0]);
+    }
+    for (r = 1; r < key->aes.rounds; r++)
+      for (i = 0; i < KEYSTORE_AES_ACCEL_BLOCKS; i++)
+        b[i] = _mm_aesenc_si128(b[i], rk[r]);
+
+    for (i = 0; i < KEYSTORE_AES_ACCEL_BLOCKS; i++)
+    {
+      __m128i in = _mm_loadu_si128((const __m128i *)(input + i * KEYSTORE_AES_BLOCK_SIZE));
+      __m128i out = _mm_xor_si128(in, _mm_aesenclast_si128(b[i], rk[key->aes.rounds]));
+
+      _mm_storeu_si128((__m128i *)(output + i * KEYSTORE_AES_BLOCK_SIZE), out);
+      x[i] = keystore_bswap128(encrypt ? out : in);
+    }
+
+    /* Y = (Y + X1) H^4 + X2 H^3 + X3 H^2 + X4 H */
+    lo = _mm_setzero_si128();
+    hi = _mm_setzero_si128();
+    keystore_clmul(_mm_xor_si128(yr, x[0]), h_pow[3], &lo, &hi);
+    keystore_clmul(x[1], h_pow[2], &lo, &hi);
+    keystore_clmul(x[2], h_pow[1], &lo, &hi);
+    keystore_clmul(x[3], h_pow[0], &lo, &hi);
+    yr = keystore_clmul_reduce(lo, hi);
+
+    input += KEYSTORE_AES_ACCEL_BLOCKS * KEYSTORE_AES_BLOCK_SIZE;
+    output += KEYSTORE_AES_ACCEL_BLOCKS * KEYSTORE_AES_BLOCK_SIZE;
+    size -= KEYSTORE_AES_ACCEL_BLOCKS * KEYSTORE_AES_BLOCK_SIZE;
+  }
+
+  /* Remaining blocks, the last one zero padded */
+  while (size)
+  {
+    n = size < KEYSTORE_AES_BLOCK_SIZE ? size : KEYSTORE_AES_BLOCK_SIZE;
+
+    c = _mm_add_epi32(c, one);
+    _mm_storeu_si128((__m128i *)block, keystore_aes_accel_block(key, keystore_bswap128(c)));
+
+    if (!encrypt)
+    {
+      memset(block + n, 0, sizeof(block) - n);
+      for (i = 0; i < (int)n; i++)
+      {
+        uint8_t in = input[i];
+
+        output[i] = in ^ block[i];
+        block[i] = in;
+      }
+    }
+    else
+    {
+      for (i = 0; i < (int)n; i++)
+        block[i] = output[i] = input[i] ^ block[i];
+      memset(block + n, 0, sizeof(block) - n);
+    }
+
+    yr = keystore_gfmul(_mm_xor_si128(yr, keystore_bswap128(_mm_loadu_si128((const __m128i *)block))),
+                        h_pow[0]);
+
+    input += n;
+    output += n;
+    size -= n;
+  }
+
+  _mm_storeu_si128((__m128i *)ctr, keystore_bswap128(c));
+  _mm_storeu_si128((__m128i *)y, keystore_bswap128(yr));
+  keystore_memzero(block, sizeof(block));
+  keystore_memzero(rk, sizeof(rk));
+}
+
+/**
+ * @brief Helper function, keystore_ghash_mult() with PCLMULQDQ.
+ */
+KEYSTORE_AES_ACCEL_TARGET
+static void keystore_ghash_accel_mult(const struct keystore_gcm_key *key, uint8_t x[KEYSTORE_AES_BLOCK_SIZE])
+{
+  __m128i xr = keystore_bswap128(_mm_loadu_si128((const __m128i *)x));
+
+  xr = keystore_gfmul(xr, _mm_loadu_si128((const __m128i *)key->h_pow[0]));
+  _mm_storeu_si128((__m128i *)x, keystore_bswap128(xr));
+}
+
+/**
+ * @brief Helper function, keystore_gcm_block() with AES-NI.
+ */
+KEYSTORE_AES_ACCEL_TARGET
+static void keystore_gcm_accel_block(const struct keystore_gcm_key *key,
+                                     const uint8_t in[KEYSTORE_AES_BLOCK_SIZE],
+                                     uint8_t out[KEYSTORE_AES_BLOCK_SIZE])
+{
+  _mm_storeu_si128((__m128i *)out,
+                   keystore_aes_accel_block(key, _mm_loadu_si128((const __m128i *)in)));
+}
+#endif /* KEYSTORE_AES_ACCEL */
+
+int keystore_gcm_accelerated(void)
+{
+#ifdef KEYSTORE_AES_ACCEL
+  static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+  pthread_once(&once, keystore_gcm_accel_detect);
+  return _accel;
+#else
+  return 0;
+#endif
+}
+
+int keystore_gcm_setkey(struct keystore_gcm_key *key, const uint8_t *raw, size_t size)
+{
+  uint8_t h[KEYSTORE_AES_BLOCK_SIZE];
+  uint64_t vh, vl;
+  unsigned int i, j;
+  int res;
+
+  res = keystore_aes_setkey(&key->aes, raw, size);
+  if (res)
+    return res;
+
+  /* With AES-NI, no table lookup depends on the key or the data */
+  key->accel = 0;
+#ifdef KEYSTORE_AES_ACCEL
+  if (keystore_gcm_accelerated())
+    keystore_gcm_accel_setkey(key, h);
+#endif
+  if (!key->accel)
+  {
+    memset(h, 0, sizeof(h));
+    keystore_aes_encrypt_block(&key->aes, h, h);
+  }
+
+  vh = GET_U64(h);
+  vl = GET_U64(h + 8);
+  keystore_memzero(h, sizeof(h));
+
+  key->hl[8] = vl;
+  key->hh[8] = vh;
+  key->hl[0] = 0;
+  key->hh[0] = 0;
+
+  for (i = 4; i > 0; i >>= 1)
+  {
+    uint64_t t = (vl & 1) * 0xe1000000u;
+    vl = (vh << 63) | (vl >> 1);
+    vh = (vh >> 1) ^ (t << 32);
+    key->hl[i] = vl;
+    key->hh[i] = vh;
+  }
+
+  for (i = 2; i <= 8; i *= 2)
+  {
+    for (j = 1; j < i; j++)
+    {
+      key->hh[i + j] = key->hh[i] ^ key->hh[j];
+      key->hl[i + j] = key->hl[i] ^ key->hl[j];
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * @brief Helper function, x = x * H in GF(2^128).
+ */
+static void keystore_ghash_mult(const struct keystore_gcm_key *key, uint8_t x[KEYSTORE_AES_BLOCK_SIZE])
+{
+  uint64_t zh, zl;
+  unsigned int rem, lo, hi;
+  int i;
+
+#ifdef KEYSTORE_AES_ACCEL
+  if (key->accel)
+  {
+    keystore_ghash_accel_mult(key, x);
+    return;
+  }
+#endif
+
+  lo = x[15] & 0xf;
+  zh = key->hh[lo];
+  zl = key->hl[lo];
+
+  for (i = 15; i >= 0; i--)
+  {
+    lo = x[i] & 0xf;
+    hi = (x[i] >> 4) & 0xf;
+
+    if (i != 15)
+    {
+      rem = (unsigned int)(zl & 0xf);
+      zl = (zh << 60) | (zl >> 4);
+      zh = (zh >> 4) ^ (_ghash_last4[rem] << 48);
+      zh ^= key->hh[lo];
+      zl ^= key->hl[lo];
+    }
+
+    rem = (unsigned int)(zl & 0xf);
+    zl = (zh << 60) | (zl >> 4);
+    zh = (zh >> 4) ^ (_ghash_last4[rem] << 48);
+    zh ^= key->hh[hi];
+    zl ^= key->hl[hi];
+  }
+
+  PUT_U64(x, zh);
+  PUT_U64(x + 8, zl);
+}
+
+/**
+ * @brief Helper function, absorbs data into the GHASH state, zero padding the last block.
+ */
+static void keystore_ghash_update(const struct keystore_gcm_key *key, uint8_t y[KEYSTORE_AES_BLOCK_SIZE],
+                                  const uint8_t *data, size_t size)
+{
+  size_t i, n;
+
+  while (size)
+  {
+    n = size < KEYSTORE_AES_BLOCK_SIZE ? size : KEYSTORE_AES_BLOCK_SIZE;
+    for (i = 0; i < n; i++)
+      y[i] ^= data[i];
+    keystore_ghash_mult(key, y);
+    data += n;
+    size -= n;
+  }
+}
+
+/**
+ * @brief Helper function, absorbs the bit lengths block into the GHASH state.
+ */
+static void keystore_ghash_lengths(const struct keystore_gcm_key *key, uint8_t y[KEYSTORE_AES_BLOCK_SIZE],
+                                   uint64_t a_size, uint64_t c_size)
+{
+  uint8_t block[KEYSTORE_AES_BLOCK_SIZE];
+
+  PUT_U64(block, a_size * 8);
+  PUT_U64(block + 8, c_size * 8);
+  keystore_ghash_update(key, y, block, sizeof(block));
+}
+
+static void keystore_ctr_inc32(uint8_t ctr[KEYSTORE_AES_BLOCK_SIZE])
+{
+  uint32_t c = GET_U32(ctr + 12) + 1;
+
+  PUT_U32(ctr + 12, c);
+}
+
+/**
+ * @brief Helper function, computes the pre-counter block J0.
+ */
+static void keystore_gcm_j0(const struct keystore_gcm_key *key, const uint8_t *iv, size_t iv_size,
+                            uint8_t j0[KEYSTORE_AES_BLOCK_SIZE])
+{
+  memset(j0, 0, KEYSTORE_AES_BLOCK_SIZE);
+
+  if (iv_size == 12)
+  {
+    memcpy(j0, iv, iv_size);
+    j0[15] = 1;
+    return;
+  }
+
+  keystore_ghash_update(key, j0, iv, iv_size);
+  keystore_ghash_lengths(key, j0, 0, iv_size);
+}
+
+/**
+ * @brief Helper function, encrypts one block with the key of @key.
+ */
+static void keystore_gcm_block(const struct keystore_gcm_key *key,
+                               const uint8_t in[KEYSTORE_AES_BLOCK_SIZE],
+                               uint8_t out[KEYSTORE_AES_BLOCK_SIZE])
+{
+#ifdef KEYSTORE_AES_ACCEL
+  if (key->accel)
+  {
+    keystore_gcm_accel_block(key, in, out);
+    return;
+  }
+#endif
+
+  keystore_aes_encrypt_block(&key->aes, in, out);
+}
+
+/**
+ * @brief Helper function, CTR mode encryption combined with GHASH.
+ * @param[in] encrypt Hash the output (encryption) or the input (decryption).
+ */
+static void keystore_gcm_crypt(const struct keystore_gcm_key *key, int encrypt,
+                               uint8_t ctr[KEYSTORE_AES_BLOCK_SIZE], uint8_t y[KEYSTORE_AES_BLOCK_SIZE],
+                               const uint8_t *input, size_t size, uint8_t *output)
+{
+  uint8_t stream[KEYSTORE_AES_BLOCK_SIZE];
+  size_t i, n;
+
+#ifdef KEYSTORE_AES_ACCEL
+  if (key->accel)
+  {
+    keystore_gcm_accel_crypt(key, encrypt, ctr, y, input, size, output);
+    return;
+  }
+#endif
+
+  while (size)
+  {
+    n = size < KEYSTORE_AES_BLOCK_SIZE ? size : KEYSTORE_AES_BLOCK_SIZE;
+
+    keystore_ctr_inc32(ctr);
+    keystore_gcm_block(key, ctr, stream);
+
+    if (!encrypt)
+      keystore_ghash_update(key, y, input, n);
+    for (i = 0; i < n; i++)
+      output[i] = input[i] ^ stream[i];
+    if (encrypt)
+      keystore_ghash_update(key, y, output, n);
+
+    input += n;
+    output += n;
+    size -= n;
+  }
+
+  keystore_memzero(stream, sizeof(stream));
+}
+
+/**
+ * @brief Helper function, shared part of GCM encryption and decryption.
+ */
+static int keystore_gcm(const struct keystore_gcm_key *key, int encrypt,
+                        const uint8_t *iv, size_t iv_size,
+                        const uint8_t *aad, size_t aad_size,
+                        const uint8_t *input, size_t size,
+                        uint8_t *output, uint8_t tag[KEYSTORE_AES_TAG_SIZE])
+{
+  uint8_t j0[KEYSTORE_AES_BLOCK_SIZE];
+  uint8_t ctr[KEYSTORE_AES_BLOCK_SIZE];
+  uint8_t y[KEYSTORE_AES_BLOCK_SIZE];
+  size_t i;
+
+  if (!key || !iv || !tag || (aad_size && !aad) || (size && (!input || !output)))
+    return -EFAULT;
+
+  if (!iv_size)
+    return -EINVAL;
+
+  keystore_gcm_j0(key, iv, iv_size, j0);
+  memcpy(ctr, j0, sizeof(ctr));
+  memset(y, 0, sizeof(y));
+
+  keystore_ghash_update(key, y, aad, aad_size);
+  keystore_gcm_crypt(key, encrypt, ctr, y, input, size, output);
+  keystore_ghash_lengths(key, y, aad_size, size);
+
+  keystore_gcm_block(key, j0, j0);
+  for (i = 0; i < KEYSTORE_AES_TAG_SIZE; i++)
+    tag[i] = j0[i] ^ y[i];
+
+  return 0;
+}
+
+int keystore_gcm_encrypt(const struct keystore_gcm_key *key,
+                         const uint8_t *iv, size_t iv_size,
+                         const uint8_t *aad, size_t aad_size,
+                         const uint8_t *input, size_t size,
+                         uint8_t *output, uint8_t tag[KEYSTORE_AES_TAG_SIZE])
+{
+  return keystore_gcm(key, 1, iv, iv_size, aad, aad_size, input, size, output, tag);
+}
+
+int keystore_gcm_decrypt(const struct keystore_gcm_key *key,
+                         const uint8_t *iv, size_t iv_size,
+                         const uint8_t *aad, size_t aad_size,
+                         const uint8_t *input, size_t size,
+                         const uint8_t tag[KEYSTORE_AES_TAG_SIZE], uint8_t *output)
+{
+  uint8_t expected[KEYSTORE_AES_TAG_SIZE];
+  int res;
+
+  if (!tag)
+    return -EFAULT;
+
+  res = keystore_gcm(key, 0, iv, iv_size, aad, aad_size, input, size, output, expected);
+  if (res)
+    return res;
+
+  if (keystore_memcmp_ct(expected, tag, sizeof(expected)))
+  {
+    keystore_memzero(output, size);
+    return -EBADMSG;
+  }
+
+  return 0;
+}
+
+/**
+ * @brief Helper function, builds the CCM counter block A0 from the IV.
+ *
+ * @return Size of the length field L, or negative error code.
+ */
+static int keystore_ccm_a0(const uint8_t *iv, size_t iv_size, size_t size,
+                           uint8_t a0[KEYSTORE_AES_BLOCK_SIZE])
+{
+  int l, i;
+
+  if (!iv_size || iv_size > KEYSTORE_AES_BLOCK_SIZE)
+    return -EINVAL;
+
+  memset(a0, 0, KEYSTORE_AES_BLOCK_SIZE);
+  memcpy(a0, iv, iv_size);
+
+  if (a0[0] < 1 || a0[0] > 7)
+    return -EINVAL;
+  l = a0[0] + 1;
+
+  /* The message length must fit into the length field */
+  if (l < 8 && (uint64_t)size >> (8 * l))
+    return -EINVAL;
+
+  for (i = KEYSTORE_AES_BLOCK_SIZE - l; i < KEYSTORE_AES_BLOCK_SIZE; i++)
+    a0[i] = 0;
+
+  return l;
+}
+
+/**
+ * @brief Helper function, CBC-MAC over B0, the additional data and the message.
+ */
+static int keystore_ccm_mac(const struct keystore_aes_key *key, const uint8_t a0[KEYSTORE_AES_BLOCK_SIZE],
+                            int l, size_t tag_size, const uint8_t *aad, size_t aad_size,
+                            uint8_t x[KEYSTORE_AES_BLOCK_SIZE])
+{
+  size_t i, n, pos;
+  uint64_t len;
+
+  /* B0: flags | nonce | length of the message (set by the caller in x) */
+  x[0] = (uint8_t)((aad_size ? 0x40 : 0) | (((tag_size - 2) / 2) << 3) | (l - 1));
+  memcpy(x + 1, a0 + 1, (size_t)(KEYSTORE_AES_BLOCK_SIZE - 1 - l));
+  keystore_aes_encrypt_block(key, x, x);
+
+  if (!aad_size)
+    return 0;
+
+  if (aad_size >= 0xff00)
+    return -EINVAL;
+
+  len = aad_size;
+  x[0] ^= (uint8_t)(len >> 8);
+  x[1] ^= (uint8_t)len;
+  pos = 2;
+
+  while (aad_size)
+  {
+    n = KEYSTORE_AES_BLOCK_SIZE - pos;
+    if (n > aad_size)
+      n = aad_size;
+    for (i = 0; i < n; i++)
+      x[pos + i] ^= aad[i];
+    keystore_aes_encrypt_block(key, x, x);
+    aad += n;
+    aad_size -= n;
+    pos = 0;
+  }
+
+  return 0;
+}
+
+/**
+ * @brief Helper function, shared part of CCM encryption and decryption.
+ */
+static int keystore_ccm(const struct keystore_aes_key *key, int encrypt,
+                        const uint8_t *iv, size_t iv_size,
+                        const uint8_t *aad, size_t aad_size,
+                        const uint8_t *input, size_t size,
+                        uint8_t *output, uint8_t *tag, size_t tag_size)
+{
+  uint8_t a[KEYSTORE_AES_BLOCK_SIZE];
+  uint8_t x[KEYSTORE_AES_BLOCK_SIZE];
+  uint8_t s[KEYSTORE_AES_BLOCK_SIZE];
+  uint64_t len = size;
+  size_t i, n;
+  int l, res;
+
+  if (!key || !iv || !tag || (aad_size && !aad) || (size && (!input || !output)))
+    return -EFAULT;
+
+  if (tag_size < 4 || tag_size > KEYSTORE_AES_TAG_SIZE || tag_size % 2)
+    return -EINVAL;
+
+  l = keystore_ccm_a0(iv, iv_size, size, a);
+  if (l < 0)
+    return l;
+
+  memset(x, 0, sizeof(x));
+  for (i = 0; i < (size_t)l; i++)
+    x[KEYSTORE_AES_BLOCK_SIZE - 1 - i] = (uint8_t)(len >> (8 * i));
+
+  res = keystore_ccm_mac(key, a, l, tag_size, aad, aad_size, x);
+  if (res)
+    return res;
+
+  /* S0 masks the tag, the message uses the counters from 1 */
+  keystore_aes_encrypt_block(key, a, s);
+  for (i = 0; i < tag_size; i++)
+    tag[i] = s[i];
+
+  while (size)
+  {
+    n = size < KEYSTORE_AES_BLOCK_SIZE ? size : KEYSTORE_AES_BLOCK_SIZE;
+
+    keystore_ctr_inc32(a);
+    keystore_aes_encrypt_block(key, a, s);
+
+    for (i = 0; i < n; i++)
+    {
+      uint8_t in = input[i];
+      uint8_t out = in ^ s[i];
+
+      x[i] ^= encrypt ? in : out;
+      output[i] = out;
+    }
+    keystore_aes_encrypt_block(key, x, x);
+
+    input += n;
+    output += n;
+    size -= n;
+  }
+
+  for (i = 0; i < tag_size; i++)
+    tag[i] ^= x[i];
+
+  keystore_memzero(s, sizeof(s));
+
+  return 0;
+}
+
+int keystore_ccm_encrypt(const struct keystore_aes_key *key,
+                         const uint8_t *iv, size_t iv_size,
+                         const uint8_t *aad, size_t aad_size,
+                         const uint8_t *input, size_t size,
+                         uint8_t *output, uint8_t tag[KEYSTORE_AES_TAG_SIZE])
+{
+  return keystore_ccm(key, 1, iv, iv_size, aad, aad_size, input, size, output, tag,
+                      KEYSTORE_AES_TAG_SIZE);
+}
+
+int keystore_ccm_encrypt_tag(const struct keystore_aes_key *key,
+                             const uint8_t *iv, size_t iv_size,
+                             const uint8_t *aad, size_t aad_size,
+                             const uint8_t *input, size_t size,
+                             uint8_t *output, uint8_t *tag, size_t tag_size)
+{
+  return keystore_ccm(key, 1, iv, iv_size, aad, aad_size, input, size, output, tag, tag_size);
+}
+
+int keystore_ccm_decrypt(const struct keystore_aes_key *key,
+                         const uint8_t *iv, size_t iv_size,
+                         const uint8_t *aad, size_t aad_size,
+                         const uint8_t *input, size_t size,
+                         const uint8_t tag[KEYSTORE_AES_TAG_SIZE], uint8_t *output)
+{
+  uint8_t expected[KEYSTORE_AES_TAG_SIZE];
+  int res;
+
+  if (!tag)
+    return -EFAULT;
+
+  res = keystore_ccm(key, 0, iv, iv_size, aad, aad_size, input, size, output, expected,
+                     sizeof(expected));
+  if (res)
+    return res;
+
+  if (keystore_memcmp_ct(expected, tag, sizeof(expected)))
+  {
+    keystore_memzero(output, size);
+    return -EBADMSG;
+  }
+
+  return 0;
+}
+
+/**
+ * @brief Helper function, doubling in GF(2^128) for the CMAC subkeys.
+ */
+static void keystore_cmac_dbl(uint8_t b[KEYSTORE_AES_BLOCK_SIZE])
+{
+  uint8_t carry = b[0] & 0x80;
+  int i;
+
+  for (i = 0; i < KEYSTORE_AES_BLOCK_SIZE - 1; i++)
+    b[i] = (uint8_t)((b[i] << 1) | (b[i + 1] >> 7));
+  b[KEYSTORE_AES_BLOCK_SIZE - 1] = (uint8_t)(b[KEYSTORE_AES_BLOCK_SIZE - 1] << 1);
+
+  if (carry)
+    b[KEYSTORE_AES_BLOCK_SIZE - 1] ^= 0x87;
+}
+
+void keystore_cmac(const struct keystore_aes_key *key,
+                   const uint8_t *msg, size_t size,
+                   uint8_t mac[KEYSTORE_AES_TAG_SIZE])
+{
+  uint8_t k[KEYSTORE_AES_BLOCK_SIZE];
+  uint8_t x[KEYSTORE_AES_BLOCK_SIZE];
+  size_t i;
+
+  memset(k, 0, sizeof(k));
+  keystore_aes_encrypt_block(key, k, k);
+  keystore_cmac_dbl(k);
+
+  memset(x, 0, sizeof(x));
+  while (size > KEYSTORE_AES_BLOCK_SIZE)
+  {
+    for (i = 0; i < KEYSTORE_AES_BLOCK_SIZE; i++)
+      x[i] ^= msg[i];
+    keystore_aes_encrypt_block(key, x, x);
+    msg += KEYSTORE_AES_BLOCK_SIZE;
+    size -= KEYSTORE_AES_BLOCK_SIZE;
+  }
+
+  /* Complete last block: K1, partial or empty last block: padding and K2 */
+  for (i = 0; i < size; i++)
+    x[i] ^= msg[i];
+  if (size < KEYSTORE_AES_BLOCK_SIZE)
+  {
+    x[size] ^= 0x80;
+    keystore_cmac_dbl(k);
+  }
+  for (i = 0; i < KEYSTORE_AES_BLOCK_SIZE; i++)
+    x[i] ^= k[i];
+
+  keystore_aes_encrypt_block(key, x, mac);
+
+  keystore_memzero(k, sizeof(k));
+  keystore_memzero(x, sizeof(x));
+}
+
+int keystore_memcmp_ct(const void *a, const void *b, size_t size)
+{
+  const volatile uint8_t *pa = (const volatile uint8_t *)a;
+  const volatile uint8_t *pb = (const volatile uint8_t *)b;
+  uint8_t diff = 0;
+  size_t i;
+
+  for (i = 0; i < size; i++)
+    diff |= pa[i] ^ pb[i];
+
+  return diff != 0;
+}
+
+void keystore_memzero(void *ptr, size_t size)
+{
+  volatile uint8_t *p = (volatile uint8_t *)ptr;
+
+  while (size--)
+    *p++ = 0;
+}
+
+/* end of file */
@@ -0,0 +1,210 @@
+/*
+   Copyright 2018 Intel Corporation
+
+   This software is licensed to you in accordance
+   with the agreement between you and Intel Corporation.
+
+   Alternatively, you can use this file in compliance
+   with the Apache license, Version 2.
+
+
+   Apache License, Version 2.0
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+   http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef IAS_KEYSTORE_AES_H
+#define IAS_KEYSTORE_AES_H
+
+/*
+ * Portable AES primitives used by the software keystore backend.
+ * Not installed and not part of the public API.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "ias_keystore_priv.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/**
+ * KEYSTORE_AES_BLOCK_SIZE - AES block size in bytes
+ */
+#define KEYSTORE_AES_BLOCK_SIZE 16
+
+/**
+ * KEYSTORE_AES_TAG_SIZE - Authentication tag size of GCM, CCM and CMAC
+ */
+#define KEYSTORE_AES_TAG_SIZE 16
+
+/* keystore_crypt_check_alias() relies on this without a size query */
+_Static_assert(KEYSTORE_AES_TAG_SIZE <= KEYSTORE_MAX_TAG_SIZE, "AES tag above KEYSTORE_MAX_TAG_SIZE");
+
+/**
+ * @brief Expanded AES encryption key.
+ * @param rk      Round keys.
+ * @param rounds  Number of rounds (10, 12 or 14).
+ */
+struct keystore_aes_key {
+  uint32_t rk[60];
+  int rounds;
+};
+
+/**
+ * @brief AES-GCM key: the AES key and the GHASH multiplication table.
+ *
+ * On CPUs with AES-NI and PCLMULQDQ, @accel is set and all blocks and
+ * GHASH go through @rk_bytes and @h_pow instead of the tables, which are
+ * not constant time; the key schedule then uses AES-NI for SubWord().
+ * @param rk_bytes  Round keys in byte order.
+ * @param h_pow     H, H^2, H^3 and H^4, byte reflected.
+ */
+struct keystore_gcm_key {
+  struct keystore_aes_key aes;
+  uint64_t hl[16];
+  uint64_t hh[16];
+  int accel;
+  uint8_t rk_bytes[15][KEYSTORE_AES_BLOCK_SIZE];
+  uint8_t h_pow[4][KEYSTORE_AES_BLOCK_SIZE];
+};
+
+/**
+ * @brief Expand an AES key.
+ *
+ * @param[out] key The expanded key.
+ * @param[in] raw The raw key.
+ * @param[in] size Raw key size: 16, 24 or 32 bytes.
+ *
+ * @return 0 if OK or negative error code (see errno.h).
+ */
+int keystore_aes_setkey(struct keystore_aes_key *key, const uint8_t *raw, size_t size);
+
+/**
+ * @brief Encrypt one block. @in and @out may be the same buffer.
+ */
+void keystore_aes_encrypt_block(const struct keystore_aes_key *key,
+                                const uint8_t in[KEYSTORE_AES_BLOCK_SIZE],
+                                uint8_t out[KEYSTORE_AES_BLOCK_SIZE]);
+
+/**
+ * @brief Check whether AES-GCM uses AES-NI and PCLMULQDQ on this CPU.
+ *
+ * @return 1 if it does, 0 if it uses the portable implementation.
+ */
+int keystore_gcm_accelerated(void);
+
+/**
+ * @brief Expand an AES key and precompute the GHASH table.
+ *
+ * @return 0 if OK or negative error code (see errno.h).
+ */
+int keystore_gcm_setkey(struct keystore_gcm_key *key, const uint8_t *raw, size_t size);
+
+/**
+ * @brief AES-GCM encryption with a 16 byte tag.
+ *
+ * Any IV size other than 0 is accepted; 12 bytes is the recommended size.
+ * @input and @output may be the same buffer.
+ *
+ * @return 0 if OK or negative error code (see errno.h).
+ */
+int keystore_gcm_encrypt(const struct keystore_gcm_key *key,
+                         const uint8_t *iv, size_t iv_size,
+                         const uint8_t *aad, size_t aad_size,
+                         const uint8_t *input, size_t size,
+                         uint8_t *output, uint8_t tag[KEYSTORE_AES_TAG_SIZE]);
+
+/**
+ * @brief AES-GCM decryption and tag verification.
+ *
+ * On a tag mismatch the output is cleared and -EBADMSG returned.
+ *
+ * @return 0 if OK or negative error code (see errno.h).
+ */
+int keystore_gcm_decrypt(const struct keystore_gcm_key *key,
+                         const uint8_t *iv, size_t iv_size,
+                         const uint8_t *aad, size_t aad_size,
+                         const uint8_t *input, size_t size,
+                         const uint8_t tag[KEYSTORE_AES_TAG_SIZE], uint8_t *output);
+
+/**
+ * @brief AES-CCM encryption with a 16 byte tag.
+ *
+ * The IV follows the RFC 3610 counter block layout: iv[0] holds L - 1,
+ * the size of the length field minus one (1..7), followed by the
+ * 15 - L byte nonce. Shorter IVs are zero padded to 16 bytes.
+ * @input and @output may be the same buffer.
+ *
+ * @return 0 if OK or negative error code (see errno.h).
+ */
+int keystore_ccm_encrypt(const struct keystore_aes_key *key,
+                         const uint8_t *iv, size_t iv_size,
+                         const uint8_t *aad, size_t aad_size,
+                         const uint8_t *input, size_t size,
+                         uint8_t *output, uint8_t tag[KEYSTORE_AES_TAG_SIZE]);
+
+/**
+ * @brief AES-CCM encryption with a @tag_size byte tag (4, 6, ..., 16).
+ *
+ * As keystore_ccm_encrypt(), which uses 16 bytes; for the SP 800-38C
+ * known answer tests.
+ *
+ * @return 0 if OK or negative error code (see errno.h).
+ */
+int keystore_ccm_encrypt_tag(const struct keystore_aes_key *key,
+                             const uint8_t *iv, size_t iv_size,
+                             const uint8_t *aad, size_t aad_size,
+                             const uint8_t *input, size_t size,
+                             uint8_t *output, uint8_t *tag, size_t tag_size);
+
+/**
+ * @brief AES-CCM decryption and tag verification.
+ *
+ * On a tag mismatch the output is cleared and -EBADMSG returned.
+ *
+ * @return 0 if OK or negative error code (see errno.h).
+ */
+int keystore_ccm_decrypt(const struct keystore_aes_key *key,
+                         const uint8_t *iv, size_t iv_size,
+                         const uint8_t *aad, size_t aad_size,
+                         const uint8_t *input, size_t size,
+                         const uint8_t tag[KEYSTORE_AES_TAG_SIZE], uint8_t *output);
+
+/**
+ * @brief AES-CMAC (RFC 4493).
+ */
+void keystore_cmac(const struct keystore_aes_key *key,
+                   const uint8_t *msg, size_t size,
+                   uint8_t mac[KEYSTORE_AES_TAG_SIZE]);
+
+/**
+ * @brief Constant time comparison.
+ *
+ * @return 0 if equal.
+ */
+int keystore_memcmp_ct(const void *a, const void *b, size_t size);
+
+/**
+ * @brief Clear memory in a way the compiler does not remove.
+ */
+void keystore_memzero(void *ptr, size_t size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* IAS_KEYSTORE_AES_H */
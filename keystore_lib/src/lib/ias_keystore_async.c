@@ -0,0 +1,345 @@
+/*
+   Copyright 2018 Intel Corporation
+
+   This software is licensed to you in accordance
+   with the agreement between you and Intel Corporation.
+
+   Alternatively, you can use this file in compliance
+   with the Apache license, Version 2.
+
+
+   Apache License, Version 2.0
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+   http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "ias_keystore.h"
+#include "ias_keystore_async.h"
+
+#define KEYSTORE_ASYNC_DEFAULT_WORKERS 4
+#define KEYSTORE_ASYNC_DEFAULT_DEPTH 64
+
+struct ias_keystore_async {
+  pthread_mutex_t lock;
+  pthread_cond_t work_cond;   /* signalled when a request is queued */
+  pthread_cond_t space_cond;  /* signalled when a request leaves the pool */
+
+  /* Submitted requests, waiting for a worker */
+  struct ias_keystore_async_req *pending_head;
+  struct ias_keystore_async_req *pending_tail;
+
+  /* Completed requests without a callback, waiting to be reaped */
+  struct ias_keystore_async_req *done_head;
+  struct ias_keystore_async_req *done_tail;
+
+  unsigned int in_flight;
+  unsigned int queue_depth;
+  int stopping;
+  int event_fd;
+
+  unsigned int workers;
+  pthread_t threads[];
+};
+
+/**
+ * @brief Helper function, executes a request with the blocking interface.
+ */
+static int keystore_async_execute(struct ias_keystore_async_req *req)
+{
+  switch (req->op)
+  {
+  case IAS_KEYSTORE_ASYNC_ENCRYPT:
+    return ias_keystore_encrypt(req->client_ticket, req->slot_id, req->algo_spec,
+                                req->iv, req->iv_size, req->input, req->input_size,
+                                req->output);
+  case IAS_KEYSTORE_ASYNC_DECRYPT:
+    return ias_keystore_decrypt(req->client_ticket, req->slot_id, req->algo_spec,
+                                req->iv, req->iv_size, req->input, req->input_size,
+                                req->output);
+  case IAS_KEYSTORE_ASYNC_GENERATE_KEY:
+    return ias_keystore_generate_key(req->client_ticket, req->key_spec, req->wrapped_key);
+  case IAS_KEYSTORE_ASYNC_WRAP_KEY:
+    return ias_keystore_wrap_key(req->client_ticket, req->input, req->input_size,
+                                 req->key_spec, req->wrapped_key);
+  case IAS_KEYSTORE_ASYNC_LOAD_KEY:
+    return ias_keystore_load_key(req->client_ticket, req->wrapped_key,
+                                 req->wrapped_key_size, &req->slot_id);
+  case IAS_KEYSTORE_ASYNC_UNLOAD_KEY:
+    return ias_keystore_unload_key(req->client_ticket, req->slot_id);
+  default:
+    return -EINVAL;
+  }
+}
+
+/**
+ * @brief Helper function, makes the completion eventfd readable.
+ */
+static void keystore_async_signal(struct ias_keystore_async *pool)
+{
+  uint64_t one = 1;
+  ssize_t res;
+
+  do
+  {
+    res = write(pool->event_fd, &one, sizeof(one));
+  } while (res < 0 && errno == EINTR);
+}
+
+/**
+ * @brief Helper function, clears the completion eventfd.
+ */
+static void keystore_async_clear(struct ias_keystore_async *pool)
+{
+  uint64_t count;
+  ssize_t res;
+
+  /* EAGAIN if the counter is already zero */
+  do
+  {
+    res = read(pool->event_fd, &count, sizeof(count));
+  } while (res < 0 && errno == EINTR);
+}
+
+/**
+ * @brief Helper function, hands a finished request back to the caller.
+ */
+static void keystore_async_complete(struct ias_keystore_async *pool,
+                                    struct ias_keystore_async_req *req)
+{
+  req->next = NULL;
+
+  if (req->callback)
+  {
+    /* The request may be reused or freed by the callback */
+    req->callback(req);
+
+    pthread_mutex_lock(&pool->lock);
+    pool->in_flight--;
+    pthread_cond_signal(&pool->space_cond);
+    pthread_mutex_unlock(&pool->lock);
+    return;
+  }
+
+  pthread_mutex_lock(&pool->lock);
+  if (pool->done_tail)
+  {
+    pool->done_tail->next = req;
+  }
+  else
+  {
+    pool->done_head = req;
+    /* The eventfd is readable exactly while the queue is non-empty */
+    keystore_async_signal(pool);
+  }
+  pool->done_tail = req;
+  pthread_mutex_unlock(&pool->lock);
+}
+
+static void *keystore_async_worker(void *arg)
+{
+  struct ias_keystore_async *pool = (struct ias_keystore_async *)arg;
+  struct ias_keystore_async_req *req;
+
+  for (;;)
+  {
+    pthread_mutex_lock(&pool->lock);
+    while (!pool->pending_head && !pool->stopping)
+      pthread_cond_wait(&pool->work_cond, &pool->lock);
+
+    req = pool->pending_head;
+    if (!req)
+    {
+      /* Stopping and nothing left to do */
+      pthread_mutex_unlock(&pool->lock);
+      break;
+    }
+
+    pool->pending_head = req->next;
+    if (!pool->pending_head)
+      pool->pending_tail = NULL;
+    pthread_mutex_unlock(&pool->lock);
+
+    req->result = keystore_async_execute(req);
+    keystore_async_complete(pool, req);
+  }
+
+  return NULL;
+}
+
+int ias_keystore_async_create(const struct ias_keystore_async_config *config,
+                              struct ias_keystore_async **pool)
+{
+  struct ias_keystore_async *p;
+  unsigned int workers = KEYSTORE_ASYNC_DEFAULT_WORKERS;
+  unsigned int depth = KEYSTORE_ASYNC_DEFAULT_DEPTH;
+  unsigned int i;
+  int res;
+
+  if (!pool)
+    return -EFAULT;
+
+  if (config && config->workers)
+    workers = config->workers;
+  if (config && config->queue_depth)
+    depth = config->queue_depth;
+
+  p = (struct ias_keystore_async *)calloc(1, sizeof(*p) + workers * sizeof(pthread_t));
+  if (!p)
+    return -ENOMEM;
+
+  p->queue_depth = depth;
+  p->workers = 0;
+
+  p->event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (p->event_fd < 0)
+  {
+    res = -errno;
+    free(p);
+    return res;
+  }
+
+  pthread_mutex_init(&p->lock, NULL);
+  pthread_cond_init(&p->work_cond, NULL);
+  pthread_cond_init(&p->space_cond, NULL);
+
+  for (i = 0; i < workers; i++)
+  {
+    res = pthread_create(&p->threads[i], NULL, keystore_async_worker, p);
+    if (res)
+    {
+      ias_keystore_async_destroy(p);
+      return -res;
+    }
+    p->workers++;
+  }
+
+  *pool = p;
+  return 0;
+}
+
+void ias_keystore_async_destroy(struct ias_keystore_async *pool)
+{
+  unsigned int i;
+
+  if (!pool)
+    return;
+
+  pthread_mutex_lock(&pool->lock);
+  pool->stopping = 1;
+  pthread_cond_broadcast(&pool->work_cond);
+  pthread_mutex_unlock(&pool->lock);
+
+  for (i = 0; i < pool->workers; i++)
+    pthread_join(pool->threads[i], NULL);
+
+  close(pool->event_fd);
+  pthread_cond_destroy(&pool->space_cond);
+  pthread_cond_destroy(&pool->work_cond);
+  pthread_mutex_destroy(&pool->lock);
+  free(pool);
+}
+
+int ias_keystore_async_submit(struct ias_keystore_async *pool,
+                              struct ias_keystore_async_req *req, int flags)
+{
+  if (!pool || !req)
+    return -EFAULT;
+
+  pthread_mutex_lock(&pool->lock);
+
+  while (pool->in_flight >= pool->queue_depth && !pool->stopping)
+  {
+    if (flags & IAS_KEYSTORE_ASYNC_NONBLOCK)
+    {
+      pthread_mutex_unlock(&pool->lock);
+      return -EAGAIN;
+    }
+    pthread_cond_wait(&pool->space_cond, &pool->lock);
+  }
+
+  if (pool->stopping)
+  {
+    pthread_mutex_unlock(&pool->lock);
+    return -ESHUTDOWN;
+  }
+
+  req->result = -EINPROGRESS;
+  req->next = NULL;
+  if (pool->pending_tail)
+    pool->pending_tail->next = req;
+  else
+    pool->pending_head = req;
+  pool->pending_tail = req;
+  pool->in_flight++;
+
+  pthread_cond_signal(&pool->work_cond);
+  pthread_mutex_unlock(&pool->lock);
+
+  return 0;
+}
+
+int ias_keystore_async_eventfd(const struct ias_keystore_async *pool)
+{
+  if (!pool)
+    return -EFAULT;
+
+  return pool->event_fd;
+}
+
+int ias_keystore_async_reap(struct ias_keystore_async *pool,
+                            struct ias_keystore_async_req **reqs, size_t max)
+{
+  struct ias_keystore_async_req *req;
+  size_t n = 0;
+
+  if (!pool || (!reqs && max))
+    return -EFAULT;
+
+  if (max > INT32_MAX)
+    max = INT32_MAX;
+
+  pthread_mutex_lock(&pool->lock);
+
+  while (n < max && pool->done_head)
+  {
+    req = pool->done_head;
+    pool->done_head = req->next;
+    req->next = NULL;
+    reqs[n++] = req;
+  }
+
+  if (!pool->done_head)
+  {
+    pool->done_tail = NULL;
+    keystore_async_clear(pool);
+  }
+
+  if (n)
+  {
+    pool->in_flight -= (unsigned int)n;
+    pthread_cond_broadcast(&pool->space_cond);
+  }
+
+  pthread_mutex_unlock(&pool->lock);
+
+  return (int)n;
+}
+
+/* end of file */
@@ -0,0 +1,1580 @@
+/*
+   Copyright 2018 Intel Corporation
+
+   This software is licensed to you in accordance
+   with the agreement between you and Intel Corporation.
+
+   Alternatively, you can use this file in compliance
+   with the Apache license, Version 2.
+
+
+   Apache License, Version 2.0
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+   http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "keystore_api_user.h"
+
+#include "ias_keystore.h"
+#include "ias_keystore_broker.h"
+#include "ias_keystore_broker_proto.h"
+#include "ias_keystore_priv.h"
+
+#define KEYSTORE_BROKER_CLIENTS_DEFAULT 4096
+#define KEYSTORE_BROKER_USER_CLIENTS_DEFAULT 256
+#define KEYSTORE_BROKER_MODE_DEFAULT 0660
+#define KEYSTORE_BROKER_SLOTS_MAX 256
+#define KEYSTORE_BROKER_DEVICE_SLOTS 256
+#define KEYSTORE_BROKER_BUCKETS 1024
+#define KEYSTORE_BROKER_KEY_SPECS 3
+#define KEYSTORE_BROKER_READ_SIZE 65536
+#define KEYSTORE_BROKER_SIZE_CACHE 64
+
+/**
+ * @brief A client registration on the device.
+ */
+struct keystore_broker_session {
+  enum keystore_seed_type seed_type;
+  uint8_t ticket[KEYSTORE_CLIENT_TICKET_SIZE];
+  unsigned int slots_used;
+};
+
+/**
+ * @brief A slot of a broker client: device session and slot.
+ */
+struct keystore_broker_slot {
+  int session;
+  uint32_t slot_id;
+};
+
+/**
+ * @brief A client registered with the broker.
+ */
+struct keystore_broker_client {
+  struct keystore_broker_client *next;
+  uint8_t ticket[KEYSTORE_CLIENT_TICKET_SIZE];
+  enum keystore_seed_type seed_type;
+  uid_t uid;
+  struct keystore_broker_slot slots[KEYSTORE_BROKER_SLOTS_MAX];
+};
+
+/**
+ * @brief The number of clients registered by a user.
+ */
+struct keystore_broker_user {
+  uid_t uid;
+  unsigned int clients;
+};
+
+/**
+ * @brief A cached encrypt or decrypt output size.
+ */
+struct keystore_broker_size {
+  uint32_t cmd;
+  uint32_t algospec;
+  uint32_t input_size;
+  uint32_t output_size;
+};
+
+/**
+ * @brief A client connection with its receive and send buffers.
+ * @param rx_fd  Descriptor received with the pending attach request, -1 if none.
+ * @param shm    The attached payload ring, NULL if none.
+ * @param dead   Failed; closed at the end of the current poll round.
+ */
+struct keystore_broker_conn {
+  int fd;
+  int dead;
+  uid_t uid;
+  int rx_fd;
+  uint8_t *shm;
+  size_t shm_size;
+  uint8_t *in;
+  size_t in_size;
+  size_t in_cap;
+  uint8_t *out;
+  size_t out_size;
+  size_t out_pos;
+  size_t out_cap;
+};
+
+/**
+ * @brief One operation of a request being served.
+ * @param op          The request record.
+ * @param iv          IV bytes in the receive buffer.
+ * @param input       Input bytes in the receive buffer or the payload ring.
+ * @param res         The reply record.
+ * @param output      Output buffer.
+ * @param output_cap  Size of @output.
+ * @param output_shm  @output is in the payload ring.
+ * @param session     Device session of a pending encrypt/decrypt, -1 if none.
+ * @param slot_id     Device slot of a pending encrypt/decrypt.
+ */
+struct keystore_broker_jop {
+  struct keystore_broker_op op;
+  const uint8_t *iv;
+  const uint8_t *input;
+  struct keystore_broker_res res;
+  uint8_t *output;
+  uint32_t output_cap;
+  int output_shm;
+  int session;
+  uint32_t slot_id;
+};
+
+/**
+ * @brief A request being served.
+ */
+struct keystore_broker_job {
+  struct keystore_broker_conn *conn;
+  struct keystore_broker_hdr hdr;
+  size_t frame_size;
+  struct keystore_broker_jop *ops;
+  uint8_t *arena;
+};
+
+struct ias_keystore_broker {
+  int dev_fd;
+  int listen_fd;
+  int stop_fd;
+  struct sockaddr_un addr;
+  unsigned int max_clients;
+  unsigned int max_user_clients;
+  unsigned int client_count;
+  struct keystore_broker_client *buckets[KEYSTORE_BROKER_BUCKETS];
+  struct keystore_broker_user *users;
+  unsigned int user_count;
+  unsigned int user_cap;
+  struct keystore_broker_session *sessions;
+  unsigned int session_count;
+  unsigned int session_cap;
+  struct keystore_broker_conn **conns;
+  unsigned int conn_count;
+  unsigned int conn_cap;
+  uint32_t wrapped_sizes[KEYSTORE_BROKER_KEY_SPECS];
+  struct keystore_broker_size sizes[KEYSTORE_BROKER_SIZE_CACHE];
+  int batch_supported;
+};
+
+/**
+ * @brief Helper function, grows an array to hold at least @count elements.
+ */
+static int keystore_broker_grow(void **array, unsigned int *cap, unsigned int count, size_t size)
+{
+  unsigned int new_cap;
+  void *ptr;
+
+  if (count <= *cap)
+    return 0;
+
+  new_cap = *cap ? *cap * 2 : 16;
+  while (new_cap < count)
+    new_cap *= 2;
+
+  ptr = realloc(*array, (size_t)new_cap * size);
+  if (!ptr)
+    return -ENOMEM;
+
+  *array = ptr;
+  *cap = new_cap;
+  return 0;
+}
+
+static unsigned int keystore_broker_bucket(const uint8_t *ticket)
+{
+  uint32_t hash;
+
+  /* Tickets are random */
+  memcpy(&hash, ticket, sizeof(hash));
+  return hash % KEYSTORE_BROKER_BUCKETS;
+}
+
+static struct keystore_broker_client *keystore_broker_find(struct ias_keystore_broker *broker,
+                                                           const uint8_t *ticket)
+{
+  struct keystore_broker_client *client;
+
+  for (client = broker->buckets[keystore_broker_bucket(ticket)]; client; client = client->next)
+  {
+    if (!memcmp(client->ticket, ticket, sizeof(client->ticket)))
+      return client;
+  }
+
+  return NULL;
+}
+
+/**
+ * @brief Helper function, looks up a client registered by the user of a connection.
+ */
+static struct keystore_broker_client *keystore_broker_client(struct ias_keystore_broker *broker,
+                                                             const struct keystore_broker_conn *conn,
+                                                             const uint8_t *ticket)
+{
+  struct keystore_broker_client *client = keystore_broker_find(broker, ticket);
+
+  return client && client->uid == conn->uid ? client : NULL;
+}
+
+/**
+ * @brief Helper function, looks up the client count of a user.
+ *
+ * @return The entry, NULL if the user has no clients.
+ */
+static struct keystore_broker_user *keystore_broker_user(struct ias_keystore_broker *broker, uid_t uid)
+{
+  unsigned int i;
+
+  for (i = 0; i < broker->user_count; i++)
+  {
+    if (broker->users[i].uid == uid)
+      return &broker->users[i];
+  }
+
+  return NULL;
+}
+
+/**
+ * @brief Helper function, returns a device session with a free slot.
+ *
+ * Registers a new session if all sessions of the SEED type are full.
+ *
+ * @return Session index or negative error code.
+ */
+static int keystore_broker_session(struct ias_keystore_broker *broker, enum keystore_seed_type seed_type)
+{
+  struct ias_keystore_register request;
+  struct keystore_broker_session *session;
+  unsigned int i;
+  int res;
+
+  for (i = 0; i < broker->session_count; i++)
+  {
+    session = &broker->sessions[i];
+    if (session->seed_type == seed_type && session->slots_used < KEYSTORE_BROKER_DEVICE_SLOTS)
+      return (int)i;
+  }
+
+  res = keystore_broker_grow((void **)&broker->sessions, &broker->session_cap,
+                             broker->session_count + 1, sizeof(*broker->sessions));
+  if (res)
+    return res;
+
+  memset(&request, 0, sizeof(request));
+  request.seed_type = seed_type;
+  res = keystore_dev_ioctl(broker->dev_fd, KEYSTORE_IOC_REGISTER, &request);
+  if (res < 0)
+    return res;
+
+  session = &broker->sessions[broker->session_count];
+  session->seed_type = seed_type;
+  memcpy(session->ticket, request.client_ticket, sizeof(session->ticket));
+  session->slots_used = 0;
+
+  return (int)broker->session_count++;
+}
+
+static int keystore_broker_unload(struct ias_keystore_broker *broker, struct keystore_broker_slot *slot)
+{
+  struct ias_keystore_unload_key request;
+  struct keystore_broker_session *session = &broker->sessions[slot->session];
+  int res;
+
+  memcpy(request.client_ticket, session->ticket, sizeof(request.client_ticket));
+  request.slot_id = slot->slot_id;
+  res = keystore_dev_ioctl(broker->dev_fd, KEYSTORE_IOC_UNLOAD_KEY, &request);
+
+  session->slots_used--;
+  slot->session = -1;
+  return res;
+}
+
+static int keystore_broker_register(struct ias_keystore_broker *broker,
+                                    const struct keystore_broker_conn *conn,
+                                    struct keystore_broker_jop *jop)
+{
+  struct keystore_broker_client *client;
+  struct keystore_broker_user *user;
+  unsigned int i, bucket;
+  ssize_t res;
+
+  if (jop->op.spec != SEED_TYPE_DEVICE && jop->op.spec != SEED_TYPE_USER)
+    return -EINVAL;
+
+  if (broker->client_count >= broker->max_clients)
+    return -ENOSPC;
+
+  /* Registrations outlive connections, so a user cannot take all of them */
+  user = keystore_broker_user(broker, conn->uid);
+  if (user && user->clients >= broker->max_user_clients)
+    return -EDQUOT;
+
+  if (!user)
+  {
+    res = keystore_broker_grow((void **)&broker->users, &broker->user_cap,
+                               broker->user_count + 1, sizeof(*broker->users));
+    if (res)
+      return (int)res;
+  }
+
+  client = (struct keystore_broker_client *)calloc(1, sizeof(*client));
+  if (!client)
+    return -ENOMEM;
+
+  do
+  {
+    res = getrandom(client->ticket, sizeof(client->ticket), 0);
+    if (res != (ssize_t)sizeof(client->ticket))
+    {
+      free(client);
+      return res < 0 ? -errno : -EIO;
+    }
+  } while (keystore_broker_find(broker, client->ticket));
+
+  client->seed_type = (enum keystore_seed_type)jop->op.spec;
+  client->uid = conn->uid;
+  for (i = 0; i < KEYSTORE_BROKER_SLOTS_MAX; i++)
+    client->slots[i].session = -1;
+
+  bucket = keystore_broker_bucket(client->ticket);
+  client->next = broker->buckets[bucket];
+  broker->buckets[bucket] = client;
+  broker->client_count++;
+
+  if (!user)
+  {
+    user = &broker->users[broker->user_count++];
+    user->uid = conn->uid;
+    user->clients = 0;
+  }
+  user->clients++;
+
+  memcpy(jop->res.client_ticket, client->ticket, sizeof(client->ticket));
+  return 0;
+}
+
+static int keystore_broker_unregister(struct ias_keystore_broker *broker,
+                                      const struct keystore_broker_conn *conn,
+                                      struct keystore_broker_jop *jop)
+{
+  struct keystore_broker_client *client, **link;
+  struct keystore_broker_user *user;
+  unsigned int i;
+
+  client = keystore_broker_client(broker, conn, jop->op.client_ticket);
+  if (!client)
+    return -EINVAL;
+
+  for (i = 0; i < KEYSTORE_BROKER_SLOTS_MAX; i++)
+  {
+    if (client->slots[i].session >= 0)
+      keystore_broker_unload(broker, &client->slots[i]);
+  }
+
+  for (link = &broker->buckets[keystore_broker_bucket(client->ticket)]; *link != client;
+       link = &(*link)->next)
+    ;
+  *link = client->next;
+  broker->client_count--;
+  free(client);
+
+  user = keystore_broker_user(broker, conn->uid);
+  if (!--user->clients)
+    *user = broker->users[--broker->user_count];
+
+  return 0;
+}
+
+/**
+ * @brief Helper function, returns the wrapped key size of a key spec.
+ */
+static int keystore_broker_wrapped_size(struct ias_keystore_broker *broker, uint32_t key_spec,
+                                        uint32_t *size)
+{
+  struct ias_keystore_wrapped_key_size request;
+  unsigned int index;
+  int res;
+
+  switch (key_spec)
+  {
+  case KEYSPEC_LENGTH_128: index = 0; break;
+  case KEYSPEC_LENGTH_256: index = 1; break;
+  case KEYSPEC_LENGTH_ECC_PAIR: index = 2; break;
+  default: return -EINVAL;
+  }
+
+  if (!broker->wrapped_sizes[index])
+  {
+    memset(&request, 0, sizeof(request));
+    request.key_spec = key_spec;
+    res = keystore_dev_ioctl(broker->dev_fd, KEYSTORE_IOC_WRAPPED_KEYSIZE, &request);
+    if (res < 0)
+      return res;
+    broker->wrapped_sizes[index] = request.key_size;
+  }
+
+  *size = broker->wrapped_sizes[index];
+  return 0;
+}
+
+static int keystore_broker_wrap(struct ias_keystore_broker *broker,
+                                const struct keystore_broker_conn *conn,
+                                unsigned int cmd, struct keystore_broker_jop *jop)
+{
+  struct ias_keystore_generate_key generate;
+  struct ias_keystore_wrap_key wrap;
+  struct keystore_broker_client *client;
+  int session, res;
+
+  client = keystore_broker_client(broker, conn, jop->op.client_ticket);
+  if (!client)
+    return -EINVAL;
+
+  if (jop->output_cap == 0)
+    return -EINVAL;
+
+  /* Wrapping needs no slot, but any session of the SEED type will do */
+  session = keystore_broker_session(broker, client->seed_type);
+  if (session < 0)
+    return session;
+
+  if (cmd == KEYSTORE_IOC_GENERATE_KEY)
+  {
+    memcpy(generate.client_ticket, broker->sessions[session].ticket, sizeof(generate.client_ticket));
+    generate.key_spec = jop->op.spec;
+    generate.wrapped_key = jop->output;
+    res = keystore_dev_ioctl(broker->dev_fd, cmd, &generate);
+  }
+  else
+  {
+    memcpy(wrap.client_ticket, broker->sessions[session].ticket, sizeof(wrap.client_ticket));
+    wrap.key_spec = jop->op.spec;
+    wrap.app_key = jop->input;
+    wrap.app_key_size = jop->op.input_size;
+    wrap.wrapped_key = jop->output;
+    res = keystore_dev_ioctl(broker->dev_fd, cmd, &wrap);
+  }
+
+  if (res >= 0)
+    jop->res.output_size = jop->output_cap;
+
+  return res;
+}
+
+static int keystore_broker_load(struct ias_keystore_broker *broker,
+                                const struct keystore_broker_conn *conn,
+                                struct keystore_broker_jop *jop)
+{
+  struct ias_keystore_load_key request;
+  struct keystore_broker_client *client;
+  unsigned int index;
+  int session, res;
+
+  client = keystore_broker_client(broker, conn, jop->op.client_ticket);
+  if (!client)
+    return -EINVAL;
+
+  for (index = 0; index < KEYSTORE_BROKER_SLOTS_MAX && client->slots[index].session >= 0; index++)
+    ;
+  if (index == KEYSTORE_BROKER_SLOTS_MAX)
+    return -ENOSPC;
+
+  session = keystore_broker_session(broker, client->seed_type);
+  if (session < 0)
+    return session;
+
+  /* The device may rewrap the key in place, so work on the output copy */
+  memcpy(jop->output, jop->input, jop->op.input_size);
+
+  memcpy(request.client_ticket, broker->sessions[session].ticket, sizeof(request.client_ticket));
+  request.wrapped_key = jop->output;
+  request.wrapped_key_size = jop->op.input_size;
+  request.slot_id = 0;
+  res = keystore_dev_ioctl(broker->dev_fd, KEYSTORE_IOC_LOAD_KEY, &request);
+
+  if (res == -EAGAIN)
+  {
+    jop->res.output_size = jop->op.input_size;
+  }
+  else if (res >= 0)
+  {
+    client->slots[index].session = session;
+    client->slots[index].slot_id = request.slot_id;
+    broker->sessions[session].slots_used++;
+    jop->res.value[0] = index;
+  }
+
+  return res;
+}
+
+static int keystore_broker_unload_key(struct ias_keystore_broker *broker,
+                                      const struct keystore_broker_conn *conn,
+                                      struct keystore_broker_jop *jop)
+{
+  struct keystore_broker_client *client;
+
+  client = keystore_broker_client(broker, conn, jop->op.client_ticket);
+  if (!client || jop->op.slot_id >= KEYSTORE_BROKER_SLOTS_MAX ||
+      client->slots[jop->op.slot_id].session < 0)
+    return -EINVAL;
+
+  return keystore_broker_unload(broker, &client->slots[jop->op.slot_id]);
+}
+
+/**
+ * @brief Helper function, returns the output size of an encrypt or decrypt call.
+ *
+ * Sizes only depend on the device, so they are cached to save a device
+ * call per operation.
+ */
+static int keystore_broker_crypt_size(struct ias_keystore_broker *broker, unsigned int cmd,
+                                      uint32_t algospec, uint32_t input_size, uint32_t *output_size)
+{
+  struct ias_keystore_crypto_size request;
+  struct keystore_broker_size *entry;
+  int res;
+
+  entry = &broker->sizes[(input_size ^ (algospec << 4) ^ cmd) % KEYSTORE_BROKER_SIZE_CACHE];
+  if (entry->cmd == cmd && entry->algospec == algospec && entry->input_size == input_size)
+  {
+    *output_size = entry->output_size;
+    return 0;
+  }
+
+  request.algospec = algospec;
+  request.input_size = input_size;
+  request.output_size = 0;
+  res = keystore_dev_ioctl(broker->dev_fd, cmd, &request);
+  if (res < 0)
+    return res;
+
+  entry->cmd = cmd;
+  entry->algospec = algospec;
+  entry->input_size = input_size;
+  entry->output_size = request.output_size;
+
+  *output_size = request.output_size;
+  return 0;
+}
+
+/**
+ * @brief Helper function, output capacity needed by an operation.
+ */
+static int keystore_broker_output_cap(struct ias_keystore_broker *broker, unsigned int cmd,
+                                      const struct keystore_broker_op *op, uint32_t *cap)
+{
+  *cap = 0;
+
+  switch (cmd)
+  {
+  case KEYSTORE_IOC_GENERATE_KEY:
+  case KEYSTORE_IOC_WRAP_KEY:
+    return keystore_broker_wrapped_size(broker, op->spec, cap);
+  case KEYSTORE_IOC_LOAD_KEY:
+    *cap = op->input_size;
+    return 0;
+  case KEYSTORE_IOC_ENCRYPT:
+  case KEYSTORE_LIB_IOC_ENCRYPT_BATCH:
+    return keystore_broker_crypt_size(broker, KEYSTORE_IOC_ENCRYPT_SIZE, op->spec,
+                                      op->input_size, cap);
+  case KEYSTORE_IOC_DECRYPT:
+  case KEYSTORE_LIB_IOC_DECRYPT_BATCH:
+    return keystore_broker_crypt_size(broker, KEYSTORE_IOC_DECRYPT_SIZE, op->spec,
+                                      op->input_size, cap);
+  default:
+    return 0;
+  }
+}
+
+/**
+ * @brief Helper function, maps an encrypt or decrypt operation to its device slot.
+ *
+ * The operation is executed later, together with the other pending ones.
+ */
+static int keystore_broker_crypt(struct ias_keystore_broker *broker,
+                                 const struct keystore_broker_conn *conn,
+                                 struct keystore_broker_jop *jop)
+{
+  const struct keystore_broker_client *client;
+  const struct keystore_broker_slot *slot;
+
+  client = keystore_broker_client(broker, conn, jop->op.client_ticket);
+  if (!client || jop->op.slot_id >= KEYSTORE_BROKER_SLOTS_MAX)
+    return -EINVAL;
+
+  slot = &client->slots[jop->op.slot_id];
+  if (slot->session < 0)
+    return -EINVAL;
+
+  jop->session = slot->session;
+  jop->slot_id = slot->slot_id;
+  return 0;
+}
+
+/**
+ * @brief Helper function, serves one operation, except encrypt/decrypt.
+ */
+static int keystore_broker_op(struct ias_keystore_broker *broker, const struct keystore_broker_conn *conn,
+                              unsigned int cmd, struct keystore_broker_jop *jop)
+{
+  const struct keystore_broker_op *op = &jop->op;
+  int res;
+
+  switch (cmd)
+  {
+  case KEYSTORE_IOC_VERSION:
+  {
+    struct ias_keystore_version request;
+
+    memset(&request, 0, sizeof(request));
+    res = keystore_dev_ioctl(broker->dev_fd, cmd, &request);
+    jop->res.value[0] = request.major;
+    jop->res.value[1] = request.minor;
+    jop->res.value[2] = request.patch;
+    return res;
+  }
+  case KEYSTORE_IOC_REGISTER:
+    return keystore_broker_register(broker, conn, jop);
+  case KEYSTORE_IOC_UNREGISTER:
+    return keystore_broker_unregister(broker, conn, jop);
+  case KEYSTORE_IOC_WRAPPED_KEYSIZE:
+  {
+    struct ias_keystore_wrapped_key_size request;
+
+    memset(&request, 0, sizeof(request));
+    request.key_spec = op->spec;
+    res = keystore_dev_ioctl(broker->dev_fd, cmd, &request);
+    jop->res.value[0] = request.key_size;
+    jop->res.value[1] = request.unwrapped_key_size;
+    return res;
+  }
+  case KEYSTORE_IOC_GENERATE_KEY:
+  case KEYSTORE_IOC_WRAP_KEY:
+    return keystore_broker_wrap(broker, conn, cmd, jop);
+  case KEYSTORE_IOC_LOAD_KEY:
+    return keystore_broker_load(broker, conn, jop);
+  case KEYSTORE_IOC_UNLOAD_KEY:
+    return keystore_broker_unload_key(broker, conn, jop);
+  case KEYSTORE_IOC_ENCRYPT_SIZE:
+  case KEYSTORE_IOC_DECRYPT_SIZE:
+    return keystore_broker_crypt_size(broker, cmd, op->spec, op->value, &jop->res.value[0]);
+  case KEYSTORE_IOC_ENCRYPT:
+  case KEYSTORE_IOC_DECRYPT:
+  case KEYSTORE_LIB_IOC_ENCRYPT_BATCH:
+  case KEYSTORE_LIB_IOC_DECRYPT_BATCH:
+    return keystore_broker_crypt(broker, conn, jop);
+  default:
+    return -ENOTTY;
+  }
+}
+
+static int keystore_broker_is_crypt(unsigned int cmd)
+{
+  return cmd == KEYSTORE_IOC_ENCRYPT || cmd == KEYSTORE_IOC_DECRYPT ||
+         cmd == KEYSTORE_LIB_IOC_ENCRYPT_BATCH || cmd == KEYSTORE_LIB_IOC_DECRYPT_BATCH;
+}
+
+static int keystore_broker_is_encrypt(unsigned int cmd)
+{
+  return cmd == KEYSTORE_IOC_ENCRYPT || cmd == KEYSTORE_LIB_IOC_ENCRYPT_BATCH;
+}
+
+/**
+ * @brief Helper function, parses a request frame into a job.
+ *
+ * @return 0 if OK, negative error code if the frame is malformed.
+ */
+static int keystore_broker_parse(struct keystore_broker_job *job)
+{
+  const uint8_t *pos = job->conn->in + sizeof(job->hdr);
+  const uint8_t *end = pos + job->hdr.size;
+  const struct keystore_broker_conn *conn = job->conn;
+  int batch = job->hdr.cmd == KEYSTORE_LIB_IOC_ENCRYPT_BATCH || job->hdr.cmd == KEYSTORE_LIB_IOC_DECRYPT_BATCH;
+  int shm = (job->hdr.flags & KEYSTORE_BROKER_FLAG_SHM) != 0;
+  uint32_t i;
+
+  if (job->hdr.count > KEYSTORE_BROKER_OPS_MAX || (!batch && job->hdr.count != 1))
+    return -EPROTO;
+
+  if (shm && (!conn->shm || !keystore_broker_is_crypt(job->hdr.cmd)))
+    return -EPROTO;
+
+  job->ops = (struct keystore_broker_jop *)calloc(job->hdr.count ? job->hdr.count : 1,
+                                                  sizeof(*job->ops));
+  if (!job->ops)
+    return -ENOMEM;
+
+  for (i = 0; i < job->hdr.count; i++)
+  {
+    struct keystore_broker_jop *jop = &job->ops[i];
+
+    if ((size_t)(end - pos) < sizeof(jop->op))
+      return -EPROTO;
+    /* Records are not aligned, and ring offsets must not change once checked */
+    memcpy(&jop->op, pos, sizeof(jop->op));
+    pos += sizeof(jop->op);
+
+    if ((size_t)(end - pos) < jop->op.iv_size)
+      return -EPROTO;
+    jop->iv = jop->op.iv_size ? pos : NULL;
+    pos += jop->op.iv_size;
+
+    if (shm)
+    {
+      if ((uint64_t)jop->op.input_offset + jop->op.input_size > conn->shm_size ||
+          (uint64_t)jop->op.output_offset + jop->op.output_max > conn->shm_size)
+        return -EPROTO;
+      jop->input = jop->op.input_size ? conn->shm + jop->op.input_offset : NULL;
+    }
+    else
+    {
+      if ((size_t)(end - pos) < jop->op.input_size)
+        return -EPROTO;
+      jop->input = jop->op.input_size ? pos : NULL;
+      pos += jop->op.input_size;
+    }
+
+    jop->session = -1;
+  }
+
+  return pos == end ? 0 : -EPROTO;
+}
+
+/**
+ * @brief Helper function, serves a job except for pending encrypt/decrypt operations.
+ */
+static void keystore_broker_serve(struct ias_keystore_broker *broker, struct keystore_broker_job *job)
+{
+  uint64_t total = 0;
+  uint8_t *pos;
+  uint32_t i;
+  int res;
+
+  for (i = 0; i < job->hdr.count; i++)
+  {
+    struct keystore_broker_jop *jop = &job->ops[i];
+
+    jop->res.status = keystore_broker_output_cap(broker, job->hdr.cmd, &jop->op, &jop->output_cap);
+
+    /* Write to the ring if the client reserved enough, else inline */
+    if ((job->hdr.flags & KEYSTORE_BROKER_FLAG_SHM) && jop->output_cap <= jop->op.output_max)
+      jop->output_shm = 1;
+    else
+      total += jop->output_cap;
+  }
+
+  job->hdr.result = 0;
+  if (total > KEYSTORE_BROKER_MSG_MAX)
+    job->hdr.result = -EINVAL;
+  else if (!(job->arena = (uint8_t *)malloc(total ? (size_t)total : 1)))
+    job->hdr.result = -ENOMEM;
+
+  if (job->hdr.result)
+  {
+    for (i = 0; i < job->hdr.count; i++)
+    {
+      job->ops[i].res.status = job->hdr.result;
+      job->ops[i].output_cap = 0;
+      job->ops[i].output_shm = 0;
+    }
+    return;
+  }
+
+  pos = job->arena;
+  for (i = 0; i < job->hdr.count; i++)
+  {
+    struct keystore_broker_jop *jop = &job->ops[i];
+
+    if (jop->output_shm)
+    {
+      jop->output = job->conn->shm + jop->op.output_offset;
+    }
+    else
+    {
+      jop->output = pos;
+      pos += jop->output_cap;
+    }
+
+    if (jop->res.status)
+      continue;
+
+    res = keystore_broker_op(broker, job->conn, job->hdr.cmd, jop);
+    jop->res.status = res < 0 ? res : 0;
+  }
+}
+
+/**
+ * @brief Helper function, executes a group of pending encrypt/decrypt operations.
+ */
+static void keystore_broker_dispatch(struct ias_keystore_broker *broker, int encrypt,
+                                     const struct keystore_broker_session *session,
+                                     struct keystore_broker_jop **jops, uint32_t count)
+{
+  struct ias_keystore_crypto_batch batch;
+  struct ias_keystore_crypto_batch_entry *entries = NULL;
+  struct ias_keystore_encrypt_decrypt request;
+  uint32_t i;
+  int res = -ENOTTY;
+
+  if (count > 1 && broker->batch_supported)
+    entries = (struct ias_keystore_crypto_batch_entry *)calloc(count, sizeof(*entries));
+
+  if (entries)
+  {
+    memcpy(batch.client_ticket, session->ticket, sizeof(batch.client_ticket));
+    batch.count = count;
+    batch.entries = entries;
+    for (i = 0; i < count; i++)
+    {
+      entries[i].slot_id = jops[i]->slot_id;
+      entries[i].algospec = jops[i]->op.spec;
+      entries[i].iv = jops[i]->iv;
+      entries[i].iv_size = jops[i]->op.iv_size;
+      entries[i].input = jops[i]->input;
+      entries[i].input_size = jops[i]->op.input_size;
+      entries[i].output = jops[i]->output;
+    }
+
+    res = keystore_dev_ioctl(broker->dev_fd,
+                             encrypt ? KEYSTORE_LIB_IOC_ENCRYPT_BATCH : KEYSTORE_LIB_IOC_DECRYPT_BATCH,
+                             &batch);
+    if (res == -ENOTTY)
+    {
+      broker->batch_supported = 0;
+    }
+    else
+    {
+      broker->batch_supported = 1;
+      for (i = 0; i < count; i++)
+        jops[i]->res.status = res < 0 ? res : entries[i].status;
+    }
+    free(entries);
+  }
+
+  if (res != -ENOTTY)
+    return;
+
+  for (i = 0; i < count; i++)
+  {
+    memcpy(request.client_ticket, session->ticket, sizeof(request.client_ticket));
+    request.slot_id = jops[i]->slot_id;
+    request.algospec = jops[i]->op.spec;
+    request.iv = jops[i]->iv;
+    request.iv_size = jops[i]->op.iv_size;
+    request.input = jops[i]->input;
+    request.input_size = jops[i]->op.input_size;
+    request.output = jops[i]->output;
+
+    res = keystore_dev_ioctl(broker->dev_fd,
+                             encrypt ? KEYSTORE_IOC_ENCRYPT : KEYSTORE_IOC_DECRYPT, &request);
+    jops[i]->res.status = res < 0 ? res : 0;
+  }
+}
+
+/**
+ * @brief Helper function, executes the pending encrypt/decrypt operations of all jobs.
+ *
+ * Operations on the same device session are coalesced into one batch call.
+ */
+static void keystore_broker_flush(struct ias_keystore_broker *broker,
+                                  struct keystore_broker_job *jobs, unsigned int job_count)
+{
+  struct keystore_broker_jop **group = NULL;
+  unsigned int session, j, total = 0, count;
+  uint32_t i;
+  int encrypt;
+
+  for (j = 0; j < job_count; j++)
+  {
+    if (keystore_broker_is_crypt(jobs[j].hdr.cmd))
+      total += jobs[j].hdr.count;
+  }
+  if (!total)
+    return;
+
+  group = (struct keystore_broker_jop **)malloc(total * sizeof(*group));
+
+  for (session = 0; session < broker->session_count; session++)
+  {
+    for (encrypt = 0; encrypt < 2; encrypt++)
+    {
+      count = 0;
+      for (j = 0; j < job_count; j++)
+      {
+        if (!keystore_broker_is_crypt(jobs[j].hdr.cmd) ||
+            keystore_broker_is_encrypt(jobs[j].hdr.cmd) != encrypt)
+          continue;
+
+        for (i = 0; i < jobs[j].hdr.count; i++)
+        {
+          struct keystore_broker_jop *jop = &jobs[j].ops[i];
+
+          if (jop->res.status || jop->session != (int)session)
+            continue;
+
+          if (group)
+          {
+            group[count++] = jop;
+          }
+          else
+          {
+            /* Out of memory: one call at a time */
+            keystore_broker_dispatch(broker, encrypt, &broker->sessions[session], &jop, 1);
+          }
+        }
+      }
+
+      if (count)
+        keystore_broker_dispatch(broker, encrypt, &broker->sessions[session], group, count);
+    }
+  }
+
+  for (j = 0; j < job_count; j++)
+  {
+    if (!keystore_broker_is_crypt(jobs[j].hdr.cmd))
+      continue;
+
+    for (i = 0; i < jobs[j].hdr.count; i++)
+    {
+      struct keystore_broker_jop *jop = &jobs[j].ops[i];
+
+      if (!jop->res.status)
+        jop->res.output_size = jop->output_cap;
+    }
+  }
+
+  free(group);
+}
+
+/**
+ * @brief Helper function, appends to the send buffer of a connection.
+ */
+static int keystore_broker_append(struct keystore_broker_conn *conn, const void *data, size_t size)
+{
+  size_t cap;
+  uint8_t *ptr;
+
+  if (conn->out_size + size > conn->out_cap)
+  {
+    cap = conn->out_cap ? conn->out_cap : 4096;
+    while (cap < conn->out_size + size)
+      cap *= 2;
+    ptr = (uint8_t *)realloc(conn->out, cap);
+    if (!ptr)
+      return -ENOMEM;
+    conn->out = ptr;
+    conn->out_cap = cap;
+  }
+
+  memcpy(conn->out + conn->out_size, data, size);
+  conn->out_size += size;
+  return 0;
+}
+
+/**
+ * @brief Helper function, queues the reply of a job.
+ */
+static int keystore_broker_reply(struct keystore_broker_job *job)
+{
+  struct keystore_broker_hdr hdr = job->hdr;
+  uint64_t size = 0;
+  uint32_t i;
+  int res;
+
+  for (i = 0; i < hdr.count; i++)
+  {
+    if (job->ops[i].output_shm)
+      job->ops[i].res.flags |= KEYSTORE_BROKER_RES_SHM;
+    else
+      size += job->ops[i].res.output_size;
+    size += sizeof(job->ops[i].res);
+  }
+
+  /* Single calls return the operation status, batch entries carry their own */
+  if (!hdr.result && hdr.cmd != KEYSTORE_LIB_IOC_ENCRYPT_BATCH && hdr.cmd != KEYSTORE_LIB_IOC_DECRYPT_BATCH)
+    hdr.result = job->ops[0].res.status;
+
+  hdr.size = (uint32_t)size;
+  hdr.flags = 0;
+  res = keystore_broker_append(job->conn, &hdr, sizeof(hdr));
+
+  for (i = 0; !res && i < hdr.count; i++)
+  {
+    res = keystore_broker_append(job->conn, &job->ops[i].res, sizeof(job->ops[i].res));
+    if (!res && job->ops[i].res.output_size && !job->ops[i].output_shm)
+      res = keystore_broker_append(job->conn, job->ops[i].output, job->ops[i].res.output_size);
+  }
+
+  return res;
+}
+
+static void keystore_broker_job_free(struct keystore_broker_job *job)
+{
+  if (job->arena)
+  {
+    /* Outputs may hold plain text and unwrapped keys */
+    size_t size = 0;
+    uint32_t i;
+
+    for (i = 0; i < job->hdr.count; i++)
+    {
+      if (!job->ops[i].output_shm)
+        size += job->ops[i].output_cap;
+    }
+    memset(job->arena, 0, size);
+  }
+
+  free(job->arena);
+  free(job->ops);
+  job->arena = NULL;
+  job->ops = NULL;
+}
+
+static void keystore_broker_conn_close(struct ias_keystore_broker *broker, unsigned int index)
+{
+  struct keystore_broker_conn *conn = broker->conns[index];
+
+  close(conn->fd);
+  if (conn->rx_fd != -1)
+    close(conn->rx_fd);
+  if (conn->shm)
+    munmap(conn->shm, conn->shm_size);
+  free(conn->in);
+  free(conn->out);
+  free(conn);
+
+  broker->conns[index] = broker->conns[--broker->conn_count];
+}
+
+static int keystore_broker_accept(struct ias_keystore_broker *broker)
+{
+  struct keystore_broker_conn *conn;
+  struct ucred cred;
+  socklen_t len = sizeof(cred);
+  int fd, res;
+
+  fd = accept4(broker->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+  if (fd == -1)
+    return (errno == EAGAIN || errno == EINTR || errno == ECONNABORTED) ? 0 : -errno;
+
+  if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1)
+  {
+    close(fd);
+    return 0;
+  }
+
+  res = keystore_broker_grow((void **)&broker->conns, &broker->conn_cap,
+                             broker->conn_count + 1, sizeof(*broker->conns));
+  conn = res ? NULL : (struct keystore_broker_conn *)calloc(1, sizeof(*conn));
+  if (!conn)
+  {
+    close(fd);
+    return 0;
+  }
+
+  conn->fd = fd;
+  conn->uid = cred.uid;
+  conn->rx_fd = -1;
+  broker->conns[broker->conn_count++] = conn;
+  return 0;
+}
+
+/**
+ * @brief Helper function, receives data and a passed descriptor.
+ */
+static ssize_t keystore_broker_recv(struct keystore_broker_conn *conn)
+{
+  union {
+    struct cmsghdr hdr;
+    char buf[CMSG_SPACE(sizeof(int))];
+  } control;
+  struct cmsghdr *cmsg;
+  struct msghdr msg;
+  struct iovec iov;
+  ssize_t res;
+  int fd;
+
+  iov.iov_base = conn->in + conn->in_size;
+  iov.iov_len = conn->in_cap - conn->in_size;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof(control.buf);
+
+  res = recvmsg(conn->fd, &msg, MSG_CMSG_CLOEXEC);
+  if (res <= 0)
+    return res;
+
+  for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+  {
+    if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+        cmsg->cmsg_len != CMSG_LEN(sizeof(int)))
+      continue;
+
+    memcpy(&fd, CMSG_DATA(cmsg), sizeof(fd));
+    /* Only the latest descriptor is kept */
+    if (conn->rx_fd != -1)
+      close(conn->rx_fd);
+    conn->rx_fd = fd;
+  }
+
+  return res;
+}
+
+/**
+ * @brief Helper function, maps the payload ring of an attach request.
+ *
+ * The memfd must be sealed against shrinking, so that the client cannot
+ * make the broker fault on the mapping.
+ */
+static int keystore_broker_attach(struct keystore_broker_conn *conn)
+{
+  struct stat st;
+  void *shm;
+  int seals, fd = conn->rx_fd;
+
+  conn->rx_fd = -1;
+  if (fd == -1)
+    return -EBADF;
+
+  if (conn->shm)
+  {
+    close(fd);
+    return -EBUSY;
+  }
+
+  seals = fcntl(fd, F_GET_SEALS);
+  if (seals == -1 || !(seals & F_SEAL_SHRINK) || fstat(fd, &st) == -1 ||
+      st.st_size <= 0 || st.st_size > KEYSTORE_BROKER_SHM_MAX)
+  {
+    close(fd);
+    return -EINVAL;
+  }
+
+  shm = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (shm == MAP_FAILED)
+    return -errno;
+
+  conn->shm = (uint8_t *)shm;
+  conn->shm_size = (size_t)st.st_size;
+  return 0;
+}
+
+/**
+ * @brief Helper function, reads available data of a connection.
+ *
+ * @return 0 if OK, negative error code if the connection must be closed.
+ */
+static int keystore_broker_read(struct keystore_broker_conn *conn)
+{
+  size_t cap;
+  ssize_t res;
+  uint8_t *ptr;
+
+  for (;;)
+  {
+    if (conn->in_cap - conn->in_size < KEYSTORE_BROKER_READ_SIZE)
+    {
+      cap = conn->in_cap ? conn->in_cap * 2 : 2 * KEYSTORE_BROKER_READ_SIZE;
+      if (cap > sizeof(struct keystore_broker_hdr) + KEYSTORE_BROKER_MSG_MAX + KEYSTORE_BROKER_READ_SIZE)
+        return -EMSGSIZE;
+      ptr = (uint8_t *)realloc(conn->in, cap);
+      if (!ptr)
+        return -ENOMEM;
+      conn->in = ptr;
+      conn->in_cap = cap;
+    }
+
+    res = keystore_broker_recv(conn);
+    if (res > 0)
+    {
+      conn->in_size += (size_t)res;
+      continue;
+    }
+    if (res == 0)
+      return -ECONNRESET;
+    if (errno == EINTR)
+      continue;
+    return errno == EAGAIN ? 0 : -errno;
+  }
+}
+
+/**
+ * @brief Helper function, sends queued data of a connection.
+ *
+ * @return 0 if OK, negative error code if the connection must be closed.
+ */
+static int keystore_broker_write(struct keystore_broker_conn *conn)
+{
+  ssize_t res;
+
+  while (conn->out_pos < conn->out_size)
+  {
+    res = send(conn->fd, conn->out + conn->out_pos, conn->out_size - conn->out_pos, MSG_NOSIGNAL);
+    if (res < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      return errno == EAGAIN ? 0 : -errno;
+    }
+    conn->out_pos += (size_t)res;
+  }
+
+  conn->out_pos = 0;
+  conn->out_size = 0;
+  return 0;
+}
+
+/**
+ * @brief Helper function, checks for a complete request frame.
+ *
+ * @return 1 if complete, 0 if not yet, negative error code if malformed.
+ */
+static int keystore_broker_frame(const struct keystore_broker_conn *conn, struct keystore_broker_hdr *hdr)
+{
+  if (conn->in_size < sizeof(*hdr))
+    return 0;
+
+  memcpy(hdr, conn->in, sizeof(*hdr));
+  if (hdr->magic != KEYSTORE_BROKER_MAGIC || hdr->size > KEYSTORE_BROKER_MSG_MAX)
+    return -EPROTO;
+
+  return conn->in_size >= sizeof(*hdr) + hdr->size;
+}
+
+/**
+ * @brief Helper function, serves one complete request per connection.
+ *
+ * Connections get one request in flight: the next one is read after
+ * the reply was sent.
+ */
+static void keystore_broker_process(struct ias_keystore_broker *broker, struct keystore_broker_job *jobs)
+{
+  unsigned int i, job_count = 0;
+  int res;
+
+  for (i = 0; i < broker->conn_count; i++)
+  {
+    struct keystore_broker_conn *conn = broker->conns[i];
+    struct keystore_broker_job *job = &jobs[job_count];
+
+    if (conn->dead || conn->out_size)
+      continue;
+
+    memset(job, 0, sizeof(*job));
+    res = keystore_broker_frame(conn, &job->hdr);
+    if (res <= 0)
+    {
+      if (res < 0)
+        conn->dead = 1;
+      continue;
+    }
+
+    job->conn = conn;
+    job->frame_size = sizeof(job->hdr) + job->hdr.size;
+
+    if (job->hdr.cmd == KEYSTORE_BROKER_CMD_ATTACH)
+    {
+      job->hdr.result = keystore_broker_attach(conn);
+      job->hdr.count = 0;
+      job->hdr.size = 0;
+      if (keystore_broker_append(conn, &job->hdr, sizeof(job->hdr)) || keystore_broker_write(conn))
+        conn->dead = 1;
+      memmove(conn->in, conn->in + job->frame_size, conn->in_size - job->frame_size);
+      conn->in_size -= job->frame_size;
+      continue;
+    }
+
+    res = keystore_broker_parse(job);
+    if (res)
+    {
+      keystore_broker_job_free(job);
+      conn->dead = 1;
+      continue;
+    }
+
+    keystore_broker_serve(broker, job);
+    job_count++;
+  }
+
+  keystore_broker_flush(broker, jobs, job_count);
+
+  for (i = 0; i < job_count; i++)
+  {
+    struct keystore_broker_conn *conn = jobs[i].conn;
+
+    if (!conn->dead && (keystore_broker_reply(&jobs[i]) || keystore_broker_write(conn)))
+      conn->dead = 1;
+
+    keystore_broker_job_free(&jobs[i]);
+
+    /* Drop the request from the receive buffer */
+    memmove(conn->in, conn->in + jobs[i].frame_size, conn->in_size - jobs[i].frame_size);
+    conn->in_size -= jobs[i].frame_size;
+  }
+}
+
+int ias_keystore_broker_run(struct ias_keystore_broker *broker)
+{
+  struct pollfd *fds = NULL;
+  struct keystore_broker_job *jobs = NULL;
+  unsigned int i, fds_cap = 0, jobs_cap = 0;
+  uint64_t value;
+  int res = 0;
+
+  if (!broker)
+    return -EFAULT;
+
+  for (;;)
+  {
+    if (keystore_broker_grow((void **)&fds, &fds_cap, broker->conn_count + 2, sizeof(*fds)) ||
+        keystore_broker_grow((void **)&jobs, &jobs_cap, broker->conn_count + 1, sizeof(*jobs)))
+    {
+      res = -ENOMEM;
+      break;
+    }
+
+    fds[0].fd = broker->stop_fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = broker->listen_fd;
+    fds[1].events = POLLIN;
+    for (i = 0; i < broker->conn_count; i++)
+    {
+      fds[i + 2].fd = broker->conns[i]->fd;
+      fds[i + 2].events = broker->conns[i]->out_size ? POLLOUT : POLLIN;
+      fds[i + 2].revents = 0;
+    }
+
+    if (poll(fds, broker->conn_count + 2, -1) == -1)
+    {
+      if (errno == EINTR)
+        continue;
+      res = -errno;
+      break;
+    }
+
+    if (fds[0].revents)
+    {
+      if (read(broker->stop_fd, &value, sizeof(value)) < 0 && errno != EAGAIN)
+        res = -errno;
+      break;
+    }
+
+    /* Connections failing below are marked dead and closed after processing */
+    for (i = 0; i < broker->conn_count; i++)
+    {
+      struct keystore_broker_conn *conn = broker->conns[i];
+      short revents = fds[i + 2].revents;
+
+      if (revents & POLLOUT)
+      {
+        if (keystore_broker_write(conn))
+          conn->dead = 1;
+      }
+      else if (revents & (POLLIN | POLLHUP | POLLERR))
+      {
+        if (keystore_broker_read(conn))
+          conn->dead = 1;
+      }
+    }
+
+    if (fds[1].revents & POLLIN)
+    {
+      res = keystore_broker_accept(broker);
+      if (res)
+        break;
+    }
+
+    keystore_broker_process(broker, jobs);
+
+    for (i = broker->conn_count; i-- > 0;)
+    {
+      if (broker->conns[i]->dead)
+        keystore_broker_conn_close(broker, i);
+    }
+  }
+
+  free(jobs);
+  free(fds);
+  return res;
+}
+
+void ias_keystore_broker_stop(struct ias_keystore_broker *broker)
+{
+  uint64_t value = 1;
+  ssize_t res;
+
+  if (!broker)
+    return;
+
+  do
+  {
+    res = write(broker->stop_fd, &value, sizeof(value));
+  } while (res == -1 && errno == EINTR);
+}
+
+/**
+ * @brief Helper function, creates the listening socket.
+ */
+static int keystore_broker_listen(struct ias_keystore_broker *broker, unsigned int mode)
+{
+  int fd, probe, res;
+
+  fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd == -1)
+    return -errno;
+
+  res = bind(fd, (const struct sockaddr *)&broker->addr, sizeof(broker->addr));
+  if (res == -1 && errno == EADDRINUSE)
+  {
+    /* Replace the socket file of a broker which is gone */
+    probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (probe != -1 && connect(probe, (const struct sockaddr *)&broker->addr, sizeof(broker->addr)) == -1 &&
+        errno == ECONNREFUSED)
+    {
+      unlink(broker->addr.sun_path);
+      res = bind(fd, (const struct sockaddr *)&broker->addr, sizeof(broker->addr));
+    }
+    else
+    {
+      errno = EADDRINUSE;
+    }
+    if (probe != -1)
+      close(probe);
+  }
+
+  if (res == -1 || chmod(broker->addr.sun_path, mode) == -1 || listen(fd, SOMAXCONN) == -1)
+  {
+    res = -errno;
+    close(fd);
+    return res;
+  }
+
+  broker->listen_fd = fd;
+  return 0;
+}
+
+int ias_keystore_broker_create(const struct ias_keystore_broker_config *config,
+                               struct ias_keystore_broker **broker)
+{
+  struct ias_keystore_broker *b;
+  int res;
+
+  if (!config || !config->socket_path || !broker)
+    return -EFAULT;
+
+  if (!*config->socket_path || strlen(config->socket_path) >= sizeof(b->addr.sun_path))
+    return -EINVAL;
+
+  b = (struct ias_keystore_broker *)calloc(1, sizeof(*b));
+  if (!b)
+    return -ENOMEM;
+
+  b->dev_fd = -1;
+  b->listen_fd = -1;
+  b->stop_fd = -1;
+  b->batch_supported = -1;
+  b->max_clients = config->max_clients ? config->max_clients : KEYSTORE_BROKER_CLIENTS_DEFAULT;
+  b->max_user_clients = config->max_user_clients ? config->max_user_clients
+                                                  : KEYSTORE_BROKER_USER_CLIENTS_DEFAULT;
+  b->addr.sun_family = AF_UNIX;
+  strcpy(b->addr.sun_path, config->socket_path);
+
+  b->stop_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (b->stop_fd == -1)
+  {
+    res = -errno;
+    goto fail;
+  }
+
+  b->dev_fd = keystore_dev_open(config->device ? config->device : ias_keystore_get_device());
+  if (b->dev_fd < 0)
+  {
+    res = b->dev_fd;
+    goto fail;
+  }
+
+  res = keystore_broker_listen(b, config->socket_mode ? config->socket_mode : KEYSTORE_BROKER_MODE_DEFAULT);
+  if (res)
+    goto fail;
+
+  *broker = b;
+  return 0;
+
+fail:
+  ias_keystore_broker_destroy(b);
+  return res;
+}
+
+void ias_keystore_broker_destroy(struct ias_keystore_broker *broker)
+{
+  struct ias_keystore_unregister request;
+  struct keystore_broker_client *client;
+  unsigned int i;
+
+  if (!broker)
+    return;
+
+  while (broker->conn_count)
+    keystore_broker_conn_close(broker, broker->conn_count - 1);
+
+  if (broker->listen_fd != -1)
+  {
+    close(broker->listen_fd);
+    unlink(broker->addr.sun_path);
+  }
+
+  for (i = 0; i < broker->session_count; i++)
+  {
+    memcpy(request.client_ticket, broker->sessions[i].ticket, sizeof(request.client_ticket));
+    keystore_dev_ioctl(broker->dev_fd, KEYSTORE_IOC_UNREGISTER, &request);
+  }
+
+  for (i = 0; i < KEYSTORE_BROKER_BUCKETS; i++)
+  {
+    while ((client = broker->buckets[i]) != NULL)
+    {
+      broker->buckets[i] = client->next;
+      free(client);
+    }
+  }
+
+  if (broker->dev_fd >= 0)
+    keystore_dev_close(broker->dev_fd);
+  if (broker->stop_fd != -1)
+    close(broker->stop_fd);
+
+  free(broker->sessions);
+  free(broker->users);
+  free(broker->conns);
+  free(broker);
+}
+
+/* end of file */
@@ -0,0 +1,137 @@
+/*
+   Copyright 2018 Intel Corporation
+
+   This software is licensed to you in accordance
+   with the agreement between you and Intel Corporation.
+
+   Alternatively, you can use this file in compliance
+   with the Apache license, Version 2.
+
+
+   Apache License, Version 2.0
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+   http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef IAS_KEYSTORE_BROKER_PROTO_H
+#define IAS_KEYSTORE_BROKER_PROTO_H
+
+/*
+ * Wire format between the "unix:" backend and the keystore broker.
+ * Not installed and not part of the public API.
+ *
+ * Every message is a header followed by @count operation records. A
+ * request record is followed by its IV and input bytes, a reply record
+ * by its output bytes. Single calls carry one record, batch calls one
+ * record per entry. Both sides run on the same host, so integers are
+ * in host byte order.
+ *
+ * A client can attach a shared payload ring to a connection: a sealed
+ * memfd passed with KEYSTORE_BROKER_CMD_ATTACH. Encrypt and decrypt
+ * requests flagged with KEYSTORE_BROKER_FLAG_SHM then carry only the
+ * IVs inline; inputs and outputs are offsets into the ring, which the
+ * broker hands to the device as they are.
+ */
+
+#include <stdint.h>
+
+#include "keystore_api_user.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#define KEYSTORE_BROKER_MAGIC 0x4b534252u /* "KSBR" */
+
+/* Upper bound for the payload of one message */
+#define KEYSTORE_BROKER_MSG_MAX (64u << 20)
+
+/* Upper bound for the number of records in one message */
+#define KEYSTORE_BROKER_OPS_MAX 4096
+
+/* Upper bound for the size of a payload ring */
+#define KEYSTORE_BROKER_SHM_MAX (256u << 20)
+
+/* Attaches the payload ring passed with SCM_RIGHTS, no records */
+#define KEYSTORE_BROKER_CMD_ATTACH 0x4b530001u
+
+/* Header flag: inputs and outputs are in the payload ring */
+#define KEYSTORE_BROKER_FLAG_SHM 0x1u
+
+/* Reply record flag: the output was written to the payload ring */
+#define KEYSTORE_BROKER_RES_SHM 0x1u
+
+/**
+ * @brief Message header.
+ * @param magic   KEYSTORE_BROKER_MAGIC.
+ * @param cmd     The KEYSTORE_IOC_* command.
+ * @param count   Number of records.
+ * @param size    Bytes following the header.
+ * @param result  Reply only: result of the call.
+ * @param flags   KEYSTORE_BROKER_FLAG_*.
+ */
+struct keystore_broker_hdr {
+  uint32_t magic;
+  uint32_t cmd;
+  uint32_t count;
+  uint32_t size;
+  int32_t result;
+  uint32_t flags;
+};
+
+/**
+ * @brief Request record, followed by @iv_size and @input_size bytes.
+ * @param client_ticket  Client ticket.
+ * @param spec           Seed type, key spec or algo spec.
+ * @param slot_id        Slot ID.
+ * @param value          Input size of the size queries.
+ * @param iv_size        IV bytes following the record.
+ * @param input_size     Input bytes following the IV, or at @input_offset.
+ * @param input_offset   Ring offset of the input (KEYSTORE_BROKER_FLAG_SHM).
+ * @param output_offset  Ring offset of the output (KEYSTORE_BROKER_FLAG_SHM).
+ * @param output_max     Ring bytes reserved at @output_offset.
+ */
+struct keystore_broker_op {
+  uint8_t client_ticket[KEYSTORE_CLIENT_TICKET_SIZE];
+  uint32_t spec;
+  uint32_t slot_id;
+  uint32_t value;
+  uint32_t iv_size;
+  uint32_t input_size;
+  uint32_t input_offset;
+  uint32_t output_offset;
+  uint32_t output_max;
+};
+
+/**
+ * @brief Reply record, followed by @output_size bytes.
+ * @param status         Result of this operation.
+ * @param client_ticket  Client ticket (register).
+ * @param value          Version, key sizes, output size or slot ID.
+ * @param output_size    Output bytes following the record, or in the ring.
+ * @param flags          KEYSTORE_BROKER_RES_*.
+ */
+struct keystore_broker_res {
+  int32_t status;
+  uint8_t client_ticket[KEYSTORE_CLIENT_TICKET_SIZE];
+  uint32_t value[3];
+  uint32_t output_size;
+  uint32_t flags;
+};
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* IAS_KEYSTORE_BROKER_PROTO_H */
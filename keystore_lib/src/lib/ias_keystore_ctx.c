@@ -0,0 +1,376 @@
+/*
+   Copyright 2018 Intel Corporation
+
+   This software is licensed to you in accordance
+   with the agreement between you and Intel Corporation.
+
+   Alternatively, you can use this file in compliance
+   with the Apache license, Version 2.
+
+
+   Apache License, Version 2.0
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+   http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#include <errno.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+
+#include "keystore_api_user.h"
+
+#include "ias_keystore.h"
+#include "ias_keystore_ctx.h"
+#include "ias_keystore_priv.h"
+
+/* Key specs with cached wrapped key sizes: KEYSPEC_LENGTH_128, _256 and _ECC_PAIR */
+#define KEYSTORE_CTX_KEY_SPECS 3
+
+struct keystore_ctx_key_size {
+  uint32_t valid;
+  uint32_t wrapped_key_size;
+  uint32_t unwrapped_key_size;
+};
+
+struct ias_keystore_ctx {
+  int fd;
+  uint8_t client_ticket[KEYSTORE_CLIENT_TICKET_SIZE];
+
+  /* Request templates, pre-filled with the client ticket */
+  struct ias_keystore_generate_key generate_template;
+  struct ias_keystore_wrap_key wrap_template;
+  struct ias_keystore_load_key load_template;
+  struct ias_keystore_unload_key unload_template;
+  struct ias_keystore_encrypt_decrypt crypt_template;
+
+  struct keystore_ctx_key_size key_sizes[KEYSTORE_CTX_KEY_SPECS];
+  /* Encrypt/decrypt sizes, NULL if they are queried */
+  const struct keystore_size_table *sizes;
+};
+
+static int keystore_ctx_key_spec_index(enum keystore_key_spec key_spec)
+{
+  switch (key_spec)
+  {
+  case KEYSPEC_LENGTH_128:
+    return 0;
+  case KEYSPEC_LENGTH_256:
+    return 1;
+  case KEYSPEC_LENGTH_ECC_PAIR:
+    return 2;
+  default:
+    return -1;
+  }
+}
+
+int ias_keystore_ctx_open(const char *dev_name, enum keystore_seed_type seed_type,
+                          struct ias_keystore_ctx **ctx)
+{
+  struct ias_keystore_register request;
+  struct ias_keystore_ctx *c;
+  int res;
+
+  if (!ctx)
+    return -EFAULT;
+
+  if (!dev_name)
+    dev_name = ias_keystore_get_device();
+
+  c = (struct ias_keystore_ctx *)calloc(1, sizeof(*c));
+  if (!c)
+    return -ENOMEM;
+
+  c->fd = keystore_dev_open(dev_name);
+  if (c->fd < 0)
+  {
+    res = c->fd;
+    free(c);
+    return res;
+  }
+
+  memset(&request, 0, sizeof(request));
+  request.seed_type = seed_type;
+
+  res = keystore_dev_ioctl(c->fd, KEYSTORE_IOC_REGISTER, &request);
+  if (res)
+  {
+    keystore_dev_close(c->fd);
+    free(c);
+    return res;
+  }
+
+  memcpy(c->client_ticket, request.client_ticket, sizeof(c->client_ticket));
+  c->sizes = keystore_size_table(c->fd, dev_name);
+  memcpy(c->generate_template.client_ticket, c->client_ticket, sizeof(c->client_ticket));
+  memcpy(c->wrap_template.client_ticket, c->client_ticket, sizeof(c->client_ticket));
+  memcpy(c->load_template.client_ticket, c->client_ticket, sizeof(c->client_ticket));
+  memcpy(c->unload_template.client_ticket, c->client_ticket, sizeof(c->client_ticket));
+  memcpy(c->crypt_template.client_ticket, c->client_ticket, sizeof(c->client_ticket));
+
+  *ctx = c;
+  return 0;
+}
+
+int ias_keystore_ctx_close(struct ias_keystore_ctx *ctx)
+{
+  struct ias_keystore_unregister request;
+  int res;
+
+  if (!ctx)
+    return 0;
+
+  memcpy(request.client_ticket, ctx->client_ticket, sizeof(request.client_ticket));
+  res = keystore_dev_ioctl(ctx->fd, KEYSTORE_IOC_UNREGISTER, &request);
+
+  keystore_dev_close(ctx->fd);
+  memset(ctx, 0, sizeof(*ctx));
+  free(ctx);
+
+  return res;
+}
+
+const uint8_t *ias_keystore_ctx_ticket(const struct ias_keystore_ctx *ctx)
+{
+  if (!ctx)
+    return NULL;
+
+  return ctx->client_ticket;
+}
+
+int ias_keystore_ctx_wrapped_key_size(struct ias_keystore_ctx *ctx,
+                                      enum keystore_key_spec key_spec,
+                                      size_t *wrapped_key_size,
+                                      size_t *unwrapped_key_size)
+{
+  struct ias_keystore_wrapped_key_size request;
+  struct keystore_ctx_key_size *cached = NULL;
+  int index;
+  int res;
+
+  if (!ctx)
+    return -EFAULT;
+
+  index = keystore_ctx_key_spec_index(key_spec);
+  if (index >= 0)
+  {
+    cached = &ctx->key_sizes[index];
+    if (__atomic_load_n(&cached->valid, __ATOMIC_ACQUIRE))
+    {
+      if (wrapped_key_size)
+        *wrapped_key_size = cached->wrapped_key_size;
+      if (unwrapped_key_size)
+        *unwrapped_key_size = cached->unwrapped_key_size;
+      return 0;
+    }
+  }
+
+  memset(&request, 0, sizeof(request));
+  request.key_spec = (uint32_t)key_spec;
+
+  res = keystore_dev_ioctl(ctx->fd, KEYSTORE_IOC_WRAPPED_KEYSIZE, &request);
+  if (res)
+    return res;
+
+  /* Concurrent first queries store the same values */
+  if (cached)
+  {
+    cached->wrapped_key_size = request.key_size;
+    cached->unwrapped_key_size = request.unwrapped_key_size;
+    __atomic_store_n(&cached->valid, 1, __ATOMIC_RELEASE);
+  }
+
+  if (wrapped_key_size)
+    *wrapped_key_size = request.key_size;
+
+  if (unwrapped_key_size)
+    *unwrapped_key_size = request.unwrapped_key_size;
+
+  return 0;
+}
+
+int ias_keystore_ctx_generate_key(struct ias_keystore_ctx *ctx,
+                                  enum keystore_key_spec key_spec,
+                                  uint8_t *wrapped_key)
+{
+  struct ias_keystore_generate_key request;
+
+  if (!ctx || !wrapped_key)
+    return -EFAULT;
+
+  request = ctx->generate_template;
+  request.key_spec = (uint32_t)key_spec;
+  request.wrapped_key = wrapped_key;
+
+  return keystore_dev_ioctl(ctx->fd, KEYSTORE_IOC_GENERATE_KEY, &request);
+}
+
+int ias_keystore_ctx_wrap_key(struct ias_keystore_ctx *ctx,
+                              const uint8_t *app_key, size_t app_key_size,
+                              enum keystore_key_spec key_spec,
+                              uint8_t *wrapped_key)
+{
+  struct ias_keystore_wrap_key request;
+
+  if (!ctx || !app_key || !wrapped_key)
+    return -EFAULT;
+
+  request = ctx->wrap_template;
+  request.key_spec = (uint32_t)key_spec;
+  request.app_key = app_key;
+  request.app_key_size = (uint32_t)app_key_size;
+  request.wrapped_key = wrapped_key;
+
+  return keystore_dev_ioctl(ctx->fd, KEYSTORE_IOC_WRAP_KEY, &request);
+}
+
+int ias_keystore_ctx_load_key(struct ias_keystore_ctx *ctx,
+                              uint8_t *wrapped_key, size_t wrapped_key_size,
+                              uint32_t *slot_id)
+{
+  struct ias_keystore_load_key request;
+  int res;
+
+  if (!ctx || !wrapped_key || !slot_id)
+    return -EFAULT;
+
+  request = ctx->load_template;
+  request.wrapped_key = wrapped_key;
+  request.wrapped_key_size = (uint32_t)wrapped_key_size;
+
+  res = keystore_dev_ioctl(ctx->fd, KEYSTORE_IOC_LOAD_KEY, &request);
+  if (res)
+    return res;
+
+  *slot_id = request.slot_id;
+
+  return 0;
+}
+
+int ias_keystore_ctx_unload_key(struct ias_keystore_ctx *ctx, uint32_t slot_id)
+{
+  struct ias_keystore_unload_key request;
+
+  if (!ctx)
+    return -EFAULT;
+
+  request = ctx->unload_template;
+  request.slot_id = slot_id;
+
+  return keystore_dev_ioctl(ctx->fd, KEYSTORE_IOC_UNLOAD_KEY, &request);
+}
+
+static int keystore_ctx_crypto_size(struct ias_keystore_ctx *ctx, unsigned int cmd,
+                                    enum keystore_algo_spec algo_spec,
+                                    size_t input_size, size_t *output_size)
+{
+  struct ias_keystore_crypto_size request;
+  int res;
+
+  if (!ctx || !output_size)
+    return -EFAULT;
+
+  res = keystore_size_crypt(ctx->sizes, cmd, algo_spec, input_size, output_size);
+  if (res != -ENOENT)
+    return res;
+
+  memset(&request, 0, sizeof(request));
+  request.algospec = (uint32_t)algo_spec;
+  request.input_size = (uint32_t)input_size;
+
+  res = keystore_dev_ioctl(ctx->fd, cmd, &request);
+  if (res)
+    return res;
+
+  *output_size = (size_t)request.output_size;
+
+  return 0;
+}
+
+int ias_keystore_ctx_encrypt_size(struct ias_keystore_ctx *ctx,
+                                  enum keystore_algo_spec algo_spec,
+                                  size_t input_size, size_t *output_size)
+{
+  return keystore_ctx_crypto_size(ctx, KEYSTORE_IOC_ENCRYPT_SIZE, algo_spec,
+                                  input_size, output_size);
+}
+
+int ias_keystore_ctx_decrypt_size(struct ias_keystore_ctx *ctx,
+                                  enum keystore_algo_spec algo_spec,
+                                  size_t input_size, size_t *output_size)
+{
+  return keystore_ctx_crypto_size(ctx, KEYSTORE_IOC_DECRYPT_SIZE, algo_spec,
+                                  input_size, output_size);
+}
+
+/**
+ * @brief Helper function, output size on the device of a context.
+ */
+static int keystore_ctx_alias_size(void *priv, unsigned int cmd, uint32_t algo_spec,
+                                   size_t input_size, size_t *output_size)
+{
+  return keystore_ctx_crypto_size((struct ias_keystore_ctx *)priv, cmd,
+                                  (enum keystore_algo_spec)algo_spec, input_size, output_size);
+}
+
+static int keystore_ctx_crypt(struct ias_keystore_ctx *ctx, unsigned int cmd,
+                              uint32_t slot_id, enum keystore_algo_spec algo_spec,
+                              const uint8_t *iv, size_t iv_size,
+                              const uint8_t *input, size_t input_size,
+                              uint8_t *output)
+{
+  struct ias_keystore_encrypt_decrypt request;
+  int res;
+
+  /* Do not check the IV as it allowed to be null */
+  if (!ctx || !input || !output)
+    return -EFAULT;
+
+  res = keystore_crypt_check_alias(cmd == KEYSTORE_IOC_ENCRYPT, (uint32_t)algo_spec,
+                                   input, input_size, output, keystore_ctx_alias_size, ctx);
+  if (res)
+    return res;
+
+  request = ctx->crypt_template;
+  request.slot_id = slot_id;
+  request.algospec = (uint32_t)algo_spec;
+  request.iv = iv;
+  request.iv_size = (uint32_t)iv_size;
+  request.input = input;
+  request.input_size = (uint32_t)input_size;
+  request.output = output;
+
+  return keystore_dev_ioctl(ctx->fd, cmd, &request);
+}
+
+int ias_keystore_ctx_encrypt(struct ias_keystore_ctx *ctx, uint32_t slot_id,
+                             enum keystore_algo_spec algo_spec,
+                             const uint8_t *iv, size_t iv_size,
+                             const uint8_t *input, size_t input_size,
+                             uint8_t *output)
+{
+  return keystore_ctx_crypt(ctx, KEYSTORE_IOC_ENCRYPT, slot_id, algo_spec,
+                            iv, iv_size, input, input_size, output);
+}
+
+int ias_keystore_ctx_decrypt(struct ias_keystore_ctx *ctx, uint32_t slot_id,
+                             enum keystore_algo_spec algo_spec,
+                             const uint8_t *iv, size_t iv_size,
+                             const uint8_t *input, size_t input_size,
+                             uint8_t *output)
+{
+  return keystore_ctx_crypt(ctx, KEYSTORE_IOC_DECRYPT, slot_id, algo_spec,
+                            iv, iv_size, input, input_size, output);
+}
+
+/* end of file */
@@ -0,0 +1,285 @@
+/*
+   Copyright 2018 Intel Corporation
+
+   This software is licensed to you in accordance
+   with the agreement between you and Intel Corporation.
+
+   Alternatively, you can use this file in compliance
+   with the Apache license, Version 2.
+
+
+   Apache License, Version 2.0
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+   http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "ias_keystore.h"
+#include "ias_keystore_aes.h"
+#include "ias_keystore_keypool.h"
+
+#define KEYSTORE_KEYPOOL_DEFAULT_HIGH 16
+/* Pause of the refill thread after a failed generate call */
+#define KEYSTORE_KEYPOOL_RETRY_MS 100
+
+struct ias_keystore_keypool {
+  pthread_mutex_t lock;
+  pthread_cond_t refill_cond;  /* signalled to start refilling or to stop */
+  pthread_cond_t fill_cond;    /* signalled when a key was generated or failed */
+  pthread_t thread;
+
+  const uint8_t *client_ticket;
+  enum keystore_key_spec key_spec;
+  uint32_t low_watermark;
+  uint32_t high_watermark;
+  size_t key_size;
+
+  /* Ring of high_watermark keys, count of them valid from head */
+  uint32_t head;
+  uint32_t count;
+  int refilling;
+  int stopping;
+  int last_error;
+
+  struct ias_keystore_keypool_stats stats;
+  uint8_t keys[];
+};
+
+static uint8_t *keystore_keypool_key(struct ias_keystore_keypool *pool, uint32_t index)
+{
+  return pool->keys + (size_t)(index % pool->high_watermark) * pool->key_size;
+}
+
+/**
+ * @brief Helper function, waits after a failed generate call.
+ *
+ * Must be called with the lock held.
+ */
+static void keystore_keypool_pause(struct ias_keystore_keypool *pool)
+{
+  struct timespec deadline;
+
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_nsec += KEYSTORE_KEYPOOL_RETRY_MS * 1000000L;
+  if (deadline.tv_nsec >= 1000000000L)
+  {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000L;
+  }
+
+  if (!pool->stopping)
+    pthread_cond_timedwait(&pool->refill_cond, &pool->lock, &deadline);
+}
+
+static void *keystore_keypool_refill(void *arg)
+{
+  struct ias_keystore_keypool *pool = (struct ias_keystore_keypool *)arg;
+  uint8_t key[pool->key_size];
+  int res;
+
+  pthread_mutex_lock(&pool->lock);
+  for (;;)
+  {
+    while (!pool->refilling && !pool->stopping)
+      pthread_cond_wait(&pool->refill_cond, &pool->lock);
+
+    if (pool->stopping)
+      break;
+
+    /* Generate without the lock, takes are served meanwhile */
+    pthread_mutex_unlock(&pool->lock);
+    res = ias_keystore_generate_key(pool->client_ticket, pool->key_spec, key);
+    pthread_mutex_lock(&pool->lock);
+
+    if (res)
+    {
+      pool->stats.errors++;
+      pool->last_error = res;
+      pthread_cond_broadcast(&pool->fill_cond);
+      keystore_keypool_pause(pool);
+      continue;
+    }
+
+    /* Only this thread adds keys, and it stops at the high watermark */
+    memcpy(keystore_keypool_key(pool, pool->head + pool->count), key, pool->key_size);
+    pool->count++;
+    pool->stats.generated++;
+    pool->last_error = 0;
+    if (pool->count >= pool->high_watermark)
+      pool->refilling = 0;
+    pthread_cond_broadcast(&pool->fill_cond);
+  }
+  pthread_mutex_unlock(&pool->lock);
+
+  keystore_memzero(key, sizeof(key));
+  return NULL;
+}
+
+int ias_keystore_keypool_create(const uint8_t *client_ticket,
+                                const struct ias_keystore_keypool_config *config,
+                                struct ias_keystore_keypool **pool)
+{
+  struct ias_keystore_keypool *p;
+  uint32_t high = KEYSTORE_KEYPOOL_DEFAULT_HIGH;
+  uint32_t low;
+  size_t key_size = 0;
+  int res;
+
+  if (!client_ticket || !config || !pool)
+    return -EFAULT;
+
+  if (config->high_watermark)
+    high = config->high_watermark;
+  low = config->low_watermark ? config->low_watermark : (high + 1) / 2;
+  if (low > high)
+    return -EINVAL;
+
+  res = ias_keystore_wrapped_key_size(config->key_spec, &key_size, NULL);
+  if (res)
+    return res;
+
+  p = (struct ias_keystore_keypool *)calloc(1, sizeof(*p) + (size_t)high * key_size);
+  if (!p)
+    return -ENOMEM;
+
+  p->client_ticket = client_ticket;
+  p->key_spec = config->key_spec;
+  p->low_watermark = low;
+  p->high_watermark = high;
+  p->key_size = key_size;
+  p->refilling = 1;
+
+  pthread_mutex_init(&p->lock, NULL);
+  pthread_cond_init(&p->refill_cond, NULL);
+  pthread_cond_init(&p->fill_cond, NULL);
+
+  res = pthread_create(&p->thread, NULL, keystore_keypool_refill, p);
+  if (res)
+  {
+    pthread_cond_destroy(&p->fill_cond);
+    pthread_cond_destroy(&p->refill_cond);
+    pthread_mutex_destroy(&p->lock);
+    free(p);
+    return -res;
+  }
+
+  *pool = p;
+  return 0;
+}
+
+void ias_keystore_keypool_destroy(struct ias_keystore_keypool *pool)
+{
+  if (!pool)
+    return;
+
+  pthread_mutex_lock(&pool->lock);
+  pool->stopping = 1;
+  pthread_cond_broadcast(&pool->refill_cond);
+  pthread_mutex_unlock(&pool->lock);
+
+  pthread_join(pool->thread, NULL);
+
+  keystore_memzero(pool->keys, (size_t)pool->high_watermark * pool->key_size);
+  pthread_cond_destroy(&pool->fill_cond);
+  pthread_cond_destroy(&pool->refill_cond);
+  pthread_mutex_destroy(&pool->lock);
+  free(pool);
+}
+
+size_t ias_keystore_keypool_key_size(const struct ias_keystore_keypool *pool)
+{
+  return pool ? pool->key_size : 0;
+}
+
+int ias_keystore_keypool_take(struct ias_keystore_keypool *pool,
+                              uint8_t *wrapped_key, size_t wrapped_key_size)
+{
+  uint8_t *key;
+
+  if (!pool || !wrapped_key)
+    return -EFAULT;
+
+  if (wrapped_key_size < pool->key_size)
+    return -EINVAL;
+
+  pthread_mutex_lock(&pool->lock);
+  pool->stats.taken++;
+
+  if (pool->count)
+  {
+    key = keystore_keypool_key(pool, pool->head);
+    memcpy(wrapped_key, key, pool->key_size);
+    keystore_memzero(key, pool->key_size);
+    pool->head = (pool->head + 1) % pool->high_watermark;
+    pool->count--;
+  }
+  else
+  {
+    pool->stats.empty++;
+    key = NULL;
+  }
+
+  if (pool->count < pool->low_watermark && !pool->refilling)
+  {
+    pool->refilling = 1;
+    pthread_cond_signal(&pool->refill_cond);
+  }
+  pthread_mutex_unlock(&pool->lock);
+
+  if (key)
+    return 0;
+
+  return ias_keystore_generate_key(pool->client_ticket, pool->key_spec, wrapped_key);
+}
+
+int ias_keystore_keypool_fill(struct ias_keystore_keypool *pool)
+{
+  int res;
+
+  if (!pool)
+    return -EFAULT;
+
+  pthread_mutex_lock(&pool->lock);
+  if (pool->count < pool->high_watermark && !pool->refilling)
+  {
+    pool->refilling = 1;
+    pthread_cond_signal(&pool->refill_cond);
+  }
+
+  pool->last_error = 0;
+  while (pool->count < pool->high_watermark && !pool->last_error)
+    pthread_cond_wait(&pool->fill_cond, &pool->lock);
+
+  res = pool->last_error;
+  pthread_mutex_unlock(&pool->lock);
+
+  return res;
+}
+
+void ias_keystore_keypool_get_stats(struct ias_keystore_keypool *pool,
+                                    struct ias_keystore_keypool_stats *stats)
+{
+  if (!pool || !stats)
+    return;
+
+  pthread_mutex_lock(&pool->lock);
+  *stats = pool->stats;
+  stats->available = pool->count;
+  pthread_mutex_unlock(&pool->lock);
+}
+
+/* end of file */
@@ -0,0 +1,326 @@
+/*
+   Copyright 2018 Intel Corporation
+
+   This software is licensed to you in accordance
+   with the agreement between you and Intel Corporation.
+
+   Alternatively, you can use this file in compliance
+   with the Apache license, Version 2.
+
+
+   Apache License, Version 2.0
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+   http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ias_keystore.h"
+#include "ias_keystore_priv.h"
+
+/*
+ * Loaded key table.
+ *
+ * Keys loaded with ias_keystore_load_key() are entered by client ticket
+ * and wrapped key content. Loading a wrapped key which the client has
+ * already loaded returns the same slot and takes a reference instead of
+ * unwrapping it again; ias_keystore_unload_key() only unloads the slot
+ * with the last reference. A load in progress is waited for.
+ *
+ * The table has no entries for loads which failed, so waiters of a
+ * failed load repeat it and get its result themselves (e.g. -EAGAIN with
+ * their own copy of the wrapped key re-wrapped).
+ */
+
+#define KEYSTORE_KEYS_BUCKETS 1024
+
+struct keystore_keys_entry {
+  struct keystore_keys_entry *next_key;   /* chain by ticket and content */
+  struct keystore_keys_entry *next_slot;  /* chain by ticket and slot, once loaded */
+  uint64_t hash;
+  uint8_t client_ticket[KEYSTORE_CLIENT_TICKET_SIZE];
+  uint32_t slot_id;
+  uint32_t refs;
+  int loading;
+  unsigned int generation;
+  size_t wrapped_key_size;
+  uint8_t wrapped_key[];
+};
+
+static struct keystore_keys_entry *_keys_by_key[KEYSTORE_KEYS_BUCKETS];
+static struct keystore_keys_entry *_keys_by_slot[KEYSTORE_KEYS_BUCKETS];
+static pthread_mutex_t _keys_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t _keys_cond = PTHREAD_COND_INITIALIZER;
+/* Incremented by keystore_keys_reset(), drops loads started before */
+static unsigned int _keys_generation;
+static int _keys_enabled;
+
+/**
+ * @brief Helper function, FNV-1a over the ticket and the wrapped key.
+ */
+static uint64_t keystore_keys_hash(const uint8_t *client_ticket,
+                                   const uint8_t *wrapped_key, size_t wrapped_key_size)
+{
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  size_t i;
+
+  for (i = 0; i < KEYSTORE_CLIENT_TICKET_SIZE; i++)
+    hash = (hash ^ client_ticket[i]) * 0x100000001b3ULL;
+
+  for (i = 0; i < wrapped_key_size; i++)
+    hash = (hash ^ wrapped_key[i]) * 0x100000001b3ULL;
+
+  return hash;
+}
+
+static size_t keystore_keys_slot_bucket(const uint8_t *client_ticket, uint32_t slot_id)
+{
+  uint64_t hash = keystore_keys_hash(client_ticket, NULL, 0) ^ slot_id;
+
+  return (size_t)((hash * 0x9e3779b97f4a7c15ULL) >> 54) % KEYSTORE_KEYS_BUCKETS;
+}
+
+static struct keystore_keys_entry **keystore_keys_find_key(uint64_t hash,
+                                                           const uint8_t *client_ticket,
+                                                           const uint8_t *wrapped_key,
+                                                           size_t wrapped_key_size)
+{
+  struct keystore_keys_entry **link = &_keys_by_key[hash % KEYSTORE_KEYS_BUCKETS];
+
+  while (*link && ((*link)->hash != hash ||
+                   (*link)->wrapped_key_size != wrapped_key_size ||
+                   memcmp((*link)->client_ticket, client_ticket, KEYSTORE_CLIENT_TICKET_SIZE) ||
+                   memcmp((*link)->wrapped_key, wrapped_key, wrapped_key_size)))
+    link = &(*link)->next_key;
+
+  return link;
+}
+
+static struct keystore_keys_entry **keystore_keys_find_slot(const uint8_t *client_ticket,
+                                                            uint32_t slot_id)
+{
+  struct keystore_keys_entry **link = &_keys_by_slot[keystore_keys_slot_bucket(client_ticket, slot_id)];
+
+  while (*link && ((*link)->slot_id != slot_id ||
+                   memcmp((*link)->client_ticket, client_ticket, KEYSTORE_CLIENT_TICKET_SIZE)))
+    link = &(*link)->next_slot;
+
+  return link;
+}
+
+/**
+ * @brief Helper function, removes an entry from the content chain.
+ *
+ * Must be called with _keys_lock held.
+ */
+static void keystore_keys_unlink_key(struct keystore_keys_entry *entry)
+{
+  struct keystore_keys_entry **link = &_keys_by_key[entry->hash % KEYSTORE_KEYS_BUCKETS];
+
+  while (*link != entry)
+    link = &(*link)->next_key;
+
+  *link = entry->next_key;
+}
+
+/**
+ * @brief Helper function, drops all loaded entries matching @client_ticket,
+ * or all of them if it is NULL.
+ *
+ * Entries which are loading are left to their loader. Must be called
+ * with _keys_lock held.
+ */
+static void keystore_keys_drop_locked(const uint8_t *client_ticket)
+{
+  struct keystore_keys_entry **link;
+  struct keystore_keys_entry *entry;
+  size_t i;
+
+  for (i = 0; i < KEYSTORE_KEYS_BUCKETS; i++)
+  {
+    link = &_keys_by_slot[i];
+    while ((entry = *link) != NULL)
+    {
+      if (client_ticket &&
+          memcmp(entry->client_ticket, client_ticket, KEYSTORE_CLIENT_TICKET_SIZE))
+      {
+        link = &entry->next_slot;
+        continue;
+      }
+
+      *link = entry->next_slot;
+      keystore_keys_unlink_key(entry);
+      free(entry);
+    }
+  }
+}
+
+void ias_keystore_set_key_sharing(int enable)
+{
+  __atomic_store_n(&_keys_enabled, enable ? 1 : 0, __ATOMIC_RELAXED);
+}
+
+int keystore_keys_claim(const uint8_t *client_ticket,
+                        const uint8_t *wrapped_key, size_t wrapped_key_size,
+                        uint32_t *slot_id, struct keystore_keys_entry **claim)
+{
+  struct keystore_keys_entry *entry;
+  uint64_t hash;
+
+  *claim = NULL;
+
+  if (!__atomic_load_n(&_keys_enabled, __ATOMIC_RELAXED))
+    return 0;
+
+  hash = keystore_keys_hash(client_ticket, wrapped_key, wrapped_key_size);
+
+  pthread_mutex_lock(&_keys_lock);
+  for (;;)
+  {
+    entry = *keystore_keys_find_key(hash, client_ticket, wrapped_key, wrapped_key_size);
+    if (!entry || !entry->loading)
+      break;
+
+    /* The entry may be gone after the wait, look it up again */
+    pthread_cond_wait(&_keys_cond, &_keys_lock);
+  }
+
+  if (entry)
+  {
+    entry->refs++;
+    *slot_id = entry->slot_id;
+    pthread_mutex_unlock(&_keys_lock);
+    return 1;
+  }
+
+  /* Without memory the key is loaded, but not shared */
+  entry = (struct keystore_keys_entry *)malloc(sizeof(*entry) + wrapped_key_size);
+  if (entry)
+  {
+    memset(entry, 0, sizeof(*entry));
+    entry->hash = hash;
+    memcpy(entry->client_ticket, client_ticket, KEYSTORE_CLIENT_TICKET_SIZE);
+    entry->refs = 1;
+    entry->loading = 1;
+    entry->generation = _keys_generation;
+    entry->wrapped_key_size = wrapped_key_size;
+    memcpy(entry->wrapped_key, wrapped_key, wrapped_key_size);
+
+    entry->next_key = _keys_by_key[hash % KEYSTORE_KEYS_BUCKETS];
+    _keys_by_key[hash % KEYSTORE_KEYS_BUCKETS] = entry;
+    *claim = entry;
+  }
+  pthread_mutex_unlock(&_keys_lock);
+
+  return 0;
+}
+
+void keystore_keys_loaded(struct keystore_keys_entry *claim, int res, uint32_t slot_id)
+{
+  struct keystore_keys_entry **link;
+
+  if (!claim)
+    return;
+
+  pthread_mutex_lock(&_keys_lock);
+  if (res || claim->generation != _keys_generation)
+  {
+    keystore_keys_unlink_key(claim);
+    free(claim);
+  }
+  else
+  {
+    claim->loading = 0;
+    claim->slot_id = slot_id;
+    link = &_keys_by_slot[keystore_keys_slot_bucket(claim->client_ticket, slot_id)];
+    claim->next_slot = *link;
+    *link = claim;
+  }
+  pthread_cond_broadcast(&_keys_cond);
+  pthread_mutex_unlock(&_keys_lock);
+}
+
+int keystore_keys_release(const uint8_t *client_ticket, uint32_t slot_id)
+{
+  struct keystore_keys_entry **link;
+  struct keystore_keys_entry *entry;
+
+  pthread_mutex_lock(&_keys_lock);
+  link = keystore_keys_find_slot(client_ticket, slot_id);
+  entry = *link;
+  if (entry && --entry->refs)
+  {
+    pthread_mutex_unlock(&_keys_lock);
+    return 1;
+  }
+
+  if (entry)
+  {
+    *link = entry->next_slot;
+    keystore_keys_unlink_key(entry);
+    free(entry);
+  }
+  pthread_mutex_unlock(&_keys_lock);
+
+  return 0;
+}
+
+void keystore_keys_forget(const uint8_t *client_ticket)
+{
+  pthread_mutex_lock(&_keys_lock);
+  keystore_keys_drop_locked(client_ticket);
+  pthread_mutex_unlock(&_keys_lock);
+}
+
+void keystore_keys_reset(void)
+{
+  pthread_mutex_lock(&_keys_lock);
+  _keys_generation++;
+  keystore_keys_drop_locked(NULL);
+  pthread_mutex_unlock(&_keys_lock);
+}
+
+void keystore_keys_atfork_prepare(void)
+{
+  pthread_mutex_lock(&_keys_lock);
+}
+
+void keystore_keys_atfork_parent(void)
+{
+  pthread_mutex_unlock(&_keys_lock);
+}
+
+void keystore_keys_atfork_child(void)
+{
+  struct keystore_keys_entry *entry;
+  size_t i;
+
+  /* Loads of the parent never finish here, drop those entries as well */
+  for (i = 0; i < KEYSTORE_KEYS_BUCKETS; i++)
+  {
+    while ((entry = _keys_by_key[i]) != NULL)
+    {
+      _keys_by_key[i] = entry->next_key;
+      free(entry);
+    }
+    _keys_by_slot[i] = NULL;
+  }
+
+  _keys_generation++;
+  pthread_cond_init(&_keys_cond, NULL);
+  pthread_mutex_unlock(&_keys_lock);
+}
+
+/* end of file */
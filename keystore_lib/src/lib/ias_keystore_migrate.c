@@ -0,0 +1,210 @@
+/*
+   Copyright 2018 Intel Corporation
+
+   This software is licensed to you in accordance
+   with the agreement between you and Intel Corporation.
+
+   Alternatively, you can use this file in compliance
+   with the Apache license, Version 2.
+
+
+   Apache License, Version 2.0
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+   http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "ias_keystore.h"
+#include "ias_keystore_migrate.h"
+
+#define KEYSTORE_MIGRATE_DEFAULT_WORKERS 4
+#define KEYSTORE_MIGRATE_MAX_WORKERS 64
+#define KEYSTORE_MIGRATE_DEFAULT_PROGRESS_MS 1000
+
+struct keystore_migrate {
+  const uint8_t *client_ticket;
+  const struct ias_keystore_migrate_config *config;
+
+  pthread_mutex_t next_lock;   /* serializes next() */
+  int done;
+  int error;
+
+  pthread_mutex_t stats_lock;  /* counters and progress() */
+  struct ias_keystore_migrate_stats stats;
+  uint64_t start_ns;
+  uint64_t progress_ns;
+  uint64_t interval_ns;
+};
+
+static uint64_t keystore_migrate_now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * @brief Helper function, runs the load and re-wrap cycle of one key.
+ *
+ * @return 0 if the key is current, IAS_KEYSTORE_MIGRATE_REWRAPPED or
+ * negative error code (see errno.h).
+ */
+static int keystore_migrate_key(const uint8_t *client_ticket,
+                                struct ias_keystore_migrate_key *key)
+{
+  uint32_t slot_id;
+  int res;
+
+  res = ias_keystore_load_key(client_ticket, key->wrapped_key, key->wrapped_key_size, &slot_id);
+  if (!res)
+  {
+    ias_keystore_unload_key(client_ticket, slot_id);
+    return 0;
+  }
+
+  if (res != -EAGAIN)
+    return res;
+
+  /* Re-wrapped in place, check the new blob before it is stored */
+  res = ias_keystore_load_key(client_ticket, key->wrapped_key, key->wrapped_key_size, &slot_id);
+  if (res)
+    return res == -EAGAIN ? -EIO : res;
+
+  ias_keystore_unload_key(client_ticket, slot_id);
+  return IAS_KEYSTORE_MIGRATE_REWRAPPED;
+}
+
+/**
+ * @brief Helper function, counts a processed key and reports progress.
+ */
+static void keystore_migrate_account(struct keystore_migrate *migrate, int result)
+{
+  const struct ias_keystore_migrate_config *config = migrate->config;
+  uint64_t now;
+
+  pthread_mutex_lock(&migrate->stats_lock);
+  migrate->stats.keys++;
+  if (result < 0)
+    migrate->stats.failed++;
+  else if (result == IAS_KEYSTORE_MIGRATE_REWRAPPED)
+    migrate->stats.rewrapped++;
+  else
+    migrate->stats.current++;
+
+  if (config->progress)
+  {
+    now = keystore_migrate_now_ns();
+    if (now - migrate->progress_ns >= migrate->interval_ns)
+    {
+      migrate->progress_ns = now;
+      migrate->stats.elapsed_ns = now - migrate->start_ns;
+      config->progress(config->priv, &migrate->stats);
+    }
+  }
+  pthread_mutex_unlock(&migrate->stats_lock);
+}
+
+static void *keystore_migrate_worker(void *arg)
+{
+  struct keystore_migrate *migrate = (struct keystore_migrate *)arg;
+  const struct ias_keystore_migrate_config *config = migrate->config;
+  struct ias_keystore_migrate_key key;
+  int res;
+
+  for (;;)
+  {
+    memset(&key, 0, sizeof(key));
+
+    pthread_mutex_lock(&migrate->next_lock);
+    res = migrate->done ? 0 : config->next(config->priv, &key);
+    if (res <= 0)
+    {
+      migrate->done = 1;
+      if (res < 0 && !migrate->error)
+        migrate->error = res;
+    }
+    pthread_mutex_unlock(&migrate->next_lock);
+
+    if (res <= 0)
+      break;
+
+    if (!key.wrapped_key || !key.wrapped_key_size)
+      key.result = -EINVAL;
+    else
+      key.result = keystore_migrate_key(migrate->client_ticket, &key);
+
+    res = config->complete(config->priv, &key);
+    keystore_migrate_account(migrate, res < 0 ? res : key.result);
+  }
+
+  return NULL;
+}
+
+int ias_keystore_migrate(const uint8_t *client_ticket,
+                         const struct ias_keystore_migrate_config *config,
+                         struct ias_keystore_migrate_stats *stats)
+{
+  struct keystore_migrate migrate;
+  pthread_t threads[KEYSTORE_MIGRATE_MAX_WORKERS];
+  unsigned int workers = KEYSTORE_MIGRATE_DEFAULT_WORKERS;
+  unsigned int started, i;
+
+  if (!client_ticket || !config || !config->next || !config->complete)
+    return -EFAULT;
+
+  if (config->workers)
+    workers = config->workers;
+  if (workers > KEYSTORE_MIGRATE_MAX_WORKERS)
+    return -EINVAL;
+
+  memset(&migrate, 0, sizeof(migrate));
+  migrate.client_ticket = client_ticket;
+  migrate.config = config;
+  migrate.interval_ns = (uint64_t)(config->progress_ms ? config->progress_ms :
+                                   KEYSTORE_MIGRATE_DEFAULT_PROGRESS_MS) * 1000000ull;
+  migrate.start_ns = keystore_migrate_now_ns();
+  migrate.progress_ns = migrate.start_ns;
+  pthread_mutex_init(&migrate.next_lock, NULL);
+  pthread_mutex_init(&migrate.stats_lock, NULL);
+
+  /* The calling thread is one of the workers */
+  for (started = 0; started < workers - 1; started++)
+  {
+    /* Continue with fewer workers if a thread cannot be started */
+    if (pthread_create(&threads[started], NULL, keystore_migrate_worker, &migrate))
+      break;
+  }
+
+  keystore_migrate_worker(&migrate);
+
+  for (i = 0; i < started; i++)
+    pthread_join(threads[i], NULL);
+
+  migrate.stats.elapsed_ns = keystore_migrate_now_ns() - migrate.start_ns;
+  if (config->progress)
+    config->progress(config->priv, &migrate.stats);
+
+  if (stats)
+    *stats = migrate.stats;
+
+  pthread_mutex_destroy(&migrate.stats_lock);
+  pthread_mutex_destroy(&migrate.next_lock);
+  return migrate.error;
+}
+
+/* end of file */
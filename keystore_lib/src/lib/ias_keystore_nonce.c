@@ -0,0 +1,245 @@
+/*
+   Copyright 2018 Intel Corporation
+
+   This software is licensed to you in accordance
+   with the agreement between you and Intel Corporation.
+
+   Alternatively, you can use this file in compliance
+   with the Apache license, Version 2.
+
+
+   Apache License, Version 2.0
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+   http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "ias_keystore_nonce.h"
+#include "ias_keystore_priv.h"
+
+/*
+ * State file: one struct keystore_nonce_state, rewritten in place. It is
+ * smaller than a disk sector, so a write is never torn.
+ */
+#define KEYSTORE_NONCE_MAGIC "IASKSNC1"
+#define KEYSTORE_NONCE_VERSION 1
+
+struct keystore_nonce_state {
+  char magic[8];
+  uint32_t version;
+  uint8_t fixed[IAS_KEYSTORE_NONCE_FIXED_SIZE];
+  uint64_t high_water;     /* no IV at or above this counter was handed out */
+};
+
+struct ias_keystore_nonce {
+  uint64_t counter;        /* next counter value, atomic */
+  uint64_t high_water;     /* reserved up to here, atomic */
+  pthread_mutex_t lock;    /* serialises the state file writes */
+  int fd;
+  uint32_t reserve;
+  uint8_t fixed[IAS_KEYSTORE_NONCE_FIXED_SIZE];
+};
+
+/**
+ * @brief Helper function, writes the high-water mark to the state file.
+ */
+static int keystore_nonce_store(struct ias_keystore_nonce *nonce, uint64_t high_water)
+{
+  struct keystore_nonce_state state;
+
+  if (nonce->fd < 0)
+    return 0;
+
+  memset(&state, 0, sizeof(state));
+  memcpy(state.magic, KEYSTORE_NONCE_MAGIC, sizeof(state.magic));
+  state.version = KEYSTORE_NONCE_VERSION;
+  memcpy(state.fixed, nonce->fixed, sizeof(state.fixed));
+  state.high_water = high_water;
+
+  if (pwrite(nonce->fd, &state, sizeof(state), 0) != (ssize_t)sizeof(state))
+    return -EIO;
+
+  return fdatasync(nonce->fd) ? -errno : 0;
+}
+
+/**
+ * @brief Helper function, reads the state file or starts a new one.
+ */
+static int keystore_nonce_load(struct ias_keystore_nonce *nonce)
+{
+  struct keystore_nonce_state state;
+  struct stat st;
+  ssize_t res;
+
+  if (nonce->fd >= 0)
+  {
+    if (fstat(nonce->fd, &st))
+      return -errno;
+
+    if (st.st_size)
+    {
+      res = pread(nonce->fd, &state, sizeof(state), 0);
+      if (res != (ssize_t)sizeof(state) ||
+          memcmp(state.magic, KEYSTORE_NONCE_MAGIC, sizeof(state.magic)) ||
+          state.version != KEYSTORE_NONCE_VERSION)
+        return -EBADMSG;
+
+      memcpy(nonce->fixed, state.fixed, sizeof(nonce->fixed));
+      nonce->counter = state.high_water;
+      return 0;
+    }
+  }
+
+  /* A new key: a random fixed field, the counter from 0 */
+  res = keystore_random(nonce->fixed, sizeof(nonce->fixed));
+  if (res)
+    return (int)res;
+
+  nonce->counter = 0;
+  return 0;
+}
+
+/**
+ * @brief Helper function, reserves counter values above @counter.
+ *
+ * Called when ias_keystore_nonce_next() took a counter value which is not
+ * reserved yet; the IV must not be handed out before the mark is stored.
+ */
+static int keystore_nonce_reserve(struct ias_keystore_nonce *nonce, uint64_t counter)
+{
+  uint64_t high_water;
+  int res = 0;
+
+  pthread_mutex_lock(&nonce->lock);
+  if (counter >= nonce->high_water)
+  {
+    high_water = counter + 1 + nonce->reserve;
+    res = keystore_nonce_store(nonce, high_water);
+    if (!res)
+      __atomic_store_n(&nonce->high_water, high_water, __ATOMIC_RELEASE);
+  }
+  pthread_mutex_unlock(&nonce->lock);
+
+  return res;
+}
+
+int ias_keystore_nonce_open(const char *path, uint32_t reserve,
+                            struct ias_keystore_nonce **nonce)
+{
+  struct ias_keystore_nonce *n;
+  int res = 0;
+
+  if (!nonce)
+    return -EFAULT;
+
+  n = (struct ias_keystore_nonce *)calloc(1, sizeof(*n));
+  if (!n)
+    return -ENOMEM;
+
+  pthread_mutex_init(&n->lock, NULL);
+  n->reserve = reserve ? reserve : IAS_KEYSTORE_NONCE_RESERVE;
+  n->fd = -1;
+
+  if (path)
+  {
+    n->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (n->fd < 0)
+      res = -errno;
+    else if (flock(n->fd, LOCK_EX | LOCK_NB))
+      res = errno == EWOULDBLOCK ? -EBUSY : -errno;
+  }
+
+  if (!res)
+    res = keystore_nonce_load(n);
+
+  /* Reserve the first values now, so a new file is complete at once */
+  if (!res)
+    res = keystore_nonce_reserve(n, n->counter);
+
+  if (res)
+  {
+    if (n->fd >= 0)
+      close(n->fd);
+    pthread_mutex_destroy(&n->lock);
+    free(n);
+    return res;
+  }
+
+  *nonce = n;
+  return 0;
+}
+
+int ias_keystore_nonce_next(struct ias_keystore_nonce *nonce, uint8_t *iv)
+{
+  uint64_t counter;
+  int res;
+  int i;
+
+  if (!nonce || !iv)
+    return -EFAULT;
+
+  counter = __atomic_fetch_add(&nonce->counter, 1, __ATOMIC_RELAXED);
+
+  /* Stop well before the counter wraps, a reserve below the end */
+  if (counter >= UINT64_MAX - nonce->reserve)
+    return -EOVERFLOW;
+
+  if (counter >= __atomic_load_n(&nonce->high_water, __ATOMIC_ACQUIRE))
+  {
+    res = keystore_nonce_reserve(nonce, counter);
+    if (res)
+      return res;
+  }
+
+  memcpy(iv, nonce->fixed, IAS_KEYSTORE_NONCE_FIXED_SIZE);
+  for (i = DAL_KEYSTORE_GCM_IV_SIZE - 1; i >= IAS_KEYSTORE_NONCE_FIXED_SIZE; i--)
+  {
+    iv[i] = (uint8_t)counter;
+    counter >>= 8;
+  }
+
+  return 0;
+}
+
+uint64_t ias_keystore_nonce_counter(const struct ias_keystore_nonce *nonce)
+{
+  return nonce ? __atomic_load_n(&nonce->counter, __ATOMIC_RELAXED) : 0;
+}
+
+int ias_keystore_nonce_close(struct ias_keystore_nonce *nonce)
+{
+  int res;
+
+  if (!nonce)
+    return 0;
+
+  /* Nothing above the counter was handed out; a failed reserve may have
+   * left the counter above the stored mark, which is harmless */
+  res = keystore_nonce_store(nonce, nonce->counter);
+
+  if (nonce->fd >= 0)
+    close(nonce->fd);
+  pthread_mutex_destroy(&nonce->lock);
+  free(nonce);
+
+  return res;
+}
+
+/* end of file */
@@ -0,0 +1,400 @@
+/*
+   Copyright 2018 Intel Corporation
+
+   This software is licensed to you in accordance
+   with the agreement between you and Intel Corporation.
+
+   Alternatively, you can use this file in compliance
+   with the Apache license, Version 2.
+
+
+   Apache License, Version 2.0
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+   http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef IAS_KEYSTORE_PRIV_H
+#define IAS_KEYSTORE_PRIV_H
+
+/*
+ * Internal interfaces shared between the keystore_lib translation units.
+ * Not installed and not part of the public API.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/ioctl.h>
+
+#include "keystore_api_user.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/**
+ * @brief In-process keystore backend.
+ *
+ * Device names starting with @prefix are served by the backend instead
+ * of a device node. The handles of such devices are at or above
+ * KEYSTORE_VDEV_BASE, well above any file descriptor.
+ *
+ * @param prefix  Device name prefix, including the separator (e.g. "sim:").
+ * @param open    Open a handle; @args is the device name after the prefix.
+ * @param close   Close a handle.
+ * @param ioctl   Execute a request, returns >=0 if OK or negative error code.
+ * @param atfork_child  Called on each open handle in a fork() child, may be
+ *                      NULL. Drops state shared with the parent.
+ */
+struct keystore_backend {
+  const char *prefix;
+  int (*open)(const char *args, void **priv);
+  void (*close)(void *priv);
+  int (*ioctl)(void *priv, unsigned int cmd, void *request);
+  void (*atfork_child)(void *priv);
+};
+
+#define KEYSTORE_VDEV_BASE 0x40000000
+
+/* Software keystore, see ias_keystore_sim.c */
+extern const struct keystore_backend keystore_sim_backend;
+
+/* Broker client, see ias_keystore_unix.c */
+extern const struct keystore_backend keystore_unix_backend;
+
+/**
+ * @brief Open a keystore device.
+ *
+ * @param[in] dev_name Path to the device or name of an in-process backend.
+ *
+ * @return Device handle if OK or negative error code (see errno.h).
+ */
+int keystore_dev_open(const char *dev_name);
+
+/**
+ * @brief Close a handle returned by keystore_dev_open().
+ *
+ * @param[in] fd Device handle.
+ */
+void keystore_dev_close(int fd);
+
+/**
+ * @brief Execute an ioctl request on a device handle.
+ *
+ * @param[in] fd Device handle returned by keystore_dev_open().
+ * @param[in] cmd IOCTL command to execute.
+ * @param[in] request Pointer to the request data structure.
+ *
+ * @return >=0 if OK or negative error code (see errno.h).
+ */
+int keystore_dev_ioctl(int fd, unsigned int cmd, void *request);
+
+/**
+ * @brief Same as keystore_dev_ioctl(), without reporting failures.
+ *
+ * For probes, which expect some requests to fail.
+ */
+int keystore_dev_ioctl_quiet(int fd, unsigned int cmd, void *request);
+
+/*
+ * Commands of the library's own backends. The driver does not define
+ * them, so they use a magic of their own which can never collide with
+ * a driver command; a driver fails them with -ENOTTY and the library
+ * falls back to one KEYSTORE_IOC_* call per operation.
+ */
+#define KEYSTORE_LIB_IOC_MAGIC  'k'
+
+/**
+ * struct ias_keystore_crypto_batch_entry - One operation of a batch
+ * @slot_id:          The assigned slot
+ * @algospec:         The encryption algorithm to use
+ * @iv:               The initialisation vector (IV)
+ * @iv_size:          Size of the IV.
+ * @input:            Pointer to the input data
+ * @input_size:       Size of the input data
+ * @output:           Pointer to an output buffer
+ * @status:           0 or negative error code for this entry
+ *
+ * The fields have the same meaning as in &struct ias_keystore_encrypt_decrypt.
+ */
+struct ias_keystore_crypto_batch_entry {
+	/* input */
+	uint32_t slot_id;
+	uint32_t algospec;
+	const uint8_t *iv;
+	uint32_t iv_size;
+	const uint8_t *input;
+	uint32_t input_size;
+
+	/* output */
+	uint8_t *output;  /* notice: pointer */
+	int32_t status;
+};
+
+/**
+ * struct ias_keystore_crypto_batch - Encrypt or Decrypt several buffers
+ * @client_ticket:    Ticket used to identify this client session
+ * @count:            Number of entries
+ * @entries:          Pointer to @count entries
+ *
+ * Process all entries with the keys of one client session in a single
+ * call. Each entry reports its own status. The ioctl itself only fails
+ * if the batch as a whole could not be processed.
+ *
+ * A batch with a @count of zero is accepted without checking the ticket,
+ * so user space can probe for batch support.
+ */
+struct ias_keystore_crypto_batch {
+	/* input */
+	uint8_t client_ticket[KEYSTORE_CLIENT_TICKET_SIZE];
+	uint32_t count;
+
+	/* input / output */
+	struct ias_keystore_crypto_batch_entry *entries;
+};
+
+/**
+ * KEYSTORE_LIB_IOC_ENCRYPT_BATCH - Encrypt several buffers in one call.
+ *
+ * Served by the sim and unix backends; the driver fails it with -ENOTTY.
+ * Uses &struct ias_keystore_crypto_batch.
+ */
+#define KEYSTORE_LIB_IOC_ENCRYPT_BATCH\
+	_IOWR(KEYSTORE_LIB_IOC_MAGIC, 12, struct ias_keystore_crypto_batch)
+
+/**
+ * KEYSTORE_LIB_IOC_DECRYPT_BATCH - Decrypt several buffers in one call.
+ *
+ * Served by the sim and unix backends; the driver fails it with -ENOTTY.
+ * Uses &struct ias_keystore_crypto_batch.
+ */
+#define KEYSTORE_LIB_IOC_DECRYPT_BATCH\
+	_IOWR(KEYSTORE_LIB_IOC_MAGIC, 13, struct ias_keystore_crypto_batch)
+
+struct iovec;
+
+/**
+ * struct ias_keystore_encrypt_decrypt_vec - Encrypt or Decrypt scattered buffers
+ * @client_ticket:    Ticket used to identify this client session
+ * @slot_id:          The assigned slot
+ * @algospec:         The encryption algorithm to use
+ * @iv:               The initialisation vector (IV)
+ * @iv_size:          Size of the IV.
+ * @input:            Pointer to @input_count input segments
+ * @input_count:      Number of input segments
+ * @output:           Pointer to @output_count output segments
+ * @output_count:     Number of output segments
+ *
+ * Same as &struct ias_keystore_encrypt_decrypt, with the input being the
+ * concatenation of the input segments and the output filling the output
+ * segments in order.
+ *
+ * A request with a NULL @output is accepted without checking the ticket,
+ * so user space can probe for vector support.
+ */
+struct ias_keystore_encrypt_decrypt_vec {
+	/* input */
+	uint8_t client_ticket[KEYSTORE_CLIENT_TICKET_SIZE];
+	uint32_t slot_id;
+	uint32_t algospec;
+	const uint8_t *iv;
+	uint32_t iv_size;
+	const struct iovec *input;
+	uint32_t input_count;
+
+	/* output */
+	const struct iovec *output;  /* notice: pointer */
+	uint32_t output_count;
+};
+
+/**
+ * KEYSTORE_LIB_IOC_ENCRYPTV - Encrypt scattered buffers.
+ *
+ * Served by the unix backend; the driver fails it with -ENOTTY.
+ * Uses &struct ias_keystore_encrypt_decrypt_vec.
+ */
+#define KEYSTORE_LIB_IOC_ENCRYPTV\
+	_IOW(KEYSTORE_LIB_IOC_MAGIC, 14, struct ias_keystore_encrypt_decrypt_vec)
+
+/**
+ * KEYSTORE_LIB_IOC_DECRYPTV - Decrypt scattered buffers.
+ *
+ * Served by the unix backend; the driver fails it with -ENOTTY.
+ * Uses &struct ias_keystore_encrypt_decrypt_vec.
+ */
+#define KEYSTORE_LIB_IOC_DECRYPTV\
+	_IOW(KEYSTORE_LIB_IOC_MAGIC, 15, struct ias_keystore_encrypt_decrypt_vec)
+
+/* Size table of a device, see ias_keystore_size.c */
+struct keystore_size_table;
+
+/**
+ * @brief Look up or build the size table of a device.
+ *
+ * Issues one KEYSTORE_IOC_VERSION call, and the size ioctls the first
+ * time a device name and version are seen.
+ *
+ * @param[in] fd Device handle.
+ * @param[in] device Name the handle was opened with.
+ *
+ * @return The table, NULL if the device does not follow the table shape.
+ */
+const struct keystore_size_table *keystore_size_table(int fd, const char *device);
+
+/**
+ * @brief Wrapped key size from a size table.
+ *
+ * @return 0 if OK, -ENOENT if the key spec is not in the table.
+ */
+int keystore_size_wrapped(const struct keystore_size_table *table, uint32_t key_spec,
+                          uint32_t *wrapped_key_size, uint32_t *unwrapped_key_size);
+
+/**
+ * @brief Encrypt or decrypt output size from a size table.
+ *
+ * @param[in] cmd KEYSTORE_IOC_ENCRYPT_SIZE or KEYSTORE_IOC_DECRYPT_SIZE.
+ *
+ * @return 0 if OK, -ENOENT if the device has to be asked.
+ */
+int keystore_size_crypt(const struct keystore_size_table *table, unsigned int cmd,
+                        uint32_t algo_spec, size_t input_size, size_t *output_size);
+
+/* Loaded key table, see ias_keystore_keys.c */
+struct keystore_keys_entry;
+
+/**
+ * @brief Share a loaded key or claim its load.
+ *
+ * @param[out] slot_id Slot of the key, if it is loaded.
+ * @param[out] claim Entry to complete with keystore_keys_loaded() after
+ *                   loading the key, NULL if it is not shared.
+ *
+ * Waits while another thread loads the same key.
+ *
+ * @return 1 if the key is loaded and a reference was taken, 0 if the
+ * caller has to load it.
+ */
+int keystore_keys_claim(const uint8_t *client_ticket,
+                        const uint8_t *wrapped_key, size_t wrapped_key_size,
+                        uint32_t *slot_id, struct keystore_keys_entry **claim);
+
+/**
+ * @brief Complete a load claimed with keystore_keys_claim().
+ *
+ * @param[in] claim The claimed entry, may be NULL.
+ * @param[in] res Result of the load.
+ * @param[in] slot_id Slot of the key if @res is 0.
+ */
+void keystore_keys_loaded(struct keystore_keys_entry *claim, int res, uint32_t slot_id);
+
+/**
+ * @brief Drop a reference to a loaded key.
+ *
+ * @return 1 if other references remain and the slot has to stay
+ * loaded, 0 if it has to be unloaded.
+ */
+int keystore_keys_release(const uint8_t *client_ticket, uint32_t slot_id);
+
+/**
+ * @brief Drop all keys of an unregistered client.
+ */
+void keystore_keys_forget(const uint8_t *client_ticket);
+
+/**
+ * @brief Drop all keys, called when the device changes.
+ */
+void keystore_keys_reset(void);
+
+/**
+ * @brief Fill @buf with random bytes from the buffer of the calling thread.
+ *
+ * @return 0 if OK or negative error code (see errno.h).
+ */
+int keystore_random(uint8_t *buf, size_t size);
+
+/* fork() handlers of the loaded key table */
+void keystore_keys_atfork_prepare(void);
+void keystore_keys_atfork_parent(void);
+void keystore_keys_atfork_child(void);
+
+/*
+ * KEYSTORE_MAX_TAG_SIZE - Most bytes an AES mode adds to its input
+ */
+#define KEYSTORE_MAX_TAG_SIZE 16
+
+/**
+ * @brief Output size of an encrypt (@cmd KEYSTORE_IOC_ENCRYPT_SIZE) or
+ * decrypt (KEYSTORE_IOC_DECRYPT_SIZE) call on a device.
+ */
+typedef int (*keystore_crypt_size_fn)(void *priv, unsigned int cmd, uint32_t algo_spec,
+                                      size_t input_size, size_t *output_size);
+
+/**
+ * @brief Check the output buffer of an encrypt (@encrypt set) or decrypt call
+ * against its input.
+ *
+ * @param crypt_size  Output size on the device of the call, only asked for
+ *                    an output closely below the input.
+ * @param priv        Passed to @crypt_size.
+ *
+ * @return 0 if the buffers do not overlap or are the same buffer of an
+ * AES-GCM or AES-CCM call (in place), -EINVAL otherwise.
+ */
+int keystore_crypt_check_alias(int encrypt, uint32_t algo_spec,
+                               const uint8_t *input, size_t input_size,
+                               const uint8_t *output,
+                               keystore_crypt_size_fn crypt_size, void *priv);
+
+struct iovec;
+
+/**
+ * @brief Total size of I/O segments.
+ *
+ * @return 0 if OK, -EFAULT if a segment with data has no base, -EINVAL if
+ * there are more than IAS_KEYSTORE_IOV_MAX segments or more than
+ * UINT32_MAX bytes.
+ */
+int keystore_iov_size(const struct iovec *iov, size_t count, size_t *size);
+
+/**
+ * @brief Copy the first @size bytes of I/O segments to @dst.
+ */
+void keystore_iov_gather(uint8_t *dst, const struct iovec *iov, size_t count, size_t size);
+
+/**
+ * @brief Copy @size bytes from @src into I/O segments, in order.
+ */
+void keystore_iov_scatter(const struct iovec *iov, size_t count, const uint8_t *src, size_t size);
+
+/**
+ * @brief Start timing an ioctl for the call statistics.
+ *
+ * @return Start timestamp, 0 if statistics are disabled.
+ */
+uint64_t keystore_stats_begin(void);
+
+/**
+ * @brief Account a finished ioctl in the call statistics.
+ *
+ * @param[in] cmd IOCTL command which was executed.
+ * @param[in] request Pointer to the request data structure.
+ * @param[in] start Timestamp returned by keystore_stats_begin().
+ * @param[in] res Result of the ioctl.
+ */
+void keystore_stats_end(unsigned int cmd, const void *request, uint64_t start, int res);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* IAS_KEYSTORE_PRIV_H */
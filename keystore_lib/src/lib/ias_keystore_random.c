@@ -0,0 +1,159 @@
+/*
+   Copyright 2018 Intel Corporation
+
+   This software is licensed to you in accordance
+   with the agreement between you and Intel Corporation.
+
+   Alternatively, you can use this file in compliance
+   with the Apache license, Version 2.
+
+
+   Apache License, Version 2.0
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+   http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/random.h>
+
+#include "ias_keystore.h"
+#include "ias_keystore_aes.h"
+#include "ias_keystore_priv.h"
+
+/*
+ * Random bytes for IVs come from a buffer per thread, refilled with one
+ * getrandom() call per KEYSTORE_RANDOM_BUFFER_SIZE bytes. Handed out bytes
+ * are cleared from the buffer. A fork() child starts with a copy of the
+ * parent's buffer; the generation is bumped in the child, so the copy is
+ * dropped before it can repeat an IV of the parent.
+ */
+#define KEYSTORE_RANDOM_BUFFER_SIZE 4096
+
+/* CCM flags byte of ias_keystore_random_iv(): a 2 byte length field */
+#define KEYSTORE_RANDOM_CCM_FLAGS 1
+
+struct keystore_random_buffer {
+  unsigned int generation;
+  size_t pos;              /* bytes up to here are used */
+  uint8_t data[KEYSTORE_RANDOM_BUFFER_SIZE];
+};
+
+static __thread struct keystore_random_buffer _random_buffer;
+/* Starts at 1, so an untouched buffer is refilled first */
+static unsigned int _random_generation = 1;
+static pthread_once_t _random_atfork_once = PTHREAD_ONCE_INIT;
+
+static void keystore_random_atfork_child(void)
+{
+  __atomic_add_fetch(&_random_generation, 1, __ATOMIC_RELAXED);
+}
+
+static void keystore_random_register_atfork(void)
+{
+  pthread_atfork(NULL, NULL, keystore_random_atfork_child);
+}
+
+/**
+ * @brief Helper function, fills @buf from getrandom().
+ */
+static int keystore_random_read(uint8_t *buf, size_t size)
+{
+  ssize_t res;
+
+  while (size)
+  {
+    res = getrandom(buf, size, 0);
+    if (res < 0 && errno == EINTR)
+      continue;
+    if (res <= 0)
+      return res < 0 ? -errno : -EIO;
+    buf += res;
+    size -= (size_t)res;
+  }
+  return 0;
+}
+
+int keystore_random(uint8_t *buf, size_t size)
+{
+  struct keystore_random_buffer *b = &_random_buffer;
+  unsigned int generation;
+  size_t n;
+  int res;
+
+  if (!buf)
+    return -EFAULT;
+
+  /* Large requests would drain the buffer for nothing */
+  if (size > KEYSTORE_RANDOM_BUFFER_SIZE / 4)
+    return keystore_random_read(buf, size);
+
+  generation = __atomic_load_n(&_random_generation, __ATOMIC_RELAXED);
+  if (b->generation != generation)
+  {
+    pthread_once(&_random_atfork_once, keystore_random_register_atfork);
+    b->generation = generation;
+    b->pos = sizeof(b->data);
+  }
+
+  while (size)
+  {
+    if (b->pos == sizeof(b->data))
+    {
+      res = keystore_random_read(b->data, sizeof(b->data));
+      if (res)
+        return res;
+      b->pos = 0;
+    }
+
+    n = sizeof(b->data) - b->pos;
+    if (n > size)
+      n = size;
+    memcpy(buf, b->data + b->pos, n);
+    keystore_memzero(b->data + b->pos, n);
+    b->pos += n;
+    buf += n;
+    size -= n;
+  }
+
+  return 0;
+}
+
+int ias_keystore_random_iv(enum keystore_algo_spec algo_spec, uint8_t *iv, size_t *iv_size)
+{
+  int res;
+
+  if (!iv || !iv_size)
+    return -EFAULT;
+
+  if (algo_spec != ALGOSPEC_AES_GCM && algo_spec != ALGOSPEC_AES_CCM)
+    return -EINVAL;
+
+  if (*iv_size < DAL_KEYSTORE_GCM_IV_SIZE)
+  {
+    *iv_size = DAL_KEYSTORE_GCM_IV_SIZE;
+    return -EMSGSIZE;
+  }
+
+  res = keystore_random(iv, DAL_KEYSTORE_GCM_IV_SIZE);
+  if (res)
+    return res;
+
+  if (algo_spec == ALGOSPEC_AES_CCM)
+    iv[0] = KEYSTORE_RANDOM_CCM_FLAGS;
+
+  *iv_size = DAL_KEYSTORE_GCM_IV_SIZE;
+  return 0;
+}
+
+/* end of file */
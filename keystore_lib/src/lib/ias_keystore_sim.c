@@ -0,0 +1,817 @@
+/*
+   Copyright 2018 Intel Corporation
+
+   This software is licensed to you in accordance
+   with the agreement between you and Intel Corporation.
+
+   Alternatively, you can use this file in compliance
+   with the Apache license, Version 2.
+
+
+   Apache License, Version 2.0
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+   http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/random.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "keystore_api_user.h"
+
+#include "ias_keystore_aes.h"
+#include "ias_keystore_priv.h"
+
+/*
+ * Software keystore backend ("sim:" device names).
+ *
+ * Implements the keystore ioctl ABI in the calling process, so that the
+ * library can be tested and benchmarked without DAL hardware. The key
+ * hierarchy mirrors the real one: client keys are derived from a SEED,
+ * the SEED type, the SEED SVN and the path of the calling executable.
+ * The SEED is a constant, so wrapped keys stay loadable across runs,
+ * but they offer no protection whatsoever.
+ *
+ * Clients and slots live in the process: they disappear on exit.
+ */
+
+#define KEYSTORE_SIM_CLIENTS_MAX 256
+#define KEYSTORE_SIM_SLOTS_MAX 256
+/* svn and synthetic IV, the KEYSTORE_WRAPPED_KEY_EXTRA of the driver */
+#define KEYSTORE_SIM_WRAP_EXTRA (1 + KEYSTORE_AES_TAG_SIZE)
+#define KEYSTORE_SIM_KEY_SIZE_MAX 32
+
+struct keystore_sim_slot {
+  int used;
+  struct keystore_gcm_key key;
+};
+
+/**
+ * @brief Client key, split into a MAC and an encryption key (SIV, RFC 5297).
+ */
+struct keystore_sim_wrap_key {
+  struct keystore_aes_key mac;
+  struct keystore_aes_key enc;
+};
+
+struct keystore_sim_client {
+  int used;
+  uint8_t ticket[KEYSTORE_CLIENT_TICKET_SIZE];
+  enum keystore_seed_type seed_type;
+  uint8_t svn;
+  struct keystore_sim_wrap_key wrap_key;
+  struct keystore_sim_slot *slots;
+};
+
+struct keystore_sim {
+  pthread_rwlock_t lock;
+  struct keystore_sim_client clients[KEYSTORE_SIM_CLIENTS_MAX];
+  unsigned int clients_end;
+  uint8_t svn;
+  struct keystore_aes_key seed;
+  char client_id[PATH_MAX];
+  size_t client_id_size;
+};
+
+struct keystore_sim_handle {
+  uint64_t latency_ns;
+};
+
+static struct keystore_sim _sim = {
+  .lock = PTHREAD_RWLOCK_INITIALIZER,
+  .svn = 1,
+};
+static pthread_once_t _sim_once = PTHREAD_ONCE_INIT;
+
+static const uint8_t _sim_seed[32] = "ias-keystore-sim-master-key-0001";
+static const char _sim_label[] = "IAS keystore client key";
+
+static void keystore_sim_init(void)
+{
+  ssize_t len;
+
+  keystore_aes_setkey(&_sim.seed, _sim_seed, sizeof(_sim_seed));
+
+  /* Clients are identified by their executable, like in the driver */
+  len = readlink("/proc/self/exe", _sim.client_id, sizeof(_sim.client_id));
+  if (len <= 0 || (size_t)len >= sizeof(_sim.client_id))
+  {
+    strcpy(_sim.client_id, "unknown");
+    len = (ssize_t)strlen(_sim.client_id);
+  }
+  _sim.client_id_size = (size_t)len;
+}
+
+/**
+ * @brief Helper function, fills a buffer with random data.
+ */
+static int keystore_sim_random(uint8_t *buf, size_t size)
+{
+  ssize_t res;
+
+  while (size)
+  {
+    res = getrandom(buf, size, 0);
+    if (res < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      return -errno;
+    }
+    buf += res;
+    size -= (size_t)res;
+  }
+
+  return 0;
+}
+
+/**
+ * @brief Helper function, derives a client key (NIST SP 800-108 counter mode KDF with CMAC).
+ */
+static int keystore_sim_client_key(enum keystore_seed_type seed_type, uint8_t svn,
+                                   struct keystore_sim_wrap_key *key)
+{
+  uint8_t msg[1 + sizeof(_sim_label) + 2 + PATH_MAX + 2];
+  uint8_t raw[2 * KEYSTORE_SIM_KEY_SIZE_MAX];
+  size_t size = 0;
+  unsigned int i;
+  int res;
+
+  msg[size++] = 1;
+  memcpy(msg + size, _sim_label, sizeof(_sim_label));
+  size += sizeof(_sim_label);
+  msg[size++] = (uint8_t)seed_type;
+  msg[size++] = svn;
+  memcpy(msg + size, _sim.client_id, _sim.client_id_size);
+  size += _sim.client_id_size;
+  msg[size++] = (uint8_t)((sizeof(raw) * 8) >> 8);
+  msg[size++] = (uint8_t)(sizeof(raw) * 8);
+
+  for (i = 0; i < sizeof(raw) / KEYSTORE_AES_TAG_SIZE; i++)
+  {
+    msg[0] = (uint8_t)(i + 1);
+    keystore_cmac(&_sim.seed, msg, size, raw + i * KEYSTORE_AES_TAG_SIZE);
+  }
+
+  res = keystore_aes_setkey(&key->mac, raw, KEYSTORE_SIM_KEY_SIZE_MAX);
+  if (!res)
+    res = keystore_aes_setkey(&key->enc, raw + KEYSTORE_SIM_KEY_SIZE_MAX, KEYSTORE_SIM_KEY_SIZE_MAX);
+  keystore_memzero(raw, sizeof(raw));
+
+  return res;
+}
+
+static int keystore_sim_key_size(uint32_t key_spec, uint32_t *size)
+{
+  switch (key_spec)
+  {
+  case KEYSPEC_LENGTH_128:
+    *size = 16;
+    return 0;
+  case KEYSPEC_LENGTH_256:
+    *size = 32;
+    return 0;
+  case KEYSPEC_LENGTH_ECC_PAIR:
+    return -EOPNOTSUPP;
+  default:
+    return -EINVAL;
+  }
+}
+
+/**
+ * @brief Helper function, looks up a client. The lock must be held.
+ */
+static struct keystore_sim_client *keystore_sim_client(const uint8_t *ticket)
+{
+  unsigned int i;
+
+  for (i = 0; i < _sim.clients_end; i++)
+  {
+    struct keystore_sim_client *client = &_sim.clients[i];
+
+    if (client->used && !memcmp(client->ticket, ticket, sizeof(client->ticket)))
+      return client;
+  }
+
+  return NULL;
+}
+
+/**
+ * @brief Helper function, synthetic IV of a raw key: CMAC over svn | key.
+ */
+static void keystore_sim_siv(const struct keystore_sim_wrap_key *key, uint8_t svn,
+                             const uint8_t *raw, uint32_t size, uint8_t siv[KEYSTORE_AES_TAG_SIZE])
+{
+  uint8_t msg[1 + KEYSTORE_SIM_KEY_SIZE_MAX];
+
+  msg[0] = svn;
+  memcpy(msg + 1, raw, size);
+  keystore_cmac(&key->mac, msg, 1 + size, siv);
+  keystore_memzero(msg, sizeof(msg));
+}
+
+/**
+ * @brief Helper function, AES-CTR keyed by a synthetic IV. @input and @output may overlap.
+ */
+static void keystore_sim_ctr(const struct keystore_sim_wrap_key *key,
+                             const uint8_t siv[KEYSTORE_AES_TAG_SIZE],
+                             const uint8_t *input, uint32_t size, uint8_t *output)
+{
+  uint8_t counter[KEYSTORE_AES_BLOCK_SIZE];
+  uint8_t stream[KEYSTORE_AES_BLOCK_SIZE];
+  uint32_t i;
+
+  /* Clear the two bits RFC 5297 reserves for the counter carry */
+  memcpy(counter, siv, sizeof(counter));
+  counter[8] &= 0x7f;
+  counter[12] &= 0x7f;
+
+  for (i = 0; i < size; i++)
+  {
+    if (!(i % KEYSTORE_AES_BLOCK_SIZE))
+    {
+      keystore_aes_encrypt_block(&key->enc, counter, stream);
+      counter[15]++;
+    }
+    output[i] = input[i] ^ stream[i % KEYSTORE_AES_BLOCK_SIZE];
+  }
+
+  keystore_memzero(stream, sizeof(stream));
+}
+
+/**
+ * @brief Helper function, wraps a raw key: svn | synthetic IV | ciphertext.
+ *
+ * Deterministic, like SIV: wrapping the same key twice gives the same blob.
+ */
+static int keystore_sim_wrap(const struct keystore_sim_client *client,
+                             const uint8_t *raw, uint32_t size, uint8_t *wrapped)
+{
+  wrapped[0] = client->svn;
+  keystore_sim_siv(&client->wrap_key, client->svn, raw, size, wrapped + 1);
+  keystore_sim_ctr(&client->wrap_key, wrapped + 1, raw, size, wrapped + KEYSTORE_SIM_WRAP_EXTRA);
+  return 0;
+}
+
+/**
+ * @brief Helper function, unwraps a key and checks its synthetic IV.
+ */
+static int keystore_sim_unwrap(const struct keystore_sim_wrap_key *key, const uint8_t *wrapped,
+                               uint32_t size, uint8_t *raw)
+{
+  uint8_t siv[KEYSTORE_AES_TAG_SIZE];
+
+  keystore_sim_ctr(key, wrapped + 1, wrapped + KEYSTORE_SIM_WRAP_EXTRA, size, raw);
+  keystore_sim_siv(key, wrapped[0], raw, size, siv);
+
+  if (keystore_memcmp_ct(siv, wrapped + 1, sizeof(siv)))
+  {
+    keystore_memzero(raw, size);
+    return -EBADMSG;
+  }
+
+  return 0;
+}
+
+static int keystore_sim_register(struct ias_keystore_register *req)
+{
+  struct keystore_sim_client *client = NULL;
+  unsigned int i;
+  int res;
+
+  if (req->seed_type != SEED_TYPE_DEVICE && req->seed_type != SEED_TYPE_USER)
+    return -EINVAL;
+
+  pthread_rwlock_wrlock(&_sim.lock);
+
+  for (i = 0; i < KEYSTORE_SIM_CLIENTS_MAX && !client; i++)
+  {
+    if (!_sim.clients[i].used)
+      client = &_sim.clients[i];
+  }
+
+  if (!client)
+  {
+    res = -ENOSPC;
+    goto out;
+  }
+
+  client->slots = (struct keystore_sim_slot *)calloc(KEYSTORE_SIM_SLOTS_MAX, sizeof(*client->slots));
+  if (!client->slots)
+  {
+    res = -ENOMEM;
+    goto out;
+  }
+
+  do
+  {
+    res = keystore_sim_random(client->ticket, sizeof(client->ticket));
+  } while (!res && keystore_sim_client(client->ticket));
+
+  if (!res)
+    res = keystore_sim_client_key(req->seed_type, _sim.svn, &client->wrap_key);
+
+  if (res)
+  {
+    free(client->slots);
+    client->slots = NULL;
+    goto out;
+  }
+
+  client->seed_type = req->seed_type;
+  client->svn = _sim.svn;
+  client->used = 1;
+  if (i > _sim.clients_end)
+    _sim.clients_end = i;
+
+  memcpy(req->client_ticket, client->ticket, sizeof(req->client_ticket));
+
+out:
+  pthread_rwlock_unlock(&_sim.lock);
+  return res;
+}
+
+static int keystore_sim_unregister(const struct ias_keystore_unregister *req)
+{
+  struct keystore_sim_client *client;
+  int res = 0;
+
+  pthread_rwlock_wrlock(&_sim.lock);
+
+  client = keystore_sim_client(req->client_ticket);
+  if (client)
+  {
+    keystore_memzero(client->slots, KEYSTORE_SIM_SLOTS_MAX * sizeof(*client->slots));
+    free(client->slots);
+    keystore_memzero(client, sizeof(*client));
+  }
+  else
+  {
+    res = -EINVAL;
+  }
+
+  pthread_rwlock_unlock(&_sim.lock);
+  return res;
+}
+
+static int keystore_sim_wrapped_key_size(struct ias_keystore_wrapped_key_size *req)
+{
+  uint32_t size;
+  int res;
+
+  res = keystore_sim_key_size(req->key_spec, &size);
+  if (res)
+    return res;
+
+  req->unwrapped_key_size = size;
+  req->key_size = size + KEYSTORE_SIM_WRAP_EXTRA;
+
+  return 0;
+}
+
+/**
+ * @brief Helper function, wraps an application or a random key.
+ */
+static int keystore_sim_wrap_key(const uint8_t *ticket, uint32_t key_spec,
+                                 const uint8_t *app_key, uint32_t app_key_size,
+                                 uint8_t *wrapped_key)
+{
+  struct keystore_sim_client *client;
+  uint8_t raw[KEYSTORE_SIM_KEY_SIZE_MAX];
+  uint32_t size;
+  int res;
+
+  res = keystore_sim_key_size(key_spec, &size);
+  if (res)
+    return res;
+
+  if (!wrapped_key || (!app_key && app_key_size))
+    return -EFAULT;
+
+  if (app_key && app_key_size != size)
+    return -EINVAL;
+
+  if (app_key)
+    memcpy(raw, app_key, size);
+  else
+    res = keystore_sim_random(raw, size);
+
+  if (!res)
+  {
+    pthread_rwlock_rdlock(&_sim.lock);
+    client = keystore_sim_client(ticket);
+    res = client ? keystore_sim_wrap(client, raw, size, wrapped_key) : -EINVAL;
+    pthread_rwlock_unlock(&_sim.lock);
+  }
+
+  keystore_memzero(raw, sizeof(raw));
+  return res;
+}
+
+static int keystore_sim_load_key(struct ias_keystore_load_key *req)
+{
+  struct keystore_sim_client *client;
+  struct keystore_sim_wrap_key legacy_key;
+  const struct keystore_sim_wrap_key *wrap_key;
+  uint8_t raw[KEYSTORE_SIM_KEY_SIZE_MAX];
+  uint8_t *wrapped = req->wrapped_key;
+  uint32_t size, slot;
+  int res;
+
+  if (!wrapped)
+    return -EFAULT;
+
+  if (req->wrapped_key_size != 16 + KEYSTORE_SIM_WRAP_EXTRA &&
+      req->wrapped_key_size != 32 + KEYSTORE_SIM_WRAP_EXTRA)
+    return -EINVAL;
+  size = req->wrapped_key_size - KEYSTORE_SIM_WRAP_EXTRA;
+
+  pthread_rwlock_wrlock(&_sim.lock);
+
+  client = keystore_sim_client(req->client_ticket);
+  if (!client)
+  {
+    res = -EINVAL;
+    goto out;
+  }
+
+  /* Keys wrapped with an older SVN are rewrapped, see ias_keystore_load_key() */
+  wrap_key = &client->wrap_key;
+  if (wrapped[0] != client->svn)
+  {
+    if (!wrapped[0] || wrapped[0] > client->svn)
+    {
+      res = -EBADMSG;
+      goto out;
+    }
+    res = keystore_sim_client_key(client->seed_type, wrapped[0], &legacy_key);
+    if (res)
+      goto out;
+    wrap_key = &legacy_key;
+  }
+
+  res = keystore_sim_unwrap(wrap_key, wrapped, size, raw);
+  if (res)
+    goto out;
+
+  if (wrap_key == &legacy_key)
+  {
+    res = keystore_sim_wrap(client, raw, size, wrapped);
+    if (!res)
+      res = -EAGAIN;
+    goto out;
+  }
+
+  for (slot = 0; slot < KEYSTORE_SIM_SLOTS_MAX && client->slots[slot].used; slot++)
+    ;
+
+  if (slot == KEYSTORE_SIM_SLOTS_MAX)
+  {
+    res = -ENOSPC;
+    goto out;
+  }
+
+  res = keystore_gcm_setkey(&client->slots[slot].key, raw, size);
+  if (!res)
+  {
+    client->slots[slot].used = 1;
+    req->slot_id = slot;
+  }
+
+out:
+  pthread_rwlock_unlock(&_sim.lock);
+  keystore_memzero(&legacy_key, sizeof(legacy_key));
+  keystore_memzero(raw, sizeof(raw));
+  return res;
+}
+
+static int keystore_sim_unload_key(const struct ias_keystore_unload_key *req)
+{
+  struct keystore_sim_client *client;
+  int res = -EINVAL;
+
+  pthread_rwlock_wrlock(&_sim.lock);
+
+  client = keystore_sim_client(req->client_ticket);
+  if (client && req->slot_id < KEYSTORE_SIM_SLOTS_MAX && client->slots[req->slot_id].used)
+  {
+    keystore_memzero(&client->slots[req->slot_id], sizeof(client->slots[req->slot_id]));
+    res = 0;
+  }
+
+  pthread_rwlock_unlock(&_sim.lock);
+  return res;
+}
+
+static int keystore_sim_algo(uint32_t algospec)
+{
+  switch (algospec)
+  {
+  case ALGOSPEC_AES_CCM:
+  case ALGOSPEC_AES_GCM:
+    return 0;
+  case ALGOSPEC_ECIES:
+  case ALGOSPEC_ECDSA:
+    return -EOPNOTSUPP;
+  default:
+    return -EINVAL;
+  }
+}
+
+static int keystore_sim_crypto_size(int encrypt, struct ias_keystore_crypto_size *req)
+{
+  int res = keystore_sim_algo(req->algospec);
+
+  if (res)
+    return res;
+
+  if (encrypt)
+  {
+    if (req->input_size > UINT32_MAX - KEYSTORE_AES_TAG_SIZE)
+      return -EINVAL;
+    req->output_size = req->input_size + KEYSTORE_AES_TAG_SIZE;
+  }
+  else
+  {
+    if (req->input_size < KEYSTORE_AES_TAG_SIZE)
+      return -EINVAL;
+    req->output_size = req->input_size - KEYSTORE_AES_TAG_SIZE;
+  }
+
+  return 0;
+}
+
+/**
+ * @brief Helper function, one encrypt or decrypt operation. The lock must be held.
+ */
+static int keystore_sim_crypt(const struct keystore_sim_client *client, int encrypt,
+                              uint32_t slot_id, uint32_t algospec,
+                              const uint8_t *iv, uint32_t iv_size,
+                              const uint8_t *input, uint32_t input_size,
+                              uint8_t *output)
+{
+  const struct keystore_gcm_key *key;
+  uint32_t size;
+  int res;
+
+  res = keystore_sim_algo(algospec);
+  if (res)
+    return res;
+
+  if (slot_id >= KEYSTORE_SIM_SLOTS_MAX || !client->slots[slot_id].used)
+    return -EINVAL;
+  key = &client->slots[slot_id].key;
+
+  if (!iv || !output || (!input && input_size))
+    return -EFAULT;
+
+  if (!iv_size || iv_size > KEYSTORE_MAX_IV_SIZE)
+    return -EINVAL;
+
+  if (encrypt)
+  {
+    if (algospec == ALGOSPEC_AES_GCM)
+      return keystore_gcm_encrypt(key, iv, iv_size, NULL, 0, input, input_size,
+                                  output, output + input_size);
+    return keystore_ccm_encrypt(&key->aes, iv, iv_size, NULL, 0, input, input_size,
+                                output, output + input_size);
+  }
+
+  if (input_size < KEYSTORE_AES_TAG_SIZE)
+    return -EINVAL;
+  size = input_size - KEYSTORE_AES_TAG_SIZE;
+
+  if (algospec == ALGOSPEC_AES_GCM)
+    return keystore_gcm_decrypt(key, iv, iv_size, NULL, 0, input, size,
+                                input + size, output);
+  return keystore_ccm_decrypt(&key->aes, iv, iv_size, NULL, 0, input, size,
+                              input + size, output);
+}
+
+static int keystore_sim_encrypt_decrypt(int encrypt, const struct ias_keystore_encrypt_decrypt *req)
+{
+  const struct keystore_sim_client *client;
+  int res;
+
+  pthread_rwlock_rdlock(&_sim.lock);
+
+  client = keystore_sim_client(req->client_ticket);
+  if (client)
+    res = keystore_sim_crypt(client, encrypt, req->slot_id, req->algospec, req->iv, req->iv_size,
+                             req->input, req->input_size, req->output);
+  else
+    res = -EINVAL;
+
+  pthread_rwlock_unlock(&_sim.lock);
+  return res;
+}
+
+static int keystore_sim_crypto_batch(int encrypt, struct ias_keystore_crypto_batch *req)
+{
+  const struct keystore_sim_client *client;
+  uint32_t i;
+  int res = 0;
+
+  if (req->count && !req->entries)
+    return -EFAULT;
+
+  pthread_rwlock_rdlock(&_sim.lock);
+
+  client = keystore_sim_client(req->client_ticket);
+  if (!client && req->count)
+    res = -EINVAL;
+
+  for (i = 0; !res && i < req->count; i++)
+  {
+    struct ias_keystore_crypto_batch_entry *entry = &req->entries[i];
+
+    entry->status = keystore_sim_crypt(client, encrypt, entry->slot_id, entry->algospec,
+                                       entry->iv, entry->iv_size,
+                                       entry->input, entry->input_size, entry->output);
+  }
+
+  pthread_rwlock_unlock(&_sim.lock);
+  return res;
+}
+
+/**
+ * @brief Helper function, parses the "sim:" options.
+ *
+ * Options are separated by commas:
+ *   latency=<us>  added to every call, to model the DAL round trip
+ *   svn=<n>       SEED SVN used for clients registered from now on
+ */
+static int keystore_sim_options(const char *args, struct keystore_sim_handle *handle)
+{
+  unsigned long value;
+  char *end;
+
+  while (*args)
+  {
+    if (!strncmp(args, "latency=", 8))
+    {
+      value = strtoul(args + 8, &end, 10);
+      if (end == args + 8 || value > 10000000)
+        return -EINVAL;
+      handle->latency_ns = (uint64_t)value * 1000;
+    }
+    else if (!strncmp(args, "svn=", 4))
+    {
+      value = strtoul(args + 4, &end, 10);
+      if (end == args + 4 || value < 1 || value > 255)
+        return -EINVAL;
+      pthread_rwlock_wrlock(&_sim.lock);
+      _sim.svn = (uint8_t)value;
+      pthread_rwlock_unlock(&_sim.lock);
+    }
+    else
+    {
+      return -EINVAL;
+    }
+
+    if (*end == ',')
+      end++;
+    else if (*end)
+      return -EINVAL;
+    args = end;
+  }
+
+  return 0;
+}
+
+static int keystore_sim_open(const char *args, void **priv)
+{
+  struct keystore_sim_handle *handle;
+  int res;
+
+  pthread_once(&_sim_once, keystore_sim_init);
+
+  handle = (struct keystore_sim_handle *)calloc(1, sizeof(*handle));
+  if (!handle)
+    return -ENOMEM;
+
+  res = keystore_sim_options(args, handle);
+  if (res)
+  {
+    free(handle);
+    return res;
+  }
+
+  *priv = handle;
+  return 0;
+}
+
+static void keystore_sim_close(void *priv)
+{
+  free(priv);
+}
+
+static int keystore_sim_ioctl(void *priv, unsigned int cmd, void *request)
+{
+  const struct keystore_sim_handle *handle = (const struct keystore_sim_handle *)priv;
+  struct ias_keystore_version *version;
+  struct ias_keystore_generate_key *generate;
+  struct ias_keystore_wrap_key *wrap;
+  int res;
+
+  if (_IOC_TYPE(cmd) != KEYSTORE_IOC_MAGIC && _IOC_TYPE(cmd) != KEYSTORE_LIB_IOC_MAGIC)
+    return -ENOTTY;
+
+  if (!request)
+    return -EFAULT;
+
+  switch (cmd)
+  {
+  case KEYSTORE_IOC_VERSION:
+    version = (struct ias_keystore_version *)request;
+    version->major = KEYSTORE_VERSION_MAJOR;
+    version->minor = KEYSTORE_VERSION_MINOR;
+    version->patch = KEYSTORE_VERSION_PATCH;
+    res = 0;
+    break;
+  case KEYSTORE_IOC_REGISTER:
+    res = keystore_sim_register((struct ias_keystore_register *)request);
+    break;
+  case KEYSTORE_IOC_UNREGISTER:
+    res = keystore_sim_unregister((struct ias_keystore_unregister *)request);
+    break;
+  case KEYSTORE_IOC_WRAPPED_KEYSIZE:
+    res = keystore_sim_wrapped_key_size((struct ias_keystore_wrapped_key_size *)request);
+    break;
+  case KEYSTORE_IOC_GENERATE_KEY:
+    generate = (struct ias_keystore_generate_key *)request;
+    res = keystore_sim_wrap_key(generate->client_ticket, generate->key_spec, NULL, 0,
+                                generate->wrapped_key);
+    break;
+  case KEYSTORE_IOC_WRAP_KEY:
+    wrap = (struct ias_keystore_wrap_key *)request;
+    res = wrap->app_key ? keystore_sim_wrap_key(wrap->client_ticket, wrap->key_spec,
+                                                wrap->app_key, wrap->app_key_size,
+                                                wrap->wrapped_key) : -EFAULT;
+    break;
+  case KEYSTORE_IOC_LOAD_KEY:
+    res = keystore_sim_load_key((struct ias_keystore_load_key *)request);
+    break;
+  case KEYSTORE_IOC_UNLOAD_KEY:
+    res = keystore_sim_unload_key((struct ias_keystore_unload_key *)request);
+    break;
+  case KEYSTORE_IOC_ENCRYPT_SIZE:
+    res = keystore_sim_crypto_size(1, (struct ias_keystore_crypto_size *)request);
+    break;
+  case KEYSTORE_IOC_ENCRYPT:
+    res = keystore_sim_encrypt_decrypt(1, (struct ias_keystore_encrypt_decrypt *)request);
+    break;
+  case KEYSTORE_IOC_DECRYPT_SIZE:
+    res = keystore_sim_crypto_size(0, (struct ias_keystore_crypto_size *)request);
+    break;
+  case KEYSTORE_IOC_DECRYPT:
+    res = keystore_sim_encrypt_decrypt(0, (struct ias_keystore_encrypt_decrypt *)request);
+    break;
+  case KEYSTORE_LIB_IOC_ENCRYPT_BATCH:
+    res = keystore_sim_crypto_batch(1, (struct ias_keystore_crypto_batch *)request);
+    break;
+  case KEYSTORE_LIB_IOC_DECRYPT_BATCH:
+    res = keystore_sim_crypto_batch(0, (struct ias_keystore_crypto_batch *)request);
+    break;
+  default:
+    return -ENOTTY;
+  }
+
+  if (handle->latency_ns)
+  {
+    struct timespec ts;
+
+    ts.tv_sec = (time_t)(handle->latency_ns / 1000000000u);
+    ts.tv_nsec = (long)(handle->latency_ns % 1000000000u);
+    while (nanosleep(&ts, &ts) && errno == EINTR)
+      ;
+  }
+
+  return res;
+}
+
+const struct keystore_backend keystore_sim_backend = {
+  "sim:",
+  keystore_sim_open,
+  keystore_sim_close,
+  keystore_sim_ioctl,
+  NULL,
+};
+
+/* end of file */
@@ -0,0 +1,249 @@
+/*
+   Copyright 2018 Intel Corporation
+
+   This software is licensed to you in accordance
+   with the agreement between you and Intel Corporation.
+
+   Alternatively, you can use this file in compliance
+   with the Apache license, Version 2.
+
+
+   Apache License, Version 2.0
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+   http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/ioctl.h>
+
+#include "keystore_api_user.h"
+
+#include "ias_keystore_priv.h"
+
+/*
+ * Client side size calculation.
+ *
+ * The wrapped key sizes of the AES key specs are constants and the AES
+ * modes add a fixed tag to the input, so the size ioctls can be answered
+ * without a device round trip. The constants are not hard-coded: they
+ * are read from the device once and checked to follow this shape. The
+ * result is kept per device name and keystore version, so switching
+ * devices and reopening after fork() do not probe again.
+ *
+ * Probes which fail are expected on some devices and are not reported.
+ * An algorithm which does not fit the shape is left to the device; the
+ * others still use the table.
+ */
+
+#define KEYSTORE_SIZE_TABLES 8
+#define KEYSTORE_SIZE_DEVICE_MAX 128
+#define KEYSTORE_SIZE_KEY_SPECS 2
+#define KEYSTORE_SIZE_ALGOS 2
+/* Marks an algorithm which does not follow the fixed tag shape */
+#define KEYSTORE_SIZE_UNKNOWN UINT32_MAX
+
+struct keystore_size_table {
+  char device[KEYSTORE_SIZE_DEVICE_MAX];
+  struct ias_keystore_version version;
+  int valid;
+  uint32_t wrapped_key_size[KEYSTORE_SIZE_KEY_SPECS];
+  uint32_t unwrapped_key_size[KEYSTORE_SIZE_KEY_SPECS];
+  uint32_t tag_size[KEYSTORE_SIZE_ALGOS];
+};
+
+static struct keystore_size_table _tables[KEYSTORE_SIZE_TABLES];
+static unsigned int _table_count;
+static pthread_mutex_t _table_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int keystore_size_key_index(uint32_t key_spec)
+{
+  switch (key_spec)
+  {
+  case KEYSPEC_LENGTH_128: return 0;
+  case KEYSPEC_LENGTH_256: return 1;
+  default: return -1;
+  }
+}
+
+static int keystore_size_algo_index(uint32_t algo_spec)
+{
+  switch (algo_spec)
+  {
+  case ALGOSPEC_AES_CCM: return 0;
+  case ALGOSPEC_AES_GCM: return 1;
+  default: return -1;
+  }
+}
+
+static int keystore_size_query(int fd, unsigned int cmd, uint32_t algo_spec,
+                               uint32_t input_size, uint32_t *output_size)
+{
+  struct ias_keystore_crypto_size request;
+  int res;
+
+  memset(&request, 0, sizeof(request));
+  request.algospec = algo_spec;
+  request.input_size = input_size;
+  res = keystore_dev_ioctl_quiet(fd, cmd, &request);
+  if (res < 0)
+    return res;
+
+  *output_size = request.output_size;
+  return 0;
+}
+
+/**
+ * @brief Helper function, reads the size of a tag added by an algorithm.
+ *
+ * Checks two input sizes for both directions, and stops at the first
+ * answer which does not fit.
+ *
+ * @return Tag size or KEYSTORE_SIZE_UNKNOWN.
+ */
+static uint32_t keystore_size_probe_tag(int fd, uint32_t algo_spec)
+{
+  static const uint32_t inputs[] = { 16, 4096 };
+  uint32_t tag = KEYSTORE_SIZE_UNKNOWN;
+  uint32_t size;
+  unsigned int i;
+
+  for (i = 0; i < sizeof(inputs) / sizeof(inputs[0]); i++)
+  {
+    if (keystore_size_query(fd, KEYSTORE_IOC_ENCRYPT_SIZE, algo_spec, inputs[i], &size) ||
+        size < inputs[i] || (i && size - inputs[i] != tag))
+      return KEYSTORE_SIZE_UNKNOWN;
+    tag = size - inputs[i];
+
+    if (keystore_size_query(fd, KEYSTORE_IOC_DECRYPT_SIZE, algo_spec, inputs[i] + tag, &size) ||
+        size != inputs[i])
+      return KEYSTORE_SIZE_UNKNOWN;
+  }
+
+  return tag;
+}
+
+/**
+ * @brief Helper function, fills a table from the device.
+ */
+static void keystore_size_probe(struct keystore_size_table *table, int fd)
+{
+  struct ias_keystore_wrapped_key_size request;
+  static const uint32_t key_specs[KEYSTORE_SIZE_KEY_SPECS] = {
+    KEYSPEC_LENGTH_128, KEYSPEC_LENGTH_256
+  };
+  static const uint32_t algo_specs[KEYSTORE_SIZE_ALGOS] = {
+    ALGOSPEC_AES_CCM, ALGOSPEC_AES_GCM
+  };
+  unsigned int i;
+
+  table->valid = 1;
+
+  for (i = 0; i < KEYSTORE_SIZE_KEY_SPECS; i++)
+  {
+    memset(&request, 0, sizeof(request));
+    request.key_spec = key_specs[i];
+    if (keystore_dev_ioctl_quiet(fd, KEYSTORE_IOC_WRAPPED_KEYSIZE, &request) < 0)
+    {
+      table->valid = 0;
+      return;
+    }
+    table->wrapped_key_size[i] = request.key_size;
+    table->unwrapped_key_size[i] = request.unwrapped_key_size;
+  }
+
+  for (i = 0; i < KEYSTORE_SIZE_ALGOS; i++)
+    table->tag_size[i] = keystore_size_probe_tag(fd, algo_specs[i]);
+}
+
+const struct keystore_size_table *keystore_size_table(int fd, const char *device)
+{
+  struct ias_keystore_version version;
+  struct keystore_size_table *table = NULL;
+  unsigned int i;
+
+  if (!device || strlen(device) >= KEYSTORE_SIZE_DEVICE_MAX)
+    return NULL;
+
+  memset(&version, 0, sizeof(version));
+  if (keystore_dev_ioctl_quiet(fd, KEYSTORE_IOC_VERSION, &version) < 0)
+    return NULL;
+
+  pthread_mutex_lock(&_table_lock);
+
+  for (i = 0; i < _table_count; i++)
+  {
+    if (!strcmp(_tables[i].device, device) &&
+        !memcmp(&_tables[i].version, &version, sizeof(version)))
+    {
+      table = &_tables[i];
+      break;
+    }
+  }
+
+  if (!table && _table_count < KEYSTORE_SIZE_TABLES)
+  {
+    table = &_tables[_table_count];
+    strcpy(table->device, device);
+    table->version = version;
+    keystore_size_probe(table, fd);
+    _table_count++;
+  }
+
+  pthread_mutex_unlock(&_table_lock);
+
+  return table && table->valid ? table : NULL;
+}
+
+int keystore_size_wrapped(const struct keystore_size_table *table, uint32_t key_spec,
+                          uint32_t *wrapped_key_size, uint32_t *unwrapped_key_size)
+{
+  int index = keystore_size_key_index(key_spec);
+
+  if (!table || index < 0)
+    return -ENOENT;
+
+  *wrapped_key_size = table->wrapped_key_size[index];
+  *unwrapped_key_size = table->unwrapped_key_size[index];
+  return 0;
+}
+
+int keystore_size_crypt(const struct keystore_size_table *table, unsigned int cmd,
+                        uint32_t algo_spec, size_t input_size, size_t *output_size)
+{
+  int index = keystore_size_algo_index(algo_spec);
+  uint32_t tag;
+
+  if (!table || index < 0 || table->tag_size[index] == KEYSTORE_SIZE_UNKNOWN)
+    return -ENOENT;
+
+  tag = table->tag_size[index];
+
+  /* Leave sizes the device would reject or truncate to the device */
+  if (cmd == KEYSTORE_IOC_ENCRYPT_SIZE && input_size && input_size <= UINT32_MAX - tag)
+  {
+    *output_size = input_size + tag;
+    return 0;
+  }
+
+  if (cmd == KEYSTORE_IOC_DECRYPT_SIZE && input_size > tag && input_size <= UINT32_MAX)
+  {
+    *output_size = input_size - tag;
+    return 0;
+  }
+
+  return -ENOENT;
+}
+
+/* end of file */
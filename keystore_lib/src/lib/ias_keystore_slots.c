@@ -0,0 +1,459 @@
+/*
+   Copyright 2018 Intel Corporation
+
+   This software is licensed to you in accordance
+   with the agreement between you and Intel Corporation.
+
+   Alternatively, you can use this file in compliance
+   with the Apache license, Version 2.
+
+
+   Apache License, Version 2.0
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+   http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ias_keystore.h"
+#include "ias_keystore_slots.h"
+
+#define KEYSTORE_SLOTS_MAX 256
+#define KEYSTORE_SLOTS_MIN_BUCKETS 64
+
+enum keystore_slots_state {
+  KEYSTORE_SLOTS_UNLOADED,
+  KEYSTORE_SLOTS_LOADING,
+  KEYSTORE_SLOTS_LOADED,
+};
+
+struct keystore_slots_entry {
+  uint64_t handle;
+  struct keystore_slots_entry *next;     /* hash chain */
+
+  /* LRU list, linked while loaded and not pinned */
+  struct keystore_slots_entry *lru_prev;
+  struct keystore_slots_entry *lru_next;
+
+  enum keystore_slots_state state;
+  uint32_t slot_id;
+  uint32_t pins;
+
+  size_t wrapped_key_size;
+  uint8_t wrapped_key[];
+};
+
+struct ias_keystore_slots {
+  pthread_mutex_t lock;
+  pthread_cond_t load_cond;   /* signalled when a load finishes */
+
+  const uint8_t *client_ticket;
+  struct ias_keystore_slots_config config;
+
+  struct keystore_slots_entry **buckets;
+  size_t bucket_mask;
+
+  /* Most recently released at the head, eviction from the tail */
+  struct keystore_slots_entry *lru_head;
+  struct keystore_slots_entry *lru_tail;
+
+  struct ias_keystore_slots_stats stats;
+};
+
+static size_t keystore_slots_hash(const struct ias_keystore_slots *slots, uint64_t handle)
+{
+  handle ^= handle >> 33;
+  handle *= 0xff51afd7ed558ccdULL;
+  handle ^= handle >> 33;
+  return (size_t)handle & slots->bucket_mask;
+}
+
+static struct keystore_slots_entry **keystore_slots_find(struct ias_keystore_slots *slots,
+                                                         uint64_t handle)
+{
+  struct keystore_slots_entry **link = &slots->buckets[keystore_slots_hash(slots, handle)];
+
+  while (*link && (*link)->handle != handle)
+    link = &(*link)->next;
+
+  return link;
+}
+
+/**
+ * @brief Helper function, doubles the hash table when it gets full.
+ */
+static void keystore_slots_grow(struct ias_keystore_slots *slots)
+{
+  struct keystore_slots_entry **old = slots->buckets;
+  size_t old_count = slots->bucket_mask + 1;
+  struct keystore_slots_entry **buckets;
+  struct keystore_slots_entry *entry;
+  size_t i;
+
+  buckets = (struct keystore_slots_entry **)calloc(old_count * 2, sizeof(*buckets));
+  if (!buckets)
+    return; /* Longer chains, still correct */
+
+  slots->buckets = buckets;
+  slots->bucket_mask = old_count * 2 - 1;
+
+  for (i = 0; i < old_count; i++)
+  {
+    while ((entry = old[i]) != NULL)
+    {
+      old[i] = entry->next;
+      entry->next = buckets[keystore_slots_hash(slots, entry->handle)];
+      buckets[keystore_slots_hash(slots, entry->handle)] = entry;
+    }
+  }
+
+  free(old);
+}
+
+static void keystore_slots_lru_unlink(struct ias_keystore_slots *slots,
+                                      struct keystore_slots_entry *entry)
+{
+  if (entry->lru_prev)
+    entry->lru_prev->lru_next = entry->lru_next;
+  else
+    slots->lru_head = entry->lru_next;
+
+  if (entry->lru_next)
+    entry->lru_next->lru_prev = entry->lru_prev;
+  else
+    slots->lru_tail = entry->lru_prev;
+
+  entry->lru_prev = NULL;
+  entry->lru_next = NULL;
+}
+
+static void keystore_slots_lru_push(struct ias_keystore_slots *slots,
+                                    struct keystore_slots_entry *entry)
+{
+  entry->lru_prev = NULL;
+  entry->lru_next = slots->lru_head;
+
+  if (slots->lru_head)
+    slots->lru_head->lru_prev = entry;
+  else
+    slots->lru_tail = entry;
+
+  slots->lru_head = entry;
+}
+
+/**
+ * @brief Helper function, pins an entry.
+ *
+ * A pinned entry is neither evicted nor removed.
+ */
+static void keystore_slots_pin(struct ias_keystore_slots *slots,
+                               struct keystore_slots_entry *entry)
+{
+  if (entry->pins++ == 0)
+  {
+    slots->stats.pinned++;
+    if (entry->state == KEYSTORE_SLOTS_LOADED)
+      keystore_slots_lru_unlink(slots, entry);
+  }
+}
+
+static void keystore_slots_unpin(struct ias_keystore_slots *slots,
+                                 struct keystore_slots_entry *entry)
+{
+  if (--entry->pins == 0)
+  {
+    slots->stats.pinned--;
+    if (entry->state == KEYSTORE_SLOTS_LOADED)
+      keystore_slots_lru_push(slots, entry);
+  }
+}
+
+/**
+ * @brief Helper function, loads a pinned entry in state LOADING.
+ *
+ * Called without the lock; the entry is not touched by other threads
+ * while it is loading.
+ */
+static int keystore_slots_load(struct ias_keystore_slots *slots,
+                               struct keystore_slots_entry *entry)
+{
+  int res;
+
+  res = ias_keystore_load_key(slots->client_ticket, entry->wrapped_key,
+                              entry->wrapped_key_size, &entry->slot_id);
+  if (res != -EAGAIN)
+    return res;
+
+  /* Re-wrapped in place for the current SEED SVN */
+  if (slots->config.rewrapped)
+    slots->config.rewrapped(slots->config.priv, entry->handle,
+                            entry->wrapped_key, entry->wrapped_key_size);
+
+  return ias_keystore_load_key(slots->client_ticket, entry->wrapped_key,
+                               entry->wrapped_key_size, &entry->slot_id);
+}
+
+int ias_keystore_slots_create(const uint8_t *client_ticket,
+                              const struct ias_keystore_slots_config *config,
+                              struct ias_keystore_slots **slots)
+{
+  struct ias_keystore_slots *s;
+
+  if (!client_ticket || !slots)
+    return -EFAULT;
+
+  if (config && config->max_slots > KEYSTORE_SLOTS_MAX)
+    return -EINVAL;
+
+  s = (struct ias_keystore_slots *)calloc(1, sizeof(*s));
+  if (!s)
+    return -ENOMEM;
+
+  s->buckets = (struct keystore_slots_entry **)calloc(KEYSTORE_SLOTS_MIN_BUCKETS,
+                                                      sizeof(*s->buckets));
+  if (!s->buckets)
+  {
+    free(s);
+    return -ENOMEM;
+  }
+  s->bucket_mask = KEYSTORE_SLOTS_MIN_BUCKETS - 1;
+
+  if (config)
+    s->config = *config;
+  if (!s->config.max_slots)
+    s->config.max_slots = KEYSTORE_SLOTS_MAX;
+
+  s->client_ticket = client_ticket;
+  pthread_mutex_init(&s->lock, NULL);
+  pthread_cond_init(&s->load_cond, NULL);
+
+  *slots = s;
+  return 0;
+}
+
+void ias_keystore_slots_destroy(struct ias_keystore_slots *slots)
+{
+  struct keystore_slots_entry *entry;
+  size_t i;
+
+  if (!slots)
+    return;
+
+  for (i = 0; i <= slots->bucket_mask; i++)
+  {
+    while ((entry = slots->buckets[i]) != NULL)
+    {
+      slots->buckets[i] = entry->next;
+      if (entry->state == KEYSTORE_SLOTS_LOADED)
+        ias_keystore_unload_key(slots->client_ticket, entry->slot_id);
+      free(entry);
+    }
+  }
+
+  pthread_cond_destroy(&slots->load_cond);
+  pthread_mutex_destroy(&slots->lock);
+  free(slots->buckets);
+  free(slots);
+}
+
+int ias_keystore_slots_add(struct ias_keystore_slots *slots, uint64_t handle,
+                           const uint8_t *wrapped_key, size_t wrapped_key_size)
+{
+  struct keystore_slots_entry **link;
+  struct keystore_slots_entry *entry;
+
+  if (!slots || !wrapped_key)
+    return -EFAULT;
+
+  if (!wrapped_key_size)
+    return -EINVAL;
+
+  entry = (struct keystore_slots_entry *)calloc(1, sizeof(*entry) + wrapped_key_size);
+  if (!entry)
+    return -ENOMEM;
+
+  entry->handle = handle;
+  entry->state = KEYSTORE_SLOTS_UNLOADED;
+  entry->wrapped_key_size = wrapped_key_size;
+  memcpy(entry->wrapped_key, wrapped_key, wrapped_key_size);
+
+  pthread_mutex_lock(&slots->lock);
+  link = keystore_slots_find(slots, handle);
+  if (*link)
+  {
+    pthread_mutex_unlock(&slots->lock);
+    free(entry);
+    return -EEXIST;
+  }
+
+  *link = entry;
+  if (++slots->stats.keys > slots->bucket_mask + 1)
+    keystore_slots_grow(slots);
+  pthread_mutex_unlock(&slots->lock);
+
+  return 0;
+}
+
+int ias_keystore_slots_remove(struct ias_keystore_slots *slots, uint64_t handle)
+{
+  struct keystore_slots_entry **link;
+  struct keystore_slots_entry *entry;
+  int res = 0;
+
+  if (!slots)
+    return -EFAULT;
+
+  pthread_mutex_lock(&slots->lock);
+  link = keystore_slots_find(slots, handle);
+  entry = *link;
+  if (!entry || entry->pins)
+  {
+    pthread_mutex_unlock(&slots->lock);
+    return entry ? -EBUSY : -ENOENT;
+  }
+
+  *link = entry->next;
+  slots->stats.keys--;
+  if (entry->state == KEYSTORE_SLOTS_LOADED)
+    keystore_slots_lru_unlink(slots, entry);
+  pthread_mutex_unlock(&slots->lock);
+
+  if (entry->state == KEYSTORE_SLOTS_LOADED)
+  {
+    /* The slot counts as used until it is really free */
+    res = ias_keystore_unload_key(slots->client_ticket, entry->slot_id);
+
+    pthread_mutex_lock(&slots->lock);
+    slots->stats.loaded--;
+    pthread_mutex_unlock(&slots->lock);
+  }
+
+  free(entry);
+  return res;
+}
+
+int ias_keystore_slots_acquire(struct ias_keystore_slots *slots, uint64_t handle,
+                               uint32_t *slot_id)
+{
+  struct keystore_slots_entry *entry;
+  struct keystore_slots_entry *victim = NULL;
+  uint32_t victim_slot = 0;
+  int res;
+
+  if (!slots || !slot_id)
+    return -EFAULT;
+
+  pthread_mutex_lock(&slots->lock);
+  entry = *keystore_slots_find(slots, handle);
+  if (!entry)
+  {
+    pthread_mutex_unlock(&slots->lock);
+    return -ENOENT;
+  }
+
+  keystore_slots_pin(slots, entry);
+
+  /* Another thread is loading the key */
+  while (entry->state == KEYSTORE_SLOTS_LOADING)
+    pthread_cond_wait(&slots->load_cond, &slots->lock);
+
+  if (entry->state == KEYSTORE_SLOTS_LOADED)
+  {
+    slots->stats.hits++;
+    *slot_id = entry->slot_id;
+    pthread_mutex_unlock(&slots->lock);
+    return 0;
+  }
+
+  /* Take a free slot or the one of the least recently used key */
+  if (slots->stats.loaded < slots->config.max_slots)
+  {
+    slots->stats.loaded++;
+  }
+  else if (slots->lru_tail)
+  {
+    victim = slots->lru_tail;
+    victim_slot = victim->slot_id;
+    keystore_slots_lru_unlink(slots, victim);
+    victim->state = KEYSTORE_SLOTS_UNLOADED;
+    slots->stats.evictions++;
+  }
+  else
+  {
+    keystore_slots_unpin(slots, entry);
+    pthread_mutex_unlock(&slots->lock);
+    return -ENOSPC;
+  }
+
+  slots->stats.misses++;
+  entry->state = KEYSTORE_SLOTS_LOADING;
+  pthread_mutex_unlock(&slots->lock);
+
+  if (victim)
+    ias_keystore_unload_key(slots->client_ticket, victim_slot);
+
+  res = keystore_slots_load(slots, entry);
+
+  pthread_mutex_lock(&slots->lock);
+  if (res)
+  {
+    entry->state = KEYSTORE_SLOTS_UNLOADED;
+    slots->stats.loaded--;
+    keystore_slots_unpin(slots, entry);
+  }
+  else
+  {
+    entry->state = KEYSTORE_SLOTS_LOADED;
+    *slot_id = entry->slot_id;
+  }
+  pthread_cond_broadcast(&slots->load_cond);
+  pthread_mutex_unlock(&slots->lock);
+
+  return res;
+}
+
+int ias_keystore_slots_release(struct ias_keystore_slots *slots, uint64_t handle)
+{
+  struct keystore_slots_entry *entry;
+  int res = 0;
+
+  if (!slots)
+    return -EFAULT;
+
+  pthread_mutex_lock(&slots->lock);
+  entry = *keystore_slots_find(slots, handle);
+  if (!entry)
+    res = -ENOENT;
+  else if (!entry->pins)
+    res = -EINVAL;
+  else
+    keystore_slots_unpin(slots, entry);
+  pthread_mutex_unlock(&slots->lock);
+
+  return res;
+}
+
+void ias_keystore_slots_get_stats(struct ias_keystore_slots *slots,
+                                  struct ias_keystore_slots_stats *stats)
+{
+  if (!slots || !stats)
+    return;
+
+  pthread_mutex_lock(&slots->lock);
+  *stats = slots->stats;
+  pthread_mutex_unlock(&slots->lock);
+}
+
+/* end of file */
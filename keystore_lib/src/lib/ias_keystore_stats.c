@@ -0,0 +1,262 @@
+/*
+   Copyright 2018 Intel Corporation
+
+   This software is licensed to you in accordance
+   with the agreement between you and Intel Corporation.
+
+   Alternatively, you can use this file in compliance
+   with the Apache license, Version 2.
+
+
+   Apache License, Version 2.0
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+   http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#include <errno.h>
+#include <inttypes.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <time.h>
+
+#include "keystore_api_user.h"
+
+#include "ias_keystore_priv.h"
+#include "ias_keystore_stats.h"
+
+static struct ias_keystore_cmd_stats _stats[IAS_KEYSTORE_STATS_CMDS];
+static int _stats_enabled = 1;
+
+static const char *const _stats_names[IAS_KEYSTORE_STATS_CMDS] = {
+  "VERSION",
+  "REGISTER",
+  "UNREGISTER",
+  "WRAPPED_KEYSIZE",
+  "GENERATE_KEY",
+  "WRAP_KEY",
+  "LOAD_KEY",
+  "UNLOAD_KEY",
+  "ENCRYPT_SIZE",
+  "ENCRYPT",
+  "DECRYPT_SIZE",
+  "DECRYPT",
+  "ENCRYPT_BATCH",
+  "DECRYPT_BATCH",
+  "ENCRYPTV",
+  "DECRYPTV",
+};
+
+uint64_t keystore_stats_begin(void)
+{
+  struct timespec ts;
+
+  if (!__atomic_load_n(&_stats_enabled, __ATOMIC_RELAXED))
+    return 0;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * @brief Helper function, returns the input bytes of a crypto request.
+ */
+static uint64_t keystore_stats_bytes(unsigned int cmd, const void *request)
+{
+  const struct ias_keystore_crypto_batch *batch;
+  const struct ias_keystore_encrypt_decrypt_vec *vec;
+  uint64_t bytes = 0;
+  uint32_t i;
+
+  if (!request)
+    return 0;
+
+  switch (cmd)
+  {
+  case KEYSTORE_IOC_ENCRYPT:
+  case KEYSTORE_IOC_DECRYPT:
+    return ((const struct ias_keystore_encrypt_decrypt *)request)->input_size;
+  case KEYSTORE_LIB_IOC_ENCRYPT_BATCH:
+  case KEYSTORE_LIB_IOC_DECRYPT_BATCH:
+    batch = (const struct ias_keystore_crypto_batch *)request;
+    for (i = 0; i < batch->count && batch->entries; i++)
+      bytes += batch->entries[i].input_size;
+    return bytes;
+  case KEYSTORE_LIB_IOC_ENCRYPTV:
+  case KEYSTORE_LIB_IOC_DECRYPTV:
+    vec = (const struct ias_keystore_encrypt_decrypt_vec *)request;
+    for (i = 0; i < vec->input_count && vec->input; i++)
+      bytes += vec->input[i].iov_len;
+    return bytes;
+  default:
+    return 0;
+  }
+}
+
+static unsigned int keystore_stats_bucket(uint64_t ns)
+{
+  unsigned int bucket = 0;
+
+  if (ns > 1)
+    bucket = 63 - (unsigned int)__builtin_clzll(ns);
+
+  if (bucket >= IAS_KEYSTORE_STATS_BUCKETS)
+    bucket = IAS_KEYSTORE_STATS_BUCKETS - 1;
+
+  return bucket;
+}
+
+void keystore_stats_end(unsigned int cmd, const void *request, uint64_t start, int res)
+{
+  struct ias_keystore_cmd_stats *stats;
+  unsigned int nr = _IOC_NR(cmd);
+  uint64_t ns, max;
+
+  if (!start || nr >= IAS_KEYSTORE_STATS_CMDS ||
+      (_IOC_TYPE(cmd) != KEYSTORE_IOC_MAGIC && _IOC_TYPE(cmd) != KEYSTORE_LIB_IOC_MAGIC))
+    return;
+
+  ns = keystore_stats_begin();
+  if (!ns)
+    return;
+  ns = ns > start ? ns - start : 0;
+
+  stats = &_stats[nr];
+  __atomic_fetch_add(&stats->calls, 1, __ATOMIC_RELAXED);
+  if (res < 0)
+    __atomic_fetch_add(&stats->errors, 1, __ATOMIC_RELAXED);
+  else
+    __atomic_fetch_add(&stats->bytes, keystore_stats_bytes(cmd, request), __ATOMIC_RELAXED);
+  __atomic_fetch_add(&stats->total_ns, ns, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&stats->histogram[keystore_stats_bucket(ns)], 1, __ATOMIC_RELAXED);
+
+  max = __atomic_load_n(&stats->max_ns, __ATOMIC_RELAXED);
+  while (ns > max &&
+         !__atomic_compare_exchange_n(&stats->max_ns, &max, ns, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+  {
+    /* max reloaded by the failed exchange */
+  }
+}
+
+void ias_keystore_stats_enable(int enable)
+{
+  __atomic_store_n(&_stats_enabled, enable ? 1 : 0, __ATOMIC_RELAXED);
+}
+
+int ias_keystore_stats_get(unsigned int cmd_nr, struct ias_keystore_cmd_stats *stats)
+{
+  const struct ias_keystore_cmd_stats *src;
+  unsigned int i;
+
+  if (!stats)
+    return -EFAULT;
+
+  if (cmd_nr >= IAS_KEYSTORE_STATS_CMDS)
+    return -EINVAL;
+
+  src = &_stats[cmd_nr];
+  stats->calls = __atomic_load_n(&src->calls, __ATOMIC_RELAXED);
+  stats->errors = __atomic_load_n(&src->errors, __ATOMIC_RELAXED);
+  stats->bytes = __atomic_load_n(&src->bytes, __ATOMIC_RELAXED);
+  stats->total_ns = __atomic_load_n(&src->total_ns, __ATOMIC_RELAXED);
+  stats->max_ns = __atomic_load_n(&src->max_ns, __ATOMIC_RELAXED);
+  for (i = 0; i < IAS_KEYSTORE_STATS_BUCKETS; i++)
+    stats->histogram[i] = __atomic_load_n(&src->histogram[i], __ATOMIC_RELAXED);
+
+  return 0;
+}
+
+void ias_keystore_stats_reset(void)
+{
+  unsigned int cmd, i;
+
+  for (cmd = 0; cmd < IAS_KEYSTORE_STATS_CMDS; cmd++)
+  {
+    struct ias_keystore_cmd_stats *stats = &_stats[cmd];
+
+    __atomic_store_n(&stats->calls, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&stats->errors, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&stats->bytes, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&stats->total_ns, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&stats->max_ns, 0, __ATOMIC_RELAXED);
+    for (i = 0; i < IAS_KEYSTORE_STATS_BUCKETS; i++)
+      __atomic_store_n(&stats->histogram[i], 0, __ATOMIC_RELAXED);
+  }
+}
+
+const char *ias_keystore_stats_name(unsigned int cmd_nr)
+{
+  if (cmd_nr >= IAS_KEYSTORE_STATS_CMDS)
+    return NULL;
+
+  return _stats_names[cmd_nr];
+}
+
+uint64_t ias_keystore_stats_percentile(const struct ias_keystore_cmd_stats *stats,
+                                       double percent)
+{
+  uint64_t target, seen = 0;
+  unsigned int i;
+
+  if (!stats || !stats->calls)
+    return 0;
+
+  if (percent < 0.0)
+    percent = 0.0;
+  if (percent > 100.0)
+    percent = 100.0;
+
+  target = (uint64_t)(percent / 100.0 * (double)stats->calls + 0.5);
+  if (!target)
+    target = 1;
+
+  for (i = 0; i < IAS_KEYSTORE_STATS_BUCKETS - 1; i++)
+  {
+    seen += stats->histogram[i];
+    if (seen >= target)
+      break;
+  }
+
+  if (i == IAS_KEYSTORE_STATS_BUCKETS - 1 || (2ull << i) > stats->max_ns)
+    return stats->max_ns;
+
+  return 2ull << i;
+}
+
+void ias_keystore_stats_dump(FILE *out)
+{
+  struct ias_keystore_cmd_stats stats;
+  unsigned int cmd;
+
+  if (!out)
+    return;
+
+  fprintf(out, "%-16s %10s %8s %12s %10s %10s %10s %10s\n",
+          "command", "calls", "errors", "bytes", "avg(us)", "p50(us)", "p99(us)", "max(us)");
+
+  for (cmd = 0; cmd < IAS_KEYSTORE_STATS_CMDS; cmd++)
+  {
+    if (ias_keystore_stats_get(cmd, &stats) || !stats.calls)
+      continue;
+
+    fprintf(out, "%-16s %10" PRIu64 " %8" PRIu64 " %12" PRIu64 " %10.1f %10.1f %10.1f %10.1f\n",
+            ias_keystore_stats_name(cmd) ? ias_keystore_stats_name(cmd) : "?",
+            stats.calls, stats.errors, stats.bytes,
+            (double)stats.total_ns / stats.calls / 1e3,
+            (double)ias_keystore_stats_percentile(&stats, 50.0) / 1e3,
+            (double)ias_keystore_stats_percentile(&stats, 99.0) / 1e3,
+            (double)stats.max_ns / 1e3);
+  }
+}
+
+/* end of file */
@@ -0,0 +1,945 @@
+/*
+   Copyright 2018 Intel Corporation
+
+   This software is licensed to you in accordance
+   with the agreement between you and Intel Corporation.
+
+   Alternatively, you can use this file in compliance
+   with the Apache license, Version 2.
+
+
+   Apache License, Version 2.0
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+   http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "ias_keystore_store.h"
+
+/*
+ * File layout, in native byte order:
+ *
+ *   header    struct keystore_store_header
+ *   index     bucket_count struct keystore_store_bucket, open addressing
+ *   records   the records of the index, written by the last compaction
+ *   log       records appended since, up to the end of the file
+ *
+ * A record is a struct keystore_store_record followed by the ID and the
+ * wrapped key, padded to KEYSTORE_STORE_ALIGN. In the log, later records
+ * replace earlier ones with the same ID.
+ */
+#define KEYSTORE_STORE_MAGIC "IASKSTOR"
+#define KEYSTORE_STORE_VERSION 1
+#define KEYSTORE_STORE_ALIGN 8
+#define KEYSTORE_STORE_KEY_MAX 65536
+/* Address space mapped beyond the end of a writable store for appends */
+#define KEYSTORE_STORE_MAP_RESERVE (16u << 20)
+#define KEYSTORE_STORE_MIN_SLOTS 64
+
+/* Record flags */
+#define KEYSTORE_STORE_REMOVED 0x1
+
+struct keystore_store_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t bucket_count;   /* power of two, 0 without index */
+  uint64_t index_offset;
+  uint64_t log_offset;     /* end of the indexed records */
+  uint64_t record_count;   /* records in the index */
+  uint8_t reserved[24];
+};
+
+struct keystore_store_bucket {
+  uint32_t hash;
+  uint32_t reserved;
+  uint64_t offset;         /* record offset, 0 if the bucket is empty */
+};
+
+struct keystore_store_record {
+  uint32_t checksum;       /* FNV-1a over the rest of the record */
+  uint16_t id_size;
+  uint16_t flags;
+  uint32_t key_size;
+  uint32_t reserved;
+};
+
+/* In-memory index of the log */
+struct keystore_store_slot {
+  uint32_t hash;
+  uint64_t offset;         /* 0 if the slot is empty */
+};
+
+struct ias_keystore_store {
+  pthread_rwlock_t lock;
+  char *path;
+  int fd;
+  int flags;
+
+  const uint8_t *map;
+  size_t map_size;
+  size_t file_size;        /* end of the last valid record */
+
+  const struct keystore_store_header *header;
+  const struct keystore_store_bucket *buckets;
+
+  struct keystore_store_slot *slots;
+  size_t slot_mask;
+  size_t slot_count;
+
+  size_t count;            /* live keys */
+};
+
+static uint32_t keystore_store_fnv(uint32_t hash, const void *data, size_t size)
+{
+  const uint8_t *p = (const uint8_t *)data;
+  size_t i;
+
+  for (i = 0; i < size; i++)
+    hash = (hash ^ p[i]) * 16777619u;
+
+  return hash;
+}
+
+static uint32_t keystore_store_hash(const char *id, size_t id_size)
+{
+  return keystore_store_fnv(2166136261u, id, id_size);
+}
+
+static size_t keystore_store_record_size(size_t id_size, size_t key_size)
+{
+  size_t size = sizeof(struct keystore_store_record) + id_size + key_size;
+
+  return (size + KEYSTORE_STORE_ALIGN - 1) & ~(size_t)(KEYSTORE_STORE_ALIGN - 1);
+}
+
+/**
+ * @brief Helper function, returns the record at @offset if it lies
+ * within [@offset, @limit) and its sizes are in bounds.
+ *
+ * Index records are not checksummed, so the sizes are checked here for
+ * every record read from the file, not only for the log.
+ */
+static const struct keystore_store_record *keystore_store_record_at(const struct ias_keystore_store *store,
+                                                                    uint64_t offset, uint64_t limit)
+{
+  const struct keystore_store_record *rec;
+
+  if (offset % KEYSTORE_STORE_ALIGN || offset > limit ||
+      limit - offset < sizeof(*rec))
+    return NULL;
+
+  rec = (const struct keystore_store_record *)(store->map + offset);
+  if (!rec->id_size || rec->id_size > IAS_KEYSTORE_STORE_ID_MAX ||
+      rec->key_size > KEYSTORE_STORE_KEY_MAX ||
+      limit - offset < keystore_store_record_size(rec->id_size, rec->key_size))
+    return NULL;
+
+  return rec;
+}
+
+static const char *keystore_store_record_id(const struct keystore_store_record *rec)
+{
+  return (const char *)(rec + 1);
+}
+
+static const uint8_t *keystore_store_record_key(const struct keystore_store_record *rec)
+{
+  return (const uint8_t *)(rec + 1) + rec->id_size;
+}
+
+static int keystore_store_record_is(const struct keystore_store_record *rec,
+                                    const char *id, size_t id_size)
+{
+  return rec->id_size == id_size && !memcmp(keystore_store_record_id(rec), id, id_size);
+}
+
+/**
+ * @brief Helper function, finds the log slot of an ID.
+ *
+ * @return The slot, or the empty slot where it would be inserted.
+ */
+static struct keystore_store_slot *keystore_store_slot(struct ias_keystore_store *store,
+                                                       uint32_t hash, const char *id, size_t id_size)
+{
+  struct keystore_store_slot *slot;
+  size_t i = hash & store->slot_mask;
+
+  for (;; i = (i + 1) & store->slot_mask)
+  {
+    slot = &store->slots[i];
+    if (!slot->offset)
+      return slot;
+
+    if (slot->hash == hash &&
+        keystore_store_record_is((const struct keystore_store_record *)(store->map + slot->offset),
+                                 id, id_size))
+      return slot;
+  }
+}
+
+/**
+ * @brief Helper function, finds an ID in the index of the last compaction.
+ */
+static const struct keystore_store_record *keystore_store_indexed(const struct ias_keystore_store *store,
+                                                                  uint32_t hash, const char *id,
+                                                                  size_t id_size)
+{
+  const struct keystore_store_record *rec;
+  uint32_t mask = store->header->bucket_count - 1;
+  uint32_t i, n;
+
+  if (!store->header->bucket_count)
+    return NULL;
+
+  for (i = hash & mask, n = 0; n <= mask; i = (i + 1) & mask, n++)
+  {
+    if (!store->buckets[i].offset)
+      return NULL;
+
+    if (store->buckets[i].hash != hash)
+      continue;
+
+    rec = keystore_store_record_at(store, store->buckets[i].offset, store->header->log_offset);
+    if (rec && keystore_store_record_is(rec, id, id_size))
+      return rec;
+  }
+
+  return NULL;
+}
+
+/**
+ * @brief Helper function, finds the current record of an ID.
+ *
+ * @return The record, NULL if there is none or the key was removed.
+ */
+static const struct keystore_store_record *keystore_store_lookup(struct ias_keystore_store *store,
+                                                                 uint32_t hash, const char *id,
+                                                                 size_t id_size)
+{
+  const struct keystore_store_record *rec;
+  struct keystore_store_slot *slot;
+
+  slot = keystore_store_slot(store, hash, id, id_size);
+  if (!slot->offset)
+    return keystore_store_indexed(store, hash, id, id_size);
+
+  rec = (const struct keystore_store_record *)(store->map + slot->offset);
+  return (rec->flags & KEYSTORE_STORE_REMOVED) ? NULL : rec;
+}
+
+/**
+ * @brief Helper function, doubles the log index.
+ */
+static int keystore_store_grow(struct ias_keystore_store *store)
+{
+  struct keystore_store_slot *old = store->slots;
+  size_t old_count = store->slot_mask + 1;
+  struct keystore_store_slot *slot;
+  const struct keystore_store_record *rec;
+  size_t i;
+
+  store->slots = (struct keystore_store_slot *)calloc(old_count * 2, sizeof(*store->slots));
+  if (!store->slots)
+  {
+    store->slots = old;
+    return -ENOMEM;
+  }
+  store->slot_mask = old_count * 2 - 1;
+
+  for (i = 0; i < old_count; i++)
+  {
+    if (!old[i].offset)
+      continue;
+
+    rec = (const struct keystore_store_record *)(store->map + old[i].offset);
+    slot = keystore_store_slot(store, old[i].hash, keystore_store_record_id(rec), rec->id_size);
+    *slot = old[i];
+  }
+
+  free(old);
+  return 0;
+}
+
+/**
+ * @brief Helper function, enters a log record which is in the mapping.
+ */
+static int keystore_store_apply(struct ias_keystore_store *store, uint64_t offset)
+{
+  const struct keystore_store_record *rec = (const struct keystore_store_record *)(store->map + offset);
+  const char *id = keystore_store_record_id(rec);
+  uint32_t hash = keystore_store_hash(id, rec->id_size);
+  struct keystore_store_slot *slot;
+  int live = keystore_store_lookup(store, hash, id, rec->id_size) != NULL;
+  int res;
+
+  slot = keystore_store_slot(store, hash, id, rec->id_size);
+  if (!slot->offset)
+  {
+    /* Keep the table at most half full */
+    if ((store->slot_count + 1) * 2 > store->slot_mask + 1)
+    {
+      res = keystore_store_grow(store);
+      if (res)
+        return res;
+      slot = keystore_store_slot(store, hash, id, rec->id_size);
+    }
+    store->slot_count++;
+  }
+
+  slot->hash = hash;
+  slot->offset = offset;
+
+  store->count -= live;
+  if (!(rec->flags & KEYSTORE_STORE_REMOVED))
+    store->count++;
+  return 0;
+}
+
+/**
+ * @brief Helper function, maps the file with room for appends.
+ */
+static int keystore_store_map(struct ias_keystore_store *store, size_t needed)
+{
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  size_t size = needed;
+  void *map;
+
+  if (!(store->flags & IAS_KEYSTORE_STORE_RDONLY))
+    size += KEYSTORE_STORE_MAP_RESERVE;
+  size = (size + page - 1) & ~(page - 1);
+
+  /* Pages past the end of the file become readable once it has grown */
+  map = mmap(NULL, size, PROT_READ, MAP_SHARED, store->fd, 0);
+  if (map == MAP_FAILED)
+    return -errno;
+
+  if (store->map)
+    munmap((void *)store->map, store->map_size);
+
+  store->map = (const uint8_t *)map;
+  store->map_size = size;
+  store->header = (const struct keystore_store_header *)store->map;
+  store->buckets = (const struct keystore_store_bucket *)(store->map + store->header->index_offset);
+  return 0;
+}
+
+static int keystore_store_check_header(const struct keystore_store_header *header, size_t size)
+{
+  uint64_t index_end;
+
+  if (memcmp(header->magic, KEYSTORE_STORE_MAGIC, sizeof(header->magic)) ||
+      header->version != KEYSTORE_STORE_VERSION)
+    return -EBADMSG;
+
+  if (header->bucket_count & (header->bucket_count - 1))
+    return -EBADMSG;
+
+  index_end = header->index_offset + (uint64_t)header->bucket_count * sizeof(struct keystore_store_bucket);
+  if (header->index_offset != sizeof(*header) || index_end > header->log_offset ||
+      header->log_offset > size || header->log_offset % KEYSTORE_STORE_ALIGN)
+    return -EBADMSG;
+
+  return 0;
+}
+
+static uint32_t keystore_store_checksum(const struct keystore_store_record *rec)
+{
+  return keystore_store_fnv(2166136261u, (const uint8_t *)rec + sizeof(rec->checksum),
+                            keystore_store_record_size(rec->id_size, rec->key_size) -
+                            sizeof(rec->checksum));
+}
+
+/**
+ * @brief Helper function, enters the log and drops a torn tail.
+ */
+static int keystore_store_scan(struct ias_keystore_store *store, size_t size)
+{
+  const struct keystore_store_record *rec;
+  uint64_t offset = store->header->log_offset;
+  int res;
+
+  while ((rec = keystore_store_record_at(store, offset, size)) != NULL)
+  {
+    if (rec->checksum != keystore_store_checksum(rec))
+      break;
+
+    res = keystore_store_apply(store, offset);
+    if (res)
+      return res;
+
+    offset += keystore_store_record_size(rec->id_size, rec->key_size);
+  }
+
+  store->file_size = offset;
+  if (offset < size && !(store->flags & IAS_KEYSTORE_STORE_RDONLY) &&
+      ftruncate(store->fd, (off_t)offset))
+    return -errno;
+
+  return 0;
+}
+
+/**
+ * @brief Helper function, (re)loads the store from its file descriptor.
+ */
+static int keystore_store_load(struct ias_keystore_store *store)
+{
+  struct stat st;
+  int res;
+
+  if (fstat(store->fd, &st))
+    return -errno;
+
+  if ((size_t)st.st_size < sizeof(struct keystore_store_header))
+    return -EBADMSG;
+
+  res = keystore_store_map(store, (size_t)st.st_size);
+  if (res)
+    return res;
+
+  res = keystore_store_check_header(store->header, (size_t)st.st_size);
+  if (res)
+    return res;
+
+  free(store->slots);
+  store->slots = (struct keystore_store_slot *)calloc(KEYSTORE_STORE_MIN_SLOTS, sizeof(*store->slots));
+  if (!store->slots)
+    return -ENOMEM;
+  store->slot_mask = KEYSTORE_STORE_MIN_SLOTS - 1;
+  store->slot_count = 0;
+  store->count = (size_t)store->header->record_count;
+
+  return keystore_store_scan(store, (size_t)st.st_size);
+}
+
+/**
+ * @brief Helper function, writes the header of an empty store.
+ */
+static int keystore_store_init(int fd)
+{
+  struct keystore_store_header header;
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, KEYSTORE_STORE_MAGIC, sizeof(header.magic));
+  header.version = KEYSTORE_STORE_VERSION;
+  header.index_offset = sizeof(header);
+  header.log_offset = sizeof(header);
+
+  if (pwrite(fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header))
+    return -EIO;
+
+  return fsync(fd) ? -errno : 0;
+}
+
+/**
+ * @brief Helper function, takes the writer lock on the file at @path.
+ *
+ * The file may be replaced by a compaction between open() and flock();
+ * the lock is only good if @fd is still the file at @path.
+ *
+ * @return 0 if OK, -ESTALE if the file was replaced.
+ */
+static int keystore_store_lock(const char *path, int fd)
+{
+  struct stat fd_st, path_st;
+
+  if (flock(fd, LOCK_EX | LOCK_NB))
+    return errno == EWOULDBLOCK ? -EBUSY : -errno;
+
+  if (fstat(fd, &fd_st) || stat(path, &path_st))
+    return -errno;
+
+  if (fd_st.st_dev != path_st.st_dev || fd_st.st_ino != path_st.st_ino)
+    return -ESTALE;
+
+  return 0;
+}
+
+int ias_keystore_store_open(const char *path, int flags, struct ias_keystore_store **store)
+{
+  struct ias_keystore_store *s;
+  struct stat st;
+  int open_flags = O_CLOEXEC;
+  int res = -ESTALE;
+  int tries;
+
+  if (!path || !store)
+    return -EFAULT;
+
+  if ((flags & IAS_KEYSTORE_STORE_RDONLY) && (flags & IAS_KEYSTORE_STORE_CREATE))
+    return -EINVAL;
+
+  s = (struct ias_keystore_store *)calloc(1, sizeof(*s));
+  if (!s)
+    return -ENOMEM;
+
+  s->fd = -1;
+  s->flags = flags;
+  s->path = strdup(path);
+  pthread_rwlock_init(&s->lock, NULL);
+  if (!s->path)
+  {
+    ias_keystore_store_close(s);
+    return -ENOMEM;
+  }
+
+  open_flags |= (flags & IAS_KEYSTORE_STORE_RDONLY) ? O_RDONLY : O_RDWR;
+  if (flags & IAS_KEYSTORE_STORE_CREATE)
+    open_flags |= O_CREAT;
+
+  for (tries = 0; tries < 3 && res == -ESTALE; tries++)
+  {
+    if (s->fd >= 0)
+      close(s->fd);
+
+    s->fd = open(path, open_flags, 0600);
+    if (s->fd < 0)
+    {
+      res = -errno;
+      break;
+    }
+
+    res = (flags & IAS_KEYSTORE_STORE_RDONLY) ? 0 : keystore_store_lock(path, s->fd);
+  }
+
+  /* A new file, or one created by a writer which did not get further */
+  if (!res && !(flags & IAS_KEYSTORE_STORE_RDONLY) && !fstat(s->fd, &st) && !st.st_size)
+    res = keystore_store_init(s->fd);
+
+  if (!res)
+    res = keystore_store_load(s);
+
+  if (res)
+  {
+    ias_keystore_store_close(s);
+    return res;
+  }
+
+  *store = s;
+  return 0;
+}
+
+void ias_keystore_store_close(struct ias_keystore_store *store)
+{
+  if (!store)
+    return;
+
+  if (store->map)
+    munmap((void *)store->map, store->map_size);
+  if (store->fd >= 0)
+    close(store->fd);
+
+  pthread_rwlock_destroy(&store->lock);
+  free(store->slots);
+  free(store->path);
+  free(store);
+}
+
+static int keystore_store_check_id(const char *id, size_t *id_size)
+{
+  if (!id)
+    return -EFAULT;
+
+  *id_size = strlen(id);
+  if (!*id_size || *id_size > IAS_KEYSTORE_STORE_ID_MAX)
+    return -EINVAL;
+
+  return 0;
+}
+
+int ias_keystore_store_get(struct ias_keystore_store *store, const char *id,
+                           uint8_t *wrapped_key, size_t *wrapped_key_size)
+{
+  const struct keystore_store_record *rec;
+  size_t id_size;
+  int res;
+
+  if (!store || !wrapped_key_size)
+    return -EFAULT;
+
+  res = keystore_store_check_id(id, &id_size);
+  if (res)
+    return res;
+
+  pthread_rwlock_rdlock(&store->lock);
+  rec = keystore_store_lookup(store, keystore_store_hash(id, id_size), id, id_size);
+  if (!rec)
+  {
+    res = -ENOENT;
+  }
+  else if (*wrapped_key_size < rec->key_size)
+  {
+    *wrapped_key_size = rec->key_size;
+    res = -EMSGSIZE;
+  }
+  else if (!wrapped_key)
+  {
+    res = -EFAULT;
+  }
+  else
+  {
+    memcpy(wrapped_key, keystore_store_record_key(rec), rec->key_size);
+    *wrapped_key_size = rec->key_size;
+  }
+  pthread_rwlock_unlock(&store->lock);
+
+  return res;
+}
+
+/**
+ * @brief Helper function, appends a record to the log.
+ *
+ * Must be called with the lock held for writing.
+ */
+static int keystore_store_append(struct ias_keystore_store *store, const char *id, size_t id_size,
+                                 const uint8_t *wrapped_key, size_t wrapped_key_size, uint16_t flags)
+{
+  size_t size = keystore_store_record_size(id_size, wrapped_key_size);
+  struct keystore_store_record *rec;
+  uint64_t offset = store->file_size;
+  ssize_t written;
+  int res = 0;
+
+  if (store->flags & IAS_KEYSTORE_STORE_RDONLY)
+    return -EBADF;
+
+  rec = (struct keystore_store_record *)calloc(1, size);
+  if (!rec)
+    return -ENOMEM;
+
+  rec->id_size = (uint16_t)id_size;
+  rec->flags = flags;
+  rec->key_size = (uint32_t)wrapped_key_size;
+  memcpy(rec + 1, id, id_size);
+  if (wrapped_key_size)
+    memcpy((uint8_t *)(rec + 1) + id_size, wrapped_key, wrapped_key_size);
+  rec->checksum = keystore_store_checksum(rec);
+
+  written = pwrite(store->fd, rec, size, (off_t)offset);
+  free(rec);
+
+  if (written != (ssize_t)size)
+    res = written < 0 ? -errno : -EIO;
+  if (!res && (store->flags & IAS_KEYSTORE_STORE_SYNC) && fdatasync(store->fd))
+    res = -errno;
+  if (!res && offset + size > store->map_size)
+    res = keystore_store_map(store, offset + size);
+  if (!res)
+    res = keystore_store_apply(store, offset);
+
+  if (res)
+  {
+    /* Do not leave a record behind that is not in the index, and
+     * refuse further writes if that fails */
+    if (ftruncate(store->fd, (off_t)offset))
+      store->flags |= IAS_KEYSTORE_STORE_RDONLY;
+    return res;
+  }
+
+  store->file_size = offset + size;
+  return 0;
+}
+
+int ias_keystore_store_put(struct ias_keystore_store *store, const char *id,
+                           const uint8_t *wrapped_key, size_t wrapped_key_size)
+{
+  size_t id_size;
+  int res;
+
+  if (!store || !wrapped_key)
+    return -EFAULT;
+
+  res = keystore_store_check_id(id, &id_size);
+  if (res)
+    return res;
+
+  if (!wrapped_key_size || wrapped_key_size > KEYSTORE_STORE_KEY_MAX)
+    return -EINVAL;
+
+  pthread_rwlock_wrlock(&store->lock);
+  res = keystore_store_append(store, id, id_size, wrapped_key, wrapped_key_size, 0);
+  pthread_rwlock_unlock(&store->lock);
+
+  return res;
+}
+
+int ias_keystore_store_remove(struct ias_keystore_store *store, const char *id)
+{
+  size_t id_size;
+  int res;
+
+  if (!store)
+    return -EFAULT;
+
+  res = keystore_store_check_id(id, &id_size);
+  if (res)
+    return res;
+
+  pthread_rwlock_wrlock(&store->lock);
+  if (!keystore_store_lookup(store, keystore_store_hash(id, id_size), id, id_size))
+    res = -ENOENT;
+  else
+    res = keystore_store_append(store, id, id_size, NULL, 0, KEYSTORE_STORE_REMOVED);
+  pthread_rwlock_unlock(&store->lock);
+
+  return res;
+}
+
+/**
+ * @brief Helper function, calls @fn for every live record.
+ *
+ * Must be called with the lock held.
+ */
+static int keystore_store_walk(struct ias_keystore_store *store,
+                               int (*fn)(void *priv, const struct keystore_store_record *rec),
+                               void *priv)
+{
+  const struct keystore_store_record *rec;
+  struct keystore_store_slot *slot;
+  uint32_t i;
+  size_t j;
+  int res;
+
+  /* Indexed records, unless replaced or removed in the log */
+  for (i = 0; i < store->header->bucket_count; i++)
+  {
+    if (!store->buckets[i].offset)
+      continue;
+
+    rec = keystore_store_record_at(store, store->buckets[i].offset, store->header->log_offset);
+    if (!rec)
+      continue;
+
+    slot = keystore_store_slot(store, store->buckets[i].hash,
+                               keystore_store_record_id(rec), rec->id_size);
+    if (slot->offset)
+      continue;
+
+    res = fn(priv, rec);
+    if (res)
+      return res;
+  }
+
+  for (j = 0; j <= store->slot_mask; j++)
+  {
+    if (!store->slots[j].offset)
+      continue;
+
+    rec = (const struct keystore_store_record *)(store->map + store->slots[j].offset);
+    if (rec->flags & KEYSTORE_STORE_REMOVED)
+      continue;
+
+    res = fn(priv, rec);
+    if (res)
+      return res;
+  }
+
+  return 0;
+}
+
+struct keystore_store_foreach {
+  int (*fn)(void *priv, const char *id, const uint8_t *wrapped_key, size_t wrapped_key_size);
+  void *priv;
+};
+
+static int keystore_store_foreach_record(void *priv, const struct keystore_store_record *rec)
+{
+  struct keystore_store_foreach *foreach = (struct keystore_store_foreach *)priv;
+  char id[IAS_KEYSTORE_STORE_ID_MAX + 1];
+
+  memcpy(id, keystore_store_record_id(rec), rec->id_size);
+  id[rec->id_size] = '\0';
+
+  return foreach->fn(foreach->priv, id, keystore_store_record_key(rec), rec->key_size);
+}
+
+int ias_keystore_store_foreach(struct ias_keystore_store *store,
+                               int (*fn)(void *priv, const char *id,
+                                         const uint8_t *wrapped_key, size_t wrapped_key_size),
+                               void *priv)
+{
+  struct keystore_store_foreach foreach = { fn, priv };
+  int res;
+
+  if (!store || !fn)
+    return -EFAULT;
+
+  pthread_rwlock_rdlock(&store->lock);
+  res = keystore_store_walk(store, keystore_store_foreach_record, &foreach);
+  pthread_rwlock_unlock(&store->lock);
+
+  return res;
+}
+
+size_t ias_keystore_store_count(struct ias_keystore_store *store)
+{
+  size_t count;
+
+  if (!store)
+    return 0;
+
+  pthread_rwlock_rdlock(&store->lock);
+  count = store->count;
+  pthread_rwlock_unlock(&store->lock);
+
+  return count;
+}
+
+/* State of a compaction: the new file is mapped writable */
+struct keystore_store_compaction {
+  uint8_t *map;
+  struct keystore_store_header *header;
+  struct keystore_store_bucket *buckets;
+  uint64_t offset;
+};
+
+static int keystore_store_compact_size(void *priv, const struct keystore_store_record *rec)
+{
+  struct keystore_store_compaction *c = (struct keystore_store_compaction *)priv;
+
+  c->header->record_count++;
+  c->offset += keystore_store_record_size(rec->id_size, rec->key_size);
+  return 0;
+}
+
+static int keystore_store_compact_copy(void *priv, const struct keystore_store_record *rec)
+{
+  struct keystore_store_compaction *c = (struct keystore_store_compaction *)priv;
+  uint32_t hash = keystore_store_hash(keystore_store_record_id(rec), rec->id_size);
+  uint32_t mask = c->header->bucket_count - 1;
+  uint32_t i = hash & mask;
+  size_t size = keystore_store_record_size(rec->id_size, rec->key_size);
+
+  while (c->buckets[i].offset)
+    i = (i + 1) & mask;
+
+  c->buckets[i].hash = hash;
+  c->buckets[i].offset = c->offset;
+
+  memcpy(c->map + c->offset, rec, size);
+  c->offset += size;
+  return 0;
+}
+
+int ias_keystore_store_compact(struct ias_keystore_store *store)
+{
+  struct keystore_store_header header;
+  struct keystore_store_compaction c;
+  uint64_t records_size;
+  size_t size;
+  char tmp_path[PATH_MAX];
+  char dir_path[PATH_MAX];
+  int fd, dir_fd;
+  int res = 0;
+
+  if (!store)
+    return -EFAULT;
+
+  if (store->flags & IAS_KEYSTORE_STORE_RDONLY)
+    return -EBADF;
+
+  if (snprintf(tmp_path, sizeof(tmp_path), "%s.compact", store->path) >= (int)sizeof(tmp_path))
+    return -ENAMETOOLONG;
+
+  pthread_rwlock_wrlock(&store->lock);
+
+  /* Size the new file */
+  memset(&header, 0, sizeof(header));
+  memset(&c, 0, sizeof(c));
+  c.header = &header;
+  keystore_store_walk(store, keystore_store_compact_size, &c);
+  records_size = c.offset;
+
+  memcpy(header.magic, KEYSTORE_STORE_MAGIC, sizeof(header.magic));
+  header.version = KEYSTORE_STORE_VERSION;
+  header.bucket_count = header.record_count ? KEYSTORE_STORE_MIN_SLOTS : 0;
+  while (header.bucket_count && header.bucket_count < header.record_count * 2)
+    header.bucket_count *= 2;
+  header.index_offset = sizeof(header);
+  header.log_offset = header.index_offset +
+                      (uint64_t)header.bucket_count * sizeof(struct keystore_store_bucket) +
+                      records_size;
+  size = (size_t)header.log_offset;
+
+  fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (fd < 0)
+  {
+    res = -errno;
+    goto out;
+  }
+
+  /* Held from before the rename, so no writer can open the new file */
+  if (flock(fd, LOCK_EX | LOCK_NB) || ftruncate(fd, (off_t)size))
+  {
+    res = -errno;
+    goto out_fd;
+  }
+
+  c.map = (uint8_t *)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (c.map == MAP_FAILED)
+  {
+    res = -errno;
+    goto out_fd;
+  }
+
+  memcpy(c.map, &header, sizeof(header));
+  c.header = (struct keystore_store_header *)c.map;
+  c.buckets = (struct keystore_store_bucket *)(c.map + header.index_offset);
+  c.offset = header.index_offset + (uint64_t)header.bucket_count * sizeof(struct keystore_store_bucket);
+  keystore_store_walk(store, keystore_store_compact_copy, &c);
+
+  if (msync(c.map, size, MS_SYNC) || fsync(fd))
+    res = -errno;
+  munmap(c.map, size);
+  if (res)
+    goto out_fd;
+
+  if (rename(tmp_path, store->path))
+  {
+    res = -errno;
+    goto out_fd;
+  }
+
+  /* Make the rename durable */
+  snprintf(dir_path, sizeof(dir_path), "%s", store->path);
+  dir_fd = open(dirname(dir_path), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (dir_fd >= 0)
+  {
+    fsync(dir_fd);
+    close(dir_fd);
+  }
+
+  close(store->fd);
+  store->fd = fd;
+  res = keystore_store_load(store);
+  goto out;
+
+out_fd:
+  close(fd);
+  unlink(tmp_path);
+out:
+  pthread_rwlock_unlock(&store->lock);
+  return res;
+}
+
+/* end of file */
@@ -0,0 +1,1027 @@
+/*
+   Copyright 2018 Intel Corporation
+
+   This software is licensed to you in accordance
+   with the agreement between you and Intel Corporation.
+
+   Alternatively, you can use this file in compliance
+   with the Apache license, Version 2.
+
+
+   Apache License, Version 2.0
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+   http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "ias_keystore.h"
+#include "ias_keystore_aes.h"
+#include "ias_keystore_priv.h"
+#include "ias_keystore_stream.h"
+
+#define KEYSTORE_STREAM_MAGIC "IASKSTRM"
+#define KEYSTORE_STREAM_VERSION 2
+#define KEYSTORE_STREAM_DEFAULT_THREADS 4
+#define KEYSTORE_STREAM_MAX_THREADS 64
+#define KEYSTORE_STREAM_DEK_SIZE 32
+#define KEYSTORE_STREAM_FLAG_ENVELOPE 0x01
+
+/*
+ * Container header, IAS_KEYSTORE_STREAM_HEADER_SIZE bytes:
+ *
+ *    0  magic           8 bytes
+ *    8  version         1 byte
+ *    9  algo_spec       1 byte
+ *   10  tag size        1 byte
+ *   11  flags           1 byte, KEYSTORE_STREAM_FLAG_*
+ *   12  chunk size      4 bytes, little endian
+ *   16  stream IV       12 bytes, random
+ *   28  reserved        4 bytes, 0
+ *
+ * With KEYSTORE_STREAM_FLAG_ENVELOPE, IAS_KEYSTORE_STREAM_ENVELOPE_SIZE
+ * more bytes follow:
+ *
+ *   32  wrap IV         12 bytes
+ *   44  wrapped DEK     32 bytes of AES-GCM ciphertext and its 16 byte tag
+ *
+ * The header is not authenticated on its own: any change to it changes
+ * the chunk nonces or boundaries, or fails to unwrap the data key, so the
+ * first chunk fails to decrypt.
+ */
+#define KEYSTORE_STREAM_OFF_VERSION 8
+#define KEYSTORE_STREAM_OFF_ALGO 9
+#define KEYSTORE_STREAM_OFF_TAG 10
+#define KEYSTORE_STREAM_OFF_CHUNK 12
+#define KEYSTORE_STREAM_OFF_FLAGS 11
+#define KEYSTORE_STREAM_OFF_IV 16
+#define KEYSTORE_STREAM_OFF_RESERVED 28
+
+struct ias_keystore_stream {
+  uint8_t client_ticket[KEYSTORE_CLIENT_TICKET_SIZE];
+  uint32_t slot_id;
+  int encrypt;
+  enum keystore_algo_spec algo_spec;
+  size_t chunk_size;   /* plaintext bytes per chunk */
+  size_t tag_size;
+  uint8_t iv[DAL_KEYSTORE_GCM_IV_SIZE];
+  uint32_t chunk;      /* number of the next chunk */
+  int error;           /* sticky error */
+  int finished;
+
+  /* Envelope mode: the data key the chunks are encrypted with on the host */
+  struct keystore_gcm_key *dek;
+
+  /* Header still to be written, or the part of it read so far */
+  uint8_t header[IAS_KEYSTORE_STREAM_HEADER_SIZE + IAS_KEYSTORE_STREAM_ENVELOPE_SIZE];
+  size_t header_size;
+  size_t header_total;   /* header bytes to read when decrypting */
+
+  /* Pending plaintext when encrypting, a pending chunk when decrypting */
+  uint8_t *buf;
+  size_t buf_size;
+  size_t fill;
+};
+
+/**
+ * @brief Helper function, the nonce of a chunk: the stream IV, its last 5 bytes
+ * XORed with the chunk number and the last flag.
+ *
+ * Every stream under a slot key draws a full 96 bit IV, so nonces of different
+ * streams collide only as often as random 96 bit IVs would, while the chunk
+ * number and last flag still authenticate the chunk position.
+ */
+static void keystore_stream_nonce(const struct ias_keystore_stream *stream, uint32_t chunk,
+                                  int last, uint8_t nonce[DAL_KEYSTORE_GCM_IV_SIZE])
+{
+  memcpy(nonce, stream->iv, DAL_KEYSTORE_GCM_IV_SIZE);
+  nonce[7] ^= (uint8_t)(chunk >> 24);
+  nonce[8] ^= (uint8_t)(chunk >> 16);
+  nonce[9] ^= (uint8_t)(chunk >> 8);
+  nonce[10] ^= (uint8_t)chunk;
+  nonce[11] ^= last ? 1 : 0;
+}
+
+static int keystore_stream_tag_size(enum keystore_algo_spec algo_spec, size_t *tag_size)
+{
+  if (algo_spec != ALGOSPEC_AES_GCM)
+    return -EINVAL;
+
+  return ias_keystore_encrypt_size(algo_spec, 0, tag_size);
+}
+
+static int keystore_stream_set_dek(struct ias_keystore_stream *stream,
+                                   const uint8_t dek[KEYSTORE_STREAM_DEK_SIZE])
+{
+  int res;
+
+  /* The table based AES and GHASH are not constant time, see envelope_init */
+  if (!keystore_gcm_accelerated())
+    return -EOPNOTSUPP;
+
+  stream->dek = (struct keystore_gcm_key *)malloc(sizeof(*stream->dek));
+  if (!stream->dek)
+    return -ENOMEM;
+
+  res = keystore_gcm_setkey(stream->dek, dek, KEYSTORE_STREAM_DEK_SIZE);
+  if (res)
+  {
+    free(stream->dek);
+    stream->dek = NULL;
+  }
+  return res;
+}
+
+/**
+ * @brief Helper function, generates the data key of an envelope stream and
+ * writes it, wrapped by the slot key, to @block.
+ */
+static int keystore_stream_wrap_dek(struct ias_keystore_stream *stream,
+                                    uint8_t block[IAS_KEYSTORE_STREAM_ENVELOPE_SIZE])
+{
+  uint8_t dek[KEYSTORE_STREAM_DEK_SIZE];
+  size_t wrapped_size;
+  int res;
+
+  res = ias_keystore_encrypt_size(ALGOSPEC_AES_GCM, sizeof(dek), &wrapped_size);
+  if (res)
+    return res;
+  if (wrapped_size != IAS_KEYSTORE_STREAM_ENVELOPE_SIZE - DAL_KEYSTORE_GCM_IV_SIZE)
+    return -EINVAL;
+
+  res = keystore_random(dek, sizeof(dek));
+  if (!res)
+    res = keystore_random(block, DAL_KEYSTORE_GCM_IV_SIZE);
+  if (!res)
+    res = ias_keystore_encrypt(stream->client_ticket, stream->slot_id, ALGOSPEC_AES_GCM,
+                               block, DAL_KEYSTORE_GCM_IV_SIZE, dek, sizeof(dek),
+                               block + DAL_KEYSTORE_GCM_IV_SIZE);
+  if (!res)
+    res = keystore_stream_set_dek(stream, dek);
+
+  keystore_memzero(dek, sizeof(dek));
+  return res;
+}
+
+/**
+ * @brief Helper function, unwraps the data key of an envelope stream.
+ */
+static int keystore_stream_unwrap_dek(struct ias_keystore_stream *stream,
+                                      const uint8_t block[IAS_KEYSTORE_STREAM_ENVELOPE_SIZE])
+{
+  uint8_t dek[KEYSTORE_STREAM_DEK_SIZE];
+  int res;
+
+  res = ias_keystore_decrypt(stream->client_ticket, stream->slot_id, ALGOSPEC_AES_GCM,
+                             block, DAL_KEYSTORE_GCM_IV_SIZE,
+                             block + DAL_KEYSTORE_GCM_IV_SIZE,
+                             IAS_KEYSTORE_STREAM_ENVELOPE_SIZE - DAL_KEYSTORE_GCM_IV_SIZE, dek);
+  if (!res)
+    res = keystore_stream_set_dek(stream, dek);
+
+  keystore_memzero(dek, sizeof(dek));
+  return res;
+}
+
+static struct ias_keystore_stream *keystore_stream_alloc(const uint8_t *client_ticket,
+                                                         uint32_t slot_id, int encrypt)
+{
+  struct ias_keystore_stream *stream;
+
+  stream = (struct ias_keystore_stream *)calloc(1, sizeof(*stream));
+  if (!stream)
+    return NULL;
+
+  memcpy(stream->client_ticket, client_ticket, sizeof(stream->client_ticket));
+  stream->slot_id = slot_id;
+  stream->encrypt = encrypt;
+  return stream;
+}
+
+static int keystore_stream_encrypt_start(const uint8_t *client_ticket, uint32_t slot_id,
+                                         enum keystore_algo_spec algo_spec, size_t chunk_size,
+                                         int envelope, struct ias_keystore_stream **stream)
+{
+  struct ias_keystore_stream *s;
+  size_t tag_size = KEYSTORE_AES_TAG_SIZE;
+  int res;
+
+  if (!client_ticket || !stream)
+    return -EFAULT;
+
+  if (!chunk_size)
+    chunk_size = IAS_KEYSTORE_STREAM_CHUNK_SIZE;
+  if (chunk_size > IAS_KEYSTORE_STREAM_CHUNK_SIZE_MAX)
+    return -EINVAL;
+
+  if (!envelope)
+  {
+    res = keystore_stream_tag_size(algo_spec, &tag_size);
+    if (res)
+      return res;
+  }
+
+  s = keystore_stream_alloc(client_ticket, slot_id, 1);
+  if (!s)
+    return -ENOMEM;
+
+  s->algo_spec = algo_spec;
+  s->chunk_size = chunk_size;
+  s->tag_size = tag_size;
+  s->buf_size = chunk_size;
+  s->buf = (uint8_t *)malloc(s->buf_size);
+  if (!s->buf)
+  {
+    free(s);
+    return -ENOMEM;
+  }
+
+  res = keystore_random(s->iv, sizeof(s->iv));
+  if (!res && envelope)
+    res = keystore_stream_wrap_dek(s, s->header + IAS_KEYSTORE_STREAM_HEADER_SIZE);
+  if (res)
+  {
+    ias_keystore_stream_free(s);
+    return res;
+  }
+
+  memcpy(s->header, KEYSTORE_STREAM_MAGIC, 8);
+  s->header[KEYSTORE_STREAM_OFF_VERSION] = KEYSTORE_STREAM_VERSION;
+  s->header[KEYSTORE_STREAM_OFF_ALGO] = (uint8_t)algo_spec;
+  s->header[KEYSTORE_STREAM_OFF_TAG] = (uint8_t)tag_size;
+  s->header[KEYSTORE_STREAM_OFF_FLAGS] = envelope ? KEYSTORE_STREAM_FLAG_ENVELOPE : 0;
+  s->header[KEYSTORE_STREAM_OFF_CHUNK] = (uint8_t)chunk_size;
+  s->header[KEYSTORE_STREAM_OFF_CHUNK + 1] = (uint8_t)(chunk_size >> 8);
+  s->header[KEYSTORE_STREAM_OFF_CHUNK + 2] = (uint8_t)(chunk_size >> 16);
+  s->header[KEYSTORE_STREAM_OFF_CHUNK + 3] = (uint8_t)(chunk_size >> 24);
+  memcpy(s->header + KEYSTORE_STREAM_OFF_IV, s->iv, sizeof(s->iv));
+  s->header_size = IAS_KEYSTORE_STREAM_HEADER_SIZE;
+  if (envelope)
+    s->header_size += IAS_KEYSTORE_STREAM_ENVELOPE_SIZE;
+
+  *stream = s;
+  return 0;
+}
+
+int ias_keystore_stream_encrypt_init(const uint8_t *client_ticket, uint32_t slot_id,
+                                     enum keystore_algo_spec algo_spec, size_t chunk_size,
+                                     struct ias_keystore_stream **stream)
+{
+  return keystore_stream_encrypt_start(client_ticket, slot_id, algo_spec, chunk_size, 0, stream);
+}
+
+int ias_keystore_stream_envelope_init(const uint8_t *client_ticket, uint32_t slot_id,
+                                      size_t chunk_size, struct ias_keystore_stream **stream)
+{
+  /* Fail before the device call which wraps the data key */
+  if (!keystore_gcm_accelerated())
+    return -EOPNOTSUPP;
+
+  return keystore_stream_encrypt_start(client_ticket, slot_id, ALGOSPEC_AES_GCM, chunk_size, 1,
+                                       stream);
+}
+
+int ias_keystore_stream_decrypt_init(const uint8_t *client_ticket, uint32_t slot_id,
+                                     struct ias_keystore_stream **stream)
+{
+  if (!client_ticket || !stream)
+    return -EFAULT;
+
+  *stream = keystore_stream_alloc(client_ticket, slot_id, 0);
+  if (!*stream)
+    return -ENOMEM;
+
+  (*stream)->header_total = IAS_KEYSTORE_STREAM_HEADER_SIZE;
+  return 0;
+}
+
+/**
+ * @brief Helper function, parses the header of a container to decrypt.
+ */
+static int keystore_stream_parse_header(struct ias_keystore_stream *stream)
+{
+  static const uint8_t reserved[IAS_KEYSTORE_STREAM_HEADER_SIZE - KEYSTORE_STREAM_OFF_RESERVED];
+  const uint8_t *header = stream->header;
+  uint8_t flags = header[KEYSTORE_STREAM_OFF_FLAGS];
+  size_t tag_size = KEYSTORE_AES_TAG_SIZE;
+  int res;
+
+  if (memcmp(header, KEYSTORE_STREAM_MAGIC, 8) ||
+      header[KEYSTORE_STREAM_OFF_VERSION] != KEYSTORE_STREAM_VERSION ||
+      (flags & ~KEYSTORE_STREAM_FLAG_ENVELOPE) ||
+      memcmp(header + KEYSTORE_STREAM_OFF_RESERVED, reserved, sizeof(reserved)))
+    return -EBADMSG;
+
+  stream->algo_spec = (enum keystore_algo_spec)header[KEYSTORE_STREAM_OFF_ALGO];
+  if (flags & KEYSTORE_STREAM_FLAG_ENVELOPE)
+  {
+    /* Chunks are encrypted on the host, the device only holds the DEK */
+    if (stream->algo_spec != ALGOSPEC_AES_GCM || header[KEYSTORE_STREAM_OFF_TAG] != tag_size)
+      return -EBADMSG;
+    stream->header_total = IAS_KEYSTORE_STREAM_HEADER_SIZE + IAS_KEYSTORE_STREAM_ENVELOPE_SIZE;
+  }
+  else
+  {
+    res = keystore_stream_tag_size(stream->algo_spec, &tag_size);
+    if (res == -EINVAL || (!res && tag_size != header[KEYSTORE_STREAM_OFF_TAG]))
+      return -EBADMSG;
+    if (res)
+      return res;
+  }
+
+  stream->tag_size = tag_size;
+  stream->chunk_size = (size_t)header[KEYSTORE_STREAM_OFF_CHUNK] |
+                       (size_t)header[KEYSTORE_STREAM_OFF_CHUNK + 1] << 8 |
+                       (size_t)header[KEYSTORE_STREAM_OFF_CHUNK + 2] << 16 |
+                       (size_t)header[KEYSTORE_STREAM_OFF_CHUNK + 3] << 24;
+  if (!stream->chunk_size || stream->chunk_size > IAS_KEYSTORE_STREAM_CHUNK_SIZE_MAX)
+    return -EBADMSG;
+  memcpy(stream->iv, header + KEYSTORE_STREAM_OFF_IV, sizeof(stream->iv));
+  return 0;
+}
+
+size_t ias_keystore_stream_output_size(const struct ias_keystore_stream *stream,
+                                       size_t input_size)
+{
+  size_t size;
+
+  if (!stream)
+    return 0;
+
+  /* Plaintext is never longer than the container data it came from */
+  if (!stream->encrypt)
+    return stream->fill + input_size;
+
+  size = stream->fill + input_size;
+  return stream->header_size + size + (size / stream->chunk_size + 1) * stream->tag_size;
+}
+
+/**
+ * @brief Helper function, encrypts or decrypts chunk number @chunk.
+ *
+ * @return Output size, or negative error code (see errno.h).
+ */
+static ssize_t keystore_stream_crypt(const struct ias_keystore_stream *stream, uint32_t chunk,
+                                     const uint8_t *input, size_t input_size, int last,
+                                     uint8_t *output)
+{
+  uint8_t nonce[DAL_KEYSTORE_GCM_IV_SIZE];
+  int res;
+
+  keystore_stream_nonce(stream, chunk, last, nonce);
+
+  if (stream->dek)
+  {
+    if (stream->encrypt)
+    {
+      res = keystore_gcm_encrypt(stream->dek, nonce, sizeof(nonce), NULL, 0, input, input_size,
+                                 output, output + input_size);
+      return res ? res : (ssize_t)(input_size + stream->tag_size);
+    }
+
+    if (input_size < stream->tag_size)
+      return -EBADMSG;
+    input_size -= stream->tag_size;
+    res = keystore_gcm_decrypt(stream->dek, nonce, sizeof(nonce), NULL, 0, input, input_size,
+                               input + input_size, output);
+    return res ? res : (ssize_t)input_size;
+  }
+
+  if (stream->encrypt)
+  {
+    res = ias_keystore_encrypt(stream->client_ticket, stream->slot_id, stream->algo_spec,
+                               nonce, sizeof(nonce), input, input_size, output);
+    if (res)
+      return res;
+    input_size += stream->tag_size;
+  }
+  else
+  {
+    if (input_size < stream->tag_size)
+      return -EBADMSG;
+    res = ias_keystore_decrypt(stream->client_ticket, stream->slot_id, stream->algo_spec,
+                               nonce, sizeof(nonce), input, input_size, output);
+    if (res)
+      return res;
+    input_size -= stream->tag_size;
+  }
+
+  return (ssize_t)input_size;
+}
+
+/**
+ * @brief Helper function, encrypts or decrypts the next chunk of a stream.
+ *
+ * @return Output size, or negative error code (see errno.h).
+ */
+static ssize_t keystore_stream_chunk(struct ias_keystore_stream *stream, const uint8_t *input,
+                                     size_t input_size, int last, uint8_t *output)
+{
+  ssize_t res;
+
+  /* Only the last chunk may use the last chunk number */
+  if (!last && stream->chunk == UINT32_MAX)
+    return -EFBIG;
+
+  res = keystore_stream_crypt(stream, stream->chunk, input, input_size, last, output);
+  if (res >= 0)
+    stream->chunk++;
+  return res;
+}
+
+/**
+ * @brief Helper function, collects and parses the header of a container to
+ * decrypt; once it is complete, sets up the chunk buffer.
+ */
+static int keystore_stream_read_header(struct ias_keystore_stream *stream,
+                                       const uint8_t **input, size_t *input_size)
+{
+  size_t n;
+  int res;
+
+  while (!stream->buf && *input_size)
+  {
+    n = stream->header_total - stream->header_size;
+    if (n > *input_size)
+      n = *input_size;
+    memcpy(stream->header + stream->header_size, *input, n);
+    stream->header_size += n;
+    *input += n;
+    *input_size -= n;
+
+    if (stream->header_size < stream->header_total)
+      break;
+
+    if (stream->header_size == IAS_KEYSTORE_STREAM_HEADER_SIZE)
+    {
+      res = keystore_stream_parse_header(stream);
+      if (res)
+        return res;
+      /* An envelope header continues with the wrapped DEK */
+      if (stream->header_total > stream->header_size)
+        continue;
+    }
+
+    if (stream->header_total > IAS_KEYSTORE_STREAM_HEADER_SIZE)
+    {
+      res = keystore_stream_unwrap_dek(stream, stream->header + IAS_KEYSTORE_STREAM_HEADER_SIZE);
+      if (res)
+        return res;
+    }
+
+    stream->buf_size = stream->chunk_size + stream->tag_size;
+    stream->buf = (uint8_t *)malloc(stream->buf_size);
+    if (!stream->buf)
+      return -ENOMEM;
+  }
+
+  return 0;
+}
+
+/**
+ * @brief Helper function, checks the state and the output buffer of a call.
+ */
+static int keystore_stream_check(struct ias_keystore_stream *stream, size_t input_size,
+                                 uint8_t *output, size_t *output_size)
+{
+  size_t needed;
+
+  if (!stream || !output_size)
+    return -EFAULT;
+
+  if (stream->error)
+    return stream->error;
+  if (stream->finished)
+    return -EINVAL;
+
+  needed = ias_keystore_stream_output_size(stream, input_size);
+  if (*output_size < needed)
+  {
+    *output_size = needed;
+    return -EMSGSIZE;
+  }
+
+  return (needed && !output) ? -EFAULT : 0;
+}
+
+int ias_keystore_stream_update(struct ias_keystore_stream *stream,
+                               const uint8_t *input, size_t input_size,
+                               uint8_t *output, size_t *output_size)
+{
+  /* Whole chunks in the buffer are only processed once more input shows
+   * that they are not the last one. */
+  size_t chunk_size;
+  size_t written = 0;
+  size_t n;
+  ssize_t res;
+
+  res = keystore_stream_check(stream, input_size, output, output_size);
+  if (res)
+    return (int)res;
+
+  if (!input && input_size)
+    return -EFAULT;
+
+  if (stream->encrypt && stream->header_size)
+  {
+    memcpy(output, stream->header, stream->header_size);
+    written = stream->header_size;
+    stream->header_size = 0;
+  }
+
+  if (!stream->encrypt && !stream->buf)
+  {
+    res = keystore_stream_read_header(stream, &input, &input_size);
+    if (res)
+      goto out;
+  }
+
+  chunk_size = stream->buf_size;
+  while (input_size)
+  {
+    if (stream->fill == chunk_size)
+    {
+      res = keystore_stream_chunk(stream, stream->buf, chunk_size, 0, output + written);
+      if (res < 0)
+        goto out;
+      written += (size_t)res;
+      stream->fill = 0;
+    }
+
+    /* Skip the buffer for chunks entirely within the input */
+    if (!stream->fill && input_size > chunk_size)
+    {
+      res = keystore_stream_chunk(stream, input, chunk_size, 0, output + written);
+      if (res < 0)
+        goto out;
+      written += (size_t)res;
+      input += chunk_size;
+      input_size -= chunk_size;
+      continue;
+    }
+
+    n = chunk_size - stream->fill;
+    if (n > input_size)
+      n = input_size;
+    memcpy(stream->buf + stream->fill, input, n);
+    stream->fill += n;
+    input += n;
+    input_size -= n;
+  }
+  res = 0;
+
+out:
+  if (res)
+    stream->error = (int)res;
+  *output_size = written;
+  return (int)res;
+}
+
+int ias_keystore_stream_final(struct ias_keystore_stream *stream,
+                              uint8_t *output, size_t *output_size)
+{
+  size_t written = 0;
+  ssize_t res;
+
+  res = keystore_stream_check(stream, 0, output, output_size);
+  if (res)
+    return (int)res;
+
+  if (stream->encrypt && stream->header_size)
+  {
+    memcpy(output, stream->header, stream->header_size);
+    written = stream->header_size;
+    stream->header_size = 0;
+  }
+
+  if (!stream->encrypt && !stream->buf)
+    res = -EBADMSG;
+  else
+    res = keystore_stream_chunk(stream, stream->buf, stream->fill, 1, output + written);
+
+  if (res < 0)
+  {
+    stream->error = (int)res;
+    *output_size = 0;
+    return (int)res;
+  }
+
+  stream->finished = 1;
+  *output_size = written + (size_t)res;
+  return 0;
+}
+
+/*
+ * Parallel encryption and decryption of a container in memory. Chunk i
+ * starts at a fixed offset on both sides, so workers take chunk numbers
+ * from a shared counter and write their output in place.
+ */
+struct keystore_stream_parallel {
+  struct ias_keystore_stream *stream;
+  const uint8_t *input;
+  uint8_t *output;
+  size_t input_chunk;    /* input bytes of a whole chunk */
+  size_t output_chunk;   /* output bytes of a whole chunk */
+  size_t last_size;      /* input bytes of the last chunk */
+  uint64_t chunks;
+  uint64_t next;
+  int error;
+};
+
+static void *keystore_stream_parallel_worker(void *arg)
+{
+  struct keystore_stream_parallel *p = (struct keystore_stream_parallel *)arg;
+  uint64_t chunk;
+  ssize_t res;
+  int last;
+
+  while (!__atomic_load_n(&p->error, __ATOMIC_RELAXED))
+  {
+    chunk = __atomic_fetch_add(&p->next, 1, __ATOMIC_RELAXED);
+    if (chunk >= p->chunks)
+      break;
+
+    last = chunk == p->chunks - 1;
+    res = keystore_stream_crypt(p->stream, (uint32_t)chunk, p->input + chunk * p->input_chunk,
+                                last ? p->last_size : p->input_chunk, last,
+                                p->output + chunk * p->output_chunk);
+    if (res < 0)
+    {
+      int expected = 0;
+
+      __atomic_compare_exchange_n(&p->error, &expected, (int)res, 0,
+                                  __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+    }
+  }
+
+  return NULL;
+}
+
+/**
+ * @brief Helper function, processes all chunks on @threads threads.
+ */
+static int keystore_stream_parallel_run(struct keystore_stream_parallel *p, unsigned int threads)
+{
+  pthread_t thread[KEYSTORE_STREAM_MAX_THREADS];
+  unsigned int started, i;
+
+  if (!threads)
+    threads = KEYSTORE_STREAM_DEFAULT_THREADS;
+  if (threads > KEYSTORE_STREAM_MAX_THREADS)
+    threads = KEYSTORE_STREAM_MAX_THREADS;
+  if (threads > p->chunks)
+    threads = (unsigned int)p->chunks;
+
+  /* The calling thread is one of the workers */
+  for (started = 0; started + 1 < threads; started++)
+  {
+    /* Continue with fewer threads if one cannot be started */
+    if (pthread_create(&thread[started], NULL, keystore_stream_parallel_worker, p))
+      break;
+  }
+
+  keystore_stream_parallel_worker(p);
+
+  for (i = 0; i < started; i++)
+    pthread_join(thread[i], NULL);
+
+  return p->error;
+}
+
+int ias_keystore_stream_encrypted_size(enum keystore_algo_spec algo_spec, size_t chunk_size,
+                                       size_t input_size, size_t *output_size)
+{
+  size_t tag_size, chunks;
+  int res;
+
+  if (!output_size)
+    return -EFAULT;
+
+  if (!chunk_size)
+    chunk_size = IAS_KEYSTORE_STREAM_CHUNK_SIZE;
+  if (chunk_size > IAS_KEYSTORE_STREAM_CHUNK_SIZE_MAX)
+    return -EINVAL;
+
+  res = keystore_stream_tag_size(algo_spec, &tag_size);
+  if (res)
+    return res;
+
+  /* An empty input still has an (empty) last chunk */
+  chunks = input_size ? (input_size - 1) / chunk_size + 1 : 1;
+  if (chunks - 1 > UINT32_MAX)
+    return -EFBIG;
+
+  *output_size = IAS_KEYSTORE_STREAM_HEADER_SIZE + input_size + chunks * tag_size;
+  return 0;
+}
+
+int ias_keystore_stream_encrypt_parallel(const uint8_t *client_ticket, uint32_t slot_id,
+                                         enum keystore_algo_spec algo_spec, size_t chunk_size,
+                                         unsigned int threads,
+                                         const uint8_t *input, size_t input_size,
+                                         uint8_t *output, size_t *output_size)
+{
+  struct keystore_stream_parallel p;
+  struct ias_keystore_stream *stream = NULL;
+  size_t needed;
+  int res;
+
+  if (!output_size || (!input && input_size))
+    return -EFAULT;
+
+  res = ias_keystore_stream_encrypted_size(algo_spec, chunk_size, input_size, &needed);
+  if (res)
+    return res;
+
+  if (*output_size < needed)
+  {
+    *output_size = needed;
+    return -EMSGSIZE;
+  }
+
+  if (!output)
+    return -EFAULT;
+
+  res = ias_keystore_stream_encrypt_init(client_ticket, slot_id, algo_spec, chunk_size, &stream);
+  if (res)
+    return res;
+
+  memcpy(output, stream->header, IAS_KEYSTORE_STREAM_HEADER_SIZE);
+
+  memset(&p, 0, sizeof(p));
+  p.stream = stream;
+  p.input = input;
+  p.output = output + IAS_KEYSTORE_STREAM_HEADER_SIZE;
+  p.input_chunk = stream->chunk_size;
+  p.output_chunk = stream->chunk_size + stream->tag_size;
+  p.chunks = input_size ? (input_size - 1) / stream->chunk_size + 1 : 1;
+  p.last_size = input_size - (p.chunks - 1) * stream->chunk_size;
+
+  res = keystore_stream_parallel_run(&p, threads);
+  ias_keystore_stream_free(stream);
+
+  *output_size = res ? 0 : needed;
+  return res;
+}
+
+int ias_keystore_stream_decrypt_parallel(const uint8_t *client_ticket, uint32_t slot_id,
+                                         unsigned int threads,
+                                         const uint8_t *input, size_t input_size,
+                                         uint8_t *output, size_t *output_size)
+{
+  struct keystore_stream_parallel p;
+  struct ias_keystore_stream *stream = NULL;
+  size_t header_size, body, needed;
+  int res;
+
+  if (!input || !output_size)
+    return -EFAULT;
+
+  if (input_size < IAS_KEYSTORE_STREAM_HEADER_SIZE)
+    return -EBADMSG;
+
+  res = ias_keystore_stream_decrypt_init(client_ticket, slot_id, &stream);
+  if (res)
+    return res;
+
+  memcpy(stream->header, input, IAS_KEYSTORE_STREAM_HEADER_SIZE);
+  stream->header_size = IAS_KEYSTORE_STREAM_HEADER_SIZE;
+  res = keystore_stream_parse_header(stream);
+  header_size = stream->header_total;
+  if (!res && input_size < header_size)
+    res = -EBADMSG;
+  if (!res && header_size > IAS_KEYSTORE_STREAM_HEADER_SIZE)
+    res = keystore_stream_unwrap_dek(stream, input + IAS_KEYSTORE_STREAM_HEADER_SIZE);
+  if (res)
+  {
+    ias_keystore_stream_free(stream);
+    return res;
+  }
+
+  memset(&p, 0, sizeof(p));
+  p.stream = stream;
+  p.input = input + header_size;
+  p.input_chunk = stream->chunk_size + stream->tag_size;
+  p.output_chunk = stream->chunk_size;
+
+  /* Every chunk, the last one included, holds at least a tag */
+  body = input_size - header_size;
+  p.chunks = body ? (body - 1) / p.input_chunk + 1 : 0;
+  p.last_size = body - (body ? (p.chunks - 1) * p.input_chunk : 0);
+  if (!p.chunks || p.last_size < stream->tag_size || p.chunks - 1 > UINT32_MAX)
+  {
+    ias_keystore_stream_free(stream);
+    return -EBADMSG;
+  }
+
+  needed = body - p.chunks * stream->tag_size;
+  if (*output_size < needed)
+  {
+    ias_keystore_stream_free(stream);
+    *output_size = needed;
+    return -EMSGSIZE;
+  }
+
+  p.output = output;
+  res = output ? keystore_stream_parallel_run(&p, threads) : -EFAULT;
+  ias_keystore_stream_free(stream);
+
+  /* Do not hand out the chunks that were authenticated before a failure */
+  if (res && output)
+    keystore_memzero(output, needed);
+
+  *output_size = res ? 0 : needed;
+  return res;
+}
+
+/**
+ * @brief Helper function, reads @size bytes of a container file at @offset.
+ */
+static int keystore_stream_pread(int fd, uint8_t *buf, size_t size, uint64_t offset)
+{
+  ssize_t res;
+
+  while (size)
+  {
+    res = pread(fd, buf, size, (off_t)offset);
+    if (res < 0 && errno == EINTR)
+      continue;
+    if (res < 0)
+      return -errno;
+    /* The file was cut short since its size was taken */
+    if (!res)
+      return -EBADMSG;
+    buf += res;
+    size -= (size_t)res;
+    offset += (uint64_t)res;
+  }
+  return 0;
+}
+
+/**
+ * @brief Helper function, reads and decrypts chunk number @chunk of a
+ * container file into @buf, in place.
+ *
+ * @return Plaintext size, or negative error code (see errno.h).
+ */
+static ssize_t keystore_stream_range_chunk(const struct ias_keystore_stream *stream, int fd,
+                                           uint64_t chunk, uint64_t chunks, size_t last_size,
+                                           uint8_t *buf)
+{
+  size_t input_chunk = stream->chunk_size + stream->tag_size;
+  int last = chunk == chunks - 1;
+  size_t size = last ? last_size : input_chunk;
+  int res;
+
+  res = keystore_stream_pread(fd, buf, size, stream->header_total + chunk * input_chunk);
+  if (res)
+    return res;
+
+  return keystore_stream_crypt(stream, (uint32_t)chunk, buf, size, last, buf);
+}
+
+int ias_keystore_stream_decrypt_range(const uint8_t *client_ticket, uint32_t slot_id,
+                                      int fd, uint64_t offset, size_t length,
+                                      uint8_t *output, size_t *output_size)
+{
+  struct ias_keystore_stream *stream = NULL;
+  uint64_t body, chunks, plain_size, chunk, first, end;
+  size_t input_chunk, last_size, needed, written, skip, n;
+  struct stat st;
+  ssize_t res;
+
+  if (!output_size)
+    return -EFAULT;
+
+  res = ias_keystore_stream_decrypt_init(client_ticket, slot_id, &stream);
+  if (res)
+    return (int)res;
+
+  /* The header, and the wrapped DEK of an envelope container */
+  res = keystore_stream_pread(fd, stream->header, IAS_KEYSTORE_STREAM_HEADER_SIZE, 0);
+  if (!res)
+    res = keystore_stream_parse_header(stream);
+  if (!res && stream->header_total > IAS_KEYSTORE_STREAM_HEADER_SIZE)
+    res = keystore_stream_pread(fd, stream->header + IAS_KEYSTORE_STREAM_HEADER_SIZE,
+                                IAS_KEYSTORE_STREAM_ENVELOPE_SIZE,
+                                IAS_KEYSTORE_STREAM_HEADER_SIZE);
+  if (!res && stream->header_total > IAS_KEYSTORE_STREAM_HEADER_SIZE)
+    res = keystore_stream_unwrap_dek(stream, stream->header + IAS_KEYSTORE_STREAM_HEADER_SIZE);
+  if (!res && fstat(fd, &st))
+    res = -errno;
+  if (!res && (uint64_t)st.st_size < stream->header_total)
+    res = -EBADMSG;
+  if (res)
+  {
+    ias_keystore_stream_free(stream);
+    return (int)res;
+  }
+
+  /* Chunks sit at fixed offsets, as in ias_keystore_stream_decrypt_parallel() */
+  input_chunk = stream->chunk_size + stream->tag_size;
+  body = (uint64_t)st.st_size - stream->header_total;
+  chunks = body ? (body - 1) / input_chunk + 1 : 0;
+  last_size = (size_t)(body - (body ? (chunks - 1) * input_chunk : 0));
+  if (!chunks || last_size < stream->tag_size || chunks - 1 > UINT32_MAX)
+  {
+    ias_keystore_stream_free(stream);
+    return -EBADMSG;
+  }
+
+  plain_size = body - chunks * stream->tag_size;
+  needed = 0;
+  if (offset < plain_size)
+    needed = (size_t)(plain_size - offset < length ? plain_size - offset : length);
+  if (*output_size < needed)
+  {
+    ias_keystore_stream_free(stream);
+    *output_size = needed;
+    return -EMSGSIZE;
+  }
+  if (!output && needed)
+  {
+    ias_keystore_stream_free(stream);
+    return -EFAULT;
+  }
+
+  stream->buf_size = input_chunk;
+  stream->buf = (uint8_t *)malloc(stream->buf_size);
+  if (!stream->buf)
+  {
+    ias_keystore_stream_free(stream);
+    return -ENOMEM;
+  }
+
+  first = offset / stream->chunk_size;
+  end = needed ? (offset + needed - 1) / stream->chunk_size + 1 : first;
+
+  /* The last chunk carries the last-chunk flag in its nonce, so decrypting
+   * it authenticates the length of the container, and with it the chunk
+   * positions computed above */
+  res = 0;
+  if (end < chunks)
+    res = keystore_stream_range_chunk(stream, fd, chunks - 1, chunks, last_size, stream->buf);
+
+  written = 0;
+  for (chunk = first; chunk < end && res >= 0; chunk++)
+  {
+    res = keystore_stream_range_chunk(stream, fd, chunk, chunks, last_size, stream->buf);
+    if (res < 0)
+      break;
+
+    skip = chunk == first ? (size_t)(offset - first * stream->chunk_size) : 0;
+    n = (size_t)res - skip;
+    if (n > needed - written)
+      n = needed - written;
+    memcpy(output + written, stream->buf + skip, n);
+    written += n;
+  }
+
+  ias_keystore_stream_free(stream);
+
+  /* Do not hand out the chunks that were authenticated before a failure */
+  if (res < 0)
+  {
+    if (written)
+      keystore_memzero(output, written);
+    *output_size = 0;
+    return (int)res;
+  }
+
+  *output_size = needed;
+  return 0;
+}
+
+void ias_keystore_stream_free(struct ias_keystore_stream *stream)
+{
+  if (!stream)
+    return;
+
+  if (stream->buf)
+  {
+    keystore_memzero(stream->buf, stream->buf_size);
+    free(stream->buf);
+  }
+  if (stream->dek)
+  {
+    keystore_memzero(stream->dek, sizeof(*stream->dek));
+    free(stream->dek);
+  }
+  free(stream);
+}
+
+/* end of file */
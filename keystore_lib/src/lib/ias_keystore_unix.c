@@ -0,0 +1,993 @@
+/*
+   Copyright 2018 Intel Corporation
+
+   This software is licensed to you in accordance
+   with the agreement between you and Intel Corporation.
+
+   Alternatively, you can use this file in compliance
+   with the Apache license, Version 2.
+
+
+   Apache License, Version 2.0
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+   http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "keystore_api_user.h"
+
+#include "ias_keystore_broker_proto.h"
+#include "ias_keystore_priv.h"
+
+/*
+ * Keystore broker client ("unix:<socket path>" device names).
+ *
+ * Forwards every ioctl to a keystore broker (see ias_keystore_broker.h)
+ * over a Unix domain stream socket. Each call is one request and one
+ * reply on a connection. A handle keeps a few connections, so that
+ * calls from several threads can be in flight at the same time.
+ *
+ * Encrypt and decrypt payloads go through a payload ring shared with the
+ * broker instead of the socket: a call reserves one ring record for its
+ * inputs and outputs, copies the inputs in and sends only the offsets.
+ * The outputs are copied out of the ring and the record is cleared when
+ * released; the request and its completion still go over the socket.
+ * Records are released in any order; the ring tail moves over released
+ * records only. Calls which do not fit fall back to inline payloads.
+ */
+
+#define KEYSTORE_UNIX_CONNS_MAX 8
+#define KEYSTORE_UNIX_SHM_SIZE (4u << 20)
+#define KEYSTORE_UNIX_SHM_ALIGN 64
+/* Output bytes reserved beyond the input, for tags and padding */
+#define KEYSTORE_UNIX_SHM_SLACK 64
+
+/**
+ * @brief Header of a payload ring record.
+ * @param size  Record size including the header.
+ * @param done  The record was released.
+ */
+struct keystore_unix_record {
+  uint32_t size;
+  uint32_t done;
+};
+
+/**
+ * @brief Broker connection handle.
+ * @param fds       All open connections, idle or in use.
+ * @param shm_fd    The payload ring memfd, -1 if not available.
+ * @param shm       The payload ring.
+ * @param shm_head  Offset of the next record.
+ * @param shm_tail  Offset of the oldest record in use.
+ * @param shm_used  Bytes in use, including padding records.
+ * @param shm_off   A broker did not accept the ring, payloads go inline.
+ */
+struct keystore_unix_handle {
+  struct sockaddr_un addr;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int idle[KEYSTORE_UNIX_CONNS_MAX];
+  unsigned int idle_count;
+  unsigned int conn_count;
+  int fds[KEYSTORE_UNIX_CONNS_MAX];
+  unsigned int fd_count;
+  int shm_fd;
+  uint8_t *shm;
+  uint32_t shm_head;
+  uint32_t shm_tail;
+  uint32_t shm_used;
+  int shm_off;
+};
+
+/**
+ * @brief Client side view of one operation.
+ * @param op          The request record.
+ * @param iv          IV bytes (op.iv_size).
+ * @param input       Input bytes (op.input_size).
+ * @param output      Destination of the output bytes.
+ * @param output_max  Capacity of @output.
+ * @param input_iov   Input segments instead of @input, gathered straight
+ *                    into the request or the payload ring.
+ * @param output_iov  Output segments instead of @output.
+ * @param res         The reply record.
+ */
+struct keystore_unix_op {
+  struct keystore_broker_op op;
+  const uint8_t *iv;
+  const uint8_t *input;
+  uint8_t *output;
+  uint32_t output_max;
+  const struct iovec *input_iov;
+  uint32_t input_iovcnt;
+  const struct iovec *output_iov;
+  uint32_t output_iovcnt;
+  struct keystore_broker_res res;
+};
+
+/**
+ * @brief Helper function, copies the input of an operation to @dst.
+ */
+static void keystore_unix_copy_input(uint8_t *dst, const struct keystore_unix_op *op)
+{
+  if (op->input_iov)
+    keystore_iov_gather(dst, op->input_iov, op->input_iovcnt, op->op.input_size);
+  else
+    memcpy(dst, op->input, op->op.input_size);
+}
+
+/**
+ * @brief Helper function, copies the output of an operation from @src.
+ *
+ * @return 0 if OK, -EMSGSIZE if it does not fit.
+ */
+static int keystore_unix_copy_output(const struct keystore_unix_op *op, const uint8_t *src)
+{
+  if ((!op->output && !op->output_iov) || op->res.output_size > op->output_max)
+    return -EMSGSIZE;
+
+  if (op->output_iov)
+    keystore_iov_scatter(op->output_iov, op->output_iovcnt, src, op->res.output_size);
+  else
+    memcpy(op->output, src, op->res.output_size);
+  return 0;
+}
+
+/**
+ * @brief Helper function, reserves a payload ring record.
+ *
+ * @return Offset of the record data, or -1 if the ring is full.
+ */
+static int64_t keystore_unix_shm_alloc(struct keystore_unix_handle *handle, uint64_t size)
+{
+  struct keystore_unix_record *record;
+  uint64_t total = (size + sizeof(*record) + KEYSTORE_UNIX_SHM_ALIGN - 1) &
+                   ~(uint64_t)(KEYSTORE_UNIX_SHM_ALIGN - 1);
+  uint32_t offset;
+
+  if (!handle->shm || total > KEYSTORE_UNIX_SHM_SIZE)
+    return -1;
+
+  pthread_mutex_lock(&handle->lock);
+  if (handle->shm_off)
+  {
+    pthread_mutex_unlock(&handle->lock);
+    return -1;
+  }
+
+  if (!handle->shm_used)
+    handle->shm_head = handle->shm_tail = 0;
+
+  if (handle->shm_head >= handle->shm_tail && handle->shm_used < KEYSTORE_UNIX_SHM_SIZE &&
+      KEYSTORE_UNIX_SHM_SIZE - handle->shm_head < total && total <= handle->shm_tail)
+  {
+    /* Pad the end of the ring and wrap around */
+    record = (struct keystore_unix_record *)(handle->shm + handle->shm_head);
+    record->size = KEYSTORE_UNIX_SHM_SIZE - handle->shm_head;
+    record->done = 1;
+    handle->shm_used += record->size;
+    handle->shm_head = 0;
+  }
+
+  if (KEYSTORE_UNIX_SHM_SIZE - handle->shm_used < total ||
+      (handle->shm_head < handle->shm_tail && handle->shm_tail - handle->shm_head < total) ||
+      (handle->shm_head >= handle->shm_tail && KEYSTORE_UNIX_SHM_SIZE - handle->shm_head < total))
+  {
+    pthread_mutex_unlock(&handle->lock);
+    return -1;
+  }
+
+  offset = handle->shm_head;
+  record = (struct keystore_unix_record *)(handle->shm + offset);
+  record->size = (uint32_t)total;
+  record->done = 0;
+  handle->shm_used += (uint32_t)total;
+  handle->shm_head = (offset + (uint32_t)total) % KEYSTORE_UNIX_SHM_SIZE;
+
+  pthread_mutex_unlock(&handle->lock);
+  return offset + sizeof(*record);
+}
+
+/**
+ * @brief Helper function, releases a payload ring record.
+ *
+ * The data is cleared, as it may hold plain text.
+ */
+static void keystore_unix_shm_free(struct keystore_unix_handle *handle, uint32_t offset)
+{
+  struct keystore_unix_record *record;
+
+  record = (struct keystore_unix_record *)(handle->shm + offset - sizeof(*record));
+  memset(record + 1, 0, record->size - sizeof(*record));
+
+  pthread_mutex_lock(&handle->lock);
+  record->done = 1;
+
+  while (handle->shm_used)
+  {
+    record = (struct keystore_unix_record *)(handle->shm + handle->shm_tail);
+    if (!record->done)
+      break;
+    handle->shm_used -= record->size;
+    handle->shm_tail = (handle->shm_tail + record->size) % KEYSTORE_UNIX_SHM_SIZE;
+  }
+
+  pthread_mutex_unlock(&handle->lock);
+}
+
+static int keystore_unix_send(int fd, const uint8_t *buf, size_t size)
+{
+  ssize_t res;
+
+  while (size)
+  {
+    res = send(fd, buf, size, MSG_NOSIGNAL);
+    if (res < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      return -errno;
+    }
+    buf += res;
+    size -= (size_t)res;
+  }
+
+  return 0;
+}
+
+static int keystore_unix_recv(int fd, uint8_t *buf, size_t size)
+{
+  ssize_t res;
+
+  while (size)
+  {
+    res = recv(fd, buf, size, 0);
+    if (res < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      return -errno;
+    }
+    if (res == 0)
+      return -ECONNRESET;
+    buf += res;
+    size -= (size_t)res;
+  }
+
+  return 0;
+}
+
+/**
+ * @brief Helper function, attaches the payload ring to a new connection.
+ *
+ * If the broker refuses it, payloads go inline from now on.
+ *
+ * @return 0 if OK or negative error code if the connection is broken.
+ */
+static int keystore_unix_attach(struct keystore_unix_handle *handle, int fd)
+{
+  union {
+    struct cmsghdr hdr;
+    char buf[CMSG_SPACE(sizeof(int))];
+  } control;
+  struct keystore_broker_hdr hdr;
+  struct cmsghdr *cmsg;
+  struct msghdr msg;
+  struct iovec iov;
+  ssize_t sent;
+  int res;
+
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.magic = KEYSTORE_BROKER_MAGIC;
+  hdr.cmd = KEYSTORE_BROKER_CMD_ATTACH;
+
+  iov.iov_base = &hdr;
+  iov.iov_len = sizeof(hdr);
+  memset(&msg, 0, sizeof(msg));
+  memset(&control, 0, sizeof(control));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof(control.buf);
+  cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg), &handle->shm_fd, sizeof(int));
+
+  do
+  {
+    sent = sendmsg(fd, &msg, MSG_NOSIGNAL);
+  } while (sent == -1 && errno == EINTR);
+  if (sent != (ssize_t)sizeof(hdr))
+    return sent == -1 ? -errno : -EIO;
+
+  res = keystore_unix_recv(fd, (uint8_t *)&hdr, sizeof(hdr));
+  if (res)
+    return res;
+  if (hdr.magic != KEYSTORE_BROKER_MAGIC || hdr.cmd != KEYSTORE_BROKER_CMD_ATTACH || hdr.size)
+    return -EPROTO;
+
+  if (hdr.result)
+  {
+    pthread_mutex_lock(&handle->lock);
+    handle->shm_off = 1;
+    pthread_mutex_unlock(&handle->lock);
+  }
+
+  return 0;
+}
+
+static int keystore_unix_connect(struct keystore_unix_handle *handle)
+{
+  int fd, res;
+
+  fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd == -1)
+    return -errno;
+
+  if (connect(fd, (const struct sockaddr *)&handle->addr, sizeof(handle->addr)) == -1)
+  {
+    res = -errno;
+    close(fd);
+    return res;
+  }
+
+  if (handle->shm)
+  {
+    res = keystore_unix_attach(handle, fd);
+    if (res)
+    {
+      close(fd);
+      return res;
+    }
+  }
+
+  return fd;
+}
+
+/**
+ * @brief Helper function, takes an idle connection or opens a new one.
+ */
+static int keystore_unix_get(struct keystore_unix_handle *handle)
+{
+  int fd;
+
+  pthread_mutex_lock(&handle->lock);
+  while (!handle->idle_count && handle->conn_count == KEYSTORE_UNIX_CONNS_MAX)
+    pthread_cond_wait(&handle->cond, &handle->lock);
+
+  if (handle->idle_count)
+  {
+    fd = handle->idle[--handle->idle_count];
+    pthread_mutex_unlock(&handle->lock);
+    return fd;
+  }
+
+  handle->conn_count++;
+  pthread_mutex_unlock(&handle->lock);
+
+  fd = keystore_unix_connect(handle);
+  pthread_mutex_lock(&handle->lock);
+  if (fd < 0)
+  {
+    handle->conn_count--;
+    pthread_cond_signal(&handle->cond);
+  }
+  else
+  {
+    handle->fds[handle->fd_count++] = fd;
+  }
+  pthread_mutex_unlock(&handle->lock);
+
+  return fd;
+}
+
+/**
+ * @brief Helper function, returns a connection. Broken ones are closed.
+ */
+static void keystore_unix_put(struct keystore_unix_handle *handle, int fd, int broken)
+{
+  unsigned int i;
+
+  pthread_mutex_lock(&handle->lock);
+  if (broken)
+  {
+    close(fd);
+    handle->conn_count--;
+    for (i = 0; handle->fds[i] != fd; i++)
+      ;
+    handle->fds[i] = handle->fds[--handle->fd_count];
+  }
+  else
+  {
+    handle->idle[handle->idle_count++] = fd;
+  }
+  pthread_cond_signal(&handle->cond);
+  pthread_mutex_unlock(&handle->lock);
+}
+
+/**
+ * @brief Helper function, builds the request message.
+ *
+ * @return Message buffer, NULL if out of memory or too large.
+ */
+static uint8_t *keystore_unix_request(unsigned int cmd, const struct keystore_unix_op *ops,
+                                      uint32_t count, uint32_t flags, size_t *size)
+{
+  struct keystore_broker_hdr hdr;
+  uint64_t payload = 0;
+  uint8_t *buf, *pos;
+  uint32_t i;
+  int inline_input = !(flags & KEYSTORE_BROKER_FLAG_SHM);
+
+  for (i = 0; i < count; i++)
+  {
+    payload += sizeof(ops[i].op) + (uint64_t)ops[i].op.iv_size;
+    if (inline_input)
+      payload += ops[i].op.input_size;
+  }
+
+  if (payload > KEYSTORE_BROKER_MSG_MAX)
+    return NULL;
+
+  buf = (uint8_t *)malloc(sizeof(hdr) + (size_t)payload);
+  if (!buf)
+    return NULL;
+
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.magic = KEYSTORE_BROKER_MAGIC;
+  hdr.cmd = cmd;
+  hdr.count = count;
+  hdr.size = (uint32_t)payload;
+  hdr.flags = flags;
+  memcpy(buf, &hdr, sizeof(hdr));
+  pos = buf + sizeof(hdr);
+
+  for (i = 0; i < count; i++)
+  {
+    memcpy(pos, &ops[i].op, sizeof(ops[i].op));
+    pos += sizeof(ops[i].op);
+    if (ops[i].op.iv_size)
+      memcpy(pos, ops[i].iv, ops[i].op.iv_size);
+    pos += ops[i].op.iv_size;
+    if (inline_input && ops[i].op.input_size)
+    {
+      keystore_unix_copy_input(pos, &ops[i]);
+      pos += ops[i].op.input_size;
+    }
+  }
+
+  *size = sizeof(hdr) + (size_t)payload;
+  return buf;
+}
+
+/**
+ * @brief Helper function, parses the reply records and copies the outputs.
+ */
+static int keystore_unix_reply(const struct keystore_unix_handle *handle,
+                               struct keystore_unix_op *ops, uint32_t count,
+                               const uint8_t *buf, size_t size)
+{
+  const uint8_t *end = buf + size;
+  uint32_t i;
+
+  for (i = 0; i < count; i++)
+  {
+    struct keystore_unix_op *op = &ops[i];
+
+    if ((size_t)(end - buf) < sizeof(op->res))
+      return -EPROTO;
+    memcpy(&op->res, buf, sizeof(op->res));
+    buf += sizeof(op->res);
+
+    if (op->res.flags & KEYSTORE_BROKER_RES_SHM)
+    {
+      if (op->res.output_size > op->op.output_max)
+        return -EPROTO;
+      if (op->res.output_size &&
+          keystore_unix_copy_output(op, handle->shm + op->op.output_offset))
+        return -EMSGSIZE;
+      continue;
+    }
+
+    if ((size_t)(end - buf) < op->res.output_size)
+      return -EPROTO;
+
+    if (op->res.output_size && keystore_unix_copy_output(op, buf))
+      return -EMSGSIZE;
+    buf += op->res.output_size;
+  }
+
+  return 0;
+}
+
+/**
+ * @brief Helper function, moves the payloads of an encrypt or decrypt call to the ring.
+ *
+ * @return Offset of the ring record, or -1 if the payloads go inline.
+ */
+static int64_t keystore_unix_shm_place(struct keystore_unix_handle *handle,
+                                       struct keystore_unix_op *ops, uint32_t count)
+{
+  uint64_t size = 0;
+  int64_t offset;
+  uint32_t i, pos;
+
+  for (i = 0; i < count; i++)
+    size += 2 * (uint64_t)ops[i].op.input_size + KEYSTORE_UNIX_SHM_SLACK;
+
+  offset = keystore_unix_shm_alloc(handle, size);
+  if (offset < 0)
+    return -1;
+
+  pos = (uint32_t)offset;
+  for (i = 0; i < count; i++)
+  {
+    struct keystore_broker_op *op = &ops[i].op;
+
+    op->input_offset = pos;
+    if (op->input_size)
+      keystore_unix_copy_input(handle->shm + pos, &ops[i]);
+    pos += op->input_size;
+
+    op->output_offset = pos;
+    op->output_max = op->input_size + KEYSTORE_UNIX_SHM_SLACK;
+    pos += op->output_max;
+  }
+
+  return offset;
+}
+
+/**
+ * @brief Helper function, executes one call on the broker.
+ *
+ * @return Result of the call or negative error code (see errno.h).
+ */
+static int keystore_unix_call(struct keystore_unix_handle *handle, unsigned int cmd,
+                              struct keystore_unix_op *ops, uint32_t count)
+{
+  struct keystore_broker_hdr hdr;
+  uint8_t *buf = NULL;
+  int64_t shm = -1;
+  int fd, res, broken = 1;
+  size_t size;
+
+  /* A new connection attaches the ring first, so take it before placing payloads */
+  fd = keystore_unix_get(handle);
+  if (fd < 0)
+    return fd;
+
+  if (cmd == KEYSTORE_IOC_ENCRYPT || cmd == KEYSTORE_IOC_DECRYPT ||
+      cmd == KEYSTORE_LIB_IOC_ENCRYPT_BATCH || cmd == KEYSTORE_LIB_IOC_DECRYPT_BATCH)
+    shm = keystore_unix_shm_place(handle, ops, count);
+
+  buf = keystore_unix_request(cmd, ops, count, shm < 0 ? 0 : KEYSTORE_BROKER_FLAG_SHM, &size);
+  if (!buf)
+  {
+    res = -ENOMEM;
+    broken = 0;
+    goto out;
+  }
+
+  res = keystore_unix_send(fd, buf, size);
+  free(buf);
+  buf = NULL;
+  if (res)
+    goto out;
+
+  res = keystore_unix_recv(fd, (uint8_t *)&hdr, sizeof(hdr));
+  if (res)
+    goto out;
+
+  if (hdr.magic != KEYSTORE_BROKER_MAGIC || hdr.cmd != cmd || hdr.count != count ||
+      hdr.size > KEYSTORE_BROKER_MSG_MAX)
+  {
+    res = -EPROTO;
+    goto out;
+  }
+
+  buf = (uint8_t *)malloc(hdr.size ? hdr.size : 1);
+  if (!buf)
+  {
+    res = -ENOMEM;
+    goto out;
+  }
+
+  res = keystore_unix_recv(fd, buf, hdr.size);
+  if (res)
+    goto out;
+
+  /* The whole reply was read, the connection can be reused */
+  broken = 0;
+  res = keystore_unix_reply(handle, ops, count, buf, hdr.size);
+  if (!res)
+    res = hdr.result;
+
+out:
+  free(buf);
+  if (shm >= 0)
+    keystore_unix_shm_free(handle, (uint32_t)shm);
+  keystore_unix_put(handle, fd, broken);
+  return res;
+}
+
+/**
+ * @brief Helper function, forwards a batch request.
+ */
+static int keystore_unix_batch(struct keystore_unix_handle *handle, unsigned int cmd,
+                               struct ias_keystore_crypto_batch *req)
+{
+  struct keystore_unix_op *ops;
+  uint32_t i;
+  int res;
+
+  if (req->count > KEYSTORE_BROKER_OPS_MAX)
+    return -EINVAL;
+
+  if (req->count && !req->entries)
+    return -EFAULT;
+
+  ops = (struct keystore_unix_op *)calloc(req->count ? req->count : 1, sizeof(*ops));
+  if (!ops)
+    return -ENOMEM;
+
+  for (i = 0; i < req->count; i++)
+  {
+    const struct ias_keystore_crypto_batch_entry *entry = &req->entries[i];
+
+    memcpy(ops[i].op.client_ticket, req->client_ticket, sizeof(ops[i].op.client_ticket));
+    ops[i].op.spec = entry->algospec;
+    ops[i].op.slot_id = entry->slot_id;
+    ops[i].op.iv_size = entry->iv ? entry->iv_size : 0;
+    ops[i].op.input_size = entry->input_size;
+    ops[i].iv = entry->iv;
+    ops[i].input = entry->input;
+    ops[i].output = entry->output;
+    ops[i].output_max = UINT32_MAX;
+  }
+
+  res = keystore_unix_call(handle, cmd, ops, req->count);
+
+  for (i = 0; i < req->count && res >= 0; i++)
+    req->entries[i].status = ops[i].res.status;
+
+  free(ops);
+  return res;
+}
+
+/**
+ * @brief Helper function, forwards a vector request as an encrypt or decrypt call.
+ */
+static int keystore_unix_vec(struct keystore_unix_handle *handle, unsigned int cmd,
+                             struct ias_keystore_encrypt_decrypt_vec *req)
+{
+  struct keystore_unix_op op;
+  size_t input_size, output_max;
+  int res;
+
+  /* Probe for vector support */
+  if (!req->output)
+    return 0;
+
+  res = keystore_iov_size(req->input, req->input_count, &input_size);
+  if (!res)
+    res = keystore_iov_size(req->output, req->output_count, &output_max);
+  if (res)
+    return res;
+
+  if (req->iv_size && !req->iv)
+    return -EFAULT;
+
+  memset(&op, 0, sizeof(op));
+  memcpy(op.op.client_ticket, req->client_ticket, KEYSTORE_CLIENT_TICKET_SIZE);
+  op.op.slot_id = req->slot_id;
+  op.op.spec = req->algospec;
+  op.op.iv_size = req->iv_size;
+  op.op.input_size = (uint32_t)input_size;
+  op.iv = req->iv;
+  op.input_iov = req->input;
+  op.input_iovcnt = req->input_count;
+  op.output_iov = req->output;
+  op.output_iovcnt = req->output_count;
+  op.output_max = (uint32_t)output_max;
+
+  /* The broker sees a plain call: the segments are only gathered into the message */
+  return keystore_unix_call(handle, cmd == KEYSTORE_LIB_IOC_ENCRYPTV ?
+                            KEYSTORE_IOC_ENCRYPT : KEYSTORE_IOC_DECRYPT, &op, 1);
+}
+
+/**
+ * @brief Helper function, maps an ioctl request to a call record.
+ */
+static int keystore_unix_ioctl(void *priv, unsigned int cmd, void *request)
+{
+  struct keystore_unix_handle *handle = (struct keystore_unix_handle *)priv;
+  struct keystore_unix_op op;
+  int res;
+
+  if (!request)
+    return -EFAULT;
+
+  memset(&op, 0, sizeof(op));
+  op.output_max = UINT32_MAX;
+
+  switch (cmd)
+  {
+  case KEYSTORE_IOC_VERSION:
+    break;
+  case KEYSTORE_IOC_REGISTER:
+    op.op.spec = (uint32_t)((struct ias_keystore_register *)request)->seed_type;
+    break;
+  case KEYSTORE_IOC_UNREGISTER:
+    memcpy(op.op.client_ticket, ((struct ias_keystore_unregister *)request)->client_ticket,
+           KEYSTORE_CLIENT_TICKET_SIZE);
+    break;
+  case KEYSTORE_IOC_WRAPPED_KEYSIZE:
+    op.op.spec = ((struct ias_keystore_wrapped_key_size *)request)->key_spec;
+    break;
+  case KEYSTORE_IOC_GENERATE_KEY:
+  {
+    struct ias_keystore_generate_key *req = (struct ias_keystore_generate_key *)request;
+    memcpy(op.op.client_ticket, req->client_ticket, KEYSTORE_CLIENT_TICKET_SIZE);
+    op.op.spec = req->key_spec;
+    op.output = req->wrapped_key;
+    break;
+  }
+  case KEYSTORE_IOC_WRAP_KEY:
+  {
+    struct ias_keystore_wrap_key *req = (struct ias_keystore_wrap_key *)request;
+    memcpy(op.op.client_ticket, req->client_ticket, KEYSTORE_CLIENT_TICKET_SIZE);
+    op.op.spec = req->key_spec;
+    op.op.input_size = req->app_key ? req->app_key_size : 0;
+    op.input = req->app_key;
+    op.output = req->wrapped_key;
+    break;
+  }
+  case KEYSTORE_IOC_LOAD_KEY:
+  {
+    struct ias_keystore_load_key *req = (struct ias_keystore_load_key *)request;
+    memcpy(op.op.client_ticket, req->client_ticket, KEYSTORE_CLIENT_TICKET_SIZE);
+    op.op.input_size = req->wrapped_key ? req->wrapped_key_size : 0;
+    op.input = req->wrapped_key;
+    /* A rewrapped key comes back on -EAGAIN */
+    op.output = req->wrapped_key;
+    op.output_max = req->wrapped_key_size;
+    break;
+  }
+  case KEYSTORE_IOC_UNLOAD_KEY:
+  {
+    struct ias_keystore_unload_key *req = (struct ias_keystore_unload_key *)request;
+    memcpy(op.op.client_ticket, req->client_ticket, KEYSTORE_CLIENT_TICKET_SIZE);
+    op.op.slot_id = req->slot_id;
+    break;
+  }
+  case KEYSTORE_IOC_ENCRYPT_SIZE:
+  case KEYSTORE_IOC_DECRYPT_SIZE:
+  {
+    struct ias_keystore_crypto_size *req = (struct ias_keystore_crypto_size *)request;
+    op.op.spec = req->algospec;
+    op.op.value = req->input_size;
+    break;
+  }
+  case KEYSTORE_IOC_ENCRYPT:
+  case KEYSTORE_IOC_DECRYPT:
+  {
+    struct ias_keystore_encrypt_decrypt *req = (struct ias_keystore_encrypt_decrypt *)request;
+    memcpy(op.op.client_ticket, req->client_ticket, KEYSTORE_CLIENT_TICKET_SIZE);
+    op.op.slot_id = req->slot_id;
+    op.op.spec = req->algospec;
+    op.op.iv_size = req->iv ? req->iv_size : 0;
+    op.op.input_size = req->input_size;
+    op.iv = req->iv;
+    op.input = req->input;
+    op.output = req->output;
+    break;
+  }
+  case KEYSTORE_LIB_IOC_ENCRYPT_BATCH:
+  case KEYSTORE_LIB_IOC_DECRYPT_BATCH:
+    return keystore_unix_batch(handle, cmd, (struct ias_keystore_crypto_batch *)request);
+  case KEYSTORE_LIB_IOC_ENCRYPTV:
+  case KEYSTORE_LIB_IOC_DECRYPTV:
+    return keystore_unix_vec(handle, cmd, (struct ias_keystore_encrypt_decrypt_vec *)request);
+  default:
+    return -ENOTTY;
+  }
+
+  if ((op.op.input_size && !op.input) || (op.op.iv_size && !op.iv))
+    return -EFAULT;
+
+  res = keystore_unix_call(handle, cmd, &op, 1);
+  if (res < 0 && res != -EAGAIN)
+    return res;
+
+  switch (cmd)
+  {
+  case KEYSTORE_IOC_VERSION:
+  {
+    struct ias_keystore_version *req = (struct ias_keystore_version *)request;
+    req->major = op.res.value[0];
+    req->minor = op.res.value[1];
+    req->patch = op.res.value[2];
+    break;
+  }
+  case KEYSTORE_IOC_REGISTER:
+    memcpy(((struct ias_keystore_register *)request)->client_ticket, op.res.client_ticket,
+           KEYSTORE_CLIENT_TICKET_SIZE);
+    break;
+  case KEYSTORE_IOC_WRAPPED_KEYSIZE:
+  {
+    struct ias_keystore_wrapped_key_size *req = (struct ias_keystore_wrapped_key_size *)request;
+    req->key_size = op.res.value[0];
+    req->unwrapped_key_size = op.res.value[1];
+    break;
+  }
+  case KEYSTORE_IOC_LOAD_KEY:
+    ((struct ias_keystore_load_key *)request)->slot_id = op.res.value[0];
+    break;
+  case KEYSTORE_IOC_ENCRYPT_SIZE:
+  case KEYSTORE_IOC_DECRYPT_SIZE:
+    ((struct ias_keystore_crypto_size *)request)->output_size = op.res.value[0];
+    break;
+  default:
+    break;
+  }
+
+  return res;
+}
+
+/**
+ * @brief Helper function, creates the payload ring.
+ *
+ * The memfd is sealed so that the broker can rely on its size. Without
+ * a ring, payloads go inline.
+ */
+static void keystore_unix_shm_create(struct keystore_unix_handle *handle)
+{
+  void *shm;
+  int fd;
+
+  handle->shm_fd = -1;
+
+  fd = memfd_create("ias-keystore-ring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (fd == -1)
+    return;
+
+  if (ftruncate(fd, KEYSTORE_UNIX_SHM_SIZE) == -1 ||
+      fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) == -1)
+  {
+    close(fd);
+    return;
+  }
+
+  shm = mmap(NULL, KEYSTORE_UNIX_SHM_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (shm == MAP_FAILED)
+  {
+    close(fd);
+    return;
+  }
+
+  handle->shm_fd = fd;
+  handle->shm = (uint8_t *)shm;
+}
+
+static void keystore_unix_shm_destroy(struct keystore_unix_handle *handle)
+{
+  if (!handle->shm)
+    return;
+
+  munmap(handle->shm, KEYSTORE_UNIX_SHM_SIZE);
+  close(handle->shm_fd);
+}
+
+static int keystore_unix_open(const char *args, void **priv)
+{
+  struct keystore_unix_handle *handle;
+  int fd;
+
+  if (!*args || strlen(args) >= sizeof(handle->addr.sun_path))
+    return -EINVAL;
+
+  handle = (struct keystore_unix_handle *)calloc(1, sizeof(*handle));
+  if (!handle)
+    return -ENOMEM;
+
+  handle->addr.sun_family = AF_UNIX;
+  strcpy(handle->addr.sun_path, args);
+  pthread_mutex_init(&handle->lock, NULL);
+  pthread_cond_init(&handle->cond, NULL);
+  keystore_unix_shm_create(handle);
+
+  /* Fail early if the broker is not running */
+  fd = keystore_unix_connect(handle);
+  if (fd < 0)
+  {
+    keystore_unix_shm_destroy(handle);
+    pthread_cond_destroy(&handle->cond);
+    pthread_mutex_destroy(&handle->lock);
+    free(handle);
+    return fd;
+  }
+
+  handle->idle[0] = fd;
+  handle->idle_count = 1;
+  handle->conn_count = 1;
+  handle->fds[0] = fd;
+  handle->fd_count = 1;
+
+  *priv = handle;
+  return 0;
+}
+
+static void keystore_unix_close(void *priv)
+{
+  struct keystore_unix_handle *handle = (struct keystore_unix_handle *)priv;
+
+  while (handle->idle_count)
+    close(handle->idle[--handle->idle_count]);
+
+  keystore_unix_shm_destroy(handle);
+  pthread_cond_destroy(&handle->cond);
+  pthread_mutex_destroy(&handle->lock);
+  free(handle);
+}
+
+/**
+ * @brief Drops the connections and the payload ring inherited from the parent.
+ *
+ * The sockets and the ring are shared with the parent, and calls in flight
+ * belong to parent threads which do not exist here; the child opens its
+ * own connections and ring on demand.
+ */
+static void keystore_unix_atfork_child(void *priv)
+{
+  struct keystore_unix_handle *handle = (struct keystore_unix_handle *)priv;
+
+  pthread_mutex_init(&handle->lock, NULL);
+  pthread_cond_init(&handle->cond, NULL);
+
+  while (handle->fd_count)
+    close(handle->fds[--handle->fd_count]);
+  handle->idle_count = 0;
+  handle->conn_count = 0;
+
+  keystore_unix_shm_destroy(handle);
+  handle->shm = NULL;
+  handle->shm_head = 0;
+  handle->shm_tail = 0;
+  handle->shm_used = 0;
+  handle->shm_off = 0;
+  keystore_unix_shm_create(handle);
+}
+
+const struct keystore_backend keystore_unix_backend = {
+  "unix:",
+  keystore_unix_open,
+  keystore_unix_close,
+  keystore_unix_ioctl,
+  keystore_unix_atfork_child,
+};
+
+/* end of file */
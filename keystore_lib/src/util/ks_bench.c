@@ -0,0 +1,504 @@
+/*
+   Copyright 2018 Intel Corporation
+
+   This software is licensed to you in accordance
+   with the agreement between you and Intel Corporation.
+
+   Alternatively, you can use this file in compliance
+   with the Apache license, Version 2.
+
+
+   Apache License, Version 2.0
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+   http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "ias_keystore.h"
+#include "ias_keystore_keypool.h"
+#include "ias_keystore_nonce.h"
+#include "ias_keystore_stream.h"
+#include "ks_bench.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/random.h>
+#include <time.h>
+
+#define KS_BENCH_MESSAGE_SIZE 64
+#define KS_BENCH_RECORD_SIZE 256
+#define KS_BENCH_BATCH_SIZE 32
+#define KS_BENCH_KEYPOOL_MAX 4096
+#define KS_BENCH_PARALLEL_SIZE (4 * 1024 * 1024)
+
+struct ks_bench_client {
+  uint8_t ticket[KEYSTORE_CLIENT_TICKET_SIZE];
+  uint32_t slot;
+};
+
+static uint64_t ks_bench_now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static void ks_bench_report(const char *name, unsigned int iterations,
+                            size_t bytes, uint64_t elapsed_ns)
+{
+  double secs = (double)elapsed_ns / 1e9;
+
+  if (secs <= 0.0)
+    secs = 1e-9;
+
+  fprintf(stdout, "%-24s calls: %-8u ns/call: %-10.0f calls/s: %-10.0f MB/s: %.2f\n",
+          name, iterations, (double)elapsed_ns / iterations, iterations / secs,
+          (double)bytes / secs / 1e6);
+}
+
+/*
+ * Register a client, generate a 128-bit key and load it into a slot.
+ */
+static int ks_bench_setup(struct ks_bench_client *client)
+{
+  int res;
+  size_t wrapped_key_size = 0;
+
+  res = ias_keystore_register_client(SEED_TYPE_DEVICE, client->ticket);
+  if (res)
+    return res;
+
+  res = ias_keystore_wrapped_key_size(KEYSPEC_LENGTH_128, &wrapped_key_size, NULL);
+  if (res)
+  {
+    ias_keystore_unregister_client(client->ticket);
+    return res;
+  }
+
+  uint8_t wrapped_key[wrapped_key_size];
+  res = ias_keystore_generate_key(client->ticket, KEYSPEC_LENGTH_128, wrapped_key);
+  if (!res)
+    res = ias_keystore_load_key(client->ticket, wrapped_key, wrapped_key_size, &client->slot);
+  if (res)
+    ias_keystore_unregister_client(client->ticket);
+
+  return res;
+}
+
+static void ks_bench_teardown(struct ks_bench_client *client)
+{
+  ias_keystore_unload_key(client->ticket, client->slot);
+  ias_keystore_unregister_client(client->ticket);
+}
+
+int ks_bench_handle(unsigned int iterations)
+{
+  int res;
+  struct ks_bench_client client;
+  const char *dev_name = ias_keystore_get_device();
+  uint8_t iv[DAL_KEYSTORE_GCM_IV_SIZE];
+  uint8_t message[KS_BENCH_MESSAGE_SIZE];
+  size_t cypher_size = 0;
+  uint64_t start;
+  unsigned int i;
+
+  if (!iterations)
+    return -1;
+
+  res = ks_bench_setup(&client);
+  if (res)
+    return res;
+
+  memset(iv, 0x5a, sizeof(iv));
+  memset(message, 0xa5, sizeof(message));
+
+  res = ias_keystore_encrypt_size(ALGOSPEC_AES_GCM, sizeof(message), &cypher_size);
+  if (res)
+  {
+    ks_bench_teardown(&client);
+    return res;
+  }
+
+  uint8_t cypher[cypher_size];
+
+  /* Reopen the device for every call, as the library used to do */
+  start = ks_bench_now_ns();
+  for (i = 0; i < iterations && !res; i++)
+  {
+    ias_keystore_set_device(dev_name);
+    res = ias_keystore_encrypt(client.ticket, client.slot, ALGOSPEC_AES_GCM, iv, sizeof(iv),
+                               message, sizeof(message), cypher);
+  }
+  if (!res)
+    ks_bench_report("encrypt (reopen)", iterations, iterations * sizeof(message),
+                    ks_bench_now_ns() - start);
+
+  /* Cached device handle */
+  start = ks_bench_now_ns();
+  for (i = 0; i < iterations && !res; i++)
+  {
+    res = ias_keystore_encrypt(client.ticket, client.slot, ALGOSPEC_AES_GCM, iv, sizeof(iv),
+                               message, sizeof(message), cypher);
+  }
+  if (!res)
+    ks_bench_report("encrypt (cached handle)", iterations, iterations * sizeof(message),
+                    ks_bench_now_ns() - start);
+
+  ks_bench_teardown(&client);
+  return res;
+}
+
+int ks_bench_batch(unsigned int iterations)
+{
+  int res;
+  struct ks_bench_client client;
+  struct ias_keystore_crypto_op ops[KS_BENCH_BATCH_SIZE];
+  uint8_t iv[DAL_KEYSTORE_GCM_IV_SIZE];
+  uint8_t records[KS_BENCH_BATCH_SIZE][KS_BENCH_RECORD_SIZE];
+  size_t cypher_size = 0;
+  unsigned int batches = (iterations + KS_BENCH_BATCH_SIZE - 1) / KS_BENCH_BATCH_SIZE;
+  uint64_t start;
+  unsigned int i, j;
+
+  if (!iterations)
+    return -1;
+
+  res = ks_bench_setup(&client);
+  if (res)
+    return res;
+
+  memset(iv, 0x5a, sizeof(iv));
+  memset(records, 0xa5, sizeof(records));
+
+  res = ias_keystore_encrypt_size(ALGOSPEC_AES_GCM, KS_BENCH_RECORD_SIZE, &cypher_size);
+  if (res)
+  {
+    ks_bench_teardown(&client);
+    return res;
+  }
+
+  uint8_t cyphers[KS_BENCH_BATCH_SIZE][cypher_size];
+
+  /* One call per record */
+  start = ks_bench_now_ns();
+  for (i = 0; i < batches && !res; i++)
+  {
+    for (j = 0; j < KS_BENCH_BATCH_SIZE && !res; j++)
+      res = ias_keystore_encrypt(client.ticket, client.slot, ALGOSPEC_AES_GCM, iv, sizeof(iv),
+                                 records[j], KS_BENCH_RECORD_SIZE, cyphers[j]);
+  }
+  if (!res)
+    ks_bench_report("encrypt (single)", batches * KS_BENCH_BATCH_SIZE,
+                    (size_t)batches * KS_BENCH_BATCH_SIZE * KS_BENCH_RECORD_SIZE,
+                    ks_bench_now_ns() - start);
+
+  for (j = 0; j < KS_BENCH_BATCH_SIZE; j++)
+  {
+    ops[j].slot_id = client.slot;
+    ops[j].algo_spec = ALGOSPEC_AES_GCM;
+    ops[j].iv = iv;
+    ops[j].iv_size = sizeof(iv);
+    ops[j].input = records[j];
+    ops[j].input_size = KS_BENCH_RECORD_SIZE;
+    ops[j].output = cyphers[j];
+    ops[j].status = 0;
+  }
+
+  /* KS_BENCH_BATCH_SIZE records per call */
+  start = ks_bench_now_ns();
+  for (i = 0; i < batches && !res; i++)
+  {
+    res = ias_keystore_encrypt_batch(client.ticket, ops, KS_BENCH_BATCH_SIZE);
+  }
+  if (!res)
+    ks_bench_report(ias_keystore_batch_supported() == 1 ? "encrypt_batch (ioctl)" : "encrypt_batch (loop)",
+                    batches * KS_BENCH_BATCH_SIZE,
+                    (size_t)batches * KS_BENCH_BATCH_SIZE * KS_BENCH_RECORD_SIZE,
+                    ks_bench_now_ns() - start);
+
+  ks_bench_teardown(&client);
+  return res;
+}
+
+int ks_bench_keypool(unsigned int iterations)
+{
+  int res;
+  struct ks_bench_client client;
+  struct ias_keystore_keypool_config config;
+  struct ias_keystore_keypool_stats stats;
+  struct ias_keystore_keypool *pool = NULL;
+  size_t wrapped_key_size = 0;
+  uint64_t start;
+  unsigned int i;
+
+  if (!iterations)
+    return -1;
+
+  res = ks_bench_setup(&client);
+  if (res)
+    return res;
+
+  res = ias_keystore_wrapped_key_size(KEYSPEC_LENGTH_256, &wrapped_key_size, NULL);
+  if (res)
+  {
+    ks_bench_teardown(&client);
+    return res;
+  }
+
+  uint8_t wrapped_key[wrapped_key_size];
+
+  /* Generate on demand */
+  start = ks_bench_now_ns();
+  for (i = 0; i < iterations && !res; i++)
+    res = ias_keystore_generate_key(client.ticket, KEYSPEC_LENGTH_256, wrapped_key);
+  if (!res)
+    ks_bench_report("generate_key", iterations, 0, ks_bench_now_ns() - start);
+
+  /* Take from a pool filled beforehand, as after an idle period */
+  memset(&config, 0, sizeof(config));
+  config.key_spec = KEYSPEC_LENGTH_256;
+  config.high_watermark = iterations < KS_BENCH_KEYPOOL_MAX ? iterations : KS_BENCH_KEYPOOL_MAX;
+
+  if (!res)
+    res = ias_keystore_keypool_create(client.ticket, &config, &pool);
+  if (!res)
+    res = ias_keystore_keypool_fill(pool);
+
+  start = ks_bench_now_ns();
+  for (i = 0; i < iterations && !res; i++)
+    res = ias_keystore_keypool_take(pool, wrapped_key, wrapped_key_size);
+  if (!res)
+  {
+    ks_bench_report("keypool_take", iterations, 0, ks_bench_now_ns() - start);
+
+    ias_keystore_keypool_get_stats(pool, &stats);
+    fprintf(stdout, "%-24s %llu of %llu takes generated on the calling thread\n", "",
+            (unsigned long long)stats.empty, (unsigned long long)stats.taken);
+  }
+
+  ias_keystore_keypool_destroy(pool);
+  ks_bench_teardown(&client);
+  return res;
+}
+
+int ks_bench_parallel(unsigned int iterations)
+{
+  static const size_t chunk_sizes[] = { 16 * 1024, 64 * 1024, 256 * 1024 };
+  static const unsigned int threads[] = { 1, 2, 4, 8 };
+  struct ks_bench_client client;
+  uint8_t *plain, *container;
+  size_t container_size = 0;
+  size_t size;
+  char name[32];
+  uint64_t start;
+  unsigned int c, t, i;
+  int res;
+
+  if (!iterations)
+    return -1;
+
+  res = ias_keystore_stream_encrypted_size(ALGOSPEC_AES_GCM, chunk_sizes[0],
+                                           KS_BENCH_PARALLEL_SIZE, &container_size);
+  if (res)
+    return res;
+
+  res = ks_bench_setup(&client);
+  if (res)
+    return res;
+
+  plain = (uint8_t *)malloc(KS_BENCH_PARALLEL_SIZE);
+  container = (uint8_t *)malloc(container_size);
+  if (!plain || !container)
+    res = -1;
+  else
+    memset(plain, 0xa5, KS_BENCH_PARALLEL_SIZE);
+
+  /* One call is one KS_BENCH_PARALLEL_SIZE payload */
+  for (c = 0; c < sizeof(chunk_sizes) / sizeof(chunk_sizes[0]) && !res; c++)
+  {
+    for (t = 0; t < sizeof(threads) / sizeof(threads[0]) && !res; t++)
+    {
+      start = ks_bench_now_ns();
+      for (i = 0; i < iterations && !res; i++)
+      {
+        size = container_size;
+        res = ias_keystore_stream_encrypt_parallel(client.ticket, client.slot, ALGOSPEC_AES_GCM,
+                                                   chunk_sizes[c], threads[t], plain,
+                                                   KS_BENCH_PARALLEL_SIZE, container, &size);
+      }
+      if (!res)
+      {
+        snprintf(name, sizeof(name), "encrypt %zuK x%u", chunk_sizes[c] / 1024, threads[t]);
+        ks_bench_report(name, iterations, (size_t)iterations * KS_BENCH_PARALLEL_SIZE,
+                        ks_bench_now_ns() - start);
+      }
+    }
+  }
+
+  free(container);
+  free(plain);
+  ks_bench_teardown(&client);
+  return res;
+}
+
+/* Run all of @input through @stream in one update */
+static int ks_bench_stream(struct ias_keystore_stream *stream, const uint8_t *input,
+                           size_t input_size, uint8_t *output, size_t *output_size)
+{
+  size_t size = *output_size;
+  size_t last;
+  int res;
+
+  res = ias_keystore_stream_update(stream, input, input_size, output, &size);
+  if (!res)
+  {
+    last = *output_size - size;
+    res = ias_keystore_stream_final(stream, output + size, &last);
+    *output_size = size + last;
+  }
+  return res;
+}
+
+int ks_bench_envelope(unsigned int iterations)
+{
+  static const char *const names[] = { "encrypt device", "encrypt envelope", "decrypt envelope" };
+  struct ks_bench_client client;
+  struct ias_keystore_stream *stream;
+  uint8_t *plain, *container;
+  size_t container_size = 0;
+  size_t size, envelope_size = 0;
+  uint64_t start;
+  unsigned int m, i;
+  int res;
+
+  if (!iterations)
+    return -1;
+
+  res = ias_keystore_stream_encrypted_size(ALGOSPEC_AES_GCM, 0, KS_BENCH_PARALLEL_SIZE,
+                                           &container_size);
+  if (res)
+    return res;
+  /* An update asks for room for one more tag than the container has */
+  container_size += IAS_KEYSTORE_STREAM_ENVELOPE_SIZE + KS_BENCH_MESSAGE_SIZE;
+
+  res = ks_bench_setup(&client);
+  if (res)
+    return res;
+
+  /* Decryption asks for as much room as the container */
+  plain = (uint8_t *)malloc(container_size);
+  container = (uint8_t *)malloc(container_size);
+  if (!plain || !container)
+    res = -1;
+  else
+    memset(plain, 0xa5, KS_BENCH_PARALLEL_SIZE);
+
+  /* One call is one KS_BENCH_PARALLEL_SIZE payload in default chunks; the
+   * envelope container of the second run is decrypted by the third */
+  for (m = 0; m < sizeof(names) / sizeof(names[0]) && !res; m++)
+  {
+    start = ks_bench_now_ns();
+    for (i = 0; i < iterations && !res; i++)
+    {
+      stream = NULL;
+      if (m == 0)
+        res = ias_keystore_stream_encrypt_init(client.ticket, client.slot, ALGOSPEC_AES_GCM, 0,
+                                               &stream);
+      else if (m == 1)
+        res = ias_keystore_stream_envelope_init(client.ticket, client.slot, 0, &stream);
+      else
+        res = ias_keystore_stream_decrypt_init(client.ticket, client.slot, &stream);
+
+      size = container_size;
+      if (!res && m < 2)
+        res = ks_bench_stream(stream, plain, KS_BENCH_PARALLEL_SIZE, container, &size);
+      else if (!res)
+        res = ks_bench_stream(stream, container, envelope_size, plain, &size);
+      if (m == 1)
+        envelope_size = size;
+      ias_keystore_stream_free(stream);
+    }
+    if (!res)
+      ks_bench_report(names[m], iterations, (size_t)iterations * KS_BENCH_PARALLEL_SIZE,
+                      ks_bench_now_ns() - start);
+  }
+
+  free(container);
+  free(plain);
+  ks_bench_teardown(&client);
+  return res;
+}
+
+int ks_bench_iv(unsigned int iterations)
+{
+  struct ias_keystore_nonce *nonce = NULL;
+  uint8_t iv[DAL_KEYSTORE_GCM_IV_SIZE];
+  size_t iv_size;
+  uint64_t start;
+  unsigned int i;
+  int res = 0;
+  FILE *fp;
+
+  if (!iterations)
+    return -1;
+
+  /* Open, read and close /dev/urandom per IV, as ksutil initvec did */
+  start = ks_bench_now_ns();
+  for (i = 0; i < iterations && !res; i++)
+  {
+    fp = fopen("/dev/urandom", "rb");
+    if (!fp)
+      res = -errno;
+    else
+    {
+      if (fread(iv, 1, sizeof(iv), fp) != sizeof(iv))
+        res = -EIO;
+      fclose(fp);
+    }
+  }
+  if (!res)
+    ks_bench_report("urandom open/read", iterations, 0, ks_bench_now_ns() - start);
+
+  /* One getrandom() per IV */
+  start = ks_bench_now_ns();
+  for (i = 0; i < iterations && !res; i++)
+  {
+    if (getrandom(iv, sizeof(iv), 0) != (ssize_t)sizeof(iv))
+      res = -EIO;
+  }
+  if (!res)
+    ks_bench_report("getrandom", iterations, 0, ks_bench_now_ns() - start);
+
+  /* The per-thread buffer */
+  start = ks_bench_now_ns();
+  for (i = 0; i < iterations && !res; i++)
+  {
+    iv_size = sizeof(iv);
+    res = ias_keystore_random_iv(ALGOSPEC_AES_GCM, iv, &iv_size);
+  }
+  if (!res)
+    ks_bench_report("random_iv", iterations, 0, ks_bench_now_ns() - start);
+
+  /* A counter, without a state file */
+  if (!res)
+    res = ias_keystore_nonce_open(NULL, 0, &nonce);
+  start = ks_bench_now_ns();
+  for (i = 0; i < iterations && !res; i++)
+    res = ias_keystore_nonce_next(nonce, iv);
+  if (!res)
+    ks_bench_report("nonce_next", iterations, 0, ks_bench_now_ns() - start);
+  ias_keystore_nonce_close(nonce);
+
+  return res;
+}
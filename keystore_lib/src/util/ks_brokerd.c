@@ -0,0 +1,114 @@
+/*
+   Copyright 2018 Intel Corporation
+
+   This software is licensed to you in accordance
+   with the agreement between you and Intel Corporation.
+
+   Alternatively, you can use this file in compliance
+   with the Apache license, Version 2.
+
+
+   Apache License, Version 2.0
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+   http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ias_keystore.h"
+#include "ias_keystore_broker.h"
+
+static struct ias_keystore_broker *broker;
+
+static void ks_brokerd_signal(int sig)
+{
+  (void)sig;
+  ias_keystore_broker_stop(broker);
+}
+
+static int ks_brokerd_usage(const char *name)
+{
+  fprintf(stderr, "Usage: %s [-d <device>] [-n <max clients>] [-u <max clients per user>] [-m <socket mode>] <socket>\n", name);
+  return 2;
+}
+
+/*
+ * Keystore broker daemon, serves keystore calls on a Unix domain socket.
+ */
+int main(int argc, char *argv[])
+{
+  struct ias_keystore_broker_config config;
+  struct sigaction action;
+  char *end;
+  int opt, res;
+
+  memset(&config, 0, sizeof(config));
+
+  while ((opt = getopt(argc, argv, "d:n:u:m:")) != -1)
+  {
+    switch (opt)
+    {
+    case 'd':
+      config.device = optarg;
+      break;
+    case 'n':
+      config.max_clients = (unsigned int)strtoul(optarg, &end, 0);
+      if (*end || !config.max_clients)
+        return ks_brokerd_usage(argv[0]);
+      break;
+    case 'u':
+      config.max_user_clients = (unsigned int)strtoul(optarg, &end, 0);
+      if (*end || !config.max_user_clients)
+        return ks_brokerd_usage(argv[0]);
+      break;
+    case 'm':
+      config.socket_mode = (unsigned int)strtoul(optarg, &end, 8);
+      if (*end || !config.socket_mode || config.socket_mode > 0777)
+        return ks_brokerd_usage(argv[0]);
+      break;
+    default:
+      return ks_brokerd_usage(argv[0]);
+    }
+  }
+
+  if (optind != argc - 1)
+    return ks_brokerd_usage(argv[0]);
+
+  config.socket_path = argv[optind];
+
+  res = ias_keystore_broker_create(&config, &broker);
+  if (res)
+  {
+    fprintf(stderr, "%s: cannot start broker on %s: %s\n", argv[0], config.socket_path, strerror(-res));
+    return 1;
+  }
+
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = ks_brokerd_signal;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
+
+  res = ias_keystore_broker_run(broker);
+  if (res)
+    fprintf(stderr, "%s: %s\n", argv[0], strerror(-res));
+
+  ias_keystore_broker_destroy(broker);
+  return res ? 1 : 0;
+}
+
+/* end of file */
@@ -24,7 +24,205 @@
 */
 
 #include "ias_keystore.h"
+#include "ias_keystore_async.h"
+#include "ias_keystore_broker.h"
+#include "ias_keystore_ctx.h"
+#include "ias_keystore_keypool.h"
+#include "ias_keystore_migrate.h"
+#include "ias_keystore_nonce.h"
+#include "ias_keystore_slots.h"
+#include "ias_keystore_store.h"
+#include "ias_keystore_stream.h"
+#include "../lib/ias_keystore_aes.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define KS_SMOKE_ASYNC_REQUESTS 32
+#define KS_SMOKE_FORK_CALLS 200
+#define KS_SMOKE_SLOTS_KEYS 16
+#define KS_SMOKE_SLOTS_MAX 4
+#define KS_SMOKE_SHARED_LOADS 8
+#define KS_SMOKE_KEYPOOL_KEYS 4
+#define KS_SMOKE_KEYPOOL_TAKES 10
+#define KS_SMOKE_MIGRATE_KEYS 16
+#define KS_SMOKE_STORE_KEYS 16
+#define KS_SMOKE_STREAM_CHUNK 1000
+#define KS_SMOKE_NONCE_THREADS 4
+#define KS_SMOKE_NONCE_IVS 100
+#define KS_SMOKE_NONCE_RESERVE 5
+
+/*
+ * Register a device client and, unless @slot is NULL, load a new key of
+ * @key_spec into it. The client is unregistered again on failure.
+ */
+static int ks_smoke_client(enum keystore_key_spec key_spec, uint8_t *ticket, uint32_t *slot)
+{
+  size_t wrapped_key_size = 0;
+  int res;
+
+  res = ias_keystore_register_client(SEED_TYPE_DEVICE, ticket);
+  if (res || !slot)
+    return res;
+
+  res = ias_keystore_wrapped_key_size(key_spec, &wrapped_key_size, NULL);
+  if (res)
+  {
+    ias_keystore_unregister_client(ticket);
+    return res;
+  }
+
+  uint8_t wrapped_key[wrapped_key_size];
+  res = ias_keystore_generate_key(ticket, key_spec, wrapped_key);
+  if (!res)
+    res = ias_keystore_load_key(ticket, wrapped_key, wrapped_key_size, slot);
+  if (res)
+    ias_keystore_unregister_client(ticket);
+  return res;
+}
+
+/*
+ * Known answers of the host AES: GCM test cases 2, 4, 6, 14 and 16 of
+ * "The Galois/Counter Mode of Operation (GCM)" as used for the NIST GCM
+ * validation, and CCM examples 1 to 3 of NIST SP 800-38C. A CCM IV is
+ * L - 1 followed by the nonce.
+ */
+struct ks_smoke_aes_vector {
+  enum keystore_algo_spec algo_spec;
+  const char *key;
+  const char *iv;
+  const char *aad;
+  const char *plain;
+  const char *cypher;
+  const char *tag;
+};
+
+#define KS_SMOKE_GCM_PLAIN "d9313225f88406e5a55909c5aff5269a86a7a9531534f7da2e4c303d8a318a72" \
+                           "1c3c0c95956809532fcf0e2449a6b525b16aedf5aa0de657ba637b39"
+#define KS_SMOKE_GCM_AAD "feedfacedeadbeeffeedfacedeadbeefabaddad2"
+
+static const struct ks_smoke_aes_vector ks_smoke_aes_kats[] = {
+  { ALGOSPEC_AES_GCM, "00000000000000000000000000000000", "000000000000000000000000", "",
+    "00000000000000000000000000000000", "0388dace60b6a392f328c2b971b2fe78",
+    "ab6e47d42cec13bdf53a67b21257bddf" },
+  { ALGOSPEC_AES_GCM, "feffe9928665731c6d6a8f9467308308", "cafebabefacedbaddecaf888",
+    KS_SMOKE_GCM_AAD, KS_SMOKE_GCM_PLAIN,
+    "42831ec2217774244b7221b784d0d49ce3aa212f2c02a4e035c17e2329aca12e"
+    "21d514b25466931c7d8f6a5aac84aa051ba30b396a0aac973d58e091",
+    "5bc94fbc3221a5db94fae95ae7121a47" },
+  { ALGOSPEC_AES_GCM, "feffe9928665731c6d6a8f9467308308",
+    "9313225df88406e555909c5aff5269aa6a7a9538534f7da1e4c303d2a318a728"
+    "c3c0c95156809539fcf0e2429a6b525416aedbf5a0de6a57a637b39b",
+    KS_SMOKE_GCM_AAD, KS_SMOKE_GCM_PLAIN,
+    "8ce24998625615b603a033aca13fb894be9112a5c3a211a8ba262a3cca7e2ca7"
+    "01e4a9a4fba43c90ccdcb281d48c7c6fd62875d2aca417034c34aee5",
+    "619cc5aefffe0bfa462af43c1699d050" },
+  { ALGOSPEC_AES_GCM, "0000000000000000000000000000000000000000000000000000000000000000",
+    "000000000000000000000000", "", "00000000000000000000000000000000",
+    "cea7403d4d606b6e074ec5d3baf39d18", "d0d1c8a799996bf0265b98b5d48ab919" },
+  { ALGOSPEC_AES_GCM, "feffe9928665731c6d6a8f9467308308feffe9928665731c6d6a8f9467308308",
+    "cafebabefacedbaddecaf888", KS_SMOKE_GCM_AAD, KS_SMOKE_GCM_PLAIN,
+    "522dc1f099567d07f47f37a32a84427d643a8cdcbfe5c0c97598a2bd2555d1aa"
+    "8cb08e48590dbb3da7b08b1056828838c5f61e6393ba7a0abcc9f662",
+    "76fc6ece0f4e1768cddf8853bb2d551b" },
+  { ALGOSPEC_AES_CCM, "404142434445464748494a4b4c4d4e4f", "0710111213141516",
+    "0001020304050607", "20212223", "7162015b", "4dac255d" },
+  { ALGOSPEC_AES_CCM, "404142434445464748494a4b4c4d4e4f", "061011121314151617",
+    "000102030405060708090a0b0c0d0e0f", "202122232425262728292a2b2c2d2e2f",
+    "d2a1f0e051ea5f62081a7792073d593d", "1fc64fbfaccd" },
+  { ALGOSPEC_AES_CCM, "404142434445464748494a4b4c4d4e4f", "02101112131415161718191a1b",
+    "000102030405060708090a0b0c0d0e0f10111213",
+    "202122232425262728292a2b2c2d2e2f3031323334353637",
+    "e3b201a9f5b71a7a9b1ceaeccd97e70b6176aad9a4428aa5", "484392fbc1b09951" },
+};
+
+/* Decode @hex into @out, returns the number of bytes */
+static size_t ks_smoke_hex(const char *hex, uint8_t *out)
+{
+  size_t i;
+
+  for (i = 0; hex[2 * i]; i++)
+    sscanf(hex + 2 * i, "%2hhx", &out[i]);
+  return i;
+}
+
+/* Run one GCM vector, also decrypting it and with a forged tag */
+static int ks_smoke_gcm_vector(const struct keystore_gcm_key *key, const uint8_t *iv, size_t iv_size,
+                               const uint8_t *aad, size_t aad_size, const uint8_t *plain,
+                               const uint8_t *cypher, size_t size, const uint8_t *tag)
+{
+  uint8_t out[64], out_tag[KEYSTORE_AES_TAG_SIZE];
+
+  if (keystore_gcm_encrypt(key, iv, iv_size, aad, aad_size, plain, size, out, out_tag) ||
+      memcmp(out, cypher, size) || memcmp(out_tag, tag, sizeof(out_tag)))
+    return -EINVAL;
+
+  if (keystore_gcm_decrypt(key, iv, iv_size, aad, aad_size, cypher, size, tag, out) ||
+      memcmp(out, plain, size))
+    return -EINVAL;
+
+  out_tag[0] ^= 1;
+  if (keystore_gcm_decrypt(key, iv, iv_size, aad, aad_size, cypher, size, out_tag, out) != -EBADMSG)
+    return -EINVAL;
+
+  return 0;
+}
+
+int ks_smoke_aes_vectors(enum keystore_key_spec key_spec, enum keystore_algo_spec algo_spec)
+{
+  uint8_t key[32], iv[64], aad[32], plain[64], cypher[64], tag[16], out[64], out_tag[16];
+  size_t key_size, iv_size, aad_size, size, tag_size, i;
+  struct keystore_gcm_key gcm, table;
+  struct keystore_aes_key aes;
+  int res = 0;
+
+  for (i = 0; i < sizeof(ks_smoke_aes_kats) / sizeof(ks_smoke_aes_kats[0]) && !res; i++)
+  {
+    const struct ks_smoke_aes_vector *v = &ks_smoke_aes_kats[i];
+
+    key_size = ks_smoke_hex(v->key, key);
+    if (v->algo_spec != algo_spec || key_size != (key_spec == KEYSPEC_LENGTH_128 ? 16u : 32u))
+      continue;
+
+    iv_size = ks_smoke_hex(v->iv, iv);
+    aad_size = ks_smoke_hex(v->aad, aad);
+    size = ks_smoke_hex(v->plain, plain);
+    ks_smoke_hex(v->cypher, cypher);
+    tag_size = ks_smoke_hex(v->tag, tag);
+
+    if (algo_spec == ALGOSPEC_AES_CCM)
+    {
+      res = keystore_aes_setkey(&aes, key, key_size);
+      if (!res)
+        res = keystore_ccm_encrypt_tag(&aes, iv, iv_size, aad, aad_size, plain, size,
+                                       out, out_tag, tag_size);
+      if (!res && (memcmp(out, cypher, size) || memcmp(out_tag, tag, tag_size)))
+        res = -EINVAL;
+      continue;
+    }
+
+    /* With AES-NI if the CPU has it, and with the tables */
+    res = keystore_gcm_setkey(&gcm, key, key_size);
+    if (!res)
+      res = ks_smoke_gcm_vector(&gcm, iv, iv_size, aad, aad_size, plain, cypher, size, tag);
+    table = gcm;
+    table.accel = 0;
+    if (!res && gcm.accel)
+      res = ks_smoke_gcm_vector(&table, iv, iv_size, aad, aad_size, plain, cypher, size, tag);
+  }
+
+  return res;
+}
 
 int ks_smoke_encrypt(enum keystore_seed_type seed_type,
                      enum keystore_key_spec key_spec,
@@ -125,3 +323,1477 @@ int ks_smoke_encrypt(enum keystore_seed_type seed_type,
   ias_keystore_unregister_client(ticket);
   return res;
 }
+
+static int ks_smoke_ctx_crypt(struct ias_keystore_ctx *ctx, uint32_t slot,
+                              enum keystore_algo_spec algo_spec)
+{
+  int res = 0;
+  char message[] = "This is a very secret message!";
+  size_t message_size = sizeof(message);
+  uint8_t iv[DAL_KEYSTORE_GCM_IV_SIZE] = { 0x01, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+                                       0x08, 0x09, 0x0a, 0x0b };
+  size_t encrypted_message_size = 0;
+  size_t decrypted_message_size = 0;
+
+  /* Encrypt */
+  res = ias_keystore_ctx_encrypt_size(ctx, algo_spec, message_size, &encrypted_message_size);
+  if (res)
+    return res;
+
+  uint8_t cypher[encrypted_message_size];
+  res = ias_keystore_ctx_encrypt(ctx, slot, algo_spec, iv, sizeof(iv),
+                                 (uint8_t *)message, message_size, cypher);
+  if (res)
+    return res;
+
+  /* Decrypt */
+  res = ias_keystore_ctx_decrypt_size(ctx, algo_spec, encrypted_message_size,
+                                      &decrypted_message_size);
+  if (res)
+    return res;
+
+  char clear[decrypted_message_size];
+  res = ias_keystore_ctx_decrypt(ctx, slot, algo_spec, iv, sizeof(iv),
+                                 cypher, encrypted_message_size, (uint8_t *)clear);
+  if (res)
+    return res;
+
+  /* Check message */
+  return strncmp(message, clear, message_size);
+}
+
+static int ks_smoke_ctx_key(struct ias_keystore_ctx *ctx,
+                            enum keystore_key_spec key_spec,
+                            enum keystore_algo_spec algo_spec)
+{
+  int res = 0;
+  size_t wrapped_key_size = 0;
+  uint32_t slot = 0;
+
+  /* Generate new key */
+  res = ias_keystore_ctx_wrapped_key_size(ctx, key_spec, &wrapped_key_size, NULL);
+  if (res)
+    return res;
+
+  uint8_t wrapped_key[wrapped_key_size];
+  res = ias_keystore_ctx_generate_key(ctx, key_spec, wrapped_key);
+  if (res)
+    return res;
+
+  /* Load Key */
+  res = ias_keystore_ctx_load_key(ctx, wrapped_key, wrapped_key_size, &slot);
+  if (res)
+    return res;
+
+  res = ks_smoke_ctx_crypt(ctx, slot, algo_spec);
+
+  ias_keystore_ctx_unload_key(ctx, slot);
+  return res;
+}
+
+int ks_smoke_ctx_encrypt(enum keystore_key_spec key_spec,
+                         enum keystore_algo_spec algo_spec)
+{
+  int res = 0;
+  struct ias_keystore_ctx *device_ctx = NULL;
+  struct ias_keystore_ctx *user_ctx = NULL;
+
+  /* Two independent sessions in one process */
+  res = ias_keystore_ctx_open(NULL, SEED_TYPE_DEVICE, &device_ctx);
+  if (res)
+    return res;
+
+  res = ias_keystore_ctx_open(NULL, SEED_TYPE_USER, &user_ctx);
+  if (res)
+  {
+    ias_keystore_ctx_close(device_ctx);
+    return res;
+  }
+
+  res = ks_smoke_ctx_key(device_ctx, key_spec, algo_spec);
+  if (!res)
+    res = ks_smoke_ctx_key(user_ctx, key_spec, algo_spec);
+
+  ias_keystore_ctx_close(user_ctx);
+  ias_keystore_ctx_close(device_ctx);
+  return res;
+}
+
+/*
+ * Submit without blocking, reaping completions whenever the pool is full.
+ */
+static int ks_smoke_async_run(struct ias_keystore_async *pool,
+                              struct ias_keystore_async_req *reqs, unsigned int count)
+{
+  struct ias_keystore_async_req *done[KS_SMOKE_ASYNC_REQUESTS];
+  struct pollfd pfd;
+  unsigned int submitted = 0;
+  unsigned int completed = 0;
+  int res = 0;
+  int n, i;
+
+  pfd.fd = ias_keystore_async_eventfd(pool);
+  pfd.events = POLLIN;
+
+  while (completed < count)
+  {
+    while (submitted < count)
+    {
+      res = ias_keystore_async_submit(pool, &reqs[submitted], IAS_KEYSTORE_ASYNC_NONBLOCK);
+      if (res == -EAGAIN)
+        break;
+      if (res)
+        return res;
+      submitted++;
+    }
+
+    if (poll(&pfd, 1, -1) < 0)
+      return -errno;
+
+    n = ias_keystore_async_reap(pool, done, KS_SMOKE_ASYNC_REQUESTS);
+    if (n < 0)
+      return n;
+
+    for (i = 0; i < n; i++)
+    {
+      if (done[i]->result)
+        res = done[i]->result;
+    }
+    completed += n;
+  }
+
+  return res;
+}
+
+int ks_smoke_async_encrypt(enum keystore_key_spec key_spec,
+                           enum keystore_algo_spec algo_spec)
+{
+  int res = 0;
+  uint8_t ticket[KEYSTORE_CLIENT_TICKET_SIZE];
+  size_t wrapped_key_size = 0;
+  char message[] = "This is a very secret message!";
+  size_t message_size = sizeof(message);
+  uint8_t iv[DAL_KEYSTORE_GCM_IV_SIZE] = { 0x01, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+                                       0x08, 0x09, 0x0a, 0x0b };
+  size_t encrypted_message_size = 0;
+  struct ias_keystore_async_config config = { 2, 8 };
+  struct ias_keystore_async *pool = NULL;
+  struct ias_keystore_async_req reqs[KS_SMOKE_ASYNC_REQUESTS];
+  uint32_t slot = 0;
+  unsigned int i;
+
+  res = ias_keystore_register_client(SEED_TYPE_DEVICE, ticket);
+  if (res)
+    return res;
+
+  res = ias_keystore_wrapped_key_size(key_spec, &wrapped_key_size, NULL);
+  if (res)
+  {
+    ias_keystore_unregister_client(ticket);
+    return res;
+  }
+
+  uint8_t wrapped_key[wrapped_key_size];
+  res = ias_keystore_async_create(&config, &pool);
+  if (res)
+  {
+    ias_keystore_unregister_client(ticket);
+    return res;
+  }
+
+  /* Generate and load the key through the pool */
+  memset(reqs, 0, sizeof(reqs));
+  reqs[0].op = IAS_KEYSTORE_ASYNC_GENERATE_KEY;
+  reqs[0].client_ticket = ticket;
+  reqs[0].key_spec = key_spec;
+  reqs[0].wrapped_key = wrapped_key;
+  res = ks_smoke_async_run(pool, reqs, 1);
+
+  if (!res)
+  {
+    reqs[0].op = IAS_KEYSTORE_ASYNC_LOAD_KEY;
+    reqs[0].wrapped_key_size = wrapped_key_size;
+    res = ks_smoke_async_run(pool, reqs, 1);
+    slot = reqs[0].slot_id;
+  }
+
+  if (!res)
+    res = ias_keystore_encrypt_size(algo_spec, message_size, &encrypted_message_size);
+  if (res)
+  {
+    ias_keystore_async_destroy(pool);
+    ias_keystore_unregister_client(ticket);
+    return res;
+  }
+
+  /* Encrypt the message more times than the pool can hold */
+  uint8_t cypher[KS_SMOKE_ASYNC_REQUESTS][encrypted_message_size];
+  char clear[KS_SMOKE_ASYNC_REQUESTS][message_size];
+
+  memset(reqs, 0, sizeof(reqs));
+  for (i = 0; i < KS_SMOKE_ASYNC_REQUESTS; i++)
+  {
+    reqs[i].op = IAS_KEYSTORE_ASYNC_ENCRYPT;
+    reqs[i].client_ticket = ticket;
+    reqs[i].slot_id = slot;
+    reqs[i].algo_spec = algo_spec;
+    reqs[i].iv = iv;
+    reqs[i].iv_size = sizeof(iv);
+    reqs[i].input = (uint8_t *)message;
+    reqs[i].input_size = message_size;
+    reqs[i].output = cypher[i];
+  }
+  res = ks_smoke_async_run(pool, reqs, KS_SMOKE_ASYNC_REQUESTS);
+
+  /* And decrypt every copy */
+  for (i = 0; i < KS_SMOKE_ASYNC_REQUESTS && !res; i++)
+  {
+    reqs[i].op = IAS_KEYSTORE_ASYNC_DECRYPT;
+    reqs[i].input = cypher[i];
+    reqs[i].input_size = encrypted_message_size;
+    reqs[i].output = (uint8_t *)clear[i];
+  }
+  if (!res)
+    res = ks_smoke_async_run(pool, reqs, KS_SMOKE_ASYNC_REQUESTS);
+
+  for (i = 0; i < KS_SMOKE_ASYNC_REQUESTS && !res; i++)
+    res = strncmp(message, clear[i], message_size);
+
+  ias_keystore_async_destroy(pool);
+  ias_keystore_unload_key(ticket, slot);
+  ias_keystore_unregister_client(ticket);
+  return res;
+}
+
+static void *ks_smoke_broker_run(void *arg)
+{
+  ias_keystore_broker_run((struct ias_keystore_broker *)arg);
+  return NULL;
+}
+
+/*
+ * A malformed frame, here a header with a bad magic after which the
+ * client hangs up, must get the connection closed rather than served
+ * over and over.
+ */
+static int ks_smoke_broker_garbage(const char *path)
+{
+  struct sockaddr_un addr;
+  struct pollfd pfd;
+  uint8_t frame[24];
+  char c;
+  int fd, res = -EIO;
+
+  fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    return -errno;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+  memset(frame, 0, sizeof(frame));
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+      write(fd, frame, sizeof(frame)) != (ssize_t)sizeof(frame) ||
+      shutdown(fd, SHUT_WR))
+  {
+    res = -errno;
+    close(fd);
+    return res;
+  }
+
+  /* The broker closes its end: end of file, nothing is sent back */
+  pfd.fd = fd;
+  pfd.events = POLLIN;
+  if (poll(&pfd, 1, 2000) == 1 && read(fd, &c, 1) == 0)
+    res = 0;
+
+  close(fd);
+  return res;
+}
+
+/*
+ * A fork() child must not share the broker connections and payload ring
+ * of the parent: both use one context at the same time.
+ */
+static int ks_smoke_broker_fork(enum keystore_key_spec key_spec,
+                                enum keystore_algo_spec algo_spec)
+{
+  struct ias_keystore_ctx *ctx = NULL;
+  size_t wrapped_key_size = 0;
+  uint32_t slot = 0;
+  int i, res, status;
+  pid_t pid;
+
+  res = ias_keystore_ctx_open(NULL, SEED_TYPE_DEVICE, &ctx);
+  if (res)
+    return res;
+
+  res = ias_keystore_ctx_wrapped_key_size(ctx, key_spec, &wrapped_key_size, NULL);
+  if (res)
+  {
+    ias_keystore_ctx_close(ctx);
+    return res;
+  }
+
+  uint8_t wrapped_key[wrapped_key_size];
+  res = ias_keystore_ctx_generate_key(ctx, key_spec, wrapped_key);
+  if (!res)
+    res = ias_keystore_ctx_load_key(ctx, wrapped_key, wrapped_key_size, &slot);
+  if (res)
+  {
+    ias_keystore_ctx_close(ctx);
+    return res;
+  }
+
+  pid = fork();
+  if (!pid)
+  {
+    for (i = 0; i < KS_SMOKE_FORK_CALLS; i++)
+      if (ks_smoke_ctx_crypt(ctx, slot, algo_spec))
+        _exit(1);
+    _exit(0);
+  }
+
+  for (i = 0; !res && i < KS_SMOKE_FORK_CALLS; i++)
+    res = ks_smoke_ctx_crypt(ctx, slot, algo_spec);
+  if (pid < 0 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status) ||
+      WEXITSTATUS(status))
+    res = res ? res : -ECHILD;
+
+  ias_keystore_ctx_unload_key(ctx, slot);
+  ias_keystore_ctx_close(ctx);
+  return res;
+}
+
+int ks_smoke_broker_encrypt(enum keystore_key_spec key_spec,
+                            enum keystore_algo_spec algo_spec)
+{
+  static char device[128];
+  char path[96];
+  const char *old_device = ias_keystore_get_device();
+  struct ias_keystore_broker_config config;
+  struct ias_keystore_broker *broker = NULL;
+  pthread_t thread;
+  int res;
+
+  /* Serve the current device through a broker on a private socket */
+  snprintf(path, sizeof(path), "/tmp/ks-smoke-%d.sock", (int)getpid());
+  memset(&config, 0, sizeof(config));
+  config.socket_path = path;
+  config.device = old_device;
+  config.socket_mode = 0600;
+
+  res = ias_keystore_broker_create(&config, &broker);
+  if (res)
+    return res;
+
+  res = -pthread_create(&thread, NULL, ks_smoke_broker_run, broker);
+  if (res)
+  {
+    ias_keystore_broker_destroy(broker);
+    return res;
+  }
+
+  snprintf(device, sizeof(device), "unix:%s", path);
+  ias_keystore_set_device(device);
+
+  res = ks_smoke_broker_garbage(path);
+  if (!res)
+    res = ks_smoke_encrypt(SEED_TYPE_DEVICE, key_spec, algo_spec);
+  if (!res)
+    res = ks_smoke_async_encrypt(key_spec, algo_spec);
+  if (!res)
+    res = ks_smoke_broker_fork(key_spec, algo_spec);
+
+  ias_keystore_set_device(old_device);
+
+  ias_keystore_broker_stop(broker);
+  pthread_join(thread, NULL);
+  ias_keystore_broker_destroy(broker);
+  return res;
+}
+
+static int ks_smoke_slots_run(struct ias_keystore_slots *slots,
+                              const uint8_t *ticket,
+                              enum keystore_key_spec key_spec,
+                              enum keystore_algo_spec algo_spec)
+{
+  int res = 0;
+  char message[] = "This is a very secret message!";
+  size_t message_size = sizeof(message);
+  uint8_t iv[DAL_KEYSTORE_GCM_IV_SIZE] = { 0x01, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+                                       0x08, 0x09, 0x0a, 0x0b };
+  size_t wrapped_key_size = 0;
+  size_t encrypted_message_size = 0;
+  struct ias_keystore_slots_stats stats;
+  uint32_t slot = 0;
+  uint64_t i;
+
+  res = ias_keystore_wrapped_key_size(key_spec, &wrapped_key_size, NULL);
+  if (!res)
+    res = ias_keystore_encrypt_size(algo_spec, message_size, &encrypted_message_size);
+  if (res)
+    return res;
+
+  uint8_t wrapped_key[wrapped_key_size];
+  uint8_t cypher[KS_SMOKE_SLOTS_KEYS][encrypted_message_size];
+  char clear[message_size];
+
+  /* More keys than slots, each one encrypts its own message */
+  for (i = 0; i < KS_SMOKE_SLOTS_KEYS && !res; i++)
+  {
+    res = ias_keystore_generate_key(ticket, key_spec, wrapped_key);
+    if (!res)
+      res = ias_keystore_slots_add(slots, i, wrapped_key, wrapped_key_size);
+    if (!res)
+      res = ias_keystore_slots_acquire(slots, i, &slot);
+    if (res)
+      return res;
+
+    res = ias_keystore_encrypt(ticket, slot, algo_spec, iv, sizeof(iv),
+                               (uint8_t *)message, message_size, cypher[i]);
+    ias_keystore_slots_release(slots, i);
+  }
+
+  /* Evicted keys are loaded again */
+  for (i = KS_SMOKE_SLOTS_KEYS; i-- > 0 && !res;)
+  {
+    res = ias_keystore_slots_acquire(slots, i, &slot);
+    if (res)
+      return res;
+
+    res = ias_keystore_decrypt(ticket, slot, algo_spec, iv, sizeof(iv),
+                               cypher[i], encrypted_message_size, (uint8_t *)clear);
+    if (!res)
+      res = strncmp(message, clear, message_size);
+    ias_keystore_slots_release(slots, i);
+  }
+  if (res)
+    return res;
+
+  /* No slot left when all of them are pinned */
+  for (i = 0; i < KS_SMOKE_SLOTS_MAX && !res; i++)
+    res = ias_keystore_slots_acquire(slots, i, &slot);
+  if (!res && ias_keystore_slots_acquire(slots, KS_SMOKE_SLOTS_MAX, &slot) != -ENOSPC)
+    res = -EINVAL;
+  while (i-- > 0)
+    ias_keystore_slots_release(slots, i);
+  if (res)
+    return res;
+
+  ias_keystore_slots_get_stats(slots, &stats);
+  if (stats.keys != KS_SMOKE_SLOTS_KEYS || stats.loaded != KS_SMOKE_SLOTS_MAX ||
+      !stats.evictions || !stats.hits || stats.pinned)
+    return -EINVAL;
+
+  return ias_keystore_slots_remove(slots, 0);
+}
+
+int ks_smoke_slots_encrypt(enum keystore_key_spec key_spec,
+                           enum keystore_algo_spec algo_spec)
+{
+  uint8_t ticket[KEYSTORE_CLIENT_TICKET_SIZE];
+  struct ias_keystore_slots_config config;
+  struct ias_keystore_slots *slots = NULL;
+  int res;
+
+  res = ks_smoke_client(key_spec, ticket, NULL);
+  if (res)
+    return res;
+
+  memset(&config, 0, sizeof(config));
+  config.max_slots = KS_SMOKE_SLOTS_MAX;
+
+  res = ias_keystore_slots_create(ticket, &config, &slots);
+  if (!res)
+    res = ks_smoke_slots_run(slots, ticket, key_spec, algo_spec);
+
+  ias_keystore_slots_destroy(slots);
+  ias_keystore_unregister_client(ticket);
+  return res;
+}
+
+struct ks_smoke_shared_load {
+  const uint8_t *ticket;
+  uint8_t *wrapped_key;
+  size_t wrapped_key_size;
+  uint32_t slot;
+  int res;
+};
+
+static void *ks_smoke_shared_load_run(void *arg)
+{
+  struct ks_smoke_shared_load *load = (struct ks_smoke_shared_load *)arg;
+
+  load->res = ias_keystore_load_key(load->ticket, load->wrapped_key,
+                                    load->wrapped_key_size, &load->slot);
+  return NULL;
+}
+
+static int ks_smoke_shared_run(const uint8_t *ticket,
+                               enum keystore_key_spec key_spec,
+                               enum keystore_algo_spec algo_spec)
+{
+  int res = 0;
+  char message[] = "This is a very secret message!";
+  size_t message_size = sizeof(message);
+  uint8_t iv[DAL_KEYSTORE_GCM_IV_SIZE] = { 0x01, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+                                       0x08, 0x09, 0x0a, 0x0b };
+  struct ks_smoke_shared_load loads[KS_SMOKE_SHARED_LOADS];
+  pthread_t threads[KS_SMOKE_SHARED_LOADS];
+  size_t wrapped_key_size = 0;
+  size_t encrypted_message_size = 0;
+  int i, started;
+
+  res = ias_keystore_wrapped_key_size(key_spec, &wrapped_key_size, NULL);
+  if (!res)
+    res = ias_keystore_encrypt_size(algo_spec, message_size, &encrypted_message_size);
+  if (res)
+    return res;
+
+  uint8_t wrapped_key[KS_SMOKE_SHARED_LOADS][wrapped_key_size];
+  uint8_t cypher[encrypted_message_size];
+
+  res = ias_keystore_generate_key(ticket, key_spec, wrapped_key[0]);
+  if (res)
+    return res;
+
+  /* Every thread loads its own copy of the same wrapped key */
+  for (started = 0; started < KS_SMOKE_SHARED_LOADS; started++)
+  {
+    memcpy(wrapped_key[started], wrapped_key[0], wrapped_key_size);
+    loads[started].ticket = ticket;
+    loads[started].wrapped_key = wrapped_key[started];
+    loads[started].wrapped_key_size = wrapped_key_size;
+    loads[started].res = -EINPROGRESS;
+
+    res = -pthread_create(&threads[started], NULL, ks_smoke_shared_load_run, &loads[started]);
+    if (res)
+      break;
+  }
+
+  for (i = 0; i < started; i++)
+  {
+    pthread_join(threads[i], NULL);
+    if (!res)
+      res = loads[i].res;
+    if (!res && loads[i].slot != loads[0].slot)
+      res = -EINVAL;
+  }
+  if (res)
+    return res;
+
+  /* The slot stays loaded until the last reference is dropped */
+  for (i = 1; i < KS_SMOKE_SHARED_LOADS && !res; i++)
+    res = ias_keystore_unload_key(ticket, loads[i].slot);
+
+  if (!res)
+    res = ias_keystore_encrypt(ticket, loads[0].slot, algo_spec, iv, sizeof(iv),
+                               (uint8_t *)message, message_size, cypher);
+
+  ias_keystore_unload_key(ticket, loads[0].slot);
+  return res;
+}
+
+/* Without sharing, the default, every load gets a slot of its own */
+static int ks_smoke_unshared_run(const uint8_t *ticket, enum keystore_key_spec key_spec)
+{
+  size_t wrapped_key_size = 0;
+  uint32_t slots[2];
+  int res;
+
+  res = ias_keystore_wrapped_key_size(key_spec, &wrapped_key_size, NULL);
+  if (res)
+    return res;
+
+  uint8_t wrapped_key[wrapped_key_size];
+
+  res = ias_keystore_generate_key(ticket, key_spec, wrapped_key);
+  if (!res)
+    res = ias_keystore_load_key(ticket, wrapped_key, wrapped_key_size, &slots[0]);
+  if (res)
+    return res;
+
+  res = ias_keystore_load_key(ticket, wrapped_key, wrapped_key_size, &slots[1]);
+  if (!res)
+  {
+    if (slots[1] == slots[0])
+      res = -EINVAL;
+    ias_keystore_unload_key(ticket, slots[1]);
+  }
+
+  ias_keystore_unload_key(ticket, slots[0]);
+  return res;
+}
+
+int ks_smoke_shared_encrypt(enum keystore_key_spec key_spec,
+                            enum keystore_algo_spec algo_spec)
+{
+  uint8_t ticket[KEYSTORE_CLIENT_TICKET_SIZE];
+  int res;
+
+  res = ks_smoke_client(key_spec, ticket, NULL);
+  if (res)
+    return res;
+
+  res = ks_smoke_unshared_run(ticket, key_spec);
+  if (!res)
+  {
+    ias_keystore_set_key_sharing(1);
+    res = ks_smoke_shared_run(ticket, key_spec, algo_spec);
+    ias_keystore_set_key_sharing(0);
+  }
+
+  ias_keystore_unregister_client(ticket);
+  return res;
+}
+
+static int ks_smoke_keypool_run(struct ias_keystore_keypool *pool,
+                                const uint8_t *ticket,
+                                enum keystore_algo_spec algo_spec)
+{
+  int res = 0;
+  char message[] = "This is a very secret message!";
+  size_t message_size = sizeof(message);
+  uint8_t iv[DAL_KEYSTORE_GCM_IV_SIZE] = { 0x01, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+                                       0x08, 0x09, 0x0a, 0x0b };
+  size_t wrapped_key_size = ias_keystore_keypool_key_size(pool);
+  size_t encrypted_message_size = 0;
+  struct ias_keystore_keypool_stats stats;
+  uint32_t slot = 0;
+  int i, j;
+
+  res = ias_keystore_encrypt_size(algo_spec, message_size, &encrypted_message_size);
+  if (res)
+    return res;
+
+  uint8_t wrapped_key[KS_SMOKE_KEYPOOL_TAKES][wrapped_key_size];
+  uint8_t cypher[encrypted_message_size];
+
+  res = ias_keystore_keypool_fill(pool);
+  if (res)
+    return res;
+
+  /* More takes than the pool holds, every key is new */
+  for (i = 0; i < KS_SMOKE_KEYPOOL_TAKES && !res; i++)
+  {
+    res = ias_keystore_keypool_take(pool, wrapped_key[i], wrapped_key_size);
+    for (j = 0; j < i && !res; j++)
+      if (!memcmp(wrapped_key[i], wrapped_key[j], wrapped_key_size))
+        res = -EINVAL;
+  }
+  if (res)
+    return res;
+
+  res = ias_keystore_load_key(ticket, wrapped_key[KS_SMOKE_KEYPOOL_TAKES - 1],
+                              wrapped_key_size, &slot);
+  if (res)
+    return res;
+
+  res = ias_keystore_encrypt(ticket, slot, algo_spec, iv, sizeof(iv),
+                             (uint8_t *)message, message_size, cypher);
+  ias_keystore_unload_key(ticket, slot);
+  if (res)
+    return res;
+
+  ias_keystore_keypool_get_stats(pool, &stats);
+  if (stats.taken != KS_SMOKE_KEYPOOL_TAKES || stats.generated < KS_SMOKE_KEYPOOL_KEYS)
+    return -EINVAL;
+
+  return 0;
+}
+
+int ks_smoke_keypool_encrypt(enum keystore_key_spec key_spec,
+                             enum keystore_algo_spec algo_spec)
+{
+  uint8_t ticket[KEYSTORE_CLIENT_TICKET_SIZE];
+  struct ias_keystore_keypool_config config;
+  struct ias_keystore_keypool *pool = NULL;
+  int res;
+
+  res = ks_smoke_client(key_spec, ticket, NULL);
+  if (res)
+    return res;
+
+  memset(&config, 0, sizeof(config));
+  config.key_spec = key_spec;
+  config.high_watermark = KS_SMOKE_KEYPOOL_KEYS;
+
+  res = ias_keystore_keypool_create(ticket, &config, &pool);
+  if (!res)
+    res = ks_smoke_keypool_run(pool, ticket, algo_spec);
+
+  /* Stop refilling before the client goes away */
+  ias_keystore_keypool_destroy(pool);
+  ias_keystore_unregister_client(ticket);
+  return res;
+}
+
+struct ks_smoke_migrate_corpus {
+  uint8_t *keys;
+  size_t wrapped_key_size;
+  int next;
+  int completed;
+};
+
+static int ks_smoke_migrate_next(void *priv, struct ias_keystore_migrate_key *key)
+{
+  struct ks_smoke_migrate_corpus *corpus = (struct ks_smoke_migrate_corpus *)priv;
+
+  if (corpus->next == KS_SMOKE_MIGRATE_KEYS)
+    return 0;
+
+  key->wrapped_key = corpus->keys + corpus->next++ * corpus->wrapped_key_size;
+  key->wrapped_key_size = corpus->wrapped_key_size;
+  return 1;
+}
+
+static int ks_smoke_migrate_complete(void *priv, struct ias_keystore_migrate_key *key)
+{
+  struct ks_smoke_migrate_corpus *corpus = (struct ks_smoke_migrate_corpus *)priv;
+
+  __atomic_fetch_add(&corpus->completed, 1, __ATOMIC_RELAXED);
+  return key->result < 0 ? key->result : 0;
+}
+
+int ks_smoke_migrate_keys(enum keystore_key_spec key_spec)
+{
+  uint8_t ticket[KEYSTORE_CLIENT_TICKET_SIZE];
+  struct ks_smoke_migrate_corpus corpus;
+  struct ias_keystore_migrate_config config;
+  struct ias_keystore_migrate_stats stats;
+  size_t wrapped_key_size = 0;
+  int res, i;
+
+  res = ias_keystore_wrapped_key_size(key_spec, &wrapped_key_size, NULL);
+  if (res)
+    return res;
+
+  uint8_t keys[KS_SMOKE_MIGRATE_KEYS * wrapped_key_size];
+
+  res = ks_smoke_client(key_spec, ticket, NULL);
+  if (res)
+    return res;
+
+  for (i = 0; i < KS_SMOKE_MIGRATE_KEYS && !res; i++)
+    res = ias_keystore_generate_key(ticket, key_spec, keys + i * wrapped_key_size);
+
+  memset(&corpus, 0, sizeof(corpus));
+  corpus.keys = keys;
+  corpus.wrapped_key_size = wrapped_key_size;
+
+  memset(&config, 0, sizeof(config));
+  config.workers = 4;
+  config.next = ks_smoke_migrate_next;
+  config.complete = ks_smoke_migrate_complete;
+  config.priv = &corpus;
+
+  /* Fresh keys are current, every one is handed back */
+  if (!res)
+    res = ias_keystore_migrate(ticket, &config, &stats);
+  if (!res && (stats.keys != KS_SMOKE_MIGRATE_KEYS || stats.current != KS_SMOKE_MIGRATE_KEYS ||
+               corpus.completed != KS_SMOKE_MIGRATE_KEYS))
+    res = -EINVAL;
+
+  ias_keystore_unregister_client(ticket);
+  return res;
+}
+
+/* Check that the store holds exactly the even keys */
+static int ks_smoke_store_check(const char *path, int flags, const uint8_t *keys,
+                                size_t wrapped_key_size)
+{
+  struct ias_keystore_store *store;
+  uint8_t key[wrapped_key_size];
+  size_t size;
+  char id[16];
+  int res, i;
+
+  res = ias_keystore_store_open(path, flags, &store);
+  if (res)
+    return res;
+
+  if (ias_keystore_store_count(store) != KS_SMOKE_STORE_KEYS / 2)
+    res = -EINVAL;
+
+  for (i = 0; i < KS_SMOKE_STORE_KEYS && !res; i++)
+  {
+    snprintf(id, sizeof(id), "key-%d", i);
+    size = sizeof(key);
+    res = ias_keystore_store_get(store, id, key, &size);
+    if (i % 2)
+      res = (res == -ENOENT) ? 0 : -EINVAL;
+    else if (!res && (size != wrapped_key_size ||
+                      memcmp(key, keys + i * wrapped_key_size, size)))
+      res = -EINVAL;
+  }
+
+  ias_keystore_store_close(store);
+  return res;
+}
+
+static int ks_smoke_store_count_ids(void *priv, const char *id,
+                                    const uint8_t *wrapped_key, size_t wrapped_key_size)
+{
+  (void)wrapped_key;
+  (void)wrapped_key_size;
+
+  if (strlen(id) > IAS_KEYSTORE_STORE_ID_MAX)
+    return -EINVAL;
+
+  (*(int *)priv)++;
+  return 0;
+}
+
+/*
+ * Records with an ID longer than IAS_KEYSTORE_STORE_ID_MAX must not be
+ * loaded: in the log (pass 0) with a valid checksum, and in the index
+ * (pass 1), which has none. Offsets follow the file layout described in
+ * ias_keystore_store.c: a 64 byte header with bucket_count at 12 and
+ * index_offset and log_offset at 16 and 24, and 16 byte record headers
+ * with the checksum first and id_size at 4.
+ */
+static int ks_smoke_store_corrupt(void)
+{
+  char path[] = "/tmp/ks_smoke_store.XXXXXX";
+  struct ias_keystore_store *store;
+  uint8_t key[64], *file, *rec;
+  uint64_t index_offset, log_offset;
+  uint32_t bucket_count, checksum;
+  uint16_t id_size;
+  size_t size, offset, rec_size;
+  struct stat st;
+  char id[16];
+  int res, fd, pass, i, count;
+
+  memset(key, 0x5a, sizeof(key));
+
+  for (pass = 0, res = 0; pass < 2 && !res; pass++)
+  {
+    fd = mkstemp(path);
+    if (fd < 0)
+      return -errno;
+    close(fd);
+
+    store = NULL;
+    res = ias_keystore_store_open(path, 0, &store);
+    for (i = 0; i < KS_SMOKE_STORE_KEYS && !res; i++)
+    {
+      snprintf(id, sizeof(id), "key-%d", i);
+      res = ias_keystore_store_put(store, id, key, sizeof(key));
+    }
+    if (!res && pass)
+      res = ias_keystore_store_compact(store);
+    ias_keystore_store_close(store);
+
+    /* Stretch the ID of the first record of the log or of the index */
+    file = NULL;
+    fd = res ? -1 : open(path, O_RDWR | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) || st.st_size < 64)
+      res = res ? res : -EIO;
+    else
+      file = (uint8_t *)calloc(1, (size_t)st.st_size + 4096);
+    size = file ? (size_t)st.st_size : 0;
+    if (file && pread(fd, file, size, 0) == (ssize_t)size)
+    {
+      memcpy(&bucket_count, file + 12, sizeof(bucket_count));
+      memcpy(&index_offset, file + 16, sizeof(index_offset));
+      memcpy(&log_offset, file + 24, sizeof(log_offset));
+      offset = pass ? index_offset + bucket_count * 16 : log_offset;
+      rec = file + offset;
+      id_size = pass ? IAS_KEYSTORE_STORE_ID_MAX + 45 : 4000;
+      memcpy(rec + 4, &id_size, sizeof(id_size));
+      if (!pass)
+      {
+        rec_size = (16 + id_size + sizeof(key) + 7) & ~(size_t)7;
+        if (offset + rec_size > size)
+          size = offset + rec_size;
+        for (checksum = 2166136261u, i = 4; i < (int)rec_size; i++)
+          checksum = (checksum ^ rec[i]) * 16777619u;
+        memcpy(rec, &checksum, sizeof(checksum));
+      }
+      if (pwrite(fd, file, size, 0) != (ssize_t)size)
+        res = -EIO;
+    }
+    else if (!res)
+    {
+      res = -EIO;
+    }
+    free(file);
+    if (fd >= 0)
+      close(fd);
+
+    /* The log ends before the bad record, the index skips it */
+    count = 0;
+    store = NULL;
+    if (!res)
+      res = ias_keystore_store_open(path, IAS_KEYSTORE_STORE_RDONLY, &store);
+    if (!res)
+      res = ias_keystore_store_foreach(store, ks_smoke_store_count_ids, &count);
+    if (!res && count != (pass ? KS_SMOKE_STORE_KEYS - 1 : 0))
+      res = -EINVAL;
+    ias_keystore_store_close(store);
+
+    unlink(path);
+    strcpy(path, "/tmp/ks_smoke_store.XXXXXX");
+  }
+
+  return res;
+}
+
+int ks_smoke_store_keys(enum keystore_key_spec key_spec)
+{
+  uint8_t ticket[KEYSTORE_CLIENT_TICKET_SIZE];
+  struct ias_keystore_store *store = NULL;
+  char path[] = "/tmp/ks_smoke_store.XXXXXX";
+  size_t wrapped_key_size = 0;
+  char id[16];
+  int res, i, fd;
+
+  res = ias_keystore_wrapped_key_size(key_spec, &wrapped_key_size, NULL);
+  if (res)
+    return res;
+
+  uint8_t keys[KS_SMOKE_STORE_KEYS * wrapped_key_size];
+
+  res = ks_smoke_client(key_spec, ticket, NULL);
+  if (res)
+    return res;
+
+  for (i = 0; i < KS_SMOKE_STORE_KEYS && !res; i++)
+    res = ias_keystore_generate_key(ticket, key_spec, keys + i * wrapped_key_size);
+  ias_keystore_unregister_client(ticket);
+  if (res)
+    return res;
+
+  /* An empty file becomes an empty store */
+  fd = mkstemp(path);
+  if (fd < 0)
+    return -errno;
+  close(fd);
+
+  res = ias_keystore_store_open(path, 0, &store);
+  for (i = 0; i < KS_SMOKE_STORE_KEYS && !res; i++)
+  {
+    snprintf(id, sizeof(id), "key-%d", i);
+    res = ias_keystore_store_put(store, id, keys + i * wrapped_key_size, wrapped_key_size);
+  }
+  for (i = 1; i < KS_SMOKE_STORE_KEYS && !res; i += 2)
+  {
+    snprintf(id, sizeof(id), "key-%d", i);
+    res = ias_keystore_store_remove(store, id);
+  }
+  ias_keystore_store_close(store);
+  store = NULL;
+
+  /* From the log, then from the index */
+  if (!res)
+    res = ks_smoke_store_check(path, IAS_KEYSTORE_STORE_RDONLY, keys, wrapped_key_size);
+  if (!res)
+    res = ias_keystore_store_open(path, 0, &store);
+  if (!res)
+    res = ias_keystore_store_compact(store);
+  ias_keystore_store_close(store);
+  if (!res)
+    res = ks_smoke_store_check(path, IAS_KEYSTORE_STORE_RDONLY, keys, wrapped_key_size);
+
+  unlink(path);
+
+  if (!res)
+    res = ks_smoke_store_corrupt();
+  return res;
+}
+
+/* Feed @input to @stream in pieces of @step bytes and finish it */
+static int ks_smoke_stream_run(struct ias_keystore_stream *stream,
+                               const uint8_t *input, size_t input_size, size_t step,
+                               uint8_t *output, size_t *output_size)
+{
+  size_t written = 0;
+  size_t n, size;
+  int res = 0;
+
+  while (input_size && !res)
+  {
+    n = input_size < step ? input_size : step;
+    size = *output_size - written;
+    res = ias_keystore_stream_update(stream, input, n, output + written, &size);
+    written += size;
+    input += n;
+    input_size -= n;
+  }
+
+  size = *output_size - written;
+  if (!res)
+    res = ias_keystore_stream_final(stream, output + written, &size);
+  *output_size = written + size;
+  return res;
+}
+
+/* Decrypt byte ranges of a container file: within, across and past chunks,
+ * and from a container which lost its last chunk */
+static int ks_smoke_stream_range(const uint8_t *ticket, uint32_t slot,
+                                 const uint8_t *container, size_t container_size,
+                                 const uint8_t *plain, size_t plain_size)
+{
+  const size_t ranges[][2] = {
+    { 0, plain_size },
+    { KS_SMOKE_STREAM_CHUNK - 5, 10 },
+    { 1, 2 * KS_SMOKE_STREAM_CHUNK },
+    { plain_size > 3 ? plain_size - 3 : 0, 100 },
+    { plain_size + 1, 10 },
+  };
+  char path[] = "/tmp/ks_smoke_range.XXXXXX";
+  uint8_t clear[plain_size + 1];
+  size_t clear_size, expected;
+  size_t tag_size = 0, last_size;
+  size_t i;
+  int fd, res = 0;
+
+  fd = mkstemp(path);
+  if (fd < 0)
+    return -errno;
+  unlink(path);
+
+  if (write(fd, container, container_size) != (ssize_t)container_size)
+    res = -EIO;
+
+  for (i = 0; i < sizeof(ranges) / sizeof(ranges[0]) && !res; i++)
+  {
+    expected = 0;
+    if (ranges[i][0] < plain_size)
+      expected = plain_size - ranges[i][0] < ranges[i][1] ? plain_size - ranges[i][0] : ranges[i][1];
+
+    clear_size = sizeof(clear);
+    res = ias_keystore_stream_decrypt_range(ticket, slot, fd, ranges[i][0], ranges[i][1],
+                                            clear, &clear_size);
+    if (!res && (clear_size != expected || memcmp(clear, plain + ranges[i][0], expected)))
+      res = -EINVAL;
+  }
+
+  /* The chunk before the cut is decrypted as the last one and fails */
+  if (!res && plain_size > KS_SMOKE_STREAM_CHUNK)
+    res = ias_keystore_encrypt_size(ALGOSPEC_AES_GCM, 0, &tag_size);
+  if (!res && plain_size > KS_SMOKE_STREAM_CHUNK)
+  {
+    last_size = plain_size - (plain_size - 1) / KS_SMOKE_STREAM_CHUNK * KS_SMOKE_STREAM_CHUNK;
+    clear_size = sizeof(clear);
+    if (ftruncate(fd, (off_t)(container_size - last_size - tag_size)) ||
+        ias_keystore_stream_decrypt_range(ticket, slot, fd, 0, 10, clear, &clear_size) != -EBADMSG)
+      res = -EINVAL;
+  }
+
+  close(fd);
+  return res;
+}
+
+static int ks_smoke_stream_check(const uint8_t *ticket, uint32_t slot,
+                                 enum keystore_algo_spec algo_spec,
+                                 const uint8_t *plain, size_t plain_size, size_t step)
+{
+  struct ias_keystore_stream *stream = NULL;
+  size_t container_size, clear_size;
+  int res;
+
+  res = ias_keystore_stream_encrypt_init(ticket, slot, algo_spec, KS_SMOKE_STREAM_CHUNK, &stream);
+  if (res)
+    return res;
+
+  container_size = ias_keystore_stream_output_size(stream, plain_size);
+  uint8_t container[container_size];
+  res = ks_smoke_stream_run(stream, plain, plain_size, step, container, &container_size);
+  ias_keystore_stream_free(stream);
+  if (res)
+    return res;
+
+  /* Decrypt in pieces of another size */
+  res = ias_keystore_stream_decrypt_init(ticket, slot, &stream);
+  if (res)
+    return res;
+
+  clear_size = container_size;
+  uint8_t clear[clear_size];
+  res = ks_smoke_stream_run(stream, container, container_size, step * 3 + 1, clear, &clear_size);
+  ias_keystore_stream_free(stream);
+
+  if (!res && (clear_size != plain_size || memcmp(clear, plain, plain_size)))
+    res = -EINVAL;
+
+  /* The parallel calls read and write the same container */
+  clear_size = container_size;
+  if (!res)
+    res = ias_keystore_stream_decrypt_parallel(ticket, slot, 3, container, container_size,
+                                               clear, &clear_size);
+  if (!res && (clear_size != plain_size || memcmp(clear, plain, plain_size)))
+    res = -EINVAL;
+
+  /* The last byte of the stream IV (header offset 27) is part of every nonce */
+  container[27] ^= 1;
+  clear_size = container_size;
+  if (!res && ias_keystore_stream_decrypt_parallel(ticket, slot, 3, container, container_size,
+                                                   clear, &clear_size) != -EBADMSG)
+    res = -EINVAL;
+  container[27] ^= 1;
+
+  if (!res)
+    res = ias_keystore_stream_encrypt_parallel(ticket, slot, algo_spec, KS_SMOKE_STREAM_CHUNK, 3,
+                                               plain, plain_size, container, &container_size);
+  if (!res)
+    res = ias_keystore_stream_decrypt_init(ticket, slot, &stream);
+  if (!res)
+  {
+    clear_size = container_size;
+    res = ks_smoke_stream_run(stream, container, container_size, step, clear, &clear_size);
+    ias_keystore_stream_free(stream);
+  }
+  if (!res && (clear_size != plain_size || memcmp(clear, plain, plain_size)))
+    res = -EINVAL;
+  if (!res)
+    res = ks_smoke_stream_range(ticket, slot, container, container_size, plain, plain_size);
+  if (res)
+    return res;
+
+  /* Envelope mode, decrypted by all paths */
+  res = ias_keystore_stream_envelope_init(ticket, slot, KS_SMOKE_STREAM_CHUNK, &stream);
+  if (res)
+    return res;
+
+  container_size = ias_keystore_stream_output_size(stream, plain_size);
+  uint8_t envelope[container_size];
+  res = ks_smoke_stream_run(stream, plain, plain_size, step, envelope, &container_size);
+  ias_keystore_stream_free(stream);
+
+  if (!res)
+    res = ias_keystore_stream_decrypt_init(ticket, slot, &stream);
+  if (!res)
+  {
+    clear_size = sizeof(clear);
+    res = ks_smoke_stream_run(stream, envelope, container_size, step * 3 + 1, clear, &clear_size);
+    ias_keystore_stream_free(stream);
+  }
+  if (!res && (clear_size != plain_size || memcmp(clear, plain, plain_size)))
+    res = -EINVAL;
+
+  clear_size = sizeof(clear);
+  if (!res)
+    res = ias_keystore_stream_decrypt_parallel(ticket, slot, 3, envelope, container_size,
+                                               clear, &clear_size);
+  if (!res && (clear_size != plain_size || memcmp(clear, plain, plain_size)))
+    res = -EINVAL;
+  if (!res)
+    res = ks_smoke_stream_range(ticket, slot, envelope, container_size, plain, plain_size);
+
+  return res;
+}
+
+int ks_smoke_stream_encrypt(enum keystore_key_spec key_spec,
+                            enum keystore_algo_spec algo_spec)
+{
+  uint8_t ticket[KEYSTORE_CLIENT_TICKET_SIZE];
+  uint8_t plain[KS_SMOKE_STREAM_CHUNK * 7 / 2];
+  uint32_t slot = 0;
+  size_t i;
+  int res;
+
+  for (i = 0; i < sizeof(plain); i++)
+    plain[i] = (uint8_t)(i * 7);
+
+  res = ks_smoke_client(key_spec, ticket, &slot);
+  if (res)
+    return res;
+
+  /* Empty, a whole number of chunks and a short last chunk */
+  res = ks_smoke_stream_check(ticket, slot, algo_spec, plain, 0, 7);
+  if (!res)
+    res = ks_smoke_stream_check(ticket, slot, algo_spec, plain, 2 * KS_SMOKE_STREAM_CHUNK, 7);
+  if (!res)
+    res = ks_smoke_stream_check(ticket, slot, algo_spec, plain, sizeof(plain), 1024);
+
+  ias_keystore_unregister_client(ticket);
+  return res;
+}
+
+int ks_smoke_vector_encrypt(enum keystore_key_spec key_spec,
+                            enum keystore_algo_spec algo_spec)
+{
+  static const char header[] = "header:";
+  static const char payload[] = "This is a very secret message!";
+  uint8_t iv[DAL_KEYSTORE_GCM_IV_SIZE] = { 0x01, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+                                           0x08, 0x09, 0x0a, 0x0b };
+  uint8_t ticket[KEYSTORE_CLIENT_TICKET_SIZE];
+  uint8_t message[sizeof(header) + sizeof(payload)];
+  size_t cypher_size = 0;
+  uint32_t slot = 0;
+  int res;
+
+  memcpy(message, header, sizeof(header));
+  memcpy(message + sizeof(header), payload, sizeof(payload));
+
+  res = ias_keystore_encrypt_size(algo_spec, sizeof(message), &cypher_size);
+  if (res)
+    return res;
+
+  uint8_t cypher[cypher_size];
+  uint8_t cypherv[cypher_size];
+  uint8_t clear[sizeof(message)];
+
+  res = ks_smoke_client(key_spec, ticket, &slot);
+  if (res)
+    return res;
+
+  res = ias_keystore_encrypt(ticket, slot, algo_spec, iv, sizeof(iv),
+                             message, sizeof(message), cypher);
+
+  /* A header and a payload in, the tag in a segment of its own out */
+  struct iovec in[] = {
+    { (void *)header, sizeof(header) },
+    { NULL, 0 },
+    { (void *)payload, sizeof(payload) },
+  };
+  struct iovec out[] = {
+    { cypherv, 5 },
+    { cypherv + 5, sizeof(message) - 5 },
+    { cypherv + sizeof(message), cypher_size - sizeof(message) },
+  };
+
+  if (!res)
+    res = ias_keystore_encryptv(ticket, slot, algo_spec, iv, sizeof(iv), in, 3, out, 3);
+  if (!res && memcmp(cypher, cypherv, cypher_size))
+    res = -EINVAL;
+
+  /* Too little room for the tag */
+  if (!res && ias_keystore_encryptv(ticket, slot, algo_spec, iv, sizeof(iv),
+                                    in, 3, out, 2) != -EMSGSIZE)
+    res = -EINVAL;
+
+  /* Decrypt the scattered output into two segments, and one to one */
+  struct iovec back[] = {
+    { clear, sizeof(header) },
+    { clear + sizeof(header), sizeof(payload) },
+  };
+
+  memset(clear, 0, sizeof(clear));
+  if (!res)
+    res = ias_keystore_decryptv(ticket, slot, algo_spec, iv, sizeof(iv), out, 3, back, 2);
+  if (!res && memcmp(clear, message, sizeof(message)))
+    res = -EINVAL;
+
+  struct iovec whole = { cypher, cypher_size };
+  struct iovec whole_clear = { clear, sizeof(clear) };
+
+  memset(clear, 0, sizeof(clear));
+  if (!res)
+    res = ias_keystore_decryptv(ticket, slot, algo_spec, iv, sizeof(iv),
+                                &whole, 1, &whole_clear, 1);
+  if (!res && memcmp(clear, message, sizeof(message)))
+    res = -EINVAL;
+
+  ias_keystore_unregister_client(ticket);
+  return res;
+}
+
+struct ks_smoke_nonce_thread {
+  struct ias_keystore_nonce *nonce;
+  uint64_t counters[KS_SMOKE_NONCE_IVS];
+  int res;
+};
+
+/* Counter of an IV, the bytes behind the fixed field */
+static uint64_t ks_smoke_nonce_counter(const uint8_t *iv)
+{
+  uint64_t counter = 0;
+  int i;
+
+  for (i = IAS_KEYSTORE_NONCE_FIXED_SIZE; i < DAL_KEYSTORE_GCM_IV_SIZE; i++)
+    counter = (counter << 8) | iv[i];
+  return counter;
+}
+
+static void *ks_smoke_nonce_run(void *arg)
+{
+  struct ks_smoke_nonce_thread *t = (struct ks_smoke_nonce_thread *)arg;
+  uint8_t iv[DAL_KEYSTORE_GCM_IV_SIZE];
+  uint8_t fixed[IAS_KEYSTORE_NONCE_FIXED_SIZE];
+  int i;
+
+  for (i = 0; i < KS_SMOKE_NONCE_IVS && !t->res; i++)
+  {
+    t->res = ias_keystore_nonce_next(t->nonce, iv);
+    if (!i)
+      memcpy(fixed, iv, sizeof(fixed));
+    else if (memcmp(fixed, iv, sizeof(fixed)))
+      t->res = -EINVAL;
+    t->counters[i] = ks_smoke_nonce_counter(iv);
+  }
+  return NULL;
+}
+
+/* Random IVs differ, also between a fork() parent and child which share
+ * the buffered bytes of the parent */
+static int ks_smoke_random_iv(void)
+{
+  uint8_t iv[DAL_KEYSTORE_GCM_IV_SIZE];
+  uint8_t child_iv[DAL_KEYSTORE_GCM_IV_SIZE];
+  uint8_t prev[DAL_KEYSTORE_GCM_IV_SIZE];
+  size_t iv_size = sizeof(iv);
+  int res, status, fds[2];
+  pid_t pid;
+
+  res = ias_keystore_random_iv(ALGOSPEC_AES_CCM, prev, &iv_size);
+  if (!res && (iv_size != sizeof(iv) || prev[0] != 1))
+    res = -EINVAL;
+  iv_size = 1;
+  if (!res && ias_keystore_random_iv(ALGOSPEC_AES_GCM, iv, &iv_size) != -EMSGSIZE)
+    res = -EINVAL;
+  if (res)
+    return res;
+
+  if (pipe(fds))
+    return -errno;
+
+  pid = fork();
+  if (!pid)
+  {
+    iv_size = sizeof(iv);
+    if (ias_keystore_random_iv(ALGOSPEC_AES_GCM, iv, &iv_size) ||
+        write(fds[1], iv, sizeof(iv)) != (ssize_t)sizeof(iv))
+      _exit(1);
+    _exit(0);
+  }
+  close(fds[1]);
+
+  iv_size = sizeof(iv);
+  res = ias_keystore_random_iv(ALGOSPEC_AES_GCM, iv, &iv_size);
+  if (pid < 0)
+    res = -ECHILD;
+  else if (read(fds[0], child_iv, sizeof(child_iv)) != (ssize_t)sizeof(child_iv) ||
+           waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status))
+    res = -ECHILD;
+  close(fds[0]);
+
+  if (!res && (!memcmp(iv, child_iv, sizeof(iv)) || !memcmp(iv, prev, sizeof(iv))))
+    res = -EINVAL;
+  return res;
+}
+
+int ks_smoke_nonce_encrypt(enum keystore_key_spec key_spec,
+                           enum keystore_algo_spec algo_spec)
+{
+  static const char message[] = "This is a very secret message!";
+  struct ks_smoke_nonce_thread threads[KS_SMOKE_NONCE_THREADS];
+  uint8_t seen[KS_SMOKE_NONCE_THREADS * KS_SMOKE_NONCE_IVS];
+  pthread_t ids[KS_SMOKE_NONCE_THREADS];
+  struct ias_keystore_nonce *nonce = NULL;
+  struct ias_keystore_nonce *other = NULL;
+  uint8_t ticket[KEYSTORE_CLIENT_TICKET_SIZE];
+  uint8_t iv[DAL_KEYSTORE_GCM_IV_SIZE];
+  char path[] = "/tmp/ks_smoke_nonce.XXXXXX";
+  size_t cypher_size = 0;
+  uint64_t counter = 0;
+  uint32_t slot = 0;
+  int res, i, j, fd, status;
+  pid_t pid;
+
+  res = ks_smoke_random_iv();
+  if (!res)
+    res = ias_keystore_encrypt_size(algo_spec, sizeof(message), &cypher_size);
+  if (res)
+    return res;
+
+  uint8_t cypher[cypher_size];
+  char clear[sizeof(message)];
+
+  /* An empty file starts a new key */
+  fd = mkstemp(path);
+  if (fd < 0)
+    return -errno;
+  close(fd);
+
+  /* IVs taken on several threads are all different */
+  res = ias_keystore_nonce_open(path, KS_SMOKE_NONCE_RESERVE, &nonce);
+  memset(threads, 0, sizeof(threads));
+  for (i = 0; i < KS_SMOKE_NONCE_THREADS && !res; i++)
+  {
+    threads[i].nonce = nonce;
+    res = -pthread_create(&ids[i], NULL, ks_smoke_nonce_run, &threads[i]);
+  }
+  for (j = 0; j < i; j++)
+  {
+    pthread_join(ids[j], NULL);
+    if (!res)
+      res = threads[j].res;
+  }
+
+  memset(seen, 0, sizeof(seen));
+  for (i = 0; i < KS_SMOKE_NONCE_THREADS && !res; i++)
+  {
+    for (j = 0; j < KS_SMOKE_NONCE_IVS && !res; j++)
+    {
+      counter = threads[i].counters[j];
+      if (counter >= sizeof(seen) || seen[counter]++)
+        res = -EINVAL;
+    }
+  }
+
+  /* The state file is locked */
+  if (!res && ias_keystore_nonce_open(path, 0, &other) != -EBUSY)
+  {
+    ias_keystore_nonce_close(other);
+    res = -EINVAL;
+  }
+
+  /* Encrypt with the next IV */
+  if (!res)
+    res = ias_keystore_nonce_next(nonce, iv);
+  if (!res)
+    res = ks_smoke_client(key_spec, ticket, &slot);
+  if (!res)
+  {
+    res = ias_keystore_encrypt(ticket, slot, algo_spec, iv, sizeof(iv),
+                               (const uint8_t *)message, sizeof(message), cypher);
+    if (!res)
+      res = ias_keystore_decrypt(ticket, slot, algo_spec, iv, sizeof(iv),
+                                 cypher, cypher_size, (uint8_t *)clear);
+    if (!res && memcmp(clear, message, sizeof(message)))
+      res = -EINVAL;
+    ias_keystore_unregister_client(ticket);
+  }
+
+  /* A clean close keeps the exact counter */
+  counter = ias_keystore_nonce_counter(nonce);
+  if (ias_keystore_nonce_close(nonce) && !res)
+    res = -EIO;
+  nonce = NULL;
+  if (!res)
+    res = ias_keystore_nonce_open(path, 0, &nonce);
+  if (!res && ias_keystore_nonce_counter(nonce) != counter)
+    res = -EINVAL;
+  ias_keystore_nonce_close(nonce);
+
+  /* A process which exits without closing only loses reserved IVs */
+  if (!res)
+  {
+    pid = fork();
+    if (!pid)
+    {
+      if (ias_keystore_nonce_open(path, KS_SMOKE_NONCE_RESERVE, &nonce))
+        _exit(1);
+      for (i = 0; i <= KS_SMOKE_NONCE_RESERVE; i++)
+        if (ias_keystore_nonce_next(nonce, iv))
+          _exit(1);
+      _exit(0);
+    }
+    if (pid < 0 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status) ||
+        WEXITSTATUS(status))
+      res = -ECHILD;
+  }
+  nonce = NULL;
+  if (!res)
+    res = ias_keystore_nonce_open(path, 0, &nonce);
+  if (!res && ias_keystore_nonce_counter(nonce) <= counter + KS_SMOKE_NONCE_RESERVE)
+    res = -EINVAL;
+  ias_keystore_nonce_close(nonce);
+
+  unlink(path);
+  return res;
+}
@@ -0,0 +1,91 @@
+/*
+   Copyright 2018 Intel Corporation
+
+   This software is licensed to you in accordance
+   with the agreement between you and Intel Corporation.
+
+   Alternatively, you can use this file in compliance
+   with the Apache license, Version 2.
+
+
+   Apache License, Version 2.0
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+   http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include <errno.h>
+#include <string.h>
+
+#include "ias_keystore.h"
+#include "ks_smoke.h"
+#include "IasKeystoreCipher.hpp"
+
+using Ias::IasKeystoreLib::Cipher;
+
+typedef Cipher<ALGOSPEC_AES_GCM, KEYSPEC_LENGTH_256> KsSmokeCipher;
+
+static const char ks_smoke_cipher_message[] = "This is a very secret message!";
+
+int ks_smoke_cipher_encrypt(void)
+{
+  uint8_t ticket[KEYSTORE_CLIENT_TICKET_SIZE];
+  KsSmokeCipher::WrappedKey wrapped_key;
+  KsSmokeCipher::Iv iv = {{ 0x01, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+                            0x08, 0x09, 0x0a, 0x0b }};
+  std::array<uint8_t, sizeof(ks_smoke_cipher_message)> clear;
+  KsSmokeCipher::Encrypted<sizeof(ks_smoke_cipher_message)> cypher;
+  KsSmokeCipher::Decrypted<cypher.size()> decrypted;
+  KsSmokeCipher::Encrypted<sizeof(ks_smoke_cipher_message)> in_place;
+  KsSmokeCipher cipher;
+  int res;
+
+  static_assert(sizeof(cypher) == sizeof(ks_smoke_cipher_message) + 16, "GCM tag size");
+
+  res = ias_keystore_register_client(SEED_TYPE_DEVICE, ticket);
+  if (res)
+    return res;
+
+  memcpy(clear.data(), ks_smoke_cipher_message, clear.size());
+
+  res = KsSmokeCipher::generateKey(ticket, wrapped_key);
+  if (!res)
+    res = KsSmokeCipher::loadKey(ticket, wrapped_key, cipher);
+  if (!res)
+    res = cipher.encrypt(iv, clear, cypher);
+  if (!res)
+    res = cipher.decrypt(iv, cypher, decrypted);
+  if (!res && memcmp(clear.data(), decrypted.data(), clear.size()))
+    res = -EBADMSG;
+
+  /* In place gives the same ciphertext; a shifted output is rejected */
+  memcpy(in_place.data(), clear.data(), clear.size());
+  if (!res)
+    res = cipher.encryptInPlace(iv, in_place);
+  if (!res && in_place != cypher)
+    res = -EBADMSG;
+  if (!res)
+    res = cipher.decryptInPlace(iv, in_place);
+  if (!res && memcmp(clear.data(), in_place.data(), clear.size()))
+    res = -EBADMSG;
+  if (!res && ias_keystore_decrypt(ticket, cipher.slot(), ALGOSPEC_AES_GCM, iv.data(), iv.size(),
+                                   cypher.data(), cypher.size(), cypher.data() + 1) != -EINVAL)
+    res = -EINVAL;
+
+  if (!res)
+    res = cipher.unloadKey();
+
+  ias_keystore_unregister_client(ticket);
+  return res;
+}
+
+/* end of file */
@@ -0,0 +1,142 @@
+/*
+   Copyright 2018 Intel Corporation
+
+   This software is licensed to you in accordance
+   with the agreement between you and Intel Corporation.
+
+   Alternatively, you can use this file in compliance
+   with the Apache license, Version 2.
+
+
+   Apache License, Version 2.0
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+   http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include <errno.h>
+#include <string.h>
+#include <vector>
+
+#include "ias_keystore.h"
+#include "ks_smoke.h"
+#include "IasKeystoreAsync.hpp"
+
+using Ias::IasKeystoreLib::AsyncKeystore;
+using Ias::IasKeystoreLib::Executor;
+using Ias::IasKeystoreLib::Task;
+
+#define KS_SMOKE_CORO_TASKS 64
+
+static const char ks_smoke_coro_message[] = "This is a very secret message!";
+
+/*
+ * Encrypt and decrypt one message, suspending on every keystore call.
+ */
+static Task<int> ks_smoke_coro_roundtrip(AsyncKeystore &ks, const uint8_t *ticket, uint32_t slot,
+                                         keystore_algo_spec algo_spec, size_t encrypted_size)
+{
+  uint8_t iv[DAL_KEYSTORE_GCM_IV_SIZE] = { 0x01, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+                                       0x08, 0x09, 0x0a, 0x0b };
+  std::vector<uint8_t> cypher(encrypted_size);
+  char clear[sizeof(ks_smoke_coro_message)];
+  int res;
+
+  res = co_await ks.encrypt(ticket, slot, algo_spec, iv, sizeof(iv),
+                            (const uint8_t *)ks_smoke_coro_message, sizeof(ks_smoke_coro_message),
+                            cypher.data());
+  if (res)
+    co_return res;
+
+  res = co_await ks.decrypt(ticket, slot, algo_spec, iv, sizeof(iv),
+                            cypher.data(), cypher.size(), (uint8_t *)clear);
+  if (res)
+    co_return res;
+
+  co_return strncmp(ks_smoke_coro_message, clear, sizeof(clear));
+}
+
+static Task<void> ks_smoke_coro_task(AsyncKeystore &ks, const uint8_t *ticket, uint32_t slot,
+                                     keystore_algo_spec algo_spec, size_t encrypted_size, int *res)
+{
+  *res = co_await ks_smoke_coro_roundtrip(ks, ticket, slot, algo_spec, encrypted_size);
+}
+
+static Task<void> ks_smoke_coro_main(AsyncKeystore &ks, Executor &executor, const uint8_t *ticket,
+                                     keystore_key_spec key_spec, keystore_algo_spec algo_spec,
+                                     int *results, int *res)
+{
+  size_t wrapped_key_size = 0;
+  size_t encrypted_size = 0;
+  int slot;
+
+  *res = ias_keystore_wrapped_key_size(key_spec, &wrapped_key_size, NULL);
+  if (!*res)
+    *res = ias_keystore_encrypt_size(algo_spec, sizeof(ks_smoke_coro_message), &encrypted_size);
+  if (*res)
+    co_return;
+
+  std::vector<uint8_t> wrapped_key(wrapped_key_size);
+  *res = co_await ks.generateKey(ticket, key_spec, wrapped_key.data());
+  if (*res)
+    co_return;
+
+  slot = co_await ks.loadKey(ticket, wrapped_key.data(), wrapped_key.size());
+  if (slot < 0)
+  {
+    *res = slot;
+    co_return;
+  }
+
+  /* More operations in flight than the pool has room for */
+  for (int i = 0; i < KS_SMOKE_CORO_TASKS; i++)
+    executor.spawn(ks_smoke_coro_task(ks, ticket, (uint32_t)slot, algo_spec, encrypted_size, &results[i]));
+}
+
+int ks_smoke_coro_encrypt(enum keystore_key_spec key_spec,
+                          enum keystore_algo_spec algo_spec)
+{
+  uint8_t ticket[KEYSTORE_CLIENT_TICKET_SIZE];
+  struct ias_keystore_async_config config = { 2, 16 };
+  int results[KS_SMOKE_CORO_TASKS];
+  int res;
+  int main_res = -EINPROGRESS;
+
+  res = ias_keystore_register_client(SEED_TYPE_DEVICE, ticket);
+  if (res)
+    return res;
+
+  for (int i = 0; i < KS_SMOKE_CORO_TASKS; i++)
+    results[i] = -EINPROGRESS;
+
+  {
+    AsyncKeystore ks;
+    Executor executor(ks);
+
+    res = ks.open(&config);
+    if (!res)
+    {
+      executor.spawn(ks_smoke_coro_main(ks, executor, ticket, key_spec, algo_spec, results, &main_res));
+      res = executor.run();
+    }
+  }
+
+  if (!res)
+    res = main_res;
+
+  for (int i = 0; i < KS_SMOKE_CORO_TASKS && !res; i++)
+    res = results[i];
+
+  /* Unregistering also frees the slot */
+  ias_keystore_unregister_client(ticket);
+  return res;
+}
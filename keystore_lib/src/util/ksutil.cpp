@@ -30,10 +30,20 @@
 #include <unistd.h>
 #include <errno.h>
 #include <cstdlib>
+#include <libgen.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 
 #include "ias_keystore.h"
+#include "ias_keystore_migrate.h"
+#include "ias_keystore_nonce.h"
+#include "ias_keystore_stats.h"
+#include "ias_keystore_store.h"
+#include "ias_keystore_stream.h"
 #include "ks_smoke.h"
+#include "ks_bench.h"
 
 #define MAX_DATA_LEN 65536
 #define MAX_ENC_DEC_DATA_LEN (16384 * 1024)
@@ -57,6 +67,17 @@ static int cmdInitVec(char *argv[]);
 static int cmdEncrypt(char *argv[]);
 static int cmdDecrypt(char *argv[]);
 static int cmdTest(char *argv[]);
+static int cmdBench(char *argv[]);
+static int cmdStats(char *argv[]);
+static int cmdMigrate(char *argv[]);
+static int cmdImport(char *argv[]);
+static int cmdExport(char *argv[]);
+static int cmdStreamEncrypt(char *argv[]);
+static int cmdStreamDecrypt(char *argv[]);
+static int cmdEnvelopeEncrypt(char *argv[]);
+static int cmdParallelEncrypt(char *argv[]);
+static int cmdParallelDecrypt(char *argv[]);
+static int cmdDecryptRange(char *argv[]);
 
 static struct command_t commands[] = {
   {"reg",     cmdReg,        2, "register client",      "[device | user] <*ticket-file>"},
@@ -65,10 +86,28 @@ static struct command_t commands[] = {
   {"wrap",    cmdWrap,       4, "wrap application key", "<ticket-file> aes128|aes256|ecc <app-key-file> <*key-file>"},
   {"load",    cmdLoad,       4, "load key to slot",     "<ticket-file> aes128|aes256|ecc <key-file> <*slot-file>"},
   {"unload",  cmdUnload,     2, "unload key from slot", "<ticket-file> <slot-file>"},
-  {"initvec", cmdInitVec,    2, "create init vector",   "aes_gcm|aes_ccm <*initvec-file>"},
+  {"initvec", cmdInitVec,   -2, "create init vector",   "aes_gcm|aes_ccm <*initvec-file> [nonce-state-file]"},
   {"encrypt", cmdEncrypt,    6, "encrypt data",         "<ticket-file> <slot-file> aes_gcm|aes_ccm|ecc <initvec-file> <in-file> <*out-file>"},
-  {"decrypt", cmdDecrypt,    5, "decrypt data",         "<ticket-file> <slot-file> aes_gcm|aes_ccm|ecc <in-file> <*out-file>"},
+  {"decrypt", cmdDecrypt,   -5, "decrypt data, or a byte range of stream-encrypt output",
+   "<ticket-file> <slot-file> aes_gcm|aes_ccm|ecc <in-file> <*out-file>\n"
+   "    ksutil decrypt --range <offset> <length> <ticket-file> <slot-file> <in-file> <*out-file>"},
   {"test", cmdTest, 0, "Run tests", ""},
+  {"bench", cmdBench, 2, "Run benchmark", "handle|batch|keypool|parallel|envelope|iv <iterations>"},
+  {"migrate", cmdMigrate, 4, "re-wrap keys for the current SEED SVN",
+   "[device | user] aes128|aes256|ecc <workers> <key-list-file>"},
+  {"import", cmdImport, -2, "add key files to a key store", "<*store-file> <key-file> [key-file...]"},
+  {"export", cmdExport, 2, "write the keys of a key store to files", "<store-file> <dir>"},
+  {"stream-encrypt", cmdStreamEncrypt, 5, "encrypt data of any size in chunks",
+   "<ticket-file> <slot-file> <chunk-size> <in-file> <*out-file>"},
+  {"stream-decrypt", cmdStreamDecrypt, 4, "decrypt stream-encrypt output",
+   "<ticket-file> <slot-file> <in-file> <*out-file>"},
+  {"envelope-encrypt", cmdEnvelopeEncrypt, 5, "encrypt data in chunks with a wrapped data key",
+   "<ticket-file> <slot-file> <chunk-size> <in-file> <*out-file>"},
+  {"parallel-encrypt", cmdParallelEncrypt, 6, "encrypt a file in chunks on several threads",
+   "<ticket-file> <slot-file> <chunk-size> <threads> <in-file> <*out-file>"},
+  {"parallel-decrypt", cmdParallelDecrypt, 5, "decrypt stream-encrypt output on several threads",
+   "<ticket-file> <slot-file> <threads> <in-file> <*out-file>"},
+  {"stats", cmdStats, -1, "run command and print keystore call statistics", "<command> [args...]"},
   {NULL, NULL, 0, NULL, NULL}
 };
 
@@ -152,11 +191,50 @@ int usage()
     printf("  %s:\n    ksutil %s %s\n", commands[i].cmdDescr, commands[i].cmd, commands[i].argDescr);
   }
   printf("\n  \"*\" marks output file\n");
-  printf("  \"-\" used as filename means stdin or stdout\n\n");
+  printf("  \"-\" used as filename means stdin or stdout\n");
+  printf("  KSUTIL_DEVICE overrides the keystore device path\n\n");
 
   return 2;
 }
 
+/*
+ * Look up a command by name
+ * @param name command name
+ *
+ * @returns command or NULL if unknown
+ */
+static const struct command_t *findCommand(const char *name)
+{
+  for (int i = 0; commands[i].cmd != NULL; i++)
+  {
+    if (!strcmp(name, commands[i].cmd))
+    {
+      return &commands[i];
+    }
+  }
+  return NULL;
+}
+
+/*
+ * Check the argument count and run a command
+ * @param command command to run
+ * @param argc number of command arguments
+ * @param argv command arguments
+ *
+ * @returns process exit code
+ */
+static int runCommand(const struct command_t *command, int argc, char *argv[])
+{
+  /* A negative count means at least that many arguments */
+  if ((command->numArgs < 0) ? (argc < -command->numArgs) : (argc != command->numArgs))
+  {
+    printf("  %s:\n    ksutil %s %s\n", command->cmdDescr, command->cmd, command->argDescr);
+    return 2;
+  }
+  int res = (*command->fn)(argv);
+  return (res < 0) ? 1 : res;
+}
+
 /*
  * Main function for unit test keep ksutil for local build main.
  * @param argc common argc
@@ -164,20 +242,19 @@ int usage()
  */
 int main(int argc, char *argv[])
 {
+  /* Allow running against a stand-in device */
+  const char *device = getenv("KSUTIL_DEVICE");
+  if (device && *device)
+  {
+    ias_keystore_set_device(device);
+  }
+
   if (argc > 1)
   {
-    for (int i = 0; commands[i].cmd != NULL; i++)
+    const struct command_t *command = findCommand(argv[1]);
+    if (command)
     {
-      if (!strcmp(argv[1], commands[i].cmd))
-      {
-        if (argc != commands[i].numArgs + 2)
-        {
-          printf("  %s:\n    ksutil %s %s\n", commands[i].cmdDescr, commands[i].cmd, commands[i].argDescr);
-          return 2;
-        }
-        int res = (*commands[i].fn)(argv + 2);
-        return (res < 0) ? 1 : res;
-      }
+      return runCommand(command, argc - 2, argv + 2);
     }
   }
   return usage();
@@ -249,6 +326,98 @@ off_t getFileSize(const char *filename) {
     return -1;
 }
 
+/*
+ * Map a whole input file read-only
+ * @param fileName file name
+ * @param size set to the file size
+ * @returns mapping, or NULL if the file cannot be mapped: stdin, an empty
+ * file or one which is not a regular file
+ */
+static uint8_t *mapInputFile(const char *fileName, size_t *size)
+{
+  struct stat st;
+  void *map;
+  int fd;
+
+  if (!strcmp(fileName, "-"))
+    return NULL;
+
+  fd = open(fileName, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return NULL;
+
+  map = MAP_FAILED;
+  if (!fstat(fd, &st) && S_ISREG(st.st_mode) && st.st_size > 0)
+  {
+    map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    *size = (size_t)st.st_size;
+  }
+  close(fd);
+
+  return (map == MAP_FAILED) ? NULL : (uint8_t *)map;
+}
+
+/*
+ * Create a temporary file of a known size next to an output file and map
+ * it for writing; finishOutputFile() moves it over the output file
+ * @param fileName output file name
+ * @param size file size, not 0
+ * @param tmpName set to the temporary file name
+ * @param tmpNameSize size of @tmpName
+ * @returns mapping, or NULL if the file cannot be mapped (stdout); a file
+ * created but not mapped is removed
+ */
+static uint8_t *mapOutputFile(const char *fileName, size_t size, char *tmpName, size_t tmpNameSize)
+{
+  void *map = MAP_FAILED;
+  mode_t mask;
+  int fd;
+
+  if (!strcmp(fileName, "-") ||
+      (size_t)snprintf(tmpName, tmpNameSize, "%s.XXXXXX", fileName) >= tmpNameSize)
+    return NULL;
+
+  fd = mkstemp(tmpName);
+  if (fd < 0)
+    return NULL;
+
+  /* Same permissions as a file created by fopen() */
+  mask = umask(0);
+  umask(mask);
+  if (!fchmod(fd, 0666 & ~mask) && !ftruncate(fd, (off_t)size))
+    map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+
+  if (map == MAP_FAILED)
+  {
+    unlink(tmpName);
+    return NULL;
+  }
+
+  return (uint8_t *)map;
+}
+
+/*
+ * Replace the output file with the temporary file of mapOutputFile() if
+ * the operation succeeded, otherwise remove the temporary file and leave
+ * the output file as it was
+ * @param res result of the operation
+ * @return @res, or error code if the file cannot be renamed
+ */
+static int finishOutputFile(const char *tmpName, const char *fileName, int res)
+{
+  if (!res && rename(tmpName, fileName))
+  {
+    res = -errno;
+    fprintf(stderr, "error: cannot write file: %s\n", fileName);
+  }
+
+  if (res)
+    unlink(tmpName);
+
+  return res;
+}
+
 /*
  * Read data from file
  * @param fileName file name
@@ -489,6 +658,21 @@ int cmdTest(char *argv[])
   int res = 0;
   int any_fail = 0;
  
+  res = ks_smoke_aes_vectors(KEYSPEC_LENGTH_128, ALGOSPEC_AES_GCM);
+  fprintf(stdout, "Seed: %s\tKey Length: %u\tAlgo: %s\tStatus: %s\n",
+          "Host KAT", 128, "GCM", resToString(res));
+  any_fail |= res;
+
+  res = ks_smoke_aes_vectors(KEYSPEC_LENGTH_256, ALGOSPEC_AES_GCM);
+  fprintf(stdout, "Seed: %s\tKey Length: %u\tAlgo: %s\tStatus: %s\n",
+          "Host KAT", 256, "GCM", resToString(res));
+  any_fail |= res;
+
+  res = ks_smoke_aes_vectors(KEYSPEC_LENGTH_128, ALGOSPEC_AES_CCM);
+  fprintf(stdout, "Seed: %s\tKey Length: %u\tAlgo: %s\tStatus: %s\n",
+          "Host KAT", 128, "CCM", resToString(res));
+  any_fail |= res;
+
   res = ks_smoke_encrypt(SEED_TYPE_USER, KEYSPEC_LENGTH_128, ALGOSPEC_AES_GCM);
   fprintf(stdout, "Seed: %s\tKey Length: %u\tAlgo: %s\tStatus: %s\n",
           "User", 128, "GCM", resToString(res));
@@ -503,7 +687,131 @@ int cmdTest(char *argv[])
   fprintf(stdout, "Seed: %s\tKey Length: %u\tAlgo: %s\tStatus: %s\n",
           "Device", 256, "GCM", resToString(res));
   any_fail |= res;
+
+  res = ks_smoke_ctx_encrypt(KEYSPEC_LENGTH_256, ALGOSPEC_AES_GCM);
+  fprintf(stdout, "Seed: %s\tKey Length: %u\tAlgo: %s\tStatus: %s\n",
+          "Context", 256, "GCM", resToString(res));
+  any_fail |= res;
+
+  res = ks_smoke_async_encrypt(KEYSPEC_LENGTH_256, ALGOSPEC_AES_GCM);
+  fprintf(stdout, "Seed: %s\tKey Length: %u\tAlgo: %s\tStatus: %s\n",
+          "Async", 256, "GCM", resToString(res));
+  any_fail |= res;
+
+  res = ks_smoke_broker_encrypt(KEYSPEC_LENGTH_256, ALGOSPEC_AES_GCM);
+  fprintf(stdout, "Seed: %s\tKey Length: %u\tAlgo: %s\tStatus: %s\n",
+          "Broker", 256, "GCM", resToString(res));
+  any_fail |= res;
+
+  res = ks_smoke_slots_encrypt(KEYSPEC_LENGTH_256, ALGOSPEC_AES_GCM);
+  fprintf(stdout, "Seed: %s\tKey Length: %u\tAlgo: %s\tStatus: %s\n",
+          "Slots", 256, "GCM", resToString(res));
+  any_fail |= res;
+
+  res = ks_smoke_shared_encrypt(KEYSPEC_LENGTH_256, ALGOSPEC_AES_GCM);
+  fprintf(stdout, "Seed: %s\tKey Length: %u\tAlgo: %s\tStatus: %s\n",
+          "Shared", 256, "GCM", resToString(res));
+  any_fail |= res;
+
+  res = ks_smoke_keypool_encrypt(KEYSPEC_LENGTH_256, ALGOSPEC_AES_GCM);
+  fprintf(stdout, "Seed: %s\tKey Length: %u\tAlgo: %s\tStatus: %s\n",
+          "Key Pool", 256, "GCM", resToString(res));
+  any_fail |= res;
+
+  res = ks_smoke_migrate_keys(KEYSPEC_LENGTH_256);
+  fprintf(stdout, "Seed: %s\tKey Length: %u\tAlgo: %s\tStatus: %s\n",
+          "Migrate", 256, "-", resToString(res));
+  any_fail |= res;
+
+  res = ks_smoke_store_keys(KEYSPEC_LENGTH_256);
+  fprintf(stdout, "Seed: %s\tKey Length: %u\tAlgo: %s\tStatus: %s\n",
+          "Store", 256, "-", resToString(res));
+  any_fail |= res;
+
+  res = ks_smoke_stream_encrypt(KEYSPEC_LENGTH_256, ALGOSPEC_AES_GCM);
+  fprintf(stdout, "Seed: %s\tKey Length: %u\tAlgo: %s\tStatus: %s\n",
+          "Stream", 256, "GCM", resToString(res));
+  any_fail |= res;
+
+  res = ks_smoke_vector_encrypt(KEYSPEC_LENGTH_256, ALGOSPEC_AES_GCM);
+  fprintf(stdout, "Seed: %s\tKey Length: %u\tAlgo: %s\tStatus: %s\n",
+          "Vector", 256, "GCM", resToString(res));
+  any_fail |= res;
+
+  res = ks_smoke_nonce_encrypt(KEYSPEC_LENGTH_256, ALGOSPEC_AES_GCM);
+  fprintf(stdout, "Seed: %s\tKey Length: %u\tAlgo: %s\tStatus: %s\n",
+          "Nonce", 256, "GCM", resToString(res));
+  any_fail |= res;
+
+  res = ks_smoke_cipher_encrypt();
+  fprintf(stdout, "Seed: %s\tKey Length: %u\tAlgo: %s\tStatus: %s\n",
+          "Cipher", 256, "GCM", resToString(res));
+  any_fail |= res;
+
+#ifdef KS_SMOKE_CORO
+  res = ks_smoke_coro_encrypt(KEYSPEC_LENGTH_256, ALGOSPEC_AES_GCM);
+  fprintf(stdout, "Seed: %s\tKey Length: %u\tAlgo: %s\tStatus: %s\n",
+          "Coroutine", 256, "GCM", resToString(res));
+  any_fail |= res;
+#endif
  
+  return any_fail;
+}
+
+/*
+ * Run a benchmark against the keystore device
+ * @param argv arguments entry use ksutil to get more info
+ * @return 0 on success or error code
+ */
+int cmdBench(char *argv[])
+{
+  int arg, res;
+  char *end = NULL;
+  unsigned long iterations;
+
+  /* arg 2: iterations */
+  arg = 1;
+  iterations = strtoul(argv[arg], &end, 0);
+  if (end == argv[arg] || *end != '\0' || iterations == 0 || iterations > UINT32_MAX)
+  {
+    fprintf(stderr, "error: invalid iteration count \"%s\"\n", argv[arg]);
+    return -1;
+  }
+
+  /* arg 1: benchmark name */
+  arg = 0;
+  if (!strcmp(argv[arg], "handle"))
+  {
+    res = ks_bench_handle((unsigned int)iterations);
+  }
+  else if (!strcmp(argv[arg], "batch"))
+  {
+    res = ks_bench_batch((unsigned int)iterations);
+  }
+  else if (!strcmp(argv[arg], "keypool"))
+  {
+    res = ks_bench_keypool((unsigned int)iterations);
+  }
+  else if (!strcmp(argv[arg], "parallel"))
+  {
+    res = ks_bench_parallel((unsigned int)iterations);
+  }
+  else if (!strcmp(argv[arg], "envelope"))
+  {
+    res = ks_bench_envelope((unsigned int)iterations);
+  }
+  else if (!strcmp(argv[arg], "iv"))
+  {
+    res = ks_bench_iv((unsigned int)iterations);
+  }
+  else
+  {
+    fprintf(stderr, "error: unknown benchmark \"%s\"\n", argv[arg]);
+    return -1;
+  }
+
+  errApi(res, argv[arg]);
+
   return res;
 }
 
@@ -887,19 +1195,39 @@ int cmdInitVec(char *argv[])
     return errAlgo(argv[arg]);
   }
 
-  /* get random data */
-  memset(initVec, 0, sizeof(initVec));
-  res = readDataFromFile("/dev/urandom", initVec, sizeof(initVec));
-  if (errRead(res, sizeof(initVec), "/dev/urandom"))
+  /* arg 3: optional nonce state file: an RFC 5288 counter IV instead of a random one */
+  if (argv[arg + 2] != NULL)
   {
-    return res;
-  }
+    struct ias_keystore_nonce *nonce = NULL;
 
-  /* keystore data is small so let's minimize max message length & maximize nonce size (rfc3610) */
-  if (isAES_CCM(argv[arg]))
+    if (!isAES_GCM(argv[arg]))
+      return errAlgo(argv[arg]);
+
+    res = ias_keystore_nonce_open(argv[arg + 2], 0, &nonce);
+    if (errApi(res, "nonceOpen"))
+      return res;
+    res = ias_keystore_nonce_next(nonce, initVec);
+    if (!res)
+      res = ias_keystore_nonce_close(nonce);
+    else
+      ias_keystore_nonce_close(nonce);
+    if (errApi(res, "nonceNext"))
+      return res;
+  }
+  else
   {
-    initVec[0] = 1;
+    /* get random data; for CCM the library minimizes the max message
+     * length & maximizes the nonce size (rfc3610) as keystore data is small */
+    size_t randomSize = sizeof(initVec);
+
+    res = ias_keystore_random_iv(isAES_CCM(argv[arg]) ? ALGOSPEC_AES_CCM : ALGOSPEC_AES_GCM,
+                                 initVec, &randomSize);
+    if (errApi(res, "randomIv"))
+    {
+      return res;
+    }
   }
+
   ksutilHexdump("initVec", initVec, initVecSize);
 
   /* arg 2: *init_vec */
@@ -912,6 +1240,74 @@ int cmdInitVec(char *argv[])
   return res;
 }
 
+/*
+ * Encrypt from a mapping of the input file straight into a mapping of the
+ * output file, with no copy of the data on the heap
+ * @param mapped set if both files could be mapped; if not, nothing was done
+ * @return 0 on success or error code
+ */
+static int encryptMapped(const uint8_t *clientTicket, uint32_t slotId,
+                         enum keystore_algo_spec algoSpec,
+                         const uint8_t *initVec, size_t initVecSize,
+                         const char *inName, const char *outName, bool *mapped)
+{
+  uint8_t *plainData, *encryptedDataBlob;
+  char tmpName[PATH_MAX];
+  size_t plainDataSize = 0;
+  size_t encryptedDataSize, encryptedDataBlobSize;
+  int res;
+
+  *mapped = false;
+  plainData = mapInputFile(inName, &plainDataSize);
+  if (!plainData)
+    return 0;
+
+  if (plainDataSize >= MAX_ENC_DEC_DATA_LEN)
+  {
+    warnDataSize(inName);
+  }
+
+  res = ias_keystore_encrypt_size(algoSpec, plainDataSize, &encryptedDataSize);
+  if (errApi(res, "encrypt_size"))
+  {
+    munmap(plainData, plainDataSize);
+    *mapped = true;
+    return res;
+  }
+
+  encryptedDataBlobSize = encryptedDataSize + DAL_KEYSTORE_GCM_IV_SIZE + 1;
+  encryptedDataBlob = mapOutputFile(outName, encryptedDataBlobSize, tmpName, sizeof(tmpName));
+  if (!encryptedDataBlob)
+  {
+    munmap(plainData, plainDataSize);
+    return 0;
+  }
+  *mapped = true;
+
+  /* The file is created zero-filled, so an ECIES blob gets a zero IV field */
+  encryptedDataBlob[0] = (uint8_t)algoSpec;
+  memcpy(&encryptedDataBlob[1], initVec, DAL_KEYSTORE_GCM_IV_SIZE);
+
+  ksutilHexdump("plainData", plainData, dumpLimit(plainDataSize));
+
+  res = ias_keystore_encrypt(clientTicket, slotId, algoSpec,
+                             (initVecSize > 0) ? initVec : 0, initVecSize,
+                             plainData, plainDataSize,
+                             &encryptedDataBlob[DAL_KEYSTORE_GCM_IV_SIZE + 1]);
+
+  ks_fprintf(stderr, "encrypt result: %d\n", res);
+
+  munmap(plainData, plainDataSize);
+  if (!res)
+    ksutilHexdump("encryptedDataBlob", encryptedDataBlob, dumpLimit(encryptedDataBlobSize));
+  munmap(encryptedDataBlob, encryptedDataBlobSize);
+
+  errApi(res, "encrypt");
+
+  /* A failed call leaves an existing output file untouched */
+  return finishOutputFile(tmpName, outName, res);
+}
+
 /*
  * Encrypt with keystore
  * @param argv arguments entry use ksutil to get more info
@@ -927,10 +1323,14 @@ int cmdEncrypt(char *argv[])
   size_t initVecSize;
   uint8_t *plainData;
   size_t plainDataSize;
+  uint8_t *encryptedDataBlob;
+  uint8_t *encryptedData;
   size_t encryptedDataSize;
   size_t encryptedDataBlobSize;
   off_t fileSize;
   uint32_t copy_len = 0;
+  bool inPlace;
+  bool mapped;
 
   memset(initVec, 0, sizeof(initVec));
 
@@ -955,12 +1355,12 @@ int cmdEncrypt(char *argv[])
   if (isAES_CCM(argv[arg]))
   {
     algoSpec = ALGOSPEC_AES_CCM;
-    initVecSize = 16;
+    initVecSize = DAL_KEYSTORE_GCM_IV_SIZE;
   }
   else if (isAES_GCM(argv[arg]))
   {
     algoSpec = ALGOSPEC_AES_GCM;
-    initVecSize = 16;
+    initVecSize = DAL_KEYSTORE_GCM_IV_SIZE;
   }
   else if (isEcc(argv[arg]))
   {
@@ -982,16 +1382,46 @@ int cmdEncrypt(char *argv[])
       return res;
   }
 
-  /* arg 5: input data */
+  /* arg 5, 6: input data, *output data: mapped when both are files */
   arg++;
+  ksutilHexdump("clientTicket", clientTicket, sizeof(clientTicket));
+  ksutilHexdump("slotId", (uint8_t*) &slotId, sizeof(slotId));
+  ksutilHexdump("algoSpec", (uint8_t*) &algoSpec, sizeof(algoSpec));
+  ksutilHexdump("initVec", initVec, initVecSize);
+
+  res = encryptMapped(clientTicket, slotId, algoSpec, initVec, initVecSize,
+                      argv[arg], argv[arg + 1], &mapped);
+  if (mapped)
+    return res;
+
   fileSize = getFileSize(argv[arg]);
-  plainData = NULL;
+  encryptedDataBlob = NULL;
+  encryptedData = NULL;
   if (fileSize > 0)
+  {
+    res = ias_keystore_encrypt_size(algoSpec, (size_t)fileSize, &encryptedDataSize);
+    if (errApi(res, "encrypt_size"))
+      return res;
+
+    encryptedDataBlobSize = encryptedDataSize + DAL_KEYSTORE_GCM_IV_SIZE + 1;
+    encryptedDataBlob = (uint8_t*) malloc(encryptedDataBlobSize);
+    if (!encryptedDataBlob)
+      return -ENOMEM;
+    encryptedData = &encryptedDataBlob[DAL_KEYSTORE_GCM_IV_SIZE + 1];
+  }
+
+  /* AES reads the plaintext straight into the blob and encrypts it in
+   * place; the ECIES output does not start with the ciphertext */
+  inPlace = algoSpec != ALGOSPEC_ECIES;
+  plainData = encryptedData;
+  if (!inPlace && fileSize > 0)
     plainData = (uint8_t*) malloc(fileSize);
   res = readAllDataFromFile(argv[arg], plainData, fileSize);
   if (errReadAll(res, argv[arg]))
   {
-    free(plainData);
+    if (!inPlace)
+      free(plainData);
+    free(encryptedDataBlob);
     return res;
   }
 
@@ -1001,20 +1431,16 @@ int cmdEncrypt(char *argv[])
     warnDataSize(argv[arg]);
   }
 
+  /* The file may have been shorter than its size said */
   res = ias_keystore_encrypt_size(algoSpec, plainDataSize, &encryptedDataSize);
   if (errApi(res, "encrypt_size"))
   {
-    free(plainData);
+    if (!inPlace)
+      free(plainData);
+    free(encryptedDataBlob);
     return res;
   }
-
   encryptedDataBlobSize = encryptedDataSize + DAL_KEYSTORE_GCM_IV_SIZE + 1;
-  uint8_t *encryptedDataBlob = (uint8_t*) malloc(encryptedDataBlobSize);
-  if (!encryptedDataBlob)
-  {
-    free(plainData);
-    return -ENOMEM;
-  }
 
   encryptedDataBlob[0] = (uint8_t)algoSpec;
   copy_len = sizeof(initVec); 
@@ -1023,18 +1449,13 @@ int cmdEncrypt(char *argv[])
  
 if (0 != keystore_memcpy(&encryptedDataBlob[1], initVec, copy_len))
   {
-    free(plainData);
+    if (!inPlace)
+      free(plainData);
     free(encryptedDataBlob);
     return -EFAULT;
   }
 
-  uint8_t *encryptedData = &encryptedDataBlob[DAL_KEYSTORE_GCM_IV_SIZE + 1];
-
   /* api: encrypt */
-  ksutilHexdump("clientTicket", clientTicket, sizeof(clientTicket));
-  ksutilHexdump("slotId", (uint8_t*) &slotId, sizeof(slotId));
-  ksutilHexdump("algoSpec", (uint8_t*) &algoSpec, sizeof(algoSpec));
-  ksutilHexdump("initVec", initVec, initVecSize);
   ksutilHexdump("plainData", plainData, dumpLimit(plainDataSize));
 
   res = ias_keystore_encrypt(clientTicket, slotId, algoSpec,
@@ -1043,7 +1464,8 @@ if (0 != keystore_memcpy(&encryptedDataBlob[1], initVec, copy_len))
 
   ks_fprintf(stderr, "encrypt result: %d\n", res);
 
-  free(plainData);
+  if (!inPlace)
+    free(plainData);
 
   if (errApi(res, "encrypt"))
   {
@@ -1065,6 +1487,77 @@ if (0 != keystore_memcpy(&encryptedDataBlob[1], initVec, copy_len))
   return res;
 }
 
+/*
+ * Decrypt from a mapping of the input file straight into a mapping of the
+ * output file, with no copy of the data on the heap
+ * @param mapped set if both files could be mapped; if not, nothing was done
+ * @return 0 on success or error code
+ */
+static int decryptMapped(const uint8_t *clientTicket, uint32_t slotId,
+                         enum keystore_algo_spec algoSpec, size_t initVecSize,
+                         const char *inName, const char *outName, bool *mapped)
+{
+  uint8_t *encryptedDataBlob, *plainData;
+  char tmpName[PATH_MAX];
+  size_t encryptedDataBlobSize = 0;
+  size_t encryptedDataSize, plainDataSize;
+  int res;
+
+  *mapped = false;
+  encryptedDataBlob = mapInputFile(inName, &encryptedDataBlobSize);
+  if (!encryptedDataBlob)
+    return 0;
+
+  /* Leave blobs too short to hold a header to the buffered path */
+  if (encryptedDataBlobSize <= DAL_KEYSTORE_GCM_IV_SIZE + 1)
+  {
+    munmap(encryptedDataBlob, encryptedDataBlobSize);
+    return 0;
+  }
+
+  if (encryptedDataBlobSize >= MAX_ENC_DEC_DATA_LEN)
+  {
+    warnDataSize(inName);
+  }
+
+  encryptedDataSize = encryptedDataBlobSize - DAL_KEYSTORE_GCM_IV_SIZE - 1;
+  res = ias_keystore_decrypt_size(algoSpec, encryptedDataSize, &plainDataSize);
+  if (errApi(res, "decrypt_size"))
+  {
+    munmap(encryptedDataBlob, encryptedDataBlobSize);
+    *mapped = true;
+    return res;
+  }
+
+  /* An empty file cannot be mapped */
+  plainData = plainDataSize ? mapOutputFile(outName, plainDataSize, tmpName, sizeof(tmpName)) : NULL;
+  if (!plainData)
+  {
+    munmap(encryptedDataBlob, encryptedDataBlobSize);
+    return 0;
+  }
+  *mapped = true;
+
+  ksutilHexdump("encryptedDataBlob", encryptedDataBlob, dumpLimit(encryptedDataBlobSize));
+
+  res = ias_keystore_decrypt(clientTicket, slotId, algoSpec,
+                             (initVecSize > 0) ? &encryptedDataBlob[1] : NULL, initVecSize,
+                             &encryptedDataBlob[DAL_KEYSTORE_GCM_IV_SIZE + 1],
+                             encryptedDataSize, plainData);
+
+  ks_fprintf(stderr, "decrypt result: %d\n", res);
+
+  munmap(encryptedDataBlob, encryptedDataBlobSize);
+  if (!res)
+    ksutilHexdump("plainData", plainData, dumpLimit(plainDataSize));
+  munmap(plainData, plainDataSize);
+
+  errApi(res, "decrypt");
+
+  /* A failed call leaves an existing output file untouched */
+  return finishOutputFile(tmpName, outName, res);
+}
+
 /*
  * Decrypt key with keystore
  * @param argv arguments entry use ksutil to get more info
@@ -1082,8 +1575,20 @@ int cmdDecrypt(char *argv[])
   uint8_t *encryptedData;
   size_t encryptedDataSize;
   size_t encryptedDataBlobSize;
+  uint8_t *plainData;
   size_t plainDataSize;
   off_t fileSize;
+  bool inPlace;
+  bool mapped;
+
+  /* --range <offset> <length>: decrypt part of a stream container */
+  if (!strcmp(argv[0], "--range"))
+    return cmdDecryptRange(argv + 1);
+  if (argv[5] != NULL)
+  {
+    fprintf(stderr, "error: too many arguments\n");
+    return -1;
+  }
 
   /* arg 1: client_ticket */
   arg = 0;
@@ -1106,12 +1611,12 @@ int cmdDecrypt(char *argv[])
   if (isAES_CCM(argv[arg]))
   {
     algoSpec = ALGOSPEC_AES_CCM;
-    initVecSize = 16;
+    initVecSize = DAL_KEYSTORE_GCM_IV_SIZE;
   }
   else if (isAES_GCM(argv[arg]))
   {
     algoSpec = ALGOSPEC_AES_GCM;
-    initVecSize = 16;
+    initVecSize = DAL_KEYSTORE_GCM_IV_SIZE;
   }
   else if (isEcc(argv[arg]))
   {
@@ -1123,8 +1628,17 @@ int cmdDecrypt(char *argv[])
     return errAlgo(argv[arg]);
   }
 
-  /* arg 4: input data */
+  /* arg 4, 5: input data, *output data: mapped when both are files */
   arg++;
+  ksutilHexdump("clientTicket", clientTicket, sizeof(clientTicket));
+  ksutilHexdump("slotId", (uint8_t*) &slotId, sizeof(slotId));
+  ksutilHexdump("algoSpec", (uint8_t*) &algoSpec, sizeof(algoSpec));
+
+  res = decryptMapped(clientTicket, slotId, algoSpec, initVecSize,
+                      argv[arg], argv[arg + 1], &mapped);
+  if (mapped)
+    return res;
+
   fileSize = getFileSize(argv[arg]);
   encryptedDataBlob = NULL;
   if (fileSize > 0)
@@ -1154,7 +1668,9 @@ int cmdDecrypt(char *argv[])
     return res;
   }
 
-  uint8_t *plainData = (uint8_t*) malloc(plainDataSize);
+  /* AES decrypts in place, over the ciphertext in the blob */
+  inPlace = algoSpec != ALGOSPEC_ECIES;
+  plainData = inPlace ? encryptedData : (uint8_t*) malloc(plainDataSize);
   if (!plainData)
   {
     free(encryptedDataBlob);
@@ -1162,9 +1678,6 @@ int cmdDecrypt(char *argv[])
   }
 
   /* api: decrypt */
-  ksutilHexdump("clientTicket", clientTicket, sizeof(clientTicket));
-  ksutilHexdump("slotId", (uint8_t*) &slotId, sizeof(slotId));
-  ksutilHexdump("algoSpec", (uint8_t*) &algoSpec, sizeof(algoSpec));
   ksutilHexdump("initVec", initVec, initVecSize);
   ksutilHexdump("encryptedDataBlob", encryptedDataBlob, dumpLimit(encryptedDataBlobSize));
   ksutilHexdump("encryptedData", encryptedData, dumpLimit(encryptedDataSize));
@@ -1175,11 +1688,11 @@ int cmdDecrypt(char *argv[])
 
   ks_fprintf(stderr, "decrypt result: %d\n", res);
 
-  free(encryptedDataBlob);
-
   if (errApi(res, "decrypt"))
   {
-    free(plainData);
+    if (!inPlace)
+      free(plainData);
+    free(encryptedDataBlob);
     return res;
   }
 
@@ -1189,11 +1702,829 @@ int cmdDecrypt(char *argv[])
   arg++;
 
   res = writeDataToFile(argv[arg], plainData, plainDataSize);
-  free(plainData);
+  if (!inPlace)
+    free(plainData);
+  free(encryptedDataBlob);
 
   errWrite(res, argv[arg]);
 
   return res;
 }
 
+
+/*
+ * Run another command and print the keystore call statistics
+ * @param argv command name followed by its arguments
+ *
+ * @returns exit code of the command
+ */
+int cmdStats(char *argv[])
+{
+  int argc = 0;
+
+  while (argv[argc] != NULL)
+  {
+    argc++;
+  }
+
+  const struct command_t *command = findCommand(argv[0]);
+  if (!command || command->fn == cmdStats)
+  {
+    fprintf(stderr, "error: invalid command \"%s\"\n", argv[0]);
+    return -1;
+  }
+
+  ias_keystore_stats_reset();
+  int res = runCommand(command, argc - 1, argv + 1);
+
+  /* stdout may carry command output */
+  ias_keystore_stats_dump(stderr);
+
+  return res;
+}
+
+/*
+ * Replace a file, so that readers see either the old or the new content
+ * @param fileName file name
+ * @param data input buffer
+ * @param size input size
+ *
+ * @returns 0 on success or negative error code
+ */
+static int replaceFileData(const char *fileName, const void *data, size_t size)
+{
+  struct stat st;
+  mode_t mode = 0600;
+  size_t len = strlen(fileName);
+  char tmpName[len + 16];
+  ssize_t written;
+  int fd, res = 0;
+
+  if (!stat(fileName, &st))
+    mode = st.st_mode & 07777;
+
+  snprintf(tmpName, sizeof(tmpName), "%s.migrate", fileName);
+  fd = open(tmpName, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, mode);
+  if (fd < 0)
+    return -errno;
+
+  written = write(fd, data, size);
+  if (written < 0)
+    res = -errno;
+  else if ((size_t)written != size)
+    res = -EIO;
+
+  if (!res && fsync(fd))
+    res = -errno;
+  close(fd);
+
+  if (!res && rename(tmpName, fileName))
+    res = -errno;
+  if (res)
+    unlink(tmpName);
+
+  return res;
+}
+
+struct migrate_corpus {
+  FILE *list;
+  size_t wrappedKeySize;
+};
+
+/*
+ * Read the next key file named in the key list
+ */
+static int migrateNext(void *priv, struct ias_keystore_migrate_key *key)
+{
+  struct migrate_corpus *corpus = (struct migrate_corpus *)priv;
+  char *line = NULL;
+  size_t lineSize = 0;
+  ssize_t len;
+
+  do
+  {
+    len = getline(&line, &lineSize, corpus->list);
+    if (len < 0)
+    {
+      free(line);
+      return ferror(corpus->list) ? -EIO : 0;
+    }
+
+    while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+      line[--len] = '\0';
+  } while (len == 0);
+
+  key->priv = line;
+  key->wrapped_key = (uint8_t *)malloc(corpus->wrappedKeySize);
+  key->wrapped_key_size = corpus->wrappedKeySize;
+
+  /* Unreadable keys are reported by migrateComplete() */
+  if (key->wrapped_key &&
+      readDataFromFile(line, key->wrapped_key, corpus->wrappedKeySize) != 0)
+  {
+    free(key->wrapped_key);
+    key->wrapped_key = NULL;
+  }
+
+  return 1;
+}
+
+/*
+ * Store a re-wrapped key and release it
+ */
+static int migrateComplete(void *priv, struct ias_keystore_migrate_key *key)
+{
+  const char *fileName = (const char *)key->priv;
+  int res = key->result;
+
+  (void)priv;
+
+  if (res == IAS_KEYSTORE_MIGRATE_REWRAPPED)
+    res = replaceFileData(fileName, key->wrapped_key, key->wrapped_key_size);
+
+  if (res < 0)
+    fprintf(stderr, "%s: %s\n", fileName, strerror(-res));
+
+  free(key->wrapped_key);
+  free(key->priv);
+  return res < 0 ? res : 0;
+}
+
+static void migrateProgress(void *priv, const struct ias_keystore_migrate_stats *stats)
+{
+  double secs = (double)stats->elapsed_ns / 1e9;
+
+  (void)priv;
+
+  fprintf(stderr, "migrate: %" PRIu64 " keys, %" PRIu64 " re-wrapped, %" PRIu64 " current, %"
+          PRIu64 " failed, %.0f keys/s\n", stats->keys, stats->rewrapped, stats->current,
+          stats->failed, secs > 0.0 ? stats->keys / secs : 0.0);
+}
+
+/*
+ * Re-wrap a corpus of key files for the current SEED SVN
+ * @param argv arguments entry use ksutil to get more info
+ * @return 0 on success or error code
+ */
+int cmdMigrate(char *argv[])
+{
+  int arg, res;
+  enum keystore_seed_type seedType;
+  enum keystore_key_spec keySpec;
+  uint8_t clientTicket[KEYSTORE_CLIENT_TICKET_SIZE];
+  struct migrate_corpus corpus;
+  struct ias_keystore_migrate_config config;
+  struct ias_keystore_migrate_stats stats;
+  char *end = NULL;
+  unsigned long workers;
+
+  /* arg 1: seed type, the keys belong to a ksutil client */
+  arg = 0;
+  if (strcasecmp(argv[arg], "device") == 0)
+  {
+    seedType = SEED_TYPE_DEVICE;
+  }
+  else if (strcasecmp(argv[arg], "user") == 0)
+  {
+    seedType = SEED_TYPE_USER;
+  }
+  else
+  {
+    fprintf(stderr, "Unknown SEED type (expect device or user, got: %s)\n", argv[arg]);
+    return -1;
+  }
+
+  /* arg 2: key_spec */
+  arg++;
+  if (isAES128(argv[arg]))
+  {
+    keySpec = KEYSPEC_LENGTH_128;
+  }
+  else if (isAES256(argv[arg]))
+  {
+    keySpec = KEYSPEC_LENGTH_256;
+  }
+  else if (isEcc(argv[arg]))
+  {
+    keySpec = KEYSPEC_LENGTH_ECC_PAIR;
+  }
+  else
+  {
+    return errKeySpec(argv[arg]);
+  }
+
+  /* arg 3: workers */
+  arg++;
+  workers = strtoul(argv[arg], &end, 0);
+  if (end == argv[arg] || *end != '\0' || workers == 0 || workers > 64)
+  {
+    fprintf(stderr, "error: invalid worker count \"%s\"\n", argv[arg]);
+    return -1;
+  }
+
+  memset(&corpus, 0, sizeof(corpus));
+  res = ias_keystore_wrapped_key_size(keySpec, &corpus.wrappedKeySize, NULL);
+  if (errApi(res, "wrappedKeySize"))
+    return res;
+
+  /* arg 4: key list, one key file per line */
+  arg++;
+  corpus.list = strcmp(argv[arg], "-") ? fopen(argv[arg], "r") : stdin;
+  if (!corpus.list)
+  {
+    fprintf(stderr, "%s: cannot open key list: %s\n", __FUNCTION__, argv[arg]);
+    return -1;
+  }
+
+  res = ias_keystore_register_client(seedType, clientTicket);
+  if (errApi(res, "registerClient"))
+  {
+    if (corpus.list != stdin)
+      fclose(corpus.list);
+    return res;
+  }
+
+  memset(&config, 0, sizeof(config));
+  config.workers = (unsigned int)workers;
+  config.next = migrateNext;
+  config.complete = migrateComplete;
+  config.progress = migrateProgress;
+  config.priv = &corpus;
+
+  res = ias_keystore_migrate(clientTicket, &config, &stats);
+  errApi(res, "migrate");
+  if (!res && stats.failed)
+    res = -EIO;
+
+  ias_keystore_unregister_client(clientTicket);
+  if (corpus.list != stdin)
+    fclose(corpus.list);
+
+  return res;
+}
+
+/*
+ * Add key files to a key store, under their base names
+ * @param argv arguments entry use ksutil to get more info
+ * @return 0 on success or error code
+ */
+int cmdImport(char *argv[])
+{
+  struct ias_keystore_store *store = NULL;
+  uint8_t data[MAX_DATA_LEN];
+  int arg, len, res;
+
+  /* arg 1: store file */
+  arg = 0;
+  res = ias_keystore_store_open(argv[arg], IAS_KEYSTORE_STORE_CREATE, &store);
+  if (errApi(res, "storeOpen"))
+    return res;
+
+  /* arg 2..: key files */
+  for (arg++; argv[arg] != NULL && !res; arg++)
+  {
+    len = readAllDataFromFile(argv[arg], data, sizeof(data));
+    if (len <= 0)
+    {
+      fprintf(stderr, "%s: cannot read key file: %s\n", __FUNCTION__, argv[arg]);
+      res = -EIO;
+      break;
+    }
+
+    char *name = strdup(argv[arg]);
+    if (!name)
+    {
+      res = -ENOMEM;
+      break;
+    }
+    res = ias_keystore_store_put(store, basename(name), data, (size_t)len);
+    free(name);
+    errApi(res, "storePut");
+  }
+
+  if (!res)
+  {
+    res = ias_keystore_store_compact(store);
+    errApi(res, "storeCompact");
+  }
+
+  ias_keystore_store_close(store);
+  return res;
+}
+
+/*
+ * Write a key from a store to <dir>/<id>
+ */
+static int exportKey(void *priv, const char *id, const uint8_t *wrappedKey, size_t wrappedKeySize)
+{
+  const char *dir = (const char *)priv;
+  char fileName[PATH_MAX];
+
+  if (strchr(id, '/') || !strcmp(id, ".") || !strcmp(id, ".."))
+  {
+    fprintf(stderr, "%s: key ID is not a file name: %s\n", __FUNCTION__, id);
+    return -EINVAL;
+  }
+
+  if (snprintf(fileName, sizeof(fileName), "%s/%s", dir, id) >= (int)sizeof(fileName))
+    return -ENAMETOOLONG;
+
+  return writeDataToFile(fileName, wrappedKey, wrappedKeySize) ? -EIO : 0;
+}
+
+/*
+ * Write the keys of a key store to files named by their IDs
+ * @param argv arguments entry use ksutil to get more info
+ * @return 0 on success or error code
+ */
+int cmdExport(char *argv[])
+{
+  struct ias_keystore_store *store = NULL;
+  int res;
+
+  /* arg 1: store file */
+  res = ias_keystore_store_open(argv[0], IAS_KEYSTORE_STORE_RDONLY, &store);
+  if (errApi(res, "storeOpen"))
+    return res;
+
+  /* arg 2: output directory */
+  res = ias_keystore_store_foreach(store, exportKey, argv[1]);
+  errApi(res, "storeForeach");
+
+  ias_keystore_store_close(store);
+  return res;
+}
+
+#define STREAM_BUFFER_SIZE (1024 * 1024)
+
+/*
+ * Grow the output buffer of a stream for the next input
+ * @param stream the stream
+ * @param inputSize size of the next input
+ * @param output output buffer
+ * @param outputMax size of the output buffer
+ * @return 0 on success or error code
+ */
+static int streamOutputBuffer(const struct ias_keystore_stream *stream, size_t inputSize,
+                              uint8_t **output, size_t *outputMax)
+{
+  size_t size = ias_keystore_stream_output_size(stream, inputSize);
+  uint8_t *buf;
+
+  if (size <= *outputMax)
+    return 0;
+
+  buf = (uint8_t *)realloc(*output, size);
+  if (!buf)
+    return -ENOMEM;
+
+  *output = buf;
+  *outputMax = size;
+  return 0;
+}
+
+/*
+ * Run a file through an encrypt or decrypt stream
+ * @param stream the stream
+ * @param inName input file name, "-" for stdin
+ * @param outName output file name, "-" for stdout
+ * @return 0 on success or error code
+ */
+static int streamFile(struct ias_keystore_stream *stream, const char *inName, const char *outName)
+{
+  FILE *in = stdin;
+  FILE *out = stdout;
+  uint8_t *input, *output;
+  size_t inputSize, outputSize;
+  size_t outputMax = 0;
+  int res = 0;
+
+  if (strcmp(inName, "-") && !(in = fopen(inName, "r")))
+  {
+    fprintf(stderr, "%s: cannot open input file: %s\n", __FUNCTION__, inName);
+    return -1;
+  }
+
+  if (strcmp(outName, "-") && !(out = fopen(outName, "w")))
+  {
+    fprintf(stderr, "%s: cannot open output file: %s\n", __FUNCTION__, outName);
+    if (in != stdin)
+      fclose(in);
+    return -1;
+  }
+
+  input = (uint8_t *)malloc(STREAM_BUFFER_SIZE);
+  output = NULL;
+  if (!input)
+    res = -ENOMEM;
+
+  while (!res)
+  {
+    inputSize = fread(input, 1, STREAM_BUFFER_SIZE, in);
+    if (inputSize == 0)
+    {
+      if (ferror(in))
+        res = -EIO;
+      break;
+    }
+
+    res = streamOutputBuffer(stream, inputSize, &output, &outputMax);
+    if (res)
+      break;
+
+    outputSize = outputMax;
+    res = ias_keystore_stream_update(stream, input, inputSize, output, &outputSize);
+    if (!errApi(res, "streamUpdate") && fwrite(output, 1, outputSize, out) != outputSize)
+      res = -EIO;
+  }
+
+  if (!res)
+    res = streamOutputBuffer(stream, 0, &output, &outputMax);
+
+  if (!res)
+  {
+    outputSize = outputMax;
+    res = ias_keystore_stream_final(stream, output, &outputSize);
+    if (!errApi(res, "streamFinal") && fwrite(output, 1, outputSize, out) != outputSize)
+      res = -EIO;
+  }
+
+  if (out != stdout && fclose(out) && !res)
+    res = -EIO;
+  if (in != stdin)
+    fclose(in);
+  free(input);
+  free(output);
+
+  /* Do not leave partial or unauthenticated output behind */
+  if (res && out != stdout)
+    unlink(outName);
+
+  return res;
+}
+
+/*
+ * Read the client ticket and slot of a stream command
+ */
+static int readTicketAndSlot(char *argv[], uint8_t *clientTicket, uint32_t *slotId)
+{
+  int res;
+
+  res = readDataFromFile(argv[0], clientTicket, KEYSTORE_CLIENT_TICKET_SIZE);
+  if (errRead(res, KEYSTORE_CLIENT_TICKET_SIZE, argv[0]))
+    return res;
+
+  *slotId = -1;
+  res = readNumFromFile(argv[1], slotId);
+  if (errReadNum(res, argv[1]))
+    return res;
+
+  return 0;
+}
+
+/*
+ * Encrypt a file of any size in chunks
+ * @param argv arguments entry use ksutil to get more info
+ * @param envelope encrypt the chunks on the host with a wrapped data key
+ * @return 0 on success or error code
+ */
+static int streamEncrypt(char *argv[], bool envelope)
+{
+  uint8_t clientTicket[KEYSTORE_CLIENT_TICKET_SIZE];
+  struct ias_keystore_stream *stream = NULL;
+  uint32_t slotId;
+  unsigned long chunkSize;
+  char *end = NULL;
+  int res;
+
+  /* arg 1, 2: client_ticket, slot_id */
+  res = readTicketAndSlot(argv, clientTicket, &slotId);
+  if (res)
+    return res;
+
+  /* arg 3: chunk size, 0 for the default */
+  chunkSize = strtoul(argv[2], &end, 0);
+  if (end == argv[2] || *end != '\0' || chunkSize > IAS_KEYSTORE_STREAM_CHUNK_SIZE_MAX)
+  {
+    fprintf(stderr, "error: invalid chunk size \"%s\"\n", argv[2]);
+    return -1;
+  }
+
+  if (envelope)
+    res = ias_keystore_stream_envelope_init(clientTicket, slotId, chunkSize, &stream);
+  else
+    res = ias_keystore_stream_encrypt_init(clientTicket, slotId, ALGOSPEC_AES_GCM,
+                                           chunkSize, &stream);
+  if (errApi(res, envelope ? "streamEnvelopeInit" : "streamEncryptInit"))
+    return res;
+
+  /* arg 4, 5: input data, *output data */
+  res = streamFile(stream, argv[3], argv[4]);
+  ias_keystore_stream_free(stream);
+  return res;
+}
+
+/*
+ * Encrypt a file of any size in chunks with the slot key
+ * @param argv arguments entry use ksutil to get more info
+ * @return 0 on success or error code
+ */
+int cmdStreamEncrypt(char *argv[])
+{
+  return streamEncrypt(argv, false);
+}
+
+/*
+ * Encrypt a file of any size in chunks with a data key wrapped by the slot key
+ * @param argv arguments entry use ksutil to get more info
+ * @return 0 on success or error code
+ */
+int cmdEnvelopeEncrypt(char *argv[])
+{
+  return streamEncrypt(argv, true);
+}
+
+/*
+ * Decrypt the output of stream-encrypt
+ * @param argv arguments entry use ksutil to get more info
+ * @return 0 on success or error code
+ */
+int cmdStreamDecrypt(char *argv[])
+{
+  uint8_t clientTicket[KEYSTORE_CLIENT_TICKET_SIZE];
+  struct ias_keystore_stream *stream = NULL;
+  uint32_t slotId;
+  int res;
+
+  /* arg 1, 2: client_ticket, slot_id */
+  res = readTicketAndSlot(argv, clientTicket, &slotId);
+  if (res)
+    return res;
+
+  res = ias_keystore_stream_decrypt_init(clientTicket, slotId, &stream);
+  if (errApi(res, "streamDecryptInit"))
+    return res;
+
+  /* arg 3, 4: input data, *output data */
+  res = streamFile(stream, argv[2], argv[3]);
+  ias_keystore_stream_free(stream);
+  return res;
+}
+
+/*
+ * Read a whole input file for a parallel command
+ * @param fileName file name
+ * @param data set to the file data, to be freed by the caller
+ * @param size set to the file size
+ * @return 0 on success or error code
+ */
+static int readWholeFile(const char *fileName, uint8_t **data, size_t *size)
+{
+  off_t fileSize = getFileSize(fileName);
+  int res;
+
+  if (fileSize < 0)
+  {
+    fprintf(stderr, "%s: cannot open input file: %s\n", __FUNCTION__, fileName);
+    return -1;
+  }
+
+  /* Keep a valid pointer for empty files */
+  *data = (uint8_t *)malloc(fileSize ? fileSize : 1);
+  if (!*data)
+    return -ENOMEM;
+
+  *size = (size_t)fileSize;
+  if (!fileSize)
+    return 0;
+
+  res = readDataFromFile(fileName, *data, *size);
+  if (errRead(res, *size, fileName))
+  {
+    free(*data);
+    return -1;
+  }
+
+  return 0;
+}
+
+/*
+ * Parse a thread count argument
+ */
+static int parseThreads(const char *arg, unsigned int *threads)
+{
+  char *end = NULL;
+  unsigned long value = strtoul(arg, &end, 0);
+
+  if (end == arg || *end != '\0' || value == 0 || value > 64)
+  {
+    fprintf(stderr, "error: invalid thread count \"%s\"\n", arg);
+    return -1;
+  }
+
+  *threads = (unsigned int)value;
+  return 0;
+}
+
+/*
+ * Encrypt a file into a stream container on several threads
+ * @param argv arguments entry use ksutil to get more info
+ * @return 0 on success or error code
+ */
+int cmdParallelEncrypt(char *argv[])
+{
+  uint8_t clientTicket[KEYSTORE_CLIENT_TICKET_SIZE];
+  uint32_t slotId;
+  unsigned long chunkSize;
+  unsigned int threads;
+  uint8_t *plainData, *container;
+  size_t plainDataSize, containerSize = 0;
+  char *end = NULL;
+  int res;
+
+  /* arg 1, 2: client_ticket, slot_id */
+  res = readTicketAndSlot(argv, clientTicket, &slotId);
+  if (res)
+    return res;
+
+  /* arg 3: chunk size, 0 for the default */
+  chunkSize = strtoul(argv[2], &end, 0);
+  if (end == argv[2] || *end != '\0' || chunkSize > IAS_KEYSTORE_STREAM_CHUNK_SIZE_MAX)
+  {
+    fprintf(stderr, "error: invalid chunk size \"%s\"\n", argv[2]);
+    return -1;
+  }
+
+  /* arg 4: threads */
+  res = parseThreads(argv[3], &threads);
+  if (res)
+    return res;
+
+  /* arg 5: input data */
+  res = readWholeFile(argv[4], &plainData, &plainDataSize);
+  if (res)
+    return res;
+
+  res = ias_keystore_stream_encrypted_size(ALGOSPEC_AES_GCM, chunkSize, plainDataSize,
+                                           &containerSize);
+  if (errApi(res, "streamEncryptedSize"))
+  {
+    free(plainData);
+    return res;
+  }
+
+  container = (uint8_t *)malloc(containerSize);
+  if (!container)
+  {
+    free(plainData);
+    return -ENOMEM;
+  }
+
+  res = ias_keystore_stream_encrypt_parallel(clientTicket, slotId, ALGOSPEC_AES_GCM, chunkSize,
+                                             threads, plainData, plainDataSize,
+                                             container, &containerSize);
+  free(plainData);
+
+  /* arg 6: *output data */
+  if (!errApi(res, "streamEncryptParallel"))
+  {
+    res = writeDataToFile(argv[5], container, containerSize);
+    errWrite(res, argv[5]);
+  }
+
+  free(container);
+  return res;
+}
+
+/*
+ * Decrypt a stream container on several threads
+ * @param argv arguments entry use ksutil to get more info
+ * @return 0 on success or error code
+ */
+int cmdParallelDecrypt(char *argv[])
+{
+  uint8_t clientTicket[KEYSTORE_CLIENT_TICKET_SIZE];
+  uint32_t slotId;
+  unsigned int threads;
+  uint8_t *container, *plainData;
+  size_t containerSize, plainDataSize;
+  int res;
+
+  /* arg 1, 2: client_ticket, slot_id */
+  res = readTicketAndSlot(argv, clientTicket, &slotId);
+  if (res)
+    return res;
+
+  /* arg 3: threads */
+  res = parseThreads(argv[2], &threads);
+  if (res)
+    return res;
+
+  /* arg 4: input data; the plaintext is never larger */
+  res = readWholeFile(argv[3], &container, &containerSize);
+  if (res)
+    return res;
+
+  plainDataSize = containerSize;
+  plainData = (uint8_t *)malloc(plainDataSize ? plainDataSize : 1);
+  if (!plainData)
+  {
+    free(container);
+    return -ENOMEM;
+  }
+
+  res = ias_keystore_stream_decrypt_parallel(clientTicket, slotId, threads,
+                                             container, containerSize,
+                                             plainData, &plainDataSize);
+  free(container);
+
+  /* arg 5: *output data */
+  if (!errApi(res, "streamDecryptParallel"))
+  {
+    res = writeDataToFile(argv[4], plainData, plainDataSize);
+    errWrite(res, argv[4]);
+  }
+
+  free(plainData);
+  return res;
+}
+
+/*
+ * Decrypt a byte range of stream-encrypt output, reading only the chunks
+ * that cover it
+ * @param argv arguments after --range, use ksutil to get more info
+ * @return 0 on success or error code
+ */
+int cmdDecryptRange(char *argv[])
+{
+  uint8_t clientTicket[KEYSTORE_CLIENT_TICKET_SIZE];
+  uint32_t slotId;
+  unsigned long long offset, length;
+  uint8_t *plainData;
+  size_t plainDataSize;
+  off_t fileSize;
+  char *end = NULL;
+  int i, fd, res;
+
+  for (i = 0; i < 6 && argv[i] != NULL; i++)
+    ;
+  if (i != 6 || argv[6] != NULL)
+  {
+    fprintf(stderr, "error: --range takes <offset> <length> <ticket-file> <slot-file> <in-file> <*out-file>\n");
+    return -1;
+  }
+
+  /* arg 1, 2: offset, length */
+  offset = strtoull(argv[0], &end, 0);
+  if (end == argv[0] || *end != '\0')
+  {
+    fprintf(stderr, "error: invalid offset \"%s\"\n", argv[0]);
+    return -1;
+  }
+  length = strtoull(argv[1], &end, 0);
+  if (end == argv[1] || *end != '\0')
+  {
+    fprintf(stderr, "error: invalid length \"%s\"\n", argv[1]);
+    return -1;
+  }
+
+  /* arg 3, 4: client_ticket, slot_id */
+  res = readTicketAndSlot(argv + 2, clientTicket, &slotId);
+  if (res)
+    return res;
+
+  /* arg 5: input data */
+  fd = open(argv[4], O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+  {
+    fprintf(stderr, "%s: cannot open input file: %s\n", __FUNCTION__, argv[4]);
+    return -1;
+  }
+
+  /* The plaintext of the range is never larger than the file */
+  fileSize = getFileSize(argv[4]);
+  plainDataSize = (fileSize >= 0 && (unsigned long long)fileSize < length) ? (size_t)fileSize
+                                                                           : (size_t)length;
+  plainData = (uint8_t *)malloc(plainDataSize ? plainDataSize : 1);
+  if (!plainData)
+  {
+    close(fd);
+    return -ENOMEM;
+  }
+
+  res = ias_keystore_stream_decrypt_range(clientTicket, slotId, fd, offset, plainDataSize,
+                                          plainData, &plainDataSize);
+  close(fd);
+
+  /* arg 6: *output data */
+  if (!errApi(res, "streamDecryptRange"))
+  {
+    res = writeDataToFile(argv[5], plainData, plainDataSize);
+    errWrite(res, argv[5]);
+  }
+
+  free(plainData);
+  return res;
+}
+
 /* end of file */
@@ -0,0 +1,138 @@
+#!/bin/sh
+
+KSUTIL=${KSUTIL:-/usr/sbin/ksutil}
+
+# Stop on error
+set -e
+
+# Run the smoke tests and benchmarks against the in-process
+# software keystore: no DAL hardware needed.
+KSUTIL_DEVICE=sim: ${KSUTIL} test
+KSUTIL_DEVICE=sim: ${KSUTIL} stats bench handle 1000
+KSUTIL_DEVICE=sim: ${KSUTIL} stats bench batch 1000
+KSUTIL_DEVICE=sim: ${KSUTIL} bench iv 1000
+
+# Model a DAL round trip of 200us per call
+KSUTIL_DEVICE=sim:latency=200 ${KSUTIL} bench batch 200
+KSUTIL_DEVICE=sim:latency=200 ${KSUTIL} bench parallel 2
+KSUTIL_DEVICE=sim:latency=200 ${KSUTIL} bench envelope 2
+
+# Serve the software keystore through a broker, from several processes at once
+KSBROKERD=${KSBROKERD:-/usr/sbin/ksbrokerd}
+SOCKET=/tmp/ksutil-sim-$$.sock
+${KSBROKERD} -d sim:latency=200 -m 600 ${SOCKET} &
+BROKER=$!
+trap 'kill ${BROKER}' EXIT
+sleep 1
+KSUTIL_DEVICE=unix:${SOCKET} ${KSUTIL} test
+CLIENTS=""
+for i in 1 2 3 4; do
+  KSUTIL_DEVICE=unix:${SOCKET} ${KSUTIL} bench handle 200 &
+  CLIENTS="${CLIENTS} $!"
+done
+for pid in ${CLIENTS}; do
+  wait ${pid}
+done
+
+# Registrations outlive the process; a user holds at most -u of them
+kill ${BROKER}
+wait ${BROKER} || true
+TICKET=/tmp/ksutil-sim-ticket-$$
+${KSBROKERD} -d sim: -u 2 -m 600 ${SOCKET} &
+BROKER=$!
+trap 'kill ${BROKER}; rm -f ${TICKET}.*' EXIT
+sleep 1
+KSUTIL_DEVICE=unix:${SOCKET} ${KSUTIL} reg device ${TICKET}.1
+KSUTIL_DEVICE=unix:${SOCKET} ${KSUTIL} reg device ${TICKET}.2
+if KSUTIL_DEVICE=unix:${SOCKET} ${KSUTIL} reg device ${TICKET}.3; then
+  echo "registered beyond the user quota" >&2
+  exit 1
+fi
+KSUTIL_DEVICE=unix:${SOCKET} ${KSUTIL} unreg ${TICKET}.1
+KSUTIL_DEVICE=unix:${SOCKET} ${KSUTIL} reg device ${TICKET}.3
+rm -f ${TICKET}.*
+
+# Re-wrap keys after a SEED SVN update: keys generated through a broker
+# with SVN 1 are migrated through a broker with SVN 2
+kill ${BROKER}
+wait ${BROKER} || true
+KEYS=/tmp/ksutil-sim-keys-$$
+mkdir -p ${KEYS}
+${KSBROKERD} -d sim:svn=1 -m 600 ${SOCKET} &
+BROKER=$!
+trap 'kill ${BROKER}; rm -rf ${KEYS}' EXIT
+sleep 1
+KSUTIL_DEVICE=unix:${SOCKET} ${KSUTIL} reg device ${KEYS}/ticket
+for i in 1 2 3 4 5 6 7 8; do
+  KSUTIL_DEVICE=unix:${SOCKET} ${KSUTIL} gen ${KEYS}/ticket aes256 ${KEYS}/key${i}
+  echo ${KEYS}/key${i}
+done > ${KEYS}/list
+kill ${BROKER}
+wait ${BROKER} || true
+${KSBROKERD} -d sim:svn=2 -m 600 ${SOCKET} &
+BROKER=$!
+sleep 1
+KSUTIL_DEVICE=unix:${SOCKET} ${KSUTIL} migrate device aes256 4 ${KEYS}/list
+KSUTIL_DEVICE=unix:${SOCKET} ${KSUTIL} migrate device aes256 4 ${KEYS}/list
+
+# Keep the migrated keys in one key store file and write them back out
+${KSUTIL} import ${KEYS}/keys.store $(cat ${KEYS}/list)
+mkdir -p ${KEYS}/export
+${KSUTIL} export ${KEYS}/keys.store ${KEYS}/export
+for i in 1 2 3 4 5 6 7 8; do
+  cmp ${KEYS}/key${i} ${KEYS}/export/key${i}
+done
+
+# Stream a file larger than one encrypt call through fixed-size chunks, also
+# on several threads and with a wrapped data key, and decrypt a byte range of
+# it; a container cut off at a chunk boundary must not decrypt
+KSUTIL_DEVICE=unix:${SOCKET} ${KSUTIL} reg device ${KEYS}/stream-ticket
+KSUTIL_DEVICE=unix:${SOCKET} ${KSUTIL} load ${KEYS}/stream-ticket aes256 ${KEYS}/key1 ${KEYS}/slot
+head -c 20000000 /dev/urandom > ${KEYS}/plain
+KSUTIL_DEVICE=unix:${SOCKET} ${KSUTIL} stream-encrypt ${KEYS}/stream-ticket ${KEYS}/slot 0 ${KEYS}/plain ${KEYS}/plain.enc
+KSUTIL_DEVICE=unix:${SOCKET} ${KSUTIL} stream-decrypt ${KEYS}/stream-ticket ${KEYS}/slot ${KEYS}/plain.enc ${KEYS}/plain.dec
+cmp ${KEYS}/plain ${KEYS}/plain.dec
+KSUTIL_DEVICE=unix:${SOCKET} ${KSUTIL} parallel-decrypt ${KEYS}/stream-ticket ${KEYS}/slot 4 ${KEYS}/plain.enc ${KEYS}/plain.pdec
+cmp ${KEYS}/plain ${KEYS}/plain.pdec
+KSUTIL_DEVICE=unix:${SOCKET} ${KSUTIL} parallel-encrypt ${KEYS}/stream-ticket ${KEYS}/slot 0 4 ${KEYS}/plain ${KEYS}/plain.penc
+KSUTIL_DEVICE=unix:${SOCKET} ${KSUTIL} stream-decrypt ${KEYS}/stream-ticket ${KEYS}/slot ${KEYS}/plain.penc - | cmp - ${KEYS}/plain
+KSUTIL_DEVICE=unix:${SOCKET} ${KSUTIL} envelope-encrypt ${KEYS}/stream-ticket ${KEYS}/slot 0 ${KEYS}/plain ${KEYS}/plain.env
+KSUTIL_DEVICE=unix:${SOCKET} ${KSUTIL} stream-decrypt ${KEYS}/stream-ticket ${KEYS}/slot ${KEYS}/plain.env - | cmp - ${KEYS}/plain
+KSUTIL_DEVICE=unix:${SOCKET} ${KSUTIL} parallel-decrypt ${KEYS}/stream-ticket ${KEYS}/slot 4 ${KEYS}/plain.env - | cmp - ${KEYS}/plain
+tail -c +1000001 ${KEYS}/plain | head -c 200000 > ${KEYS}/plain.range
+for container in plain.enc plain.env; do
+  KSUTIL_DEVICE=unix:${SOCKET} ${KSUTIL} decrypt --range 1000000 200000 ${KEYS}/stream-ticket ${KEYS}/slot \
+    ${KEYS}/${container} - | cmp - ${KEYS}/plain.range
+done
+head -c $((24 + 2 * (65536 + 16))) ${KEYS}/plain.enc > ${KEYS}/plain.cut
+if KSUTIL_DEVICE=unix:${SOCKET} ${KSUTIL} stream-decrypt ${KEYS}/stream-ticket ${KEYS}/slot ${KEYS}/plain.cut - > /dev/null; then
+  echo "truncated stream decrypted" >&2
+  exit 1
+fi
+
+# Encrypt and decrypt a message in place, in a single buffer, with a
+# counter IV: the second IV of a nonce state file differs from the first
+head -c 100000 ${KEYS}/plain > ${KEYS}/message
+${KSUTIL} initvec aes_gcm ${KEYS}/iv0 ${KEYS}/nonce
+${KSUTIL} initvec aes_gcm ${KEYS}/iv ${KEYS}/nonce
+if cmp -s ${KEYS}/iv0 ${KEYS}/iv; then
+  echo "nonce repeated" >&2
+  exit 1
+fi
+KSUTIL_DEVICE=unix:${SOCKET} ${KSUTIL} encrypt ${KEYS}/stream-ticket ${KEYS}/slot aes_gcm ${KEYS}/iv ${KEYS}/message ${KEYS}/message.enc
+KSUTIL_DEVICE=unix:${SOCKET} ${KSUTIL} decrypt ${KEYS}/stream-ticket ${KEYS}/slot aes_gcm ${KEYS}/message.enc ${KEYS}/message.dec
+cmp ${KEYS}/message ${KEYS}/message.dec
+
+# Files are mapped, stdin and stdout buffered: both give the same bytes, and
+# a message that fails authentication leaves an existing output file as it
+# was, with no temporary file behind
+KSUTIL_DEVICE=unix:${SOCKET} ${KSUTIL} encrypt ${KEYS}/stream-ticket ${KEYS}/slot aes_gcm ${KEYS}/iv ${KEYS}/message - | cmp - ${KEYS}/message.enc
+KSUTIL_DEVICE=unix:${SOCKET} ${KSUTIL} decrypt ${KEYS}/stream-ticket ${KEYS}/slot aes_gcm ${KEYS}/message.enc - | cmp - ${KEYS}/message
+cp ${KEYS}/message.enc ${KEYS}/message.bad
+printf 'x' | dd of=${KEYS}/message.bad bs=1 seek=50000 conv=notrunc 2> /dev/null
+cp ${KEYS}/message ${KEYS}/message.bad.dec
+if KSUTIL_DEVICE=unix:${SOCKET} ${KSUTIL} decrypt ${KEYS}/stream-ticket ${KEYS}/slot aes_gcm ${KEYS}/message.bad ${KEYS}/message.bad.dec 2> /dev/null \
+   || ! cmp -s ${KEYS}/message ${KEYS}/message.bad.dec || ls ${KEYS}/message.bad.dec.* > /dev/null 2>&1; then
+  echo "forged message decrypted or output file lost" >&2
+  exit 1
+fi